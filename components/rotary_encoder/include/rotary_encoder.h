@@ -54,6 +54,16 @@ typedef struct {
  */
 typedef struct rotary_encoder_t rotary_encoder_t;
 
+/**
+ * @brief Type of rotary encoder event callback
+ *
+ * @note Called from the PCNT interrupt, keep it short and only use ISR safe functions
+ * @param encoder Rotary encoder handle
+ * @param direction +1 or -1, the direction the counter moved in
+ * @param user_ctx User context passed to set_event_callback
+ */
+typedef void (*rotary_encoder_event_cb_t)(rotary_encoder_t *encoder, int direction, void *user_ctx);
+
 /**
  * @brief Rotary encoder interface
  *
@@ -107,6 +117,20 @@ struct rotary_encoder_t {
      * @return Current counter value (the sign indicates the direction of rotation)
      */
     int (*get_counter_value)(rotary_encoder_t *encoder);
+
+    /**
+     * @brief Call back every time the counter has moved by step counts
+     *
+     * @param encoder Rotary encoder handle
+     * @param step Counts between two callbacks, e.g. the counts per detent
+     * @param callback Event callback, NULL stops the callbacks
+     * @param user_ctx User context passed to the callback
+     * @return
+     *      - ESP_OK: Set event callback successfully
+     *      - ESP_ERR_INVALID_ARG: Set event callback failed because step is out of the counter range
+     *      - ESP_FAIL: Set event callback failed because of other error
+     */
+    esp_err_t (*set_event_callback)(rotary_encoder_t *encoder, int16_t step, rotary_encoder_event_cb_t callback, void *user_ctx);
 };
 
 /**
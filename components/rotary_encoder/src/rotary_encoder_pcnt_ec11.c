@@ -38,9 +38,12 @@ static const char *TAG = "rotary_encoder";
 
 typedef struct
 {
-    int accumu_count;
+    volatile int accumu_count;
     rotary_encoder_t parent;
     pcnt_unit_t pcnt_unit;
+    int16_t event_step;
+    rotary_encoder_event_cb_t event_cb;
+    void *event_ctx;
 } ec11_t;
 
 static esp_err_t ec11_set_glitch_filter(rotary_encoder_t *encoder, uint32_t max_glitch_us)
@@ -83,8 +86,45 @@ static int ec11_get_counter_value(rotary_encoder_t *encoder)
 {
     ec11_t *ec11 = __containerof(encoder, ec11_t, parent);
     int16_t val = 0;
+    int accumu_count;
+    // The threshold interrupt clears the counter, retry if it landed between the two reads
+    do
+    {
+        accumu_count = ec11->accumu_count;
+        pcnt_get_counter_value(ec11->pcnt_unit, &val);
+    } while (accumu_count != ec11->accumu_count);
+    return val + accumu_count;
+}
+
+static esp_err_t ec11_set_event_callback(rotary_encoder_t *encoder, int16_t step, rotary_encoder_event_cb_t callback, void *user_ctx)
+{
+    esp_err_t ret_code = ESP_OK;
+    ec11_t *ec11 = __containerof(encoder, ec11_t, parent);
+    int16_t val = 0;
+
+    ROTARY_CHECK(step > 0 && step < EC11_PCNT_DEFAULT_HIGH_LIMIT, "invalid step %d", err, ESP_ERR_INVALID_ARG, step);
+
+    pcnt_event_disable(ec11->pcnt_unit, PCNT_EVT_THRES_0);
+    pcnt_event_disable(ec11->pcnt_unit, PCNT_EVT_THRES_1);
+    ec11->event_step = step;
+    ec11->event_ctx = user_ctx;
+    ec11->event_cb = callback;
+    if (!callback)
+    {
+        return ESP_OK;
+    }
+
+    ROTARY_CHECK(pcnt_set_event_value(ec11->pcnt_unit, PCNT_EVT_THRES_0, step) == ESP_OK, "set threshold 0 failed", err, ESP_FAIL);
+    ROTARY_CHECK(pcnt_set_event_value(ec11->pcnt_unit, PCNT_EVT_THRES_1, -step) == ESP_OK, "set threshold 1 failed", err, ESP_FAIL);
+    // Thresholds are measured from zero, fold the pending counts into the accumulator first
     pcnt_get_counter_value(ec11->pcnt_unit, &val);
-    return val + ec11->accumu_count;
+    pcnt_counter_clear(ec11->pcnt_unit);
+    ec11->accumu_count += val;
+    pcnt_event_enable(ec11->pcnt_unit, PCNT_EVT_THRES_0);
+    pcnt_event_enable(ec11->pcnt_unit, PCNT_EVT_THRES_1);
+    return ESP_OK;
+err:
+    return ret_code;
 }
 
 static esp_err_t ec11_del(rotary_encoder_t *encoder)
@@ -100,14 +140,33 @@ static void ec11_pcnt_overflow_handler(void *arg)
     uint32_t status = 0;
     pcnt_get_event_status(ec11->pcnt_unit, &status);
 
+    // Several events can latch before the interrupt is served, handle every bit that is set
     if (status & PCNT_EVT_H_LIM)
     {
         ec11->accumu_count += EC11_PCNT_DEFAULT_HIGH_LIMIT;
     }
-    else if (status & PCNT_EVT_L_LIM)
+    if (status & PCNT_EVT_L_LIM)
     {
         ec11->accumu_count += EC11_PCNT_DEFAULT_LOW_LIMIT;
     }
+    if (status & (PCNT_EVT_THRES_0 | PCNT_EVT_THRES_1))
+    {
+        int16_t val = 0;
+        int direction = (status & PCNT_EVT_THRES_0) ? 1 : -1;
+        // Restart from zero so the same thresholds fire again on the next step, keeping the counts that came in
+        // past the threshold before the interrupt was served
+        pcnt_get_counter_value(ec11->pcnt_unit, &val);
+        pcnt_counter_clear(ec11->pcnt_unit);
+        ec11->accumu_count += val;
+        if ((status & PCNT_EVT_THRES_0) && (status & PCNT_EVT_THRES_1))
+        {
+            direction = val < 0 ? -1 : 1;
+        }
+        if (ec11->event_cb)
+        {
+            ec11->event_cb(&ec11->parent, direction, ec11->event_ctx);
+        }
+    }
 }
 
 esp_err_t rotary_encoder_new_ec11(const rotary_encoder_config_t *config, rotary_encoder_t **ret_encoder)
@@ -166,6 +225,7 @@ esp_err_t rotary_encoder_new_ec11(const rotary_encoder_config_t *config, rotary_
     ec11->parent.stop = ec11_stop;
     ec11->parent.set_glitch_filter = ec11_set_glitch_filter;
     ec11->parent.get_counter_value = ec11_get_counter_value;
+    ec11->parent.set_event_callback = ec11_set_event_callback;
 
     *ret_encoder = &(ec11->parent);
     ESP_LOGI(TAG, "PCNT: Unit Registered");
@@ -0,0 +1,14 @@
+#ifndef RTC_IO_H__
+#define RTC_IO_H__
+
+#include <stdbool.h>
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+
+bool rtc_gpio_is_valid_gpio(gpio_num_t gpio_num);
+esp_err_t rtc_gpio_deinit(gpio_num_t gpio_num);
+esp_err_t rtc_gpio_pullup_en(gpio_num_t gpio_num);
+esp_err_t rtc_gpio_pulldown_dis(gpio_num_t gpio_num);
+
+#endif /* RTC_IO_H__ */
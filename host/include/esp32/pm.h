@@ -0,0 +1,12 @@
+#ifndef ESP32_PM_H__
+#define ESP32_PM_H__
+
+#include <stdbool.h>
+
+typedef struct {
+  int max_freq_mhz;
+  int min_freq_mhz;
+  bool light_sleep_enable;
+} esp_pm_config_esp32_t;
+
+#endif /* ESP32_PM_H__ */
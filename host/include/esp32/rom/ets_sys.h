@@ -0,0 +1,9 @@
+#ifndef ETS_SYS_H__
+#define ETS_SYS_H__
+
+#include <stdint.h>
+
+// Burns virtual time, the busy wait is part of the measured latency
+void ets_delay_us(uint32_t us);
+
+#endif /* ETS_SYS_H__ */
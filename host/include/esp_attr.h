@@ -0,0 +1,11 @@
+#ifndef ESP_ATTR_H__
+#define ESP_ATTR_H__
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+// RTC slow memory survives a deep sleep, the host build gives it sections outside the firmware's .data and .bss
+#define RTC_DATA_ATTR __attribute__((section(".rtc.data")))
+#define RTC_NOINIT_ATTR __attribute__((section(".rtc_noinit")))
+#define RTC_IRAM_ATTR
+
+#endif /* ESP_ATTR_H__ */
@@ -0,0 +1,10 @@
+#ifndef ESP_BT_DEVICE_H__
+#define ESP_BT_DEVICE_H__
+
+#include <stdint.h>
+
+#include "esp_bt_defs.h"
+
+const uint8_t* esp_bt_dev_get_address(void);
+
+#endif /* ESP_BT_DEVICE_H__ */
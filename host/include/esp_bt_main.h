@@ -0,0 +1,11 @@
+#ifndef ESP_BT_MAIN_H__
+#define ESP_BT_MAIN_H__
+
+#include "esp_err.h"
+
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_enable(void);
+esp_err_t esp_bluedroid_disable(void);
+esp_err_t esp_bluedroid_deinit(void);
+
+#endif /* ESP_BT_MAIN_H__ */
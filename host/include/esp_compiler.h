@@ -0,0 +1,14 @@
+#ifndef ESP_COMPILER_H__
+#define ESP_COMPILER_H__
+
+#include <stddef.h>
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// newlib's sys/cdefs.h provides this on target, glibc does not
+#ifndef __containerof
+#define __containerof(ptr, type, member) ((type*)((char*)(ptr)-offsetof(type, member)))
+#endif
+
+#endif /* ESP_COMPILER_H__ */
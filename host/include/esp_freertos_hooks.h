@@ -0,0 +1,17 @@
+#ifndef ESP_FREERTOS_HOOKS_H__
+#define ESP_FREERTOS_HOOKS_H__
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+// The simulator runs every task on one core. Idle hooks run whenever nothing is ready, tick hooks whenever the
+// chip wakes from such a spell, standing in for the first tick after it.
+typedef bool (*esp_freertos_idle_cb_t)(void);
+typedef void (*esp_freertos_tick_cb_t)(void);
+
+esp_err_t esp_register_freertos_idle_hook_for_cpu(esp_freertos_idle_cb_t new_idle_cb, UBaseType_t cpuid);
+esp_err_t esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t new_tick_cb, UBaseType_t cpuid);
+
+#endif /* ESP_FREERTOS_HOOKS_H__ */
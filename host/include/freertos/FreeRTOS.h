@@ -0,0 +1,45 @@
+#ifndef FREERTOS_H__
+#define FREERTOS_H__
+
+// FreeRTOS stand-in on top of the host simulator. Only one task runs at a time, so the critical section macros
+// have nothing to guard against and compile away.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+typedef TickType_t portTickType;
+typedef int portMUX_TYPE;
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t)(((TickType_t)(xTimeInMs) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000))
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS (pdTRUE)
+#define pdFAIL (pdFALSE)
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void)(mux))
+
+void sim_yield(void);
+#define portYIELD_FROM_ISR() sim_yield()
+#define portYIELD() sim_yield()
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+// Every task runs on the one simulated core
+#define portNUM_PROCESSORS 1
+#define xPortGetCoreID() 0
+
+#endif /* FREERTOS_H__ */
@@ -0,0 +1,6 @@
+#ifndef EVENT_GROUPS_H__
+#define EVENT_GROUPS_H__
+
+#include "freertos/FreeRTOS.h"
+
+#endif /* EVENT_GROUPS_H__ */
@@ -0,0 +1,4 @@
+#ifndef PCNT_HAL_H__
+#define PCNT_HAL_H__
+
+#endif /* PCNT_HAL_H__ */
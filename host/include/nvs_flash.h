@@ -0,0 +1,10 @@
+#ifndef NVS_FLASH_H__
+#define NVS_FLASH_H__
+
+#include "esp_err.h"
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif /* NVS_FLASH_H__ */
@@ -0,0 +1,22 @@
+#ifndef SDKCONFIG_H__
+#define SDKCONFIG_H__
+
+// The subset of ../sdkconfig the firmware reads, override from the command line to try other settings
+
+#ifndef CONFIG_LOG_DEFAULT_LEVEL
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#endif
+
+#ifndef CONFIG_FREERTOS_HZ
+#define CONFIG_FREERTOS_HZ 100
+#endif
+
+#ifndef CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 160
+#endif
+
+#ifndef CONFIG_PM_ENABLE
+#define CONFIG_PM_ENABLE 1
+#endif
+
+#endif /* SDKCONFIG_H__ */
@@ -0,0 +1,1430 @@
+// Scenario runner for the host build
+//
+// Boots the unmodified firmware on the simulator, replays a timed script of board and host events against it,
+// checks the expectations in the script and prints latency and throughput figures. Time in the script is
+// virtual, so a run is deterministic and a 10 s scenario finishes in a fraction of a second.
+//
+//   macropad_sim [-v|-vv] scenario.scn
+//
+// Script lines are "<time> <command> [args]", the time absolute or relative to the previous line when it starts
+// with '+', in us, ms or s (ms when no unit is given). '#' starts a comment.
+//
+//   connect [other|<host>]                   host side of a BLE link, host 1 (default) to 4, other is host 2.
+//                                            A connect the advertising does not let in is ignored.
+//   disconnect [host]                        drop the link to a host (default: every host)
+//   reconnect [host]                         the host (default 1) scans in the background until it finds the pad
+//   press <key> | release <key>              key 1..9 in matrix order or "sw" for the encoder switch
+//   tap <key> [hold]                         press, then release after hold (default 30ms)
+//   bounce <key> <press|release> <t>,...     a bouncing contact: it goes to the new state at once, then flips
+//                                            after each time in the list, an even number of them so that it
+//                                            settles there, e.g. bounce 1 press 300us,200us,500us,100us
+//   encoder <detents> [duration]             turn the encoder, 4 counts per detent, spread over duration
+//   imcu <cmd> <data> [<cmd> <data>...]      inter-MCU frame from the ATmega carrying one record per pair, data
+//                                            of more than one byte is comma separated, e.g. 1,0,2,0x3a,0x20
+//   report <hex> ...                         vendor output report written by the host, padded to its full length
+//   protocol <boot|report> [host]            protocol mode written by a host (default: the first one connected)
+//   subscribe battery                        host turns on Battery Level notifications
+//   uart <hex> ...                           raw bytes on the inter-MCU UART
+//   send <cmd> <length>                      a record of length bytes the ESP32 firmware queues for the ATmega
+//   peer <max baud>                          the ATmega answers rate changes up to max baud (default: it never
+//                                            answers, like firmware that predates the negotiation)
+//   loopback <n>                             the ATmega sends an ACK_REQ for every ACK it gets back, n times
+//   adc <channel> <raw> | pin <gpio> <level> analog and plain digital inputs
+//   latency reset                            clear the firmware latency histograms
+//   wakeups reset                            restart the wake-up count and rate from now
+//   typed reset                              clear the text the host has typed and restart its rate
+//   end                                      stop the run here (default: 100ms after the last line)
+//
+//   expect sent <key|boot|cc|battery|any> <op> <n>   notifications delivered to the host so far, key counts
+//                                            every keyboard report and boot the ones on the boot keyboard report
+//   expect keys <key>... | none              keys the host currently sees held
+//   expect usages <usage>... | none          keyboard usages the host currently sees held, e.g. 0x3a for F1
+//   expect consumer <button> <op> <n>        presses of a consumer button the host saw: mute, play, pause, next,
+//                                            prev, stop, rewind or ffwd
+//   expect latency <stage> <count|p50|p99|max> <op> <value>
+//   expect input <count|p50|p99|max> <op> <value>   input edge to host delivery, measured by the runner
+//   expect uart <cmd> <op> <n>               inter-MCU records of type cmd sent by the ESP32
+//   expect uart <frames|bytes|rate> <op> <n> frames and bytes sent by the ESP32, rate is records per second the
+//                                            line would carry at the bytes per record seen so far
+//   expect uart <errors|gaps> <op> <n>       frames the ESP32 dropped for a bad CRC, COBS or length, and
+//                                            frames it found missing from the sequence
+//   expect uart dropped <op> <n>             records the ESP32 turned away instead of queueing them
+//   expect uart suppressed <op> <n>          state records the ESP32 held back because nothing changed
+//   expect baud <op> <n>                     rate the ESP32 side of the inter-MCU UART runs at
+//   expect loopback <count|rate> <op> <n>    loopback round trips completed, and round trips per second
+//   expect interval <op> <value>             current connection interval of the first host connected
+//   expect host <n> keys <key>... | none     what a single host sees, as expect keys
+//   expect host <n> sent <op> <count>        input reports delivered to a host
+//   expect host <n> <interval|latency> <op> <value>   connection interval and slave latency of a host's link
+//   expect wakeups <count|rate> <op> <n>     times the firmware left idle since the last "wakeups reset", and
+//                                            wake-ups per second
+//   expect pm <cpu_max|apb_max|apb_min|sleep|deep>   power mode the held esp_pm locks leave the chip in, deep
+//                                            while it is in deep sleep
+//   expect power <battery|usb|cpu_max|active|idle> <op> <time>   time since boot spent on a power source or in
+//                                            a power mode, as POWER_DATA reports it
+//   expect volume <up|down|net|lost|missed> <op> <n>   volume steps the host saw, lost is steps the firmware
+//                                            produced that never reached the host, missed is detents turned that
+//                                            the firmware never read
+//   expect nvs <writes|commits> <op> <n>     NVS entries changed and commits made since boot
+//   expect text <word>...                    text the host typed, key presses read on a US layout, compared
+//                                            with the words joined by single spaces
+//   expect typed <count|rate> <op> <n>       keys the host saw go down, and keys per second from the first to
+//                                            the last of them
+//   expect battery <level|notified> <op> <n> Battery Level a host read would return, and the last one notified
+//   expect advertising <off|directed|whitelist|open>   advertising on air
+//   expect reconnect <link|report> <op> <time>   last disconnect to the link coming back, and to the first input
+//                                            report that host saw after it
+//   expect reconnect count <op> <n>          disconnects the firmware saw followed by a report to the same host
+//   expect boot <stage> <op> <time|stage>    startup to the first time the firmware reached a boot stage, e.g.
+//                                            advertising, compared with a time or the time of another stage
+//   expect sleep count <op> <n>              deep sleeps the firmware entered
+//   expect sleep report <op> <time>          edge that last woke the chip to the first input report the host saw
+//                                            after it
+//   expect debounce [<algorithm>] <press|release> <op> <time>   first edge of the last bounced press or release
+//                                            to the host seeing the key in its new state
+//   expect debounce [<algorithm>] <raw|accepted|chatter> <op> <n>   edges the firmware sampled, edges its
+//                                            debouncer let through, and accepted edges beyond the key changes
+//                                            the script made. Named with eager, symmetric or integrator, the
+//                                            line only counts against a build with that KEY_DEBOUNCE_ALGORITHM.
+//
+// <op> is one of == != < <= > >=, time values take the same units as the line time.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ble_profile.h"
+#include "board.h"
+#include "boot.h"
+#include "debounce.h"
+#include "encoder_accel.h"
+#include "esp_log.h"
+#include "hid_keydefinition.h"
+#include "imcu.h"
+#include "latency.h"
+#include "macro.h"
+#include "power.h"
+#include "reconnect.h"
+#include "sim.h"
+
+#define RUNNER_MAX_LINE 256
+#define RUNNER_MAX_ARGS 40
+#define RUNNER_MAX_INPUTS 4096
+#define RUNNER_MAX_TYPED 1024
+#define RUNNER_USAGE_WORDS 8  // Every keyboard usage a boot or NKRO report can carry, as a bitmap
+#define RUNNER_TAIL_US 100000  // Run on after the last line so that its effects reach the host
+#define RUNNER_TAP_HOLD_US 30000
+#define RUNNER_MAX_BOUNCES 32  // Contact flips per bounce line
+#define RUNNER_ENCODER_STEP_US 5000  // Per count when no duration is given
+#define RUNNER_COUNTS_PER_DETENT 4
+#define RUNNER_IMCU_UART 0
+#define RUNNER_IMCU_BAUD 38400  // UART_BAUD in main.h
+#define RUNNER_ACK_REQ 0x04     // ACK_REQ in main.h
+#define RUNNER_IMCU_ACK 0x1F    // IMCU_ACK in main.h
+
+typedef struct RunnerAction {
+  int line;
+  int argc;
+  char* argv[RUNNER_MAX_ARGS];
+  char text[RUNNER_MAX_LINE];
+} RunnerAction;
+
+typedef struct RunnerInput {
+  int64_t at;
+  int key;  // 1..9, 10 for the switch, 0 for the encoder
+  bool pressed;
+} RunnerInput;
+
+typedef struct RunnerStep {
+  int delta;
+  bool detent;  // Completes a detent
+  bool first;   // Completes the first detent, the earliest point the host could be expected to react
+} RunnerStep;
+
+extern EncoderAccel encoder_accel;  // Defined in main.h
+extern Debouncer debouncer;         // Defined in main.h
+
+static const char* const runner_debounce_names[] = {
+    [DEBOUNCE_EAGER_PRESS] = "eager",
+    [DEBOUNCE_SYMMETRIC] = "symmetric",
+    [DEBOUNCE_INTEGRATOR] = "integrator",
+};
+
+static const char* runner_path = NULL;
+static int runner_failures = 0;
+static int runner_passes = 0;
+static int runner_verbose = 0;
+
+static uint32_t runner_sent_key = 0;
+static uint32_t runner_sent_boot = 0;
+static uint32_t runner_sent_cc = 0;
+static uint32_t runner_sent_other = 0;
+static uint32_t runner_sent_battery = 0;  // Counted in runner_sent_other too
+static int runner_battery = -1;           // Last Battery Level notified
+static int64_t runner_disconnect_us = -1;  // Last disconnect
+static int64_t runner_reconnect_report = -1;  // First input report delivered after it
+static int64_t runner_woke_us = -1;  // Deep sleep wake the last report below was measured from
+static int64_t runner_sleep_report = -1;  // From that wake to the first input report delivered after it
+static uint32_t runner_held[RUNNER_USAGE_WORDS];  // Usages the host sees held, u at bit u % 32 of word u / 32
+static uint32_t runner_host_held[SIM_BLE_HOSTS + 1][RUNNER_USAGE_WORDS];  // The same per host number
+static uint32_t runner_host_sent[SIM_BLE_HOSTS + 1];  // Input reports per host number
+static const uint32_t* runner_view = runner_held;  // Held usages expect keys and usages look at
+static int runner_disconnect_host = 0;  // Host of the last disconnect, 0 for every host
+static uint8_t runner_consumer = 0;  // First byte of the last consumer report, holds the volume bits
+static uint8_t runner_cc_button = 0;  // Button field of the last consumer report
+static uint32_t runner_cc_presses[16];
+static uint32_t runner_volume_up = 0;
+static uint32_t runner_volume_down = 0;
+static uint32_t runner_detents = 0;
+static uint32_t runner_key_changes = 0;  // Settled key state changes the script made
+static uint32_t runner_bounce_edges = 0;  // Contact changes injected by bounce lines
+static int runner_bounce_key = 0;  // Key of the last bounce line until the host sees it settle, 0 after
+static bool runner_bounce_pressed = false;
+static int64_t runner_bounce_start = 0;
+static int64_t runner_bounce_latency[2] = {-1, -1};  // Release, press
+static int64_t runner_air_total = 0;
+static int64_t runner_air_max = 0;
+static char runner_typed[RUNNER_MAX_TYPED + 1];
+static uint32_t runner_typed_count = 0;
+static int64_t runner_typed_first = 0;
+static int64_t runner_typed_last = 0;
+
+static RunnerInput runner_pending[RUNNER_MAX_INPUTS];
+static int runner_pending_count = 0;
+static uint32_t runner_input_latency[RUNNER_MAX_INPUTS];
+static int runner_input_count = 0;
+
+static ImcuParser runner_uart_parser;  // Decodes what the ESP32 sends
+static ImcuStats runner_uart_stats;
+static uint32_t runner_uart_records[IMCU_MAX_TYPE + 1];
+static uint32_t runner_uart_garbled = 0;  // Bytes the ESP32 sent at a rate the ATmega was not listening at
+
+// ATmega side of the link
+static const uint32_t runner_baud_rates[IMCU_BAUD_RATE_COUNT] = IMCU_BAUD_RATES;
+static uint8_t runner_imcu_seq = 0;
+static uint32_t runner_peer_baud = RUNNER_IMCU_BAUD;
+static uint32_t runner_peer_max = 0;  // 0 when the ATmega ignores rate changes
+static uint32_t runner_peer_fallback = RUNNER_IMCU_BAUD;
+static SimEvent* runner_peer_revert = NULL;
+static int64_t runner_peer_busy_until = 0;
+static uint32_t runner_loopback_left = 0;
+static uint32_t runner_loopback_count = 0;
+static int64_t runner_loopback_start = 0;
+static int64_t runner_loopback_end = 0;
+static int64_t runner_encode_ns = 0;  // Host CPU spent in the codec, the same code the firmware runs
+static int64_t runner_decode_ns = 0;
+static uint32_t runner_encode_frames = 0;
+static uint64_t runner_wakeups_base = 0;
+static int64_t runner_wakeups_start = 0;
+
+static const char* const runner_stage_names[LATENCY_STAGE_MAX] = {
+    "edge", "scan", "debounce", "build", "enqueue", "send", "total",
+};
+
+void app_main(void);
+
+static void runner_fail(const RunnerAction* action, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void runner_fail(const RunnerAction* action, const char* format, ...) {
+  va_list args;
+  fprintf(stdout, "%s:%d: FAIL at %.3f ms: ", runner_path, action->line, sim_now() / 1000.0);
+  va_start(args, format);
+  vfprintf(stdout, format, args);
+  va_end(args);
+  fputc('\n', stdout);
+  runner_failures++;
+}
+
+// Parse "12", "12ms", "250us", "1.5s", defaulting to ms
+static bool runner_parse_time(const char* text, int64_t* us) {
+  char* end;
+  double value = strtod(text, &end);
+  if (end == text) return false;
+  if (*end == '\0' || strcmp(end, "ms") == 0) {
+    value *= 1000.0;
+  } else if (strcmp(end, "s") == 0) {
+    value *= 1000000.0;
+  } else if (strcmp(end, "us") != 0) {
+    return false;
+  }
+  *us = (int64_t)(value + 0.5);
+  return true;
+}
+
+static int runner_parse_key(const char* text) {
+  if (strcmp(text, "sw") == 0) return 10;
+  int key = atoi(text);
+  return (key >= 1 && key <= 10) ? key : -1;
+}
+
+static int runner_parse_boot_stage(const char* text) {
+  for (int stage = 0; stage < BOOT_STAGE_MAX; stage++) {
+    if (strcmp(text, boot_stage_name(stage)) == 0) return stage;
+  }
+  return -1;
+}
+
+static bool runner_compare(double value, const char* op, double expected) {
+  if (strcmp(op, "==") == 0) return value == expected;
+  if (strcmp(op, "!=") == 0) return value != expected;
+  if (strcmp(op, "<") == 0) return value < expected;
+  if (strcmp(op, "<=") == 0) return value <= expected;
+  if (strcmp(op, ">") == 0) return value > expected;
+  if (strcmp(op, ">=") == 0) return value >= expected;
+  return false;
+}
+
+static bool runner_valid_op(const char* op) {
+  static const char* const ops[] = {"==", "!=", "<", "<=", ">", ">="};
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(op, ops[i]) == 0) return true;
+  }
+  return false;
+}
+
+static void runner_check(const RunnerAction* action, const char* what, double value, const char* op, double expected) {
+  if (runner_compare(value, op, expected)) {
+    runner_passes++;
+    if (runner_verbose) printf("%s:%d: ok %s %g %s %g\n", runner_path, action->line, what, value, op, expected);
+  } else {
+    runner_fail(action, "%s is %g, expected %s %g", what, value, op, expected);
+  }
+}
+
+static int runner_cmp_u32(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Exact percentile over the runner's own input samples
+static uint32_t runner_input_percentile(int percent) {
+  if (runner_input_count == 0) return 0;
+  uint32_t sorted[RUNNER_MAX_INPUTS];
+  memcpy(sorted, runner_input_latency, runner_input_count * sizeof(uint32_t));
+  qsort(sorted, runner_input_count, sizeof(uint32_t), runner_cmp_u32);
+  int index = (runner_input_count * percent + 99) / 100 - 1;
+  if (index < 0) index = 0;
+  return sorted[index];
+}
+
+static void runner_input(int key, bool pressed) {
+  if (runner_pending_count >= RUNNER_MAX_INPUTS) return;
+  runner_pending[runner_pending_count++] = (RunnerInput){.at = sim_now(), .key = key, .pressed = pressed};
+}
+
+static bool runner_usage_held(uint8_t usage) {
+  return (runner_view[usage >> 5] >> (usage & 31)) & 1;
+}
+
+static bool runner_key_held(int key) {
+  return runner_usage_held(HID_KEY_1 + key - 1);
+}
+
+// What a key going down types, through the same US layout table the macros use
+static char runner_char(uint8_t usage, bool shift) {
+  uint8_t typed = usage | (shift ? MACRO_CHAR_SHIFT : 0);
+  for (int c = 1; c < 128; c++) {
+    if (macro_char(c) == typed) return c;
+  }
+  return '?';
+}
+
+static void runner_type(uint8_t modifiers, const uint32_t* held, int64_t delivered) {
+  bool shift = modifiers & (LEFT_SHIFT_KEY_MASK | RIGHT_SHIFT_KEY_MASK);
+  for (int usage = 1; usage < RUNNER_USAGE_WORDS * 32; usage++) {
+    if (!((held[usage >> 5] >> (usage & 31)) & 1) || runner_usage_held(usage)) continue;
+    if (runner_typed_count == 0) runner_typed_first = delivered;
+    runner_typed_last = delivered;
+    if (runner_typed_count < RUNNER_MAX_TYPED) runner_typed[runner_typed_count] = runner_char(usage, shift);
+    runner_typed_count++;
+  }
+}
+
+static double runner_typed_rate(void) {
+  if (runner_typed_count < 2) return 0;
+  return (runner_typed_count - 1) * 1e6 / (double)(runner_typed_last - runner_typed_first);
+}
+
+// Match delivered reports against the inputs still waiting for the host to see them
+static void runner_resolve(bool keyboard, int64_t delivered) {
+  int kept = 0;
+  for (int i = 0; i < runner_pending_count; i++) {
+    RunnerInput* input = &runner_pending[i];
+    bool resolved = keyboard ? (input->key >= 1 && input->key <= 9 && runner_key_held(input->key) == input->pressed)
+                             : (input->key == 0 || input->key == 10);
+    if (resolved && runner_input_count < RUNNER_MAX_INPUTS) {
+      runner_input_latency[runner_input_count++] = (uint32_t)(delivered - input->at);
+    } else {
+      runner_pending[kept++] = *input;
+    }
+  }
+  runner_pending_count = kept;
+}
+
+// Keyboard state out of a boot or 6KRO report, the key array at bytes 2..7
+static void runner_keys_held(const uint8_t* report, uint32_t* held) {
+  for (int i = 2; i < HID_KEYBOARD_IN_RPT_LEN; i++) {
+    if (report[i] != 0) held[report[i] >> 5] |= 1u << (report[i] & 31);
+  }
+}
+
+// Keyboard state out of the NKRO report, the bitmap after the modifier byte
+static void runner_bits_held(const uint8_t* report, uint32_t* held) {
+  for (int usage = 0; usage < HID_NKRO_USAGES; usage++) {
+    if (report[1 + usage / 8] & (1 << (usage % 8))) held[usage >> 5] |= 1u << (usage & 31);
+  }
+}
+
+static void runner_keyboard(uint8_t host, uint8_t modifiers, const uint32_t* held, int64_t delivered) {
+  runner_sent_key++;
+  if (host <= SIM_BLE_HOSTS) memcpy(runner_host_held[host], held, sizeof(runner_held));
+  runner_type(modifiers, held, delivered);
+  memcpy(runner_held, held, sizeof(runner_held));
+  runner_resolve(true, delivered);
+  if (runner_bounce_key && runner_key_held(runner_bounce_key) == runner_bounce_pressed) {
+    runner_bounce_latency[runner_bounce_pressed] = delivered - runner_bounce_start;
+    runner_bounce_key = 0;
+  }
+}
+
+static void runner_notify(const SimBleNotification* notification) {
+  int64_t air = notification->delivered_us - notification->accepted_us;
+  runner_air_total += air;
+  if (air > runner_air_max) runner_air_max = air;
+
+  uint32_t held[RUNNER_USAGE_WORDS] = {0};
+  if (notification->host <= SIM_BLE_HOSTS && notification->handle != hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL]) {
+    runner_host_sent[notification->host]++;
+  }
+  if (runner_disconnect_us >= 0 && runner_reconnect_report < 0 &&
+      (runner_disconnect_host == 0 || notification->host == runner_disconnect_host) &&
+      notification->handle != hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL]) {
+    runner_reconnect_report = notification->delivered_us - runner_disconnect_us;
+  }
+  int64_t woke = sim_sleep_woke_at();
+  if (woke >= 0 && woke != runner_woke_us && notification->delivered_us >= woke &&
+      notification->handle != hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL]) {
+    runner_woke_us = woke;
+    runner_sleep_report = notification->delivered_us - woke;
+  }
+  if (notification->handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_VAL] ||
+      notification->handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_BOOT_KB_IN_REPORT_VAL]) {
+    if (notification->handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_BOOT_KB_IN_REPORT_VAL]) runner_sent_boot++;
+    runner_keys_held(notification->data, held);
+    runner_keyboard(notification->host, notification->data[0], held, notification->delivered_us);
+  } else if (notification->handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_VAL]) {
+    runner_bits_held(notification->data, held);
+    runner_keyboard(notification->host, notification->data[0], held, notification->delivered_us);
+  } else if (notification->handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_CC_IN_VAL]) {
+    runner_sent_cc++;
+    // Volume keys are one shot controls, the host steps once per press
+    uint8_t pressed = notification->data[0] & ~runner_consumer;
+    if (pressed & HID_CC_RPT_VOLUME_UP) runner_volume_up++;
+    if (pressed & HID_CC_RPT_VOLUME_DOWN) runner_volume_down++;
+    runner_consumer = notification->data[0];
+    uint8_t button = notification->data[1] & ~HID_CC_RPT_BUTTON_BITS;
+    if (button != 0 && button != runner_cc_button) runner_cc_presses[button]++;
+    runner_cc_button = button;
+    runner_resolve(false, notification->delivered_us);
+  } else if (notification->handle == hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL]) {
+    runner_sent_other++;
+    runner_sent_battery++;
+    runner_battery = notification->data[0];
+  } else {
+    runner_sent_other++;
+  }
+
+  if (runner_verbose > 1) {
+    printf("%10.3f ms notify handle %d len %d:", notification->delivered_us / 1000.0, notification->handle,
+           notification->length);
+    for (int i = 0; i < notification->length; i++) printf(" %02x", notification->data[i]);
+    printf("\n");
+  }
+}
+
+// Monotonic rather than CPU time clock, the CPU clocks cost a system call each and would swamp a small frame.
+// Only one thread runs at a time, so the difference is the same.
+static int64_t runner_cpu_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Frame records from the ATmega, sent at its current rate behind whatever it is still sending
+static void runner_peer_send(const uint8_t* records, size_t length) {
+  uint8_t frame[IMCU_MAX_FRAME];
+  int64_t start = runner_cpu_ns();
+  size_t encoded = imcu_frame_encode(runner_imcu_seq++, records, length, frame);
+  runner_encode_ns += runner_cpu_ns() - start;
+  runner_encode_frames++;
+
+  sim_uart_inject_baud(RUNNER_IMCU_UART, frame, encoded, runner_peer_baud);
+  int64_t byte_us = (10 * 1000000LL + runner_peer_baud - 1) / runner_peer_baud;
+  if (runner_peer_busy_until < sim_now()) runner_peer_busy_until = sim_now();
+  runner_peer_busy_until += encoded * byte_us;
+}
+
+static void runner_peer_send_record(uint8_t type, uint8_t data) {
+  uint8_t records[2];
+  runner_peer_send(records, imcu_record_put(records, sizeof(records), type, &data, 1));
+}
+
+static void runner_peer_set_baud(void* arg) {
+  runner_peer_baud = (uint32_t)(uintptr_t)arg;
+}
+
+// The confirmation at the new rate never came
+static void runner_peer_timeout(void* arg) {
+  runner_peer_revert = NULL;
+  runner_peer_baud = runner_peer_fallback;
+}
+
+// ATmega half of the negotiation described in imcu.c
+static void runner_peer_baud_req(uint8_t code) {
+  if (code >= IMCU_BAUD_RATE_COUNT || runner_baud_rates[code] > runner_peer_max) {
+    for (code = 0; code < IMCU_BAUD_RATE_COUNT && runner_baud_rates[code] != runner_peer_baud; code++) {
+    }
+    runner_peer_send_record(IMCU_BAUD_ACK, code);
+    return;
+  }
+  runner_peer_send_record(IMCU_BAUD_ACK, code);
+  if (runner_baud_rates[code] == runner_peer_baud) {
+    if (runner_peer_revert != NULL) sim_cancel(runner_peer_revert);
+    runner_peer_revert = NULL;
+    return;
+  }
+  // Switch once the ACK is out, and fall back unless the ESP32 confirms at the new rate
+  runner_peer_fallback = runner_peer_baud;
+  sim_schedule(runner_peer_busy_until, runner_peer_set_baud, (void*)(uintptr_t)runner_baud_rates[code]);
+  if (runner_peer_revert != NULL) sim_cancel(runner_peer_revert);
+  runner_peer_revert = sim_schedule(runner_peer_busy_until + IMCU_BAUD_TIMEOUT_US, runner_peer_timeout, NULL);
+}
+
+static void runner_uart_record(uint8_t type, const uint8_t* value, uint8_t length, void* ctx) {
+  runner_uart_records[type]++;
+  if (runner_verbose > 1) {
+    printf("%10.3f ms uart tx cmd 0x%02x len %u data 0x%02x\n", sim_now() / 1000.0, type, length,
+           length ? value[0] : 0);
+  }
+  if (type == IMCU_BAUD_REQ && length == 1 && runner_peer_max) runner_peer_baud_req(value[0]);
+  if (type == RUNNER_IMCU_ACK && runner_loopback_left) {
+    runner_loopback_count++;
+    runner_loopback_end = sim_now();
+    if (--runner_loopback_left) runner_peer_send_record(RUNNER_ACK_REQ, 0);
+  }
+}
+
+static void runner_uart_tx(int uart_num, const uint8_t* data, int length) {
+  if (uart_num != RUNNER_IMCU_UART) return;
+  runner_uart_stats.tx_bytes += length;
+  if (imcu_baud() != runner_peer_baud) {
+    runner_uart_garbled += length;
+    imcu_parser_reset(&runner_uart_parser);
+    return;
+  }
+  // Replies sent from the record handler are encode time, not decode time
+  int64_t encode_ns = runner_encode_ns;
+  int64_t start = runner_cpu_ns();
+  imcu_parser_feed(&runner_uart_parser, data, length);
+  runner_decode_ns += runner_cpu_ns() - start - (runner_encode_ns - encode_ns);
+}
+
+// Records per second the line carries at the bytes per record the ESP32 achieved, framing included
+static double runner_uart_rate(void) {
+  if (runner_uart_stats.rx_records == 0) return 0;
+  return imcu_baud() / 10.0 * runner_uart_stats.rx_records / runner_uart_stats.tx_bytes;
+}
+
+static double runner_loopback_rate(void) {
+  int64_t elapsed = runner_loopback_end - runner_loopback_start;
+  return elapsed > 0 ? runner_loopback_count * 1000000.0 / elapsed : 0;
+}
+
+static double runner_wakeup_rate(void) {
+  int64_t elapsed = sim_now() - runner_wakeups_start;
+  return elapsed > 0 ? (sim_wakeups() - runner_wakeups_base) * 1e6 / elapsed : 0.0;
+}
+
+static void runner_encoder_step(void* arg) {
+  RunnerStep* step = arg;
+  sim_encoder_step(step->delta);
+  if (step->detent) runner_detents++;
+  if (step->first) runner_input(0, true);
+  free(step);
+}
+
+static void runner_key_event(int key, bool pressed) {
+  if (sim_key_get(key) != pressed) runner_key_changes++;
+  sim_key_set(key, pressed);
+  runner_input(key, pressed);
+}
+
+// One contact change of a bounce line, key and level packed as key * 2 + level
+static void runner_bounce_edge(void* arg) {
+  int packed = (int)(intptr_t)arg;
+  runner_bounce_edges++;
+  sim_key_set(packed >> 1, packed & 1);
+}
+
+static void runner_release(void* arg) {
+  runner_key_event((int)(intptr_t)arg, false);
+}
+
+static bool runner_expect(const RunnerAction* action) {
+  int argc = action->argc;
+  char* const* argv = action->argv;
+  if (argc < 2) return false;
+
+  if (strcmp(argv[1], "sent") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "key") == 0) {
+      value = runner_sent_key;
+    } else if (strcmp(argv[2], "boot") == 0) {
+      value = runner_sent_boot;
+    } else if (strcmp(argv[2], "cc") == 0) {
+      value = runner_sent_cc;
+    } else if (strcmp(argv[2], "battery") == 0) {
+      value = runner_sent_battery;
+    } else if (strcmp(argv[2], "any") == 0) {
+      value = runner_sent_key + runner_sent_cc + runner_sent_other;
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "sent %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "battery") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "level") == 0) {
+      uint16_t length = 0;
+      const uint8_t* level = NULL;
+      if (esp_ble_gatts_get_attr_value(hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL], &length, &level) != ESP_OK ||
+          length != 1) {
+        runner_fail(action, "no Battery Level value");
+        return true;
+      }
+      value = level[0];
+    } else if (strcmp(argv[2], "notified") == 0) {
+      value = runner_battery;
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "battery %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "keys") == 0 && argc >= 3) {
+    bool expected[10] = {false};
+    if (strcmp(argv[2], "none") != 0) {
+      for (int i = 2; i < argc; i++) {
+        int key = runner_parse_key(argv[i]);
+        if (key < 1 || key > 9) return false;
+        expected[key] = true;
+      }
+    }
+    for (int key = 1; key <= 9; key++) {
+      if (runner_key_held(key) != expected[key]) {
+        runner_fail(action, "key %d is %s on the host", key, expected[key] ? "not held" : "held");
+        return true;
+      }
+    }
+    runner_passes++;
+    if (runner_verbose) printf("%s:%d: ok keys\n", runner_path, action->line);
+    return true;
+  }
+
+  if (strcmp(argv[1], "usages") == 0 && argc >= 3) {
+    int expected = 0;
+    if (strcmp(argv[2], "none") != 0) {
+      for (int i = 2; i < argc; i++) {
+        long usage = strtol(argv[i], NULL, 0);
+        if (usage <= 0 || usage > 0xFF) return false;
+        if (!runner_usage_held(usage)) {
+          runner_fail(action, "usage 0x%02lx is not held on the host", usage);
+          return true;
+        }
+        expected++;
+      }
+    }
+    int held = 0;
+    for (int word = 0; word < RUNNER_USAGE_WORDS; word++) held += __builtin_popcount(runner_view[word]);
+    if (held != expected) {
+      runner_fail(action, "host sees %d usages held, expected %d", held, expected);
+      return true;
+    }
+    runner_passes++;
+    if (runner_verbose) printf("%s:%d: ok usages\n", runner_path, action->line);
+    return true;
+  }
+
+  if (strcmp(argv[1], "consumer") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    static const char* const names[] = {
+        [HID_CC_RPT_MUTE] = "mute",
+        [HID_CC_RPT_PLAY] = "play",
+        [HID_CC_RPT_PAUSE] = "pause",
+        [HID_CC_RPT_FAST_FWD] = "ffwd",
+        [HID_CC_RPT_REWIND] = "rewind",
+        [HID_CC_RPT_SCAN_NEXT_TRK] = "next",
+        [HID_CC_RPT_SCAN_PREV_TRK] = "prev",
+        [HID_CC_RPT_STOP] = "stop",
+    };
+    int button = -1;
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+      if (names[i] != NULL && strcmp(argv[2], names[i]) == 0) button = i;
+    }
+    if (button < 0) return false;
+    char what[32];
+    snprintf(what, sizeof(what), "consumer %s", argv[2]);
+    runner_check(action, what, runner_cc_presses[button], argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "latency") == 0 && argc == 6 && runner_valid_op(argv[4])) {
+    int stage = -1;
+    for (int i = 0; i < LATENCY_STAGE_MAX; i++) {
+      if (strcmp(argv[2], runner_stage_names[i]) == 0) stage = i;
+    }
+    if (stage < 0) return false;
+    LatencyStats stats;
+    latency_get_stats(stage, &stats);
+
+    char what[48];
+    snprintf(what, sizeof(what), "latency %s %s", argv[2], argv[3]);
+    if (strcmp(argv[3], "count") == 0) {
+      runner_check(action, what, stats.count, argv[4], atof(argv[5]));
+      return true;
+    }
+    int64_t expected;
+    if (!runner_parse_time(argv[5], &expected)) return false;
+    uint32_t value;
+    if (strcmp(argv[3], "p50") == 0) {
+      value = stats.p50_us;
+    } else if (strcmp(argv[3], "p99") == 0) {
+      value = stats.p99_us;
+    } else if (strcmp(argv[3], "max") == 0) {
+      value = stats.max_us;
+    } else {
+      return false;
+    }
+    runner_check(action, what, value, argv[4], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "input") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    char what[32];
+    snprintf(what, sizeof(what), "input %s", argv[2]);
+    if (strcmp(argv[2], "count") == 0) {
+      runner_check(action, what, runner_input_count, argv[3], atof(argv[4]));
+      return true;
+    }
+    int64_t expected;
+    if (!runner_parse_time(argv[4], &expected)) return false;
+    uint32_t value;
+    if (strcmp(argv[2], "p50") == 0) {
+      value = runner_input_percentile(50);
+    } else if (strcmp(argv[2], "p99") == 0) {
+      value = runner_input_percentile(99);
+    } else if (strcmp(argv[2], "max") == 0) {
+      value = runner_input_percentile(100);
+    } else {
+      return false;
+    }
+    runner_check(action, what, value, argv[3], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "uart") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    ImcuStats firmware;
+    imcu_get_stats(&firmware);
+    char what[32];
+    double value;
+    if (strcmp(argv[2], "frames") == 0) {
+      value = runner_uart_stats.rx_frames;
+    } else if (strcmp(argv[2], "bytes") == 0) {
+      value = runner_uart_stats.tx_bytes;
+    } else if (strcmp(argv[2], "rate") == 0) {
+      value = runner_uart_rate();
+    } else if (strcmp(argv[2], "errors") == 0) {
+      value = firmware.crc_errors + firmware.malformed + firmware.overruns;
+    } else if (strcmp(argv[2], "gaps") == 0) {
+      value = firmware.seq_gaps;
+    } else if (strcmp(argv[2], "suppressed") == 0) {
+      value = firmware.tx_suppressed;
+    } else if (strcmp(argv[2], "dropped") == 0) {
+      value = firmware.tx_dropped;
+    } else {
+      unsigned cmd = strtoul(argv[2], NULL, 0);
+      value = cmd <= IMCU_MAX_TYPE ? runner_uart_records[cmd] : 0;
+      snprintf(what, sizeof(what), "uart records 0x%02x", cmd);
+      runner_check(action, what, value, argv[3], atof(argv[4]));
+      return true;
+    }
+    snprintf(what, sizeof(what), "uart %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "baud") == 0 && argc == 4 && runner_valid_op(argv[2])) {
+    runner_check(action, "baud", imcu_baud(), argv[2], atof(argv[3]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "loopback") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "count") == 0) {
+      value = runner_loopback_count;
+    } else if (strcmp(argv[2], "rate") == 0) {
+      value = runner_loopback_rate();
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "loopback %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "wakeups") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "count") == 0) {
+      value = sim_wakeups() - runner_wakeups_base;
+    } else if (strcmp(argv[2], "rate") == 0) {
+      value = runner_wakeup_rate();
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "wakeups %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "pm") == 0 && argc == 3) {
+    SimPmMode mode = sim_pm_mode();
+    if (strcasecmp(argv[2], sim_pm_mode_name(mode)) == 0) {
+      runner_passes++;
+      if (runner_verbose) printf("%s:%d: ok pm %s\n", runner_path, action->line, argv[2]);
+    } else {
+      runner_fail(action, "pm mode is %s, expected %s", sim_pm_mode_name(mode), argv[2]);
+    }
+    return true;
+  }
+
+  if (strcmp(argv[1], "power") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    int64_t expected;
+    if (!runner_parse_time(argv[4], &expected)) return false;
+    uint32_t source_ms[POWER_SOURCE_MAX];
+    uint32_t mode_ms[POWER_MODE_MAX];
+    power_get_residency(source_ms);
+    power_get_mode_residency(mode_ms);
+    uint32_t ms;
+    if (strcmp(argv[2], "battery") == 0) {
+      ms = source_ms[POWER_SOURCE_BATTERY];
+    } else if (strcmp(argv[2], "usb") == 0) {
+      ms = source_ms[POWER_SOURCE_USB];
+    } else if (strcmp(argv[2], "cpu_max") == 0) {
+      ms = mode_ms[POWER_MODE_CPU_MAX];
+    } else if (strcmp(argv[2], "active") == 0) {
+      ms = mode_ms[POWER_MODE_ACTIVE];
+    } else if (strcmp(argv[2], "idle") == 0) {
+      ms = mode_ms[POWER_MODE_IDLE];
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "power %s us", argv[2]);
+    runner_check(action, what, (double)ms * 1000, argv[3], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "volume") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "up") == 0) {
+      value = runner_volume_up;
+    } else if (strcmp(argv[2], "down") == 0) {
+      value = runner_volume_down;
+    } else if (strcmp(argv[2], "net") == 0) {
+      value = (double)runner_volume_up - runner_volume_down;
+    } else if (strcmp(argv[2], "lost") == 0) {
+      value = (double)encoder_accel.steps - runner_volume_up - runner_volume_down;
+    } else if (strcmp(argv[2], "missed") == 0) {
+      value = (double)runner_detents - encoder_accel.detents;
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "volume %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "nvs") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "writes") == 0) {
+      value = sim_nvs_writes();
+    } else if (strcmp(argv[2], "commits") == 0) {
+      value = sim_nvs_commits();
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "nvs %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "text") == 0) {
+    char expected[RUNNER_MAX_LINE] = "";
+    for (int i = 2; i < argc; i++) {
+      if (i > 2) strcat(expected, " ");
+      strcat(expected, argv[i]);
+    }
+    runner_typed[runner_typed_count < RUNNER_MAX_TYPED ? runner_typed_count : RUNNER_MAX_TYPED] = '\0';
+    if (strcmp(runner_typed, expected) == 0) {
+      runner_passes++;
+      if (runner_verbose) printf("%s:%d: ok text \"%s\"\n", runner_path, action->line, expected);
+    } else {
+      runner_fail(action, "host typed \"%s\", expected \"%s\"", runner_typed, expected);
+    }
+    return true;
+  }
+
+  if (strcmp(argv[1], "typed") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    double value;
+    if (strcmp(argv[2], "count") == 0) {
+      value = runner_typed_count;
+    } else if (strcmp(argv[2], "rate") == 0) {
+      value = runner_typed_rate();
+    } else {
+      return false;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "typed %s", argv[2]);
+    runner_check(action, what, value, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "advertising") == 0 && argc == 3) {
+    if (strcmp(sim_ble_advertising_kind(), argv[2]) != 0) {
+      runner_fail(action, "advertising is %s, expected %s", sim_ble_advertising_kind(), argv[2]);
+    } else {
+      runner_passes++;
+    }
+    return true;
+  }
+
+  if (strcmp(argv[1], "reconnect") == 0 && argc == 5 && runner_valid_op(argv[3]) && strcmp(argv[2], "count") == 0) {
+    ReconnectStats reconnect;
+    reconnect_get_stats(&reconnect);
+    runner_check(action, "reconnect count", reconnect.count, argv[3], atof(argv[4]));
+    return true;
+  }
+
+  if (strcmp(argv[1], "reconnect") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    int64_t expected;
+    double value;
+    if (!runner_parse_time(argv[4], &expected)) return false;
+    if (strcmp(argv[2], "link") == 0) {
+      int64_t since = sim_ble_link_since(runner_disconnect_host);
+      value = since >= 0 && runner_disconnect_us >= 0 && since >= runner_disconnect_us ? since - runner_disconnect_us
+                                                                                      : -1;
+    } else if (strcmp(argv[2], "report") == 0) {
+      value = runner_reconnect_report;
+    } else {
+      return false;
+    }
+    if (value < 0) {
+      runner_fail(action, "no reconnect %s since the last disconnect", argv[2]);
+      return true;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "reconnect %s us", argv[2]);
+    runner_check(action, what, value, argv[3], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "sleep") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    if (strcmp(argv[2], "count") == 0) {
+      runner_check(action, "sleep count", sim_sleep_count(), argv[3], atof(argv[4]));
+      return true;
+    }
+    int64_t expected;
+    if (strcmp(argv[2], "report") != 0 || !runner_parse_time(argv[4], &expected)) return false;
+    if (runner_sleep_report < 0 || runner_woke_us != sim_sleep_woke_at()) {
+      runner_fail(action, "no input report since the last wake from deep sleep");
+      return true;
+    }
+    runner_check(action, "sleep report us", runner_sleep_report, argv[3], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "debounce") == 0 && (argc == 5 || argc == 6)) {
+    if (argc == 6) {
+      int algorithm = -1;
+      for (size_t i = 0; i < sizeof(runner_debounce_names) / sizeof(runner_debounce_names[0]); i++) {
+        if (strcmp(argv[2], runner_debounce_names[i]) == 0) algorithm = i;
+      }
+      if (algorithm < 0) return false;
+      // Written for another build
+      if (algorithm != (int)debouncer.algorithm) return true;
+    }
+    const char* what = argv[argc - 3];
+    const char* op = argv[argc - 2];
+    if (!runner_valid_op(op)) return false;
+    char label[32];
+    snprintf(label, sizeof(label), "debounce %s", what);
+    if (strcmp(what, "press") == 0 || strcmp(what, "release") == 0) {
+      int64_t expected;
+      bool pressed = strcmp(what, "press") == 0;
+      if (!runner_parse_time(argv[argc - 1], &expected)) return false;
+      if (runner_bounce_latency[pressed] < 0) {
+        runner_fail(action, "no bounced %s seen by the host", what);
+        return true;
+      }
+      runner_check(action, label, runner_bounce_latency[pressed], op, expected);
+    } else if (strcmp(what, "raw") == 0) {
+      runner_check(action, label, debouncer.raw_edges, op, atof(argv[argc - 1]));
+    } else if (strcmp(what, "accepted") == 0) {
+      runner_check(action, label, debouncer.accepted_edges, op, atof(argv[argc - 1]));
+    } else if (strcmp(what, "chatter") == 0) {
+      runner_check(action, label, (double)debouncer.accepted_edges - runner_key_changes, op, atof(argv[argc - 1]));
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  if (strcmp(argv[1], "boot") == 0 && argc == 5 && runner_valid_op(argv[3])) {
+    int stage = runner_parse_boot_stage(argv[2]);
+    int other = runner_parse_boot_stage(argv[4]);
+    int64_t expected;
+    if (stage < 0) return false;
+    if (other >= 0) {
+      expected = boot_time(other);
+    } else if (!runner_parse_time(argv[4], &expected)) {
+      return false;
+    }
+    if (boot_time(stage) < 0 || expected < 0) {
+      runner_fail(action, "boot stage %s not reached", boot_time(stage) < 0 ? argv[2] : argv[4]);
+      return true;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "boot %s us", argv[2]);
+    runner_check(action, what, boot_time(stage), argv[3], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "interval") == 0 && argc == 4 && runner_valid_op(argv[2])) {
+    int64_t expected;
+    if (!runner_parse_time(argv[3], &expected)) return false;
+    runner_check(action, "interval us", sim_ble_interval(0) * 1250.0, argv[2], expected);
+    return true;
+  }
+
+  if (strcmp(argv[1], "host") == 0 && argc >= 4) {
+    int host = atoi(argv[2]);
+    if (host < 1 || host > SIM_BLE_HOSTS) return false;
+    char what[32];
+    if (strcmp(argv[3], "keys") == 0) {
+      // The same check against what this host alone sees
+      RunnerAction shifted = *action;
+      shifted.argc = argc - 2;
+      for (int i = 1; i < shifted.argc; i++) shifted.argv[i] = argv[i + 2];
+      runner_view = runner_host_held[host];
+      bool ok = runner_expect(&shifted);
+      runner_view = runner_held;
+      return ok;
+    }
+    if (argc != 6 || !runner_valid_op(argv[4])) return false;
+    snprintf(what, sizeof(what), "host %d %s", host, argv[3]);
+    if (strcmp(argv[3], "sent") == 0) {
+      runner_check(action, what, runner_host_sent[host], argv[4], atof(argv[5]));
+    } else if (strcmp(argv[3], "latency") == 0) {
+      runner_check(action, what, sim_ble_latency(host), argv[4], atof(argv[5]));
+    } else if (strcmp(argv[3], "interval") == 0) {
+      int64_t expected;
+      if (!runner_parse_time(argv[5], &expected)) return false;
+      runner_check(action, what, sim_ble_interval(host) * 1250.0, argv[4], expected);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+// Host number of a connect, reconnect or disconnect line, fallback when it names none and -1 when it is not one
+static int runner_parse_host(int argc, char* const* argv, int fallback) {
+  if (argc < 2) return fallback;
+  if (strcmp(argv[1], "other") == 0) return 2;
+  int host = atoi(argv[1]);
+  return host >= 1 && host <= SIM_BLE_HOSTS ? host : -1;
+}
+
+static void runner_run_action(void* arg) {
+  RunnerAction* action = arg;
+  int argc = action->argc;
+  char* const* argv = action->argv;
+  const char* cmd = argv[0];
+  bool ok = true;
+
+  if (runner_verbose) {
+    printf("%10.3f ms >", sim_now() / 1000.0);
+    for (int i = 0; i < argc; i++) printf(" %s", argv[i]);
+    printf("\n");
+  }
+
+  if (strcmp(cmd, "connect") == 0 && argc <= 2) {
+    int host = runner_parse_host(argc, argv, 1);
+    ok = host > 0;
+    if (ok) sim_ble_connect(host);
+  } else if (strcmp(cmd, "reconnect") == 0 && argc <= 2) {
+    int host = runner_parse_host(argc, argv, 1);
+    ok = host > 0;
+    if (ok) sim_ble_reconnect(host);
+  } else if (strcmp(cmd, "disconnect") == 0 && argc <= 2) {
+    int host = runner_parse_host(argc, argv, 0);
+    ok = host >= 0;
+    if (ok && sim_ble_connected(host)) {
+      runner_disconnect_us = sim_now();
+      runner_disconnect_host = host;
+      runner_reconnect_report = -1;
+    }
+    if (ok) sim_ble_disconnect(host);
+  } else if ((strcmp(cmd, "press") == 0 || strcmp(cmd, "release") == 0) && argc == 2) {
+    int key = runner_parse_key(argv[1]);
+    ok = key > 0;
+    if (ok) runner_key_event(key, strcmp(cmd, "press") == 0);
+  } else if (strcmp(cmd, "tap") == 0 && (argc == 2 || argc == 3)) {
+    int key = runner_parse_key(argv[1]);
+    int64_t hold = RUNNER_TAP_HOLD_US;
+    ok = key > 0 && (argc == 2 || runner_parse_time(argv[2], &hold));
+    if (ok) {
+      runner_key_event(key, true);
+      sim_schedule(sim_now() + hold, runner_release, (void*)(intptr_t)key);
+    }
+  } else if (strcmp(cmd, "bounce") == 0 && argc == 4 &&
+             (strcmp(argv[2], "press") == 0 || strcmp(argv[2], "release") == 0)) {
+    int key = runner_parse_key(argv[1]);
+    bool pressed = strcmp(argv[2], "press") == 0;
+    int64_t flips[RUNNER_MAX_BOUNCES];
+    int count = 0;
+    ok = key > 0 && sim_key_get(key) != pressed;
+    for (char* next = argv[3]; ok && next != NULL; next = strchr(next, ',')) {
+      if (*next == ',') next++;
+      char interval[16];
+      snprintf(interval, sizeof(interval), "%.*s", (int)strcspn(next, ","), next);
+      ok = count < RUNNER_MAX_BOUNCES && runner_parse_time(interval, &flips[count]) && flips[count] > 0;
+      count++;
+    }
+    ok = ok && count % 2 == 0;
+    if (ok) {
+      runner_bounce_key = key;
+      runner_bounce_pressed = pressed;
+      runner_bounce_start = sim_now();
+      runner_bounce_edges++;
+      runner_key_event(key, pressed);
+      int64_t at = sim_now();
+      for (int i = 0; i < count; i++) {
+        at += flips[i];
+        bool level = i % 2 ? pressed : !pressed;
+        sim_schedule(at, runner_bounce_edge, (void*)(intptr_t)(key * 2 + level));
+      }
+    }
+  } else if (strcmp(cmd, "encoder") == 0 && (argc == 2 || argc == 3)) {
+    int detents = atoi(argv[1]);
+    int counts = abs(detents) * RUNNER_COUNTS_PER_DETENT;
+    int64_t duration = (int64_t)counts * RUNNER_ENCODER_STEP_US;
+    ok = counts > 0 && (argc == 2 || runner_parse_time(argv[2], &duration));
+    if (ok) {
+      for (int i = 0; i < counts; i++) {
+        RunnerStep* step = malloc(sizeof(RunnerStep));
+        step->delta = detents > 0 ? 1 : -1;
+        step->detent = i % RUNNER_COUNTS_PER_DETENT == RUNNER_COUNTS_PER_DETENT - 1;
+        step->first = i == RUNNER_COUNTS_PER_DETENT - 1;
+        sim_schedule(sim_now() + duration * i / counts, runner_encoder_step, step);
+      }
+    }
+  } else if (strcmp(cmd, "imcu") == 0 && argc >= 3 && argc % 2 == 1) {
+    uint8_t records[IMCU_MAX_RECORDS_LEN];
+    uint8_t frame[IMCU_MAX_FRAME];
+    size_t length = 0;
+    for (int i = 1; i < argc && ok; i += 2) {
+      uint8_t data[IMCU_MAX_RECORDS_LEN];
+      size_t count = 0;
+      for (char* next = argv[i + 1]; next != NULL && count < sizeof(data); next = strchr(next, ',')) {
+        if (*next == ',') next++;
+        data[count++] = strtoul(next, NULL, 0);
+      }
+      size_t size =
+          imcu_record_put(records + length, sizeof(records) - length, strtoul(argv[i], NULL, 0), data, count);
+      ok = size != 0;
+      length += size;
+    }
+    if (ok) runner_peer_send(records, length);
+  } else if (strcmp(cmd, "uart") == 0 && argc >= 2) {
+    uint8_t bytes[RUNNER_MAX_ARGS];
+    for (int i = 1; i < argc; i++) bytes[i - 1] = strtoul(argv[i], NULL, 16);
+    sim_uart_inject_baud(RUNNER_IMCU_UART, bytes, argc - 1, runner_peer_baud);
+  } else if (strcmp(cmd, "send") == 0 && argc == 3) {
+    uint8_t value[UINT8_MAX];
+    unsigned length = strtoul(argv[2], NULL, 0);
+    ok = length <= sizeof(value);
+    for (unsigned i = 0; ok && i < length; i++) value[i] = i;
+    // Turned away is a result the script checks, not a bad line
+    if (ok) imcu_send(strtoul(argv[1], NULL, 0), value, length);
+  } else if (strcmp(cmd, "report") == 0 && argc >= 2 && argc <= HID_VENDOR_OUT_RPT_LEN + 1) {
+    uint8_t report[HID_VENDOR_OUT_RPT_LEN] = {0};
+    for (int i = 1; i < argc; i++) report[i - 1] = strtoul(argv[i], NULL, 16);
+    sim_ble_write(0, hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL], report, sizeof(report));
+  } else if (strcmp(cmd, "protocol") == 0 && (argc == 2 || argc == 3) &&
+             (strcmp(argv[1], "boot") == 0 || strcmp(argv[1], "report") == 0)) {
+    uint8_t mode = strcmp(argv[1], "boot") == 0 ? HID_PROTOCOL_MODE_BOOT : HID_PROTOCOL_MODE_REPORT;
+    int host = argc == 3 ? runner_parse_host(argc - 1, argv + 1, 0) : 0;
+    ok = host >= 0;
+    if (ok) sim_ble_write(host, hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL], &mode, sizeof(mode));
+  } else if (strcmp(cmd, "subscribe") == 0 && argc == 2 && strcmp(argv[1], "battery") == 0) {
+    const uint8_t ccc[2] = {0x01, 0x00};
+    sim_ble_write(0, hid_engine.bas_tbl[BAS_IDX_BATT_LVL_NTF_CFG], ccc, sizeof(ccc));
+  } else if (strcmp(cmd, "peer") == 0 && argc == 2) {
+    runner_peer_max = strtoul(argv[1], NULL, 0);
+  } else if (strcmp(cmd, "loopback") == 0 && argc == 2) {
+    runner_loopback_left = strtoul(argv[1], NULL, 0);
+    runner_loopback_count = 0;
+    runner_loopback_start = sim_now();
+    runner_loopback_end = sim_now();
+    if (runner_loopback_left) runner_peer_send_record(RUNNER_ACK_REQ, 0);
+  } else if (strcmp(cmd, "adc") == 0 && argc == 3) {
+    sim_adc_set_raw(atoi(argv[1]), atoi(argv[2]));
+  } else if (strcmp(cmd, "pin") == 0 && argc == 3) {
+    sim_pin_set(atoi(argv[1]), atoi(argv[2]));
+  } else if (strcmp(cmd, "latency") == 0 && argc == 2 && strcmp(argv[1], "reset") == 0) {
+    latency_reset();
+  } else if (strcmp(cmd, "wakeups") == 0 && argc == 2 && strcmp(argv[1], "reset") == 0) {
+    runner_wakeups_base = sim_wakeups();
+    runner_wakeups_start = sim_now();
+  } else if (strcmp(cmd, "typed") == 0 && argc == 2 && strcmp(argv[1], "reset") == 0) {
+    runner_typed_count = 0;
+  } else if (strcmp(cmd, "expect") == 0) {
+    ok = runner_expect(action);
+  } else {
+    ok = false;
+  }
+
+  if (!ok) runner_fail(action, "cannot run \"%s\" with %d arguments", cmd, argc - 1);
+  free(action);
+}
+
+// Schedule every line of the script, returns the end of the run or -1 if the script could not be read
+static int64_t runner_load(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  char buffer[RUNNER_MAX_LINE];
+  int64_t at = 0;
+  int64_t end = -1;
+  int line = 0;
+  while (fgets(buffer, sizeof(buffer), file) != NULL) {
+    line++;
+    char* comment = strchr(buffer, '#');
+    if (comment != NULL) *comment = '\0';
+
+    char* save = NULL;
+    char* time_token = strtok_r(buffer, " \t\r\n", &save);
+    if (time_token == NULL) continue;
+    bool relative = *time_token == '+';
+    int64_t offset;
+    if (!runner_parse_time(relative ? time_token + 1 : time_token, &offset)) {
+      fprintf(stderr, "%s:%d: bad time \"%s\"\n", path, line, time_token);
+      fclose(file);
+      return -1;
+    }
+    at = relative ? at + offset : offset;
+
+    RunnerAction* action = calloc(1, sizeof(RunnerAction));
+    action->line = line;
+    for (char* arg = strtok_r(NULL, " \t\r\n", &save); arg != NULL && action->argc < RUNNER_MAX_ARGS;
+         arg = strtok_r(NULL, " \t\r\n", &save)) {
+      // Arguments are packed into text one after the other, argv points at each
+      size_t used = action->argc ? (size_t)(action->argv[action->argc - 1] - action->text) +
+                                       strlen(action->argv[action->argc - 1]) + 1
+                                 : 0;
+      if (used + strlen(arg) + 1 > sizeof(action->text)) break;
+      action->argv[action->argc] = strcpy(action->text + used, arg);
+      action->argc++;
+    }
+    if (action->argc == 0) {
+      fprintf(stderr, "%s:%d: missing command\n", path, line);
+      free(action);
+      fclose(file);
+      return -1;
+    }
+
+    if (strcmp(action->argv[0], "end") == 0) {
+      end = at;
+      free(action);
+      continue;
+    }
+    sim_schedule(at, runner_run_action, action);
+    if (end < at + RUNNER_TAIL_US) end = at + RUNNER_TAIL_US;
+  }
+  fclose(file);
+  return end;
+}
+
+static void runner_summary(int64_t host_ns) {
+  double sim_ms = sim_now() / 1000.0;
+  double host_ms = host_ns / 1e6;
+  uint32_t notifications = runner_sent_key + runner_sent_cc + runner_sent_other;
+
+  printf("\n%s\n", runner_path);
+  printf("  simulated %.3f ms in %.3f ms of host CPU (%.0fx real time)\n", sim_ms, host_ms,
+         host_ms > 0 ? sim_ms / host_ms : 0.0);
+  printf("  notifications %u (keyboard %u, consumer %u), air time mean %.3f ms max %.3f ms\n", notifications,
+         runner_sent_key, runner_sent_cc, notifications ? runner_air_total / 1000.0 / notifications : 0.0,
+         runner_air_max / 1000.0);
+  printf("  input to host n=%d p50 %.3f ms p99 %.3f ms max %.3f ms, %d never seen by the host\n", runner_input_count,
+         runner_input_percentile(50) / 1000.0, runner_input_percentile(99) / 1000.0,
+         runner_input_percentile(100) / 1000.0, runner_pending_count);
+  if (runner_typed_count) {
+    printf("  typed %u keys in %.3f ms, %.0f keys/s\n", runner_typed_count,
+           (runner_typed_last - runner_typed_first) / 1000.0, runner_typed_rate());
+  }
+
+  if (runner_detents) {
+    uint32_t seen = runner_volume_up + runner_volume_down;
+    printf("  encoder %u detents, %u volume steps produced, host saw %u (up %u, down %u), %.1f%% preserved over %u "
+           "consumer reports\n",
+           runner_detents, encoder_accel.steps, seen, runner_volume_up, runner_volume_down,
+           encoder_accel.steps ? 100.0 * seen / encoder_accel.steps : 100.0, encoder_accel.reports);
+  }
+
+  ImcuStats firmware;
+  imcu_get_stats(&firmware);
+  printf("  inter-MCU tx %u bytes, %u frames, %u records, %.0f records/s at %u baud, %u undecodable, %u garbled\n",
+         runner_uart_stats.tx_bytes, runner_uart_stats.rx_frames, runner_uart_stats.rx_records, runner_uart_rate(),
+         imcu_baud(), runner_uart_stats.crc_errors + runner_uart_stats.malformed + runner_uart_stats.overruns,
+         runner_uart_garbled);
+  printf("  inter-MCU state records suppressed %u\n", firmware.tx_suppressed);
+  printf("  inter-MCU rx %u frames, %u records, %u dropped, %u sequence gaps\n", firmware.rx_frames,
+         firmware.rx_records, firmware.crc_errors + firmware.malformed + firmware.overruns, firmware.seq_gaps);
+  if (runner_loopback_count) {
+    printf("  inter-MCU loopback %u round trips in %.3f ms, %.0f frames/s each way\n", runner_loopback_count,
+           (runner_loopback_end - runner_loopback_start) / 1000.0, runner_loopback_rate());
+  }
+  if (runner_encode_frames && runner_uart_stats.rx_frames) {
+    printf("  inter-MCU codec host CPU %.0f ns per frame encoded, %.0f ns per frame decoded\n",
+           (double)runner_encode_ns / runner_encode_frames, (double)runner_decode_ns / runner_uart_stats.rx_frames);
+  }
+
+  printf("  boot advertising at %.3f ms: bluedroid %.3f ms, services %.3f ms, app %.3f ms\n",
+         boot_time(BOOT_ADVERTISING) / 1000.0, boot_time(BOOT_BLUEDROID) / 1000.0, boot_time(BOOT_SERVICES) / 1000.0,
+         boot_time(BOOT_APP) / 1000.0);
+
+  ReconnectStats reconnect;
+  reconnect_get_stats(&reconnect);
+  if (runner_disconnect_us >= 0) {
+    printf("  reconnect %u bonds, links up while advertising directed %u, white list %u, open %u\n", sim_ble_bonds(),
+           reconnect.connects[RECONNECT_DIRECTED], reconnect.connects[RECONNECT_WHITELIST],
+           reconnect.connects[RECONNECT_OPEN]);
+    printf("  reconnect first report %u times, last %.3f ms after its disconnect, max %.3f ms", reconnect.count,
+           reconnect.report_us / 1000.0, reconnect.max_report_us / 1000.0);
+    if (runner_reconnect_report >= 0) printf(", host saw one %.3f ms after the last", runner_reconnect_report / 1000.0);
+    printf("\n");
+  }
+
+  if (runner_bounce_edges) {
+    printf("  debounce %s %u us, %u contact changes injected, %u sampled, %u accepted for %u key changes",
+           runner_debounce_names[debouncer.algorithm], debouncer.window_us, runner_bounce_edges, debouncer.raw_edges,
+           debouncer.accepted_edges, runner_key_changes);
+    if (runner_bounce_latency[1] >= 0) printf(", last press %.3f ms", runner_bounce_latency[1] / 1000.0);
+    if (runner_bounce_latency[0] >= 0) printf(", last release %.3f ms", runner_bounce_latency[0] / 1000.0);
+    printf("\n");
+  }
+
+  if (sim_sleep_count()) {
+    printf("  deep sleep %u times, %s", sim_sleep_count(), sim_sleeping() ? "asleep now" : "awake now");
+    if (runner_sleep_report >= 0) printf(", first report %.3f ms after the last wake", runner_sleep_report / 1000.0);
+    printf("\n");
+  }
+
+  if (runner_host_sent[2] || runner_host_sent[3]) {
+    for (int host = 1; host <= SIM_BLE_HOSTS; host++) {
+      printf("  host %d %u input reports, ", host, runner_host_sent[host]);
+      if (sim_ble_connected(host)) {
+        printf("interval %.2f ms latency %u\n", sim_ble_interval(host) * 1.25, sim_ble_latency(host));
+      } else {
+        printf("not connected\n");
+      }
+    }
+  }
+
+  printf("  wakeups %llu since %.3f ms, %.1f/s, power modes", (unsigned long long)(sim_wakeups() - runner_wakeups_base),
+         runner_wakeups_start / 1000.0, runner_wakeup_rate());
+  for (int mode = 0; mode < SIM_PM_MODE_MAX; mode++) {
+    printf(" %s %.1f%%", sim_pm_mode_name(mode), sim_now() ? 100.0 * sim_pm_mode_time(mode) / sim_now() : 0.0);
+  }
+  printf("\n");
+
+  printf("  %-9s %8s %10s %10s %10s\n", "stage", "count", "p50 us", "p99 us", "max us");
+  for (int stage = 0; stage < LATENCY_STAGE_MAX; stage++) {
+    LatencyStats stats;
+    latency_get_stats(stage, &stats);
+    printf("  %-9s %8u %10u %10u %10u\n", runner_stage_names[stage], stats.count, stats.p50_us, stats.p99_us,
+           stats.max_us);
+  }
+  printf("  expectations: %d passed, %d failed\n", runner_passes, runner_failures);
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) {
+      runner_verbose = 1;
+    } else if (strcmp(argv[i], "-vv") == 0) {
+      runner_verbose = 2;
+    } else if (argv[i][0] != '-' && runner_path == NULL) {
+      runner_path = argv[i];
+    } else {
+      runner_path = NULL;
+      break;
+    }
+  }
+  if (runner_path == NULL) {
+    fprintf(stderr, "usage: %s [-v|-vv] scenario.scn\n", argv[0]);
+    return 2;
+  }
+
+  sim_log_set_level(runner_verbose > 1 ? ESP_LOG_VERBOSE : runner_verbose ? ESP_LOG_INFO : ESP_LOG_ERROR);
+  sim_ble_set_notify_hook(runner_notify);
+  imcu_parser_init(&runner_uart_parser, runner_uart_record, NULL, &runner_uart_stats);
+  sim_uart_set_tx_hook(runner_uart_tx);
+
+  int64_t end = runner_load(runner_path);
+  if (end < 0) return 2;
+
+  struct timespec start, stop;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+  sim_start(app_main);
+  sim_run_until(end);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stop);
+
+  runner_summary((stop.tv_sec - start.tv_sec) * 1000000000LL + (stop.tv_nsec - start.tv_nsec));
+  fflush(stdout);
+  // Firmware tasks are still parked on their threads, leave without unwinding them
+  _exit(runner_failures ? 1 : 0);
+}
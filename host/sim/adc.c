@@ -0,0 +1,60 @@
+// ADC1 stand-in, raw readings are set by the scenario
+//
+// The calibration is the linear fit esp_adc_cal makes from an eFuse Vref, without the lookup table the IDF adds
+// at 11 dB. Close enough to the real curve over the battery range.
+
+#include <stddef.h>
+
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+
+#include "sim.h"
+
+#define SIM_ADC_DEFAULT_RAW 3100  // About 3.9 V on the battery divider
+#define SIM_ADC_EFUSE_VREF_MV 1121
+#define SIM_ADC_COEFF_SCALE 65536
+
+// Gain and offset of each attenuation in the IDF's linear fit
+static const uint32_t sim_adc_atten_scales[] = {57431, 76236, 105481, 196602};
+static const uint32_t sim_adc_atten_offsets[] = {75, 78, 88, 142};
+
+static int sim_adc_raw[ADC1_CHANNEL_MAX] = {
+    [0 ... ADC1_CHANNEL_MAX - 1] = SIM_ADC_DEFAULT_RAW,
+};
+
+void sim_adc_set_raw(int channel, int raw) {
+  if (channel >= 0 && channel < ADC1_CHANNEL_MAX) sim_adc_raw[channel] = raw;
+}
+
+esp_err_t adc1_config_width(adc_bits_width_t width_bit) {
+  return ESP_OK;
+}
+
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten) {
+  return channel < ADC1_CHANNEL_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+int adc1_get_raw(adc1_channel_t channel) {
+  return channel < ADC1_CHANNEL_MAX ? sim_adc_raw[channel] : -1;
+}
+
+esp_err_t esp_adc_cal_check_efuse(esp_adc_cal_value_t value_type) {
+  return value_type == ESP_ADC_CAL_VAL_EFUSE_VREF ? ESP_OK : ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t adc_num, adc_atten_t atten, adc_bits_width_t bit_width,
+                                             uint32_t default_vref, esp_adc_cal_characteristics_t* chars) {
+  chars->adc_num = adc_num;
+  chars->atten = atten;
+  chars->bit_width = bit_width;
+  chars->vref = SIM_ADC_EFUSE_VREF_MV;
+  chars->coeff_a = chars->vref * sim_adc_atten_scales[atten] / ((1 << (9 + bit_width)) - 1);
+  chars->coeff_b = sim_adc_atten_offsets[atten];
+  chars->low_curve = NULL;
+  chars->high_curve = NULL;
+  return ESP_ADC_CAL_VAL_EFUSE_VREF;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t adc_reading, const esp_adc_cal_characteristics_t* chars) {
+  return (chars->coeff_a * adc_reading + SIM_ADC_COEFF_SCALE / 2) / SIM_ADC_COEFF_SCALE + chars->coeff_b;
+}
@@ -0,0 +1,75 @@
+// Board model: the 3x3 key matrix, the rotary encoder and its switch
+//
+// Matches the wiring in main/board.h, key k sits on column (k - 1) / 3 and row (k - 1) % 3, so it shows up as
+// bit k of matrix_scan(). A row reads high while a pressed key connects it to a column driven high. The encoder
+// contacts pull A and B low in quadrature, both open at a detent, and each count also steps PCNT unit 0.
+
+#include <stdbool.h>
+
+#include "board.h"
+#include "sim_internal.h"
+
+#define SIM_BOARD_KEYS 10
+#define SIM_BOARD_ROT_SW_KEY 10
+#define SIM_BOARD_ENCODER_UNIT 0  // PCNT unit the firmware gives the encoder
+#define SIM_BOARD_ENCODER_PHASES 4
+
+static const int sim_board_cols[3] = {PIN_COL0, PIN_COL1, PIN_COL2};
+static const int sim_board_rows[3] = {PIN_ROW0, PIN_ROW1, PIN_ROW2};
+
+static bool sim_board_pressed[SIM_BOARD_KEYS + 1];
+static int sim_board_encoder_phase = 0;  // 0 at a detent, counting up clockwise
+
+static int sim_board_input(int gpio, int* level) {
+  if (gpio == PIN_ROT_SW) {
+    *level = sim_board_pressed[SIM_BOARD_ROT_SW_KEY];
+    return 1;
+  }
+  // A B from a detent: 11, 01, 00, 10
+  if (gpio == PIN_ROT_A) {
+    *level = sim_board_encoder_phase == 0 || sim_board_encoder_phase == 3;
+    return 1;
+  }
+  if (gpio == PIN_ROT_B) {
+    *level = sim_board_encoder_phase == 0 || sim_board_encoder_phase == 1;
+    return 1;
+  }
+  for (int row = 0; row < 3; row++) {
+    if (sim_board_rows[row] != gpio) continue;
+    *level = 0;
+    for (int col = 0; col < 3; col++) {
+      // A column left floating (USB mode, ATmega scanning) drives nothing
+      if (!sim_board_pressed[1 + col * 3 + row] || !sim_gpio_is_output(sim_board_cols[col])) continue;
+      if (sim_gpio_output_level(sim_board_cols[col])) *level = 1;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+void sim_board_init(void) {
+  sim_gpio_set_input_hook(sim_board_input);
+}
+
+void sim_key_set(int key, bool pressed) {
+  if (key < 1 || key > SIM_BOARD_KEYS) return;
+  sim_board_pressed[key] = pressed;
+  sim_gpio_eval_interrupts();
+}
+
+void sim_encoder_step(int delta) {
+  int step = delta > 0 ? 1 : -1;
+  for (int i = 0; i != delta; i += step) {
+    sim_board_encoder_phase = (sim_board_encoder_phase + SIM_BOARD_ENCODER_PHASES + step) % SIM_BOARD_ENCODER_PHASES;
+    sim_gpio_eval_interrupts();
+    sim_pcnt_step(SIM_BOARD_ENCODER_UNIT, step);
+  }
+}
+
+bool sim_key_get(int key) {
+  return key >= 1 && key <= SIM_BOARD_KEYS && sim_board_pressed[key];
+}
+
+void sim_pin_set(int gpio, int level) {
+  sim_gpio_set_input(gpio, level);
+}
@@ -0,0 +1,741 @@
+// Bluedroid stand-in: GATT server registration, GAP security and up to three BLE links to four hosts
+//
+// Every stack callback is posted as an event and runs from scheduler context, like the BTC task on target.
+// Notifications go into a small controller TX FIFO per link that drains a few packets per connection event; the
+// FIFO raises ESP_GATTS_CONGEST_EVT at the high watermark and clears it again at the low watermark.
+//
+// Bringing the stack up takes time: enabling the controller and Bluedroid blocks the caller while the stack's own
+// tasks do the work, and every GATT and GAP configuration call answers one BTC round trip later.
+//
+// Four hosts can connect, three at a time, each on a link of its own with conn_id one less than its number: the
+// one the pad bonds with first and three others. Advertising lets them in according to its type and white list,
+// and runs on while a link is still free. A host that reconnects on its own scans in the background, a short window every
+// 1.28 s, and connects at the first advertising packet that falls inside a window.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_bt.h"
+#include "esp_bt_device.h"
+#include "esp_bt_main.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatts_api.h"
+#include "esp_log.h"
+#include "sim_internal.h"
+
+#define SIM_BT_TAG "SIM_BT"
+#define SIM_BLE_MAX_APPS 4
+#define SIM_BLE_MAX_HANDLES 256
+#define SIM_BLE_FIRST_HANDLE 40
+#define SIM_BLE_FIRST_GATTS_IF 3
+#define SIM_BLE_TX_FIFO 12               // Controller ACL buffers per link
+#define SIM_BLE_CONGEST_HIGH 10          // Raise congestion at this FIFO depth
+#define SIM_BLE_CONGEST_LOW 4            // Clear it once drained to this depth
+#define SIM_BLE_PACKETS_PER_EVENT 4      // Notifications the host accepts per connection event
+#define SIM_BLE_INITIAL_INTERVAL 0x0018  // 30 ms, what most hosts open a link with
+#define SIM_BLE_ENCRYPT_US 50000         // Pairing round trips after the connect
+#define SIM_BLE_UPDATE_EVENTS 6          // Connection events until a parameter update takes effect
+#define SIM_BLE_MAX_BONDS 4
+#define SIM_BLE_WHITELIST 8
+#define SIM_BLE_SCAN_INTERVAL_US 1280000  // Background scan of a host looking for its bonded devices
+#define SIM_BLE_SCAN_WINDOW_US 11250
+#define SIM_BLE_SCAN_PHASE_US 300000      // Start of the first window of host 1
+#define SIM_BLE_SCAN_STAGGER_US 400000    // Each further host scans this much later
+#define SIM_BLE_DIRECTED_US 1280000       // Controller limit for high duty cycle directed advertising
+#define SIM_BLE_DIRECTED_INTERVAL_US 3750
+#define SIM_BLE_ADV_DELAY_US 10000        // Pseudo-random delay added to every undirected advertising event
+#define SIM_BLE_SCAN_LIMIT_US 600000000   // A host that found nothing in this long has given up
+#define SIM_BT_CONTROLLER_US 8000         // esp_bt_controller_enable(), RF calibration from the stored data
+#define SIM_BT_BLUEDROID_INIT_US 2000
+#define SIM_BT_BLUEDROID_ENABLE_US 16000  // BTU and BTC tasks started, the controller reset and read out
+#define SIM_BLE_BTC_US 1000               // Configuration call to its completion event
+
+typedef struct SimBleEvent {
+  bool gap;
+  int event;
+  esp_gatt_if_t gatts_if;
+  union {
+    esp_ble_gatts_cb_param_t gatts;
+    esp_ble_gap_cb_param_t gap;
+  } param;
+  uint16_t handles[SIM_BLE_MAX_HANDLES];
+} SimBleEvent;
+
+// A write carries its value behind the event and is freed with it
+typedef struct SimBleWrite {
+  SimBleEvent event;
+  uint8_t value[];
+} SimBleWrite;
+
+typedef struct SimBleAttr {
+  esp_gatt_if_t gatts_if;
+  uint16_t length;
+  uint16_t max_length;
+  uint8_t* value;
+} SimBleAttr;
+
+// One host and the link to it
+typedef struct SimBleHost {
+  esp_bd_addr_t bda;
+  bool link;
+  int64_t link_up;
+  uint16_t conn_interval;
+  uint16_t conn_latency;
+  uint16_t conn_timeout;
+  SimEvent* conn_event;
+  SimBleNotification fifo[SIM_BLE_TX_FIFO];
+  int fifo_head;
+  int fifo_count;
+  bool congested;
+  bool seeking;  // Scanning for the pad
+  SimEvent* found;
+} SimBleHost;
+
+static esp_gatts_cb_t sim_ble_gatts_cb = NULL;
+static esp_gap_ble_cb_t sim_ble_gap_cb = NULL;
+static esp_gatt_if_t sim_ble_apps[SIM_BLE_MAX_APPS];
+static int sim_ble_app_count = 0;
+static SimBleAttr sim_ble_attrs[SIM_BLE_MAX_HANDLES];
+static uint16_t sim_ble_next_handle = SIM_BLE_FIRST_HANDLE;
+
+static bool sim_ble_advertising = false;
+static esp_ble_adv_params_t sim_ble_adv;
+static int64_t sim_ble_adv_start = 0;
+static esp_bd_addr_t sim_ble_whitelist[SIM_BLE_WHITELIST];
+static int sim_ble_whitelist_count = 0;
+static esp_ble_bond_dev_t sim_ble_bonded[SIM_BLE_MAX_BONDS];
+static int sim_ble_bonded_count = 0;
+static SimBleHost sim_ble_hosts[SIM_BLE_HOSTS] = {
+    {.bda = {0x5e, 0x11, 0x0c, 0xa1, 0x00, 0x01}},
+    {.bda = {0x5e, 0x11, 0x0c, 0xa1, 0x00, 0x02}},
+    {.bda = {0x5e, 0x11, 0x0c, 0xa1, 0x00, 0x03}},
+    {.bda = {0x5e, 0x11, 0x0c, 0xa1, 0x00, 0x04}},
+};
+static const uint8_t sim_ble_local[ESP_BD_ADDR_LEN] = {0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01};
+static SimBleNotifyHook sim_ble_notify_hook = NULL;
+
+static void sim_ble_dispatch(void* arg) {
+  SimBleEvent* event = arg;
+  if (event->gap) {
+    if (sim_ble_gap_cb != NULL) sim_ble_gap_cb(event->event, &event->param.gap);
+  } else if (sim_ble_gatts_cb != NULL) {
+    sim_ble_gatts_cb(event->event, event->gatts_if, &event->param.gatts);
+  }
+  free(event);
+}
+
+static SimBleEvent* sim_ble_event(bool gap, int type, esp_gatt_if_t gatts_if) {
+  SimBleEvent* event = calloc(1, sizeof(SimBleEvent));
+  event->gap = gap;
+  event->event = type;
+  event->gatts_if = gatts_if;
+  return event;
+}
+
+static void sim_ble_post(SimBleEvent* event, int64_t delay_us) {
+  sim_schedule_chip(sim_now() + delay_us, sim_ble_dispatch, event);
+}
+
+// Link level events reach every registered application, as Bluedroid does
+static void sim_ble_post_all_apps(int type, const esp_ble_gatts_cb_param_t* param) {
+  for (int i = 0; i < sim_ble_app_count; i++) {
+    SimBleEvent* event = sim_ble_event(false, type, sim_ble_apps[i]);
+    event->param.gatts = *param;
+    sim_ble_post(event, 0);
+  }
+}
+
+// Host number 1..SIM_BLE_HOSTS, NULL for any other
+static SimBleHost* sim_ble_host(int host) {
+  return host >= 1 && host <= SIM_BLE_HOSTS ? &sim_ble_hosts[host - 1] : NULL;
+}
+
+static SimBleHost* sim_ble_link_of(uint16_t conn_id) {
+  SimBleHost* host = sim_ble_host(conn_id + 1);
+  return host != NULL && host->link ? host : NULL;
+}
+
+static SimBleHost* sim_ble_link_to(const esp_bd_addr_t bda) {
+  for (int i = 0; i < SIM_BLE_HOSTS; i++) {
+    if (sim_ble_hosts[i].link && memcmp(sim_ble_hosts[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+      return &sim_ble_hosts[i];
+    }
+  }
+  return NULL;
+}
+
+static int sim_ble_links(void) {
+  int links = 0;
+  for (int i = 0; i < SIM_BLE_HOSTS; i++) links += sim_ble_hosts[i].link;
+  return links;
+}
+
+// The host asked for, or the first one connected for 0
+static SimBleHost* sim_ble_pick(int host) {
+  if (host != 0) return sim_ble_host(host);
+  for (int i = 0; i < SIM_BLE_HOSTS; i++) {
+    if (sim_ble_hosts[i].link) return &sim_ble_hosts[i];
+  }
+  return NULL;
+}
+
+void sim_ble_set_notify_hook(SimBleNotifyHook hook) {
+  sim_ble_notify_hook = hook;
+}
+
+bool sim_ble_connected(int host) {
+  SimBleHost* link = sim_ble_pick(host);
+  return link != NULL && link->link;
+}
+
+uint16_t sim_ble_interval(int host) {
+  SimBleHost* link = sim_ble_pick(host);
+  return link != NULL && link->link ? link->conn_interval : 0;
+}
+
+uint16_t sim_ble_latency(int host) {
+  SimBleHost* link = sim_ble_pick(host);
+  return link != NULL && link->link ? link->conn_latency : 0;
+}
+
+static void sim_ble_set_congested(SimBleHost* host, bool congested) {
+  if (host->congested == congested) return;
+  host->congested = congested;
+  esp_ble_gatts_cb_param_t param = {0};
+  param.congest.conn_id = host - sim_ble_hosts;
+  param.congest.congested = congested;
+  sim_ble_post_all_apps(ESP_GATTS_CONGEST_EVT, &param);
+}
+
+static void sim_ble_connection_event(void* arg) {
+  SimBleHost* host = arg;
+  host->conn_event = NULL;
+  if (!host->link) return;
+
+  for (int i = 0; i < SIM_BLE_PACKETS_PER_EVENT && host->fifo_count > 0; i++) {
+    SimBleNotification* notification = &host->fifo[host->fifo_head];
+    notification->delivered_us = sim_now();
+    if (sim_ble_notify_hook != NULL) sim_ble_notify_hook(notification);
+    host->fifo_head = (host->fifo_head + 1) % SIM_BLE_TX_FIFO;
+    host->fifo_count--;
+  }
+  if (host->congested && host->fifo_count <= SIM_BLE_CONGEST_LOW) sim_ble_set_congested(host, false);
+
+  host->conn_event = sim_schedule(sim_now() + host->conn_interval * 1250, sim_ble_connection_event, host);
+}
+
+// Directed advertising runs out on its own, the others last until stopped
+static bool sim_ble_adv_active(int64_t at) {
+  if (!sim_ble_advertising) return false;
+  return sim_ble_adv.adv_type != ADV_TYPE_DIRECT_IND_HIGH || at < sim_ble_adv_start + SIM_BLE_DIRECTED_US;
+}
+
+static bool sim_ble_adv_accepts(const esp_bd_addr_t peer) {
+  if (sim_ble_adv.adv_type == ADV_TYPE_DIRECT_IND_HIGH || sim_ble_adv.adv_type == ADV_TYPE_DIRECT_IND_LOW) {
+    return memcmp(sim_ble_adv.peer_addr, peer, sizeof(esp_bd_addr_t)) == 0;
+  }
+  if (sim_ble_adv.adv_type != ADV_TYPE_IND) return false;
+  if (sim_ble_adv.adv_filter_policy != ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST &&
+      sim_ble_adv.adv_filter_policy != ADV_FILTER_ALLOW_SCAN_WLST_CON_WLST) {
+    return true;
+  }
+  for (int i = 0; i < sim_ble_whitelist_count; i++) {
+    if (memcmp(sim_ble_whitelist[i], peer, sizeof(esp_bd_addr_t)) == 0) return true;
+  }
+  return false;
+}
+
+static void sim_ble_host_scan(void);
+
+// A connection ends advertising, the stack starts it again if it wants more hosts
+static void sim_ble_link_open(SimBleHost* host) {
+  if (host->found != NULL) sim_cancel(host->found);
+  host->found = NULL;
+  host->seeking = false;
+  sim_ble_advertising = false;
+  host->link = true;
+  host->link_up = sim_now();
+  host->conn_interval = SIM_BLE_INITIAL_INTERVAL;
+  host->conn_latency = 0;
+  host->conn_timeout = 400;
+  host->fifo_count = 0;
+  host->congested = false;
+  sim_ble_host_scan();
+
+  esp_ble_gatts_cb_param_t param = {0};
+  param.connect.conn_id = host - sim_ble_hosts;
+  memcpy(param.connect.remote_bda, host->bda, sizeof(esp_bd_addr_t));
+  param.connect.conn_params.interval = host->conn_interval;
+  param.connect.conn_params.latency = host->conn_latency;
+  param.connect.conn_params.timeout = host->conn_timeout;
+  sim_ble_post_all_apps(ESP_GATTS_CONNECT_EVT, &param);
+
+  host->conn_event = sim_schedule(sim_now() + host->conn_interval * 1250, sim_ble_connection_event, host);
+}
+
+void sim_ble_connect(int number) {
+  SimBleHost* host = sim_ble_host(number);
+  if (host == NULL || host->link) return;
+  if (!sim_ble_adv_active(sim_now())) {
+    ESP_LOGW(SIM_BT_TAG, "connect while not advertising ignored");
+    return;
+  }
+  if (!sim_ble_adv_accepts(host->bda)) {
+    ESP_LOGW(SIM_BT_TAG, "connect refused by the advertising filter");
+    return;
+  }
+  sim_ble_link_open(host);
+}
+
+static void sim_ble_host_found(void* arg) {
+  SimBleHost* host = arg;
+  host->found = NULL;
+  sim_ble_link_open(host);
+}
+
+// First advertising packet of the current set that lands in a scan window of a seeking host, -1 for none.
+// Packets go out every interval, undirected ones plus a pseudo-random delay as the controller adds.
+static int64_t sim_ble_first_seen(const SimBleHost* host) {
+  bool directed = sim_ble_adv.adv_type == ADV_TYPE_DIRECT_IND_HIGH;
+  int64_t interval = directed ? SIM_BLE_DIRECTED_INTERVAL_US : sim_ble_adv.adv_int_min * 625;
+  int64_t phase = SIM_BLE_SCAN_PHASE_US + (host - sim_ble_hosts) * SIM_BLE_SCAN_STAGGER_US;
+  uint32_t seed = (uint32_t)sim_ble_adv_start;
+
+  for (int64_t at = sim_ble_adv_start; at < sim_ble_adv_start + SIM_BLE_SCAN_LIMIT_US;) {
+    if (!sim_ble_adv_active(at)) return -1;
+    int64_t since_phase = at - phase;
+    if (at >= sim_now() && since_phase >= 0 && since_phase % SIM_BLE_SCAN_INTERVAL_US < SIM_BLE_SCAN_WINDOW_US) {
+      return at;
+    }
+    at += interval;
+    if (!directed) {
+      seed = seed * 1103515245u + 12345u;
+      at += (seed >> 16) % SIM_BLE_ADV_DELAY_US;
+    }
+  }
+  return -1;
+}
+
+// Work out when each seeking host picks up the current advertising, if it ever does. The earliest one connects
+// and ends the advertising, the others are worked out again against whatever follows.
+static void sim_ble_host_scan(void) {
+  for (int i = 0; i < SIM_BLE_HOSTS; i++) {
+    SimBleHost* host = &sim_ble_hosts[i];
+    if (host->found != NULL) sim_cancel(host->found);
+    host->found = NULL;
+    if (!host->seeking || host->link || !sim_ble_advertising || !sim_ble_adv_accepts(host->bda)) continue;
+
+    int64_t at = sim_ble_first_seen(host);
+    if (at >= 0) host->found = sim_schedule(at, sim_ble_host_found, host);
+  }
+}
+
+void sim_ble_reconnect(int number) {
+  SimBleHost* host = sim_ble_host(number);
+  if (host == NULL || host->link) return;
+  host->seeking = true;
+  sim_ble_host_scan();
+}
+
+int64_t sim_ble_link_since(int number) {
+  SimBleHost* host = sim_ble_pick(number);
+  return host != NULL && host->link ? host->link_up : -1;
+}
+
+const char* sim_ble_advertising_kind(void) {
+  if (!sim_ble_adv_active(sim_now())) return "off";
+  if (sim_ble_adv.adv_type == ADV_TYPE_DIRECT_IND_HIGH || sim_ble_adv.adv_type == ADV_TYPE_DIRECT_IND_LOW) {
+    return "directed";
+  }
+  if (sim_ble_adv.adv_filter_policy == ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST ||
+      sim_ble_adv.adv_filter_policy == ADV_FILTER_ALLOW_SCAN_WLST_CON_WLST) {
+    return "whitelist";
+  }
+  return "open";
+}
+
+int sim_ble_bonds(void) {
+  return sim_ble_bonded_count;
+}
+
+static void sim_ble_link_close(SimBleHost* host) {
+  host->link = false;
+  host->fifo_count = 0;
+  host->congested = false;
+  if (host->conn_event != NULL) sim_cancel(host->conn_event);
+  host->conn_event = NULL;
+
+  esp_ble_gatts_cb_param_t param = {0};
+  param.disconnect.conn_id = host - sim_ble_hosts;
+  memcpy(param.disconnect.remote_bda, host->bda, sizeof(esp_bd_addr_t));
+  param.disconnect.reason = 0x13;  // Remote user terminated connection
+  sim_ble_post_all_apps(ESP_GATTS_DISCONNECT_EVT, &param);
+}
+
+void sim_ble_disconnect(int number) {
+  for (int i = 0; i < SIM_BLE_HOSTS; i++) {
+    if (sim_ble_hosts[i].link && (number == 0 || number == i + 1)) sim_ble_link_close(&sim_ble_hosts[i]);
+  }
+}
+
+// The controller powers down with the chip: the hosts lose their links at the supervision timeout, a seeking host
+// goes on scanning, and the stack starts over with the bonds it keeps in NVS
+void sim_ble_chip_reset(void) {
+  for (int i = 0; i < SIM_BLE_HOSTS; i++) {
+    SimBleHost* host = &sim_ble_hosts[i];
+    if (host->conn_event != NULL) sim_cancel(host->conn_event);
+    if (host->found != NULL) sim_cancel(host->found);
+    host->conn_event = NULL;
+    host->found = NULL;
+    host->link = false;
+    host->fifo_count = 0;
+    host->congested = false;
+  }
+  sim_ble_gatts_cb = NULL;
+  sim_ble_gap_cb = NULL;
+  sim_ble_app_count = 0;
+  for (int handle = 0; handle < SIM_BLE_MAX_HANDLES; handle++) free(sim_ble_attrs[handle].value);
+  memset(sim_ble_attrs, 0, sizeof(sim_ble_attrs));
+  sim_ble_next_handle = SIM_BLE_FIRST_HANDLE;
+  sim_ble_advertising = false;
+  sim_ble_whitelist_count = 0;
+}
+
+// Write without response from the first host connected, the stack stores the value (ESP_GATT_AUTO_RSP) and
+// tells the application that owns it
+void sim_ble_write(int from, uint16_t handle, const uint8_t* data, uint16_t length) {
+  SimBleHost* host = sim_ble_pick(from);
+  if (host == NULL || !host->link || handle >= SIM_BLE_MAX_HANDLES || sim_ble_attrs[handle].value == NULL) return;
+  SimBleAttr* attr = &sim_ble_attrs[handle];
+  if (length > attr->max_length) return;
+  memcpy(attr->value, data, length);
+  attr->length = length;
+
+  SimBleWrite* write = calloc(1, sizeof(SimBleWrite) + length);
+  write->event.gap = false;
+  write->event.event = ESP_GATTS_WRITE_EVT;
+  write->event.gatts_if = attr->gatts_if;
+  memcpy(write->value, data, length);
+  esp_ble_gatts_cb_param_t* param = &write->event.param.gatts;
+  param->write.conn_id = host - sim_ble_hosts;
+  memcpy(param->write.bda, host->bda, sizeof(esp_bd_addr_t));
+  param->write.handle = handle;
+  param->write.len = length;
+  param->write.value = write->value;
+  sim_ble_post(&write->event, 0);
+}
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t* cfg) {
+  return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_deinit(void) {
+  return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) {
+  sim_task_block(sim_now() + SIM_BT_CONTROLLER_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_disable(void) {
+  return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) {
+  return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_init(void) {
+  sim_task_block(sim_now() + SIM_BT_BLUEDROID_INIT_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_enable(void) {
+  sim_task_block(sim_now() + SIM_BT_BLUEDROID_ENABLE_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_disable(void) {
+  return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_deinit(void) {
+  return ESP_OK;
+}
+
+const uint8_t* esp_bt_dev_get_address(void) {
+  return sim_ble_local;
+}
+
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback) {
+  sim_ble_gatts_cb = callback;
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id) {
+  if (sim_ble_app_count >= SIM_BLE_MAX_APPS) return ESP_FAIL;
+  esp_gatt_if_t gatts_if = SIM_BLE_FIRST_GATTS_IF + sim_ble_app_count;
+  sim_ble_apps[sim_ble_app_count++] = gatts_if;
+
+  SimBleEvent* event = sim_ble_event(false, ESP_GATTS_REG_EVT, gatts_if);
+  event->param.gatts.reg.status = ESP_GATT_OK;
+  event->param.gatts.reg.app_id = app_id;
+  sim_ble_post(event, SIM_BLE_BTC_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_app_unregister(esp_gatt_if_t gatts_if) {
+  for (int i = 0; i < sim_ble_app_count; i++) {
+    if (sim_ble_apps[i] != gatts_if) continue;
+    memmove(&sim_ble_apps[i], &sim_ble_apps[i + 1], (sim_ble_app_count - i - 1) * sizeof(esp_gatt_if_t));
+    sim_ble_app_count--;
+    return ESP_OK;
+  }
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t* gatts_attr_db, esp_gatt_if_t gatts_if,
+                                        uint8_t max_nb_attr, uint8_t srvc_inst_id) {
+  if (gatts_attr_db == NULL || max_nb_attr == 0) return ESP_ERR_INVALID_ARG;
+  if (sim_ble_next_handle + max_nb_attr > SIM_BLE_MAX_HANDLES) return ESP_ERR_NO_MEM;
+
+  SimBleEvent* event = sim_ble_event(false, ESP_GATTS_CREAT_ATTR_TAB_EVT, gatts_if);
+  for (int i = 0; i < max_nb_attr; i++) {
+    const esp_attr_desc_t* desc = &gatts_attr_db[i].att_desc;
+    uint16_t handle = sim_ble_next_handle++;
+    SimBleAttr* attr = &sim_ble_attrs[handle];
+    attr->gatts_if = gatts_if;
+    attr->max_length = desc->max_length > desc->length ? desc->max_length : desc->length;
+    attr->length = desc->length;
+    attr->value = calloc(1, attr->max_length ? attr->max_length : 1);
+    if (desc->value != NULL && desc->length) memcpy(attr->value, desc->value, desc->length);
+    event->handles[i] = handle;
+  }
+
+  // The first entry is the primary service declaration, its value is the service UUID
+  const esp_attr_desc_t* svc = &gatts_attr_db[0].att_desc;
+  event->param.gatts.add_attr_tab.status = ESP_GATT_OK;
+  event->param.gatts.add_attr_tab.svc_uuid.len = svc->length;
+  if (svc->value != NULL && svc->length == ESP_UUID_LEN_16) {
+    event->param.gatts.add_attr_tab.svc_uuid.uuid.uuid16 = svc->value[0] | (svc->value[1] << 8);
+  }
+  event->param.gatts.add_attr_tab.svc_inst_id = srvc_inst_id;
+  event->param.gatts.add_attr_tab.num_handle = max_nb_attr;
+  event->param.gatts.add_attr_tab.handles = event->handles;
+  sim_ble_post(event, SIM_BLE_BTC_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle) {
+  if (service_handle >= SIM_BLE_MAX_HANDLES || sim_ble_attrs[service_handle].value == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  SimBleEvent* event = sim_ble_event(false, ESP_GATTS_START_EVT, sim_ble_attrs[service_handle].gatts_if);
+  event->param.gatts.start.status = ESP_GATT_OK;
+  event->param.gatts.start.service_handle = service_handle;
+  sim_ble_post(event, SIM_BLE_BTC_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_stop_service(uint16_t service_handle) {
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_delete_service(uint16_t service_handle) {
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                      uint16_t value_len, uint8_t* value, bool need_confirm) {
+  SimBleHost* host = sim_ble_link_of(conn_id);
+  if (host == NULL) return ESP_ERR_INVALID_STATE;
+  if (host->fifo_count >= SIM_BLE_TX_FIFO) return ESP_FAIL;
+
+  SimBleNotification* notification = &host->fifo[(host->fifo_head + host->fifo_count) % SIM_BLE_TX_FIFO];
+  memset(notification, 0, sizeof(SimBleNotification));
+  notification->host = conn_id + 1;
+  notification->handle = attr_handle;
+  notification->length = value_len < sizeof(notification->data) ? value_len : sizeof(notification->data);
+  memcpy(notification->data, value, notification->length);
+  notification->accepted_us = sim_now();
+  host->fifo_count++;
+
+  if (!host->congested && host->fifo_count >= SIM_BLE_CONGEST_HIGH) sim_ble_set_congested(host, true);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_set_attr_value(uint16_t attr_handle, uint16_t length, const uint8_t* value) {
+  if (attr_handle >= SIM_BLE_MAX_HANDLES || sim_ble_attrs[attr_handle].value == NULL) return ESP_ERR_INVALID_ARG;
+  SimBleAttr* attr = &sim_ble_attrs[attr_handle];
+  if (length > attr->max_length) return ESP_ERR_INVALID_SIZE;
+  memcpy(attr->value, value, length);
+  attr->length = length;
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_get_attr_value(uint16_t attr_handle, uint16_t* length, const uint8_t** value) {
+  if (attr_handle >= SIM_BLE_MAX_HANDLES || sim_ble_attrs[attr_handle].value == NULL) return ESP_ERR_INVALID_ARG;
+  *length = sim_ble_attrs[attr_handle].length;
+  *value = sim_ble_attrs[attr_handle].value;
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback) {
+  sim_ble_gap_cb = callback;
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_adv_data(esp_ble_adv_data_t* adv_data) {
+  SimBleEvent* event = sim_ble_event(true, ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT, ESP_GATT_IF_NONE);
+  event->param.gap.adv_data_cmpl.status = ESP_BT_STATUS_SUCCESS;
+  sim_ble_post(event, SIM_BLE_BTC_US);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t* adv_params) {
+  bool full = sim_ble_links() >= SIM_BLE_LINKS;
+  sim_ble_advertising = !full;
+  sim_ble_adv = *adv_params;
+  sim_ble_adv_start = sim_now();
+  sim_ble_host_scan();
+  SimBleEvent* event = sim_ble_event(true, ESP_GAP_BLE_ADV_START_COMPLETE_EVT, ESP_GATT_IF_NONE);
+  event->param.gap.adv_start_cmpl.status = full ? ESP_BT_STATUS_FAIL : ESP_BT_STATUS_SUCCESS;
+  sim_ble_post(event, 0);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void) {
+  sim_ble_advertising = false;
+  sim_ble_host_scan();
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_update_whitelist(bool add_remove, esp_bd_addr_t remote_bda, esp_ble_wl_addr_type_t wl_addr_type) {
+  for (int i = 0; i < sim_ble_whitelist_count; i++) {
+    if (memcmp(sim_ble_whitelist[i], remote_bda, sizeof(esp_bd_addr_t)) != 0) continue;
+    if (!add_remove) {
+      memmove(&sim_ble_whitelist[i], &sim_ble_whitelist[i + 1],
+              (sim_ble_whitelist_count - i - 1) * sizeof(esp_bd_addr_t));
+      sim_ble_whitelist_count--;
+    }
+    return ESP_OK;
+  }
+  if (!add_remove) return ESP_OK;
+  if (sim_ble_whitelist_count >= SIM_BLE_WHITELIST) return ESP_ERR_NO_MEM;
+  memcpy(sim_ble_whitelist[sim_ble_whitelist_count++], remote_bda, sizeof(esp_bd_addr_t));
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_clear_whitelist(void) {
+  sim_ble_whitelist_count = 0;
+  return ESP_OK;
+}
+
+int esp_ble_get_bond_device_num(void) {
+  return sim_ble_bonded_count;
+}
+
+esp_err_t esp_ble_get_bond_device_list(int* dev_num, esp_ble_bond_dev_t* dev_list) {
+  if (*dev_num > sim_ble_bonded_count) *dev_num = sim_ble_bonded_count;
+  memcpy(dev_list, sim_ble_bonded, *dev_num * sizeof(esp_ble_bond_dev_t));
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_remove_bond_device(esp_bd_addr_t bd_addr) {
+  for (int i = 0; i < sim_ble_bonded_count; i++) {
+    if (memcmp(sim_ble_bonded[i].bd_addr, bd_addr, sizeof(esp_bd_addr_t)) != 0) continue;
+    memmove(&sim_ble_bonded[i], &sim_ble_bonded[i + 1], (sim_ble_bonded_count - i - 1) * sizeof(esp_ble_bond_dev_t));
+    sim_ble_bonded_count--;
+    return ESP_OK;
+  }
+  return ESP_FAIL;
+}
+
+esp_err_t esp_ble_gap_set_device_name(const char* name) {
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_local_icon(uint16_t icon) {
+  return ESP_OK;
+}
+
+static void sim_ble_apply_update(void* arg) {
+  SimBleEvent* event = arg;
+  SimBleHost* host = sim_ble_link_to(event->param.gap.update_conn_params.bda);
+  if (host == NULL) {
+    free(event);
+    return;
+  }
+  host->conn_interval = event->param.gap.update_conn_params.conn_int;
+  host->conn_latency = event->param.gap.update_conn_params.latency;
+  host->conn_timeout = event->param.gap.update_conn_params.timeout;
+  sim_ble_dispatch(event);
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t* params) {
+  SimBleHost* host = sim_ble_link_to(params->bda);
+  if (host == NULL) return ESP_ERR_INVALID_STATE;
+
+  // The host always grants the slowest interval the request allows
+  uint16_t interval = params->max_int;
+  SimBleEvent* event = sim_ble_event(true, ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, ESP_GATT_IF_NONE);
+  event->param.gap.update_conn_params.status = ESP_BT_STATUS_SUCCESS;
+  memcpy(event->param.gap.update_conn_params.bda, params->bda, sizeof(esp_bd_addr_t));
+  event->param.gap.update_conn_params.min_int = params->min_int;
+  event->param.gap.update_conn_params.max_int = params->max_int;
+  event->param.gap.update_conn_params.latency = params->latency;
+  event->param.gap.update_conn_params.conn_int = interval;
+  event->param.gap.update_conn_params.timeout = params->timeout;
+
+  // Takes effect at an instant a few connection events ahead, the old interval applies until then
+  sim_schedule_chip(sim_now() + (int64_t)SIM_BLE_UPDATE_EVENTS * host->conn_interval * 1250, sim_ble_apply_update, event);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_security_param(esp_ble_sm_param_t param_type, void* value, uint8_t len) {
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_security_rsp(esp_bd_addr_t bd_addr, bool accept) {
+  return ESP_OK;
+}
+
+// New bonds go to the end of the list, as the stack stores them
+static void sim_ble_bond(const esp_bd_addr_t peer) {
+  for (int i = 0; i < sim_ble_bonded_count; i++) {
+    if (memcmp(sim_ble_bonded[i].bd_addr, peer, sizeof(esp_bd_addr_t)) == 0) return;
+  }
+  if (sim_ble_bonded_count >= SIM_BLE_MAX_BONDS) return;
+  esp_ble_bond_dev_t* bond = &sim_ble_bonded[sim_ble_bonded_count++];
+  memset(bond, 0, sizeof(esp_ble_bond_dev_t));
+  memcpy(bond->bd_addr, peer, sizeof(esp_bd_addr_t));
+  bond->bond_key.key_mask = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+  bond->bond_key.pid_key.addr_type = BLE_ADDR_TYPE_PUBLIC;
+  memcpy(bond->bond_key.pid_key.static_addr, peer, sizeof(esp_bd_addr_t));
+}
+
+static void sim_ble_auth_complete(void* arg) {
+  SimBleHost* host = arg;
+  if (!host->link) return;
+  sim_ble_bond(host->bda);
+  SimBleEvent* event = sim_ble_event(true, ESP_GAP_BLE_AUTH_CMPL_EVT, ESP_GATT_IF_NONE);
+  memcpy(event->param.gap.ble_security.auth_cmpl.bd_addr, host->bda, sizeof(esp_bd_addr_t));
+  event->param.gap.ble_security.auth_cmpl.success = true;
+  event->param.gap.ble_security.auth_cmpl.addr_type = BLE_ADDR_TYPE_PUBLIC;
+  sim_ble_dispatch(event);
+}
+
+esp_err_t esp_ble_set_encryption(esp_bd_addr_t bd_addr, esp_ble_sec_act_t sec_act) {
+  SimBleHost* host = sim_ble_link_to(bd_addr);
+  if (host == NULL) return ESP_ERR_INVALID_STATE;
+  sim_schedule_chip(sim_now() + SIM_BLE_ENCRYPT_US, sim_ble_auth_complete, host);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t remote_device) {
+  SimBleHost* host = sim_ble_link_to(remote_device);
+  if (host == NULL) return ESP_ERR_INVALID_STATE;
+  sim_ble_link_close(host);
+  return ESP_OK;
+}
@@ -0,0 +1,5 @@
+// First of the firmware objects on the link line, chip_end.c is the last. The linker places .data and .bss in
+// link order, so everything between the two markers is the memory a deep sleep loses, see sim_chip_boot().
+
+char sim_chip_data_begin[1] = {1};
+char sim_chip_bss_begin[1];
@@ -0,0 +1,4 @@
+// Last of the firmware objects on the link line, see chip_begin.c
+
+char sim_chip_data_end[1] = {1};
+char sim_chip_bss_end[1];
@@ -0,0 +1,80 @@
+// esp_timer stand-in, callbacks run from scheduler context like the esp_timer task on target
+
+#include "esp_timer.h"
+
+#include <stdlib.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void* arg;
+  const char* name;
+  uint64_t period;  // 0 for one shot
+  int64_t alarm;
+  SimEvent* event;
+};
+
+// Counts from the last start of the firmware, a wake from deep sleep included
+int64_t esp_timer_get_time(void) {
+  return sim_now() - sim_chip_boot_us();
+}
+
+static void sim_timer_fire(void* arg) {
+  esp_timer_handle_t timer = arg;
+  timer->event = NULL;
+  if (timer->period) {
+    // Periodic timers keep their phase, a late callback does not push the next one back
+    timer->alarm += timer->period;
+    timer->event = sim_schedule_chip(timer->alarm, sim_timer_fire, timer);
+  }
+  sim_wakeup_note();
+  timer->callback(timer->arg);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+  if (create_args == NULL || create_args->callback == NULL || out_handle == NULL) return ESP_ERR_INVALID_ARG;
+  esp_timer_handle_t timer = calloc(1, sizeof(struct esp_timer));
+  timer->callback = create_args->callback;
+  timer->arg = create_args->arg;
+  timer->name = create_args->name;
+  *out_handle = timer;
+  return ESP_OK;
+}
+
+static esp_err_t sim_timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period) {
+  if (timer == NULL) return ESP_ERR_INVALID_ARG;
+  if (timer->event != NULL) return ESP_ERR_INVALID_STATE;
+  timer->period = period;
+  timer->alarm = sim_now() + (int64_t)timeout_us;
+  timer->event = sim_schedule_chip(timer->alarm, sim_timer_fire, timer);
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  return sim_timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+  return sim_timer_start(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  if (timer == NULL) return ESP_ERR_INVALID_ARG;
+  if (timer->event == NULL) return ESP_ERR_INVALID_STATE;
+  sim_cancel(timer->event);
+  timer->event = NULL;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+  if (timer == NULL) return ESP_ERR_INVALID_ARG;
+  if (timer->event != NULL) return ESP_ERR_INVALID_STATE;
+  free(timer);
+  return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+  return timer != NULL && timer->event != NULL;
+}
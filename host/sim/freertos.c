@@ -0,0 +1,230 @@
+// FreeRTOS task, notification, queue and queue set stand-ins
+//
+// Timeouts are rounded up to the tick boundary the real kernel would wake on, so a vTaskDelay(1) at
+// CONFIG_FREERTOS_HZ=100 sleeps anywhere between 0 and 10 ms of virtual time, as it does on target.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_freertos_hooks.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "sim_internal.h"
+
+#define SIM_TICK_US (1000000 / configTICK_RATE_HZ)
+#define SIM_HOOKS_MAX 8  // Per core in ESP-IDF, the simulator has the one
+
+static esp_freertos_idle_cb_t sim_idle_hooks[SIM_HOOKS_MAX];
+static esp_freertos_tick_cb_t sim_tick_hooks[SIM_HOOKS_MAX];
+
+struct SimQueue {
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t count;
+  UBaseType_t head;
+  uint8_t* items;
+  struct SimQueue* set;  // Queue set this queue is a member of, it gets the handle of every item put here
+};
+
+static int64_t sim_tick_deadline(TickType_t ticks) {
+  if (ticks == portMAX_DELAY) return SIM_FOREVER;
+  return (sim_now() / SIM_TICK_US + ticks) * SIM_TICK_US;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char* const pcName, const uint32_t usStackDepth,
+                                   void* const pvParameters, UBaseType_t uxPriority, TaskHandle_t* const pvCreatedTask,
+                                   const BaseType_t xCoreID) {
+  (void)usStackDepth;
+  (void)xCoreID;
+  TaskHandle_t task = sim_task_create(pvTaskCode, pcName, pvParameters, uxPriority);
+  if (pvCreatedTask != NULL) *pvCreatedTask = task;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char* const pcName, const uint32_t usStackDepth,
+                       void* const pvParameters, UBaseType_t uxPriority, TaskHandle_t* const pvCreatedTask) {
+  return xTaskCreatePinnedToCore(pvTaskCode, pcName, usStackDepth, pvParameters, uxPriority, pvCreatedTask,
+                                 tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete) {
+  if (xTaskToDelete == NULL || xTaskToDelete == sim_task_current()) sim_task_exit();
+  xTaskToDelete->state = SIM_TASK_DELETED;
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay) {
+  if (xTicksToDelay == 0) {
+    sim_yield();
+    return;
+  }
+  sim_task_block(sim_tick_deadline(xTicksToDelay));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  return sim_task_current();
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return (TickType_t)(sim_now() / SIM_TICK_US);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait) {
+  SimTask* self = sim_task_current();
+
+  if (self->notify_value == 0 && xTicksToWait != 0) {
+    self->notify_waiting = true;
+    sim_task_block(sim_tick_deadline(xTicksToWait));
+    self->notify_waiting = false;
+  }
+
+  uint32_t value = self->notify_value;
+  if (value) self->notify_value = xClearCountOnExit ? 0 : value - 1;
+  return value;
+}
+
+static void sim_notify_give(TaskHandle_t task) {
+  task->notify_value++;
+  if (task->notify_waiting) sim_task_make_ready(task);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify) {
+  sim_notify_give(xTaskToNotify);
+  sim_yield();
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t* pxHigherPriorityTaskWoken) {
+  sim_notify_give(xTaskToNotify);
+  if (pxHigherPriorityTaskWoken != NULL) {
+    SimTask* self = sim_task_current();
+    if (self == NULL || xTaskToNotify->priority > self->priority) *pxHigherPriorityTaskWoken = pdTRUE;
+  }
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize) {
+  QueueHandle_t queue = calloc(1, sizeof(struct SimQueue));
+  queue->length = uxQueueLength;
+  queue->item_size = uxItemSize;
+  queue->items = calloc(uxQueueLength, uxItemSize);
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t xQueue) {
+  free(xQueue->items);
+  free(xQueue);
+}
+
+// Wake the highest priority task blocked on the queue
+static void sim_queue_wake(QueueHandle_t queue) {
+  SimTask* best = NULL;
+  for (SimTask* task = sim_task_first(); task != NULL; task = task->next) {
+    if (task->state == SIM_TASK_BLOCKED && task->queue_waiting == queue &&
+        (best == NULL || task->priority > best->priority)) {
+      best = task;
+    }
+  }
+  if (best != NULL) sim_task_make_ready(best);
+}
+
+static BaseType_t sim_queue_put(QueueHandle_t queue, const void* item) {
+  if (queue->count >= queue->length) return pdFALSE;
+  UBaseType_t tail = (queue->head + queue->count) % queue->length;
+  memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+  queue->count++;
+  sim_queue_wake(queue);
+  if (queue->set != NULL) sim_queue_put(queue->set, &queue);
+  return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void* pvItemToQueue, TickType_t xTicksToWait) {
+  // Senders never block in the firmware, a full queue fails straight away
+  (void)xTicksToWait;
+  BaseType_t ret = sim_queue_put(xQueue, pvItemToQueue);
+  sim_yield();
+  return ret;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t xQueue, const void* pvItemToQueue, BaseType_t* pxHigherPriorityTaskWoken) {
+  BaseType_t ret = sim_queue_put(xQueue, pvItemToQueue);
+  if (pxHigherPriorityTaskWoken != NULL) *pxHigherPriorityTaskWoken = ret;
+  return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void* pvBuffer, TickType_t xTicksToWait) {
+  if (xQueue->count == 0 && xTicksToWait != 0) {
+    SimTask* self = sim_task_current();
+    self->queue_waiting = xQueue;
+    sim_task_block(sim_tick_deadline(xTicksToWait));
+    self->queue_waiting = NULL;
+  }
+  if (xQueue->count == 0) return pdFALSE;
+
+  memcpy(pvBuffer, xQueue->items + xQueue->head * xQueue->item_size, xQueue->item_size);
+  xQueue->head = (xQueue->head + 1) % xQueue->length;
+  xQueue->count--;
+  return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t xQueue) {
+  xQueue->count = 0;
+  xQueue->head = 0;
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue) {
+  return xQueue->count;
+}
+
+QueueSetHandle_t xQueueCreateSet(UBaseType_t uxEventQueueLength) {
+  return xQueueCreate(uxEventQueueLength, sizeof(QueueSetMemberHandle_t));
+}
+
+BaseType_t xQueueAddToSet(QueueSetMemberHandle_t xQueueOrSemaphore, QueueSetHandle_t xQueueSet) {
+  // As on target, only an empty queue that is not in another set can join
+  if (xQueueOrSemaphore->set != NULL || xQueueOrSemaphore->count != 0) return pdFAIL;
+  xQueueOrSemaphore->set = xQueueSet;
+  return pdPASS;
+}
+
+QueueSetMemberHandle_t xQueueSelectFromSet(QueueSetHandle_t xQueueSet, TickType_t xTicksToWait) {
+  QueueSetMemberHandle_t member = NULL;
+  return xQueueReceive(xQueueSet, &member, xTicksToWait) ? member : NULL;
+}
+
+esp_err_t esp_register_freertos_idle_hook_for_cpu(esp_freertos_idle_cb_t new_idle_cb, UBaseType_t cpuid) {
+  if (cpuid >= portNUM_PROCESSORS) return ESP_ERR_INVALID_ARG;
+  for (int i = 0; i < SIM_HOOKS_MAX; i++) {
+    if (sim_idle_hooks[i] != NULL) continue;
+    sim_idle_hooks[i] = new_idle_cb;
+    return ESP_OK;
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t new_tick_cb, UBaseType_t cpuid) {
+  if (cpuid >= portNUM_PROCESSORS) return ESP_ERR_INVALID_ARG;
+  for (int i = 0; i < SIM_HOOKS_MAX; i++) {
+    if (sim_tick_hooks[i] != NULL) continue;
+    sim_tick_hooks[i] = new_tick_cb;
+    return ESP_OK;
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+void sim_freertos_idle(void) {
+  for (int i = 0; i < SIM_HOOKS_MAX; i++) {
+    if (sim_idle_hooks[i] != NULL) sim_idle_hooks[i]();
+  }
+}
+
+void sim_freertos_tick(void) {
+  for (int i = 0; i < SIM_HOOKS_MAX; i++) {
+    if (sim_tick_hooks[i] != NULL) sim_tick_hooks[i]();
+  }
+}
+
+void sim_freertos_chip_reset(void) {
+  memset(sim_idle_hooks, 0, sizeof(sim_idle_hooks));
+  memset(sim_tick_hooks, 0, sizeof(sim_tick_hooks));
+}
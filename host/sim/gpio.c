@@ -0,0 +1,272 @@
+// GPIO stand-in
+//
+// Inputs are resolved through the board model hook first, so a matrix row reads high only while one of its keys
+// is pressed and the matching column is driven high. Level and edge interrupts are re-evaluated whenever a level
+// or an interrupt enable could have changed. A pad on hold keeps its output level, through a deep sleep as well
+// once gpio_deep_sleep_hold_en() is set.
+//
+// In light sleep an interrupt only reaches the firmware if its pin woke the chip, that is the pin has a level
+// armed with gpio_wakeup_enable() and esp_sleep_enable_gpio_wakeup() is set, as on target. Any other interrupt
+// waits for the next wake-up the chip has for its own reasons, a timer, a task timeout or the BLE controller.
+
+#include "driver/gpio.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "sim_internal.h"
+
+typedef struct SimGpio {
+  gpio_mode_t mode;
+  gpio_int_type_t intr_type;
+  bool intr_enabled;
+  int output;
+  int input;       // Level driven from outside when no hook claims the pin
+  int last_level;  // For edge detection
+  bool held;
+  bool wakeup;  // gpio_wakeup_enable(), the level is intr_type
+  gpio_isr_t isr;
+  void* isr_arg;
+} SimGpio;
+
+static SimGpio sim_gpio[GPIO_NUM_MAX];
+static bool sim_gpio_isr_service = false;
+static bool sim_gpio_in_eval = false;
+static bool sim_gpio_deep_hold = false;
+static bool sim_gpio_deferred = false;  // An interrupt is waiting for the chip to leave light sleep
+static bool sim_gpio_awake = false;     // Woken by something else, whatever is pending goes through
+static SimGpioInputHook sim_gpio_input_hook = NULL;
+
+static bool sim_gpio_valid(gpio_num_t gpio_num) {
+  return gpio_num >= 0 && gpio_num < GPIO_NUM_MAX;
+}
+
+void sim_gpio_set_input_hook(SimGpioInputHook hook) {
+  sim_gpio_input_hook = hook;
+}
+
+int sim_gpio_output_level(int gpio) {
+  return sim_gpio_valid(gpio) ? sim_gpio[gpio].output : 0;
+}
+
+bool sim_gpio_is_output(int gpio) {
+  return sim_gpio_valid(gpio) && (sim_gpio[gpio].mode & GPIO_MODE_OUTPUT);
+}
+
+static int sim_gpio_level(gpio_num_t gpio_num) {
+  SimGpio* pin = &sim_gpio[gpio_num];
+  if ((pin->mode & GPIO_MODE_OUTPUT) && !(pin->mode & GPIO_MODE_INPUT)) return pin->output;
+
+  int level;
+  if (sim_gpio_input_hook != NULL && sim_gpio_input_hook(gpio_num, &level)) return level;
+  return pin->input;
+}
+
+static bool sim_gpio_trigger(SimGpio* pin, int level) {
+  switch (pin->intr_type) {
+    case GPIO_INTR_HIGH_LEVEL:
+      return level == 1;
+    case GPIO_INTR_LOW_LEVEL:
+      return level == 0;
+    case GPIO_INTR_POSEDGE:
+      return level == 1 && pin->last_level == 0;
+    case GPIO_INTR_NEGEDGE:
+      return level == 0 && pin->last_level == 1;
+    case GPIO_INTR_ANYEDGE:
+      return level != pin->last_level;
+    default:
+      return false;
+  }
+}
+
+// Light sleeping with no GPIO wake-up asserted, the interrupts stay pending
+static bool sim_gpio_dozing(void) {
+  if (sim_gpio_awake || sim_pm_mode() != SIM_PM_LIGHT_SLEEP || !sim_chip_idle()) return false;
+  if (!sim_sleep_gpio_wakeup_enabled()) return true;
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    SimGpio* pin = &sim_gpio[gpio];
+    if (pin->wakeup && sim_gpio_trigger(pin, sim_gpio_level(gpio))) return false;
+  }
+  return true;
+}
+
+void sim_gpio_eval_interrupts(void) {
+  if (sim_gpio_in_eval) return;
+  if (sim_gpio_dozing()) {
+    sim_gpio_deferred = true;
+    sim_sleep_eval();
+    return;
+  }
+  sim_gpio_deferred = false;
+  sim_gpio_in_eval = true;
+
+  bool fired = true;
+  while (fired) {
+    fired = false;
+    for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+      SimGpio* pin = &sim_gpio[gpio];
+      int level = sim_gpio_level(gpio);
+      bool trigger = sim_gpio_trigger(pin, level);
+      pin->last_level = level;
+
+      if (trigger && pin->intr_enabled && pin->isr != NULL && sim_gpio_isr_service) {
+        pin->isr(pin->isr_arg);
+        // A level interrupt that is still asserted and enabled would lock up the core on target too
+        if (pin->intr_enabled && (pin->intr_type == GPIO_INTR_HIGH_LEVEL || pin->intr_type == GPIO_INTR_LOW_LEVEL)) {
+          continue;
+        }
+        fired = true;
+      }
+    }
+  }
+  sim_gpio_in_eval = false;
+  sim_sleep_eval();
+}
+
+bool sim_gpio_chip_wake(void) {
+  if (!sim_gpio_deferred) return false;
+  sim_gpio_awake = true;
+  sim_gpio_eval_interrupts();
+  sim_gpio_awake = false;
+  return true;
+}
+
+void sim_gpio_set_input(int gpio, int level) {
+  if (!sim_gpio_valid(gpio)) return;
+  sim_gpio[gpio].input = level ? 1 : 0;
+  sim_gpio_eval_interrupts();
+}
+
+esp_err_t gpio_config(const gpio_config_t* pGPIOConfig) {
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    if (!(pGPIOConfig->pin_bit_mask & (1ULL << gpio))) continue;
+    sim_gpio[gpio].mode = pGPIOConfig->mode;
+    sim_gpio[gpio].intr_type = pGPIOConfig->intr_type;
+    // gpio_config() enables the interrupt of every pin it gives an interrupt type
+    sim_gpio[gpio].intr_enabled = pGPIOConfig->intr_type != GPIO_INTR_DISABLE;
+    sim_gpio[gpio].last_level = sim_gpio_level(gpio);
+  }
+  sim_gpio_eval_interrupts();
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  if (sim_gpio[gpio_num].held) return ESP_OK;
+  sim_gpio[gpio_num].output = level ? 1 : 0;
+  sim_gpio_eval_interrupts();
+  return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return 0;
+  return sim_gpio_level(gpio_num);
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].mode = mode;
+  sim_gpio_eval_interrupts();
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].intr_type = intr_type;
+  sim_gpio[gpio_num].last_level = sim_gpio_level(gpio_num);
+  sim_gpio_eval_interrupts();
+  return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].intr_enabled = true;
+  sim_gpio_eval_interrupts();
+  return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].intr_enabled = false;
+  return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags) {
+  (void)intr_alloc_flags;
+  if (sim_gpio_isr_service) return ESP_ERR_INVALID_STATE;
+  sim_gpio_isr_service = true;
+  return ESP_OK;
+}
+
+void gpio_uninstall_isr_service(void) {
+  sim_gpio_isr_service = false;
+  sim_gpio_deferred = false;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  if (!sim_gpio_isr_service) return ESP_ERR_INVALID_STATE;
+  sim_gpio[gpio_num].isr = isr_handler;
+  sim_gpio[gpio_num].isr_arg = args;
+  sim_gpio_eval_interrupts();
+  return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].isr = NULL;
+  sim_gpio[gpio_num].isr_arg = NULL;
+  return ESP_OK;
+}
+
+// The wake-up level is the interrupt type of the pin, as on target
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  if (intr_type != GPIO_INTR_HIGH_LEVEL && intr_type != GPIO_INTR_LOW_LEVEL) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].wakeup = true;
+  return gpio_set_intr_type(gpio_num, intr_type);
+}
+
+esp_err_t gpio_wakeup_disable(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].wakeup = false;
+  return ESP_OK;
+}
+
+esp_err_t gpio_hold_en(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].held = true;
+  return ESP_OK;
+}
+
+esp_err_t gpio_hold_dis(gpio_num_t gpio_num) {
+  if (!sim_gpio_valid(gpio_num)) return ESP_ERR_INVALID_ARG;
+  sim_gpio[gpio_num].held = false;
+  return ESP_OK;
+}
+
+void gpio_deep_sleep_hold_en(void) {
+  sim_gpio_deep_hold = true;
+}
+
+void gpio_deep_sleep_hold_dis(void) {
+  sim_gpio_deep_hold = false;
+}
+
+// The pads go back to their reset state, disabled with no interrupt, unless they are held through the sleep
+void sim_gpio_chip_reset(void) {
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    SimGpio* pin = &sim_gpio[gpio];
+    pin->intr_type = GPIO_INTR_DISABLE;
+    pin->intr_enabled = false;
+    pin->wakeup = false;
+    pin->isr = NULL;
+    pin->isr_arg = NULL;
+    if (pin->held && sim_gpio_deep_hold) continue;
+    pin->held = false;
+    pin->mode = GPIO_MODE_DISABLE;
+    pin->output = 0;
+  }
+  sim_gpio_isr_service = false;
+  sim_gpio_deferred = false;
+}
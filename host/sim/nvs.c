@@ -0,0 +1,194 @@
+// NVS stand-in, an in-memory key/value store that counts what would reach flash
+//
+// Entries live for the whole run, so a scenario sees what the firmware committed. Like NVS, a set that stores
+// the value already there writes nothing, and every other set costs one flash write. Mounting scans every page
+// of the partition, which keeps the caller busy for a few milliseconds.
+
+#include "nvs.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nvs_flash.h"
+#include "sim_internal.h"
+
+#define SIM_NVS_MAX_ENTRIES 64
+#define SIM_NVS_MAX_HANDLES 8
+#define SIM_NVS_KEY_LEN 16  // NVS namespace and key names are at most 15 characters
+#define SIM_NVS_INIT_US 3000
+
+typedef enum SimNvsType {
+  SIM_NVS_U16 = 0,
+  SIM_NVS_BLOB,
+} SimNvsType;
+
+typedef struct SimNvsEntry {
+  bool used;
+  char space[SIM_NVS_KEY_LEN];
+  char key[SIM_NVS_KEY_LEN];
+  SimNvsType type;
+  size_t length;
+  uint8_t* value;
+} SimNvsEntry;
+
+typedef struct SimNvsHandle {
+  bool open;
+  nvs_open_mode_t mode;
+  char space[SIM_NVS_KEY_LEN];
+} SimNvsHandle;
+
+static SimNvsEntry sim_nvs_entries[SIM_NVS_MAX_ENTRIES];
+static SimNvsHandle sim_nvs_handles[SIM_NVS_MAX_HANDLES];
+static uint32_t sim_nvs_write_count = 0;
+static uint32_t sim_nvs_commit_count = 0;
+
+esp_err_t nvs_flash_init(void) {
+  sim_advance(SIM_NVS_INIT_US);
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+  for (int i = 0; i < SIM_NVS_MAX_ENTRIES; i++) {
+    free(sim_nvs_entries[i].value);
+    memset(&sim_nvs_entries[i], 0, sizeof(SimNvsEntry));
+  }
+  return ESP_OK;
+}
+
+void sim_nvs_chip_reset(void) {
+  memset(sim_nvs_handles, 0, sizeof(sim_nvs_handles));
+}
+
+uint32_t sim_nvs_writes(void) {
+  return sim_nvs_write_count;
+}
+
+uint32_t sim_nvs_commits(void) {
+  return sim_nvs_commit_count;
+}
+
+static SimNvsHandle* sim_nvs_handle(nvs_handle_t handle) {
+  if (handle == 0 || handle > SIM_NVS_MAX_HANDLES || !sim_nvs_handles[handle - 1].open) return NULL;
+  return &sim_nvs_handles[handle - 1];
+}
+
+static SimNvsEntry* sim_nvs_find(const SimNvsHandle* handle, const char* key) {
+  for (int i = 0; i < SIM_NVS_MAX_ENTRIES; i++) {
+    SimNvsEntry* entry = &sim_nvs_entries[i];
+    if (entry->used && strcmp(entry->space, handle->space) == 0 && strcmp(entry->key, key) == 0) return entry;
+  }
+  return NULL;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle) {
+  if (name == NULL || strlen(name) >= SIM_NVS_KEY_LEN) return ESP_ERR_NVS_INVALID_NAME;
+  for (int i = 0; i < SIM_NVS_MAX_HANDLES; i++) {
+    if (sim_nvs_handles[i].open) continue;
+    sim_nvs_handles[i].open = true;
+    sim_nvs_handles[i].mode = open_mode;
+    strcpy(sim_nvs_handles[i].space, name);
+    *out_handle = i + 1;
+    return ESP_OK;
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle) {
+  SimNvsHandle* open = sim_nvs_handle(handle);
+  if (open != NULL) open->open = false;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  if (sim_nvs_handle(handle) == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  sim_nvs_commit_count++;
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+  SimNvsHandle* open = sim_nvs_handle(handle);
+  if (open == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (open->mode == NVS_READONLY) return ESP_ERR_NVS_READ_ONLY;
+  SimNvsEntry* entry = sim_nvs_find(open, key);
+  if (entry == NULL) return ESP_ERR_NVS_NOT_FOUND;
+  free(entry->value);
+  memset(entry, 0, sizeof(SimNvsEntry));
+  sim_nvs_write_count++;
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  SimNvsHandle* open = sim_nvs_handle(handle);
+  if (open == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (open->mode == NVS_READONLY) return ESP_ERR_NVS_READ_ONLY;
+  for (int i = 0; i < SIM_NVS_MAX_ENTRIES; i++) {
+    SimNvsEntry* entry = &sim_nvs_entries[i];
+    if (!entry->used || strcmp(entry->space, open->space) != 0) continue;
+    free(entry->value);
+    memset(entry, 0, sizeof(SimNvsEntry));
+    sim_nvs_write_count++;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t sim_nvs_get(nvs_handle_t handle, const char* key, SimNvsType type, void* out, size_t* length) {
+  SimNvsHandle* open = sim_nvs_handle(handle);
+  if (open == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  SimNvsEntry* entry = sim_nvs_find(open, key);
+  if (entry == NULL) return ESP_ERR_NVS_NOT_FOUND;
+  if (entry->type != type) return ESP_ERR_NVS_TYPE_MISMATCH;
+  if (out == NULL) {
+    *length = entry->length;
+    return ESP_OK;
+  }
+  if (*length < entry->length) return ESP_ERR_NVS_INVALID_LENGTH;
+  memcpy(out, entry->value, entry->length);
+  *length = entry->length;
+  return ESP_OK;
+}
+
+static esp_err_t sim_nvs_set(nvs_handle_t handle, const char* key, SimNvsType type, const void* value,
+                             size_t length) {
+  SimNvsHandle* open = sim_nvs_handle(handle);
+  if (open == NULL) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (open->mode == NVS_READONLY) return ESP_ERR_NVS_READ_ONLY;
+  if (key == NULL || strlen(key) >= SIM_NVS_KEY_LEN) return ESP_ERR_NVS_INVALID_NAME;
+
+  SimNvsEntry* entry = sim_nvs_find(open, key);
+  if (entry != NULL && entry->type == type && entry->length == length && memcmp(entry->value, value, length) == 0) {
+    return ESP_OK;
+  }
+  if (entry == NULL) {
+    for (int i = 0; i < SIM_NVS_MAX_ENTRIES && entry == NULL; i++) {
+      if (!sim_nvs_entries[i].used) entry = &sim_nvs_entries[i];
+    }
+    if (entry == NULL) return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    entry->used = true;
+    strcpy(entry->space, open->space);
+    strcpy(entry->key, key);
+  }
+  free(entry->value);
+  entry->type = type;
+  entry->length = length;
+  entry->value = malloc(length > 0 ? length : 1);
+  memcpy(entry->value, value, length);
+  sim_nvs_write_count++;
+  return ESP_OK;
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char* key, uint16_t* out_value) {
+  size_t length = sizeof(uint16_t);
+  return sim_nvs_get(handle, key, SIM_NVS_U16, out_value, &length);
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char* key, uint16_t value) {
+  return sim_nvs_set(handle, key, SIM_NVS_U16, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length) {
+  return sim_nvs_get(handle, key, SIM_NVS_BLOB, out_value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+  return sim_nvs_set(handle, key, SIM_NVS_BLOB, value, length);
+}
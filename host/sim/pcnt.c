@@ -0,0 +1,205 @@
+// Pulse counter stand-in
+//
+// sim_pcnt_step() moves a unit one count at a time so that limit and threshold events fire exactly where the
+// hardware would raise them. Limit events reset the counter to zero, as on target. The interrupt is served
+// SIM_PCNT_ISR_US after the event, and the unit keeps counting meanwhile: events that land in that window latch
+// into the same status, as they do in the hardware status register.
+
+#include "driver/pcnt.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "sim_internal.h"
+
+#define SIM_PCNT_ISR_US 20  // Interrupt entry plus the ISR service dispatch
+
+typedef struct SimPcnt {
+  bool running;
+  int16_t count;
+  int16_t h_lim;
+  int16_t l_lim;
+  int16_t thres0;
+  int16_t thres1;
+  uint32_t events;  // Enabled pcnt_evt_type_t bits
+  uint32_t status;   // Events behind the last interrupt
+  uint32_t pending;  // Events latched since, not served yet
+  bool intr_enabled;
+  uint16_t filter;
+  void (*isr)(void*);
+  void* isr_arg;
+} SimPcnt;
+
+static SimPcnt sim_pcnt[PCNT_UNIT_MAX];
+static bool sim_pcnt_isr_service = false;
+
+static bool sim_pcnt_valid(pcnt_unit_t unit) {
+  return unit >= 0 && unit < PCNT_UNIT_MAX;
+}
+
+static void sim_pcnt_serve(void* arg) {
+  SimPcnt* pcnt = arg;
+  if (!pcnt->pending) return;  // Chip reset in between
+  pcnt->status = pcnt->pending;
+  pcnt->pending = 0;
+  if (pcnt->intr_enabled && pcnt->isr != NULL && sim_pcnt_isr_service) pcnt->isr(pcnt->isr_arg);
+}
+
+static void sim_pcnt_raise(SimPcnt* pcnt, uint32_t status) {
+  status &= pcnt->events;
+  if (!status) return;
+  if (!pcnt->pending) sim_schedule_chip(sim_now() + SIM_PCNT_ISR_US, sim_pcnt_serve, pcnt);
+  pcnt->pending |= status;
+}
+
+void sim_pcnt_step(int unit, int delta) {
+  if (!sim_pcnt_valid(unit)) return;
+  SimPcnt* pcnt = &sim_pcnt[unit];
+  int step = delta > 0 ? 1 : -1;
+
+  for (int i = 0; i != delta && pcnt->running; i += step) {
+    pcnt->count += step;
+    uint32_t status = 0;
+    if (pcnt->count == pcnt->thres0) status |= PCNT_EVT_THRES_0;
+    if (pcnt->count == pcnt->thres1) status |= PCNT_EVT_THRES_1;
+    if (pcnt->count == 0) status |= PCNT_EVT_ZERO;
+    if (pcnt->h_lim && pcnt->count >= pcnt->h_lim) {
+      status |= PCNT_EVT_H_LIM;
+      pcnt->count = 0;
+    } else if (pcnt->l_lim && pcnt->count <= pcnt->l_lim) {
+      status |= PCNT_EVT_L_LIM;
+      pcnt->count = 0;
+    }
+    sim_pcnt_raise(pcnt, status);
+  }
+}
+
+void sim_pcnt_chip_reset(void) {
+  memset(sim_pcnt, 0, sizeof(sim_pcnt));
+  sim_pcnt_isr_service = false;
+}
+
+esp_err_t pcnt_unit_config(const pcnt_config_t* pcnt_config) {
+  if (pcnt_config == NULL || !sim_pcnt_valid(pcnt_config->unit)) return ESP_ERR_INVALID_ARG;
+  SimPcnt* pcnt = &sim_pcnt[pcnt_config->unit];
+  pcnt->h_lim = pcnt_config->counter_h_lim;
+  pcnt->l_lim = pcnt_config->counter_l_lim;
+  pcnt->running = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_get_counter_value(pcnt_unit_t pcnt_unit, int16_t* count) {
+  if (!sim_pcnt_valid(pcnt_unit) || count == NULL) return ESP_ERR_INVALID_ARG;
+  *count = sim_pcnt[pcnt_unit].count;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_pause(pcnt_unit_t pcnt_unit) {
+  if (!sim_pcnt_valid(pcnt_unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[pcnt_unit].running = false;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_resume(pcnt_unit_t pcnt_unit) {
+  if (!sim_pcnt_valid(pcnt_unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[pcnt_unit].running = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_clear(pcnt_unit_t pcnt_unit) {
+  if (!sim_pcnt_valid(pcnt_unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[pcnt_unit].count = 0;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_intr_enable(pcnt_unit_t pcnt_unit) {
+  if (!sim_pcnt_valid(pcnt_unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[pcnt_unit].intr_enabled = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_intr_disable(pcnt_unit_t pcnt_unit) {
+  if (!sim_pcnt_valid(pcnt_unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[pcnt_unit].intr_enabled = false;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t evt_type) {
+  if (!sim_pcnt_valid(unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[unit].events |= evt_type;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_event_disable(pcnt_unit_t unit, pcnt_evt_type_t evt_type) {
+  if (!sim_pcnt_valid(unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[unit].events &= ~evt_type;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_set_event_value(pcnt_unit_t unit, pcnt_evt_type_t evt_type, int16_t value) {
+  if (!sim_pcnt_valid(unit)) return ESP_ERR_INVALID_ARG;
+  switch (evt_type) {
+    case PCNT_EVT_THRES_0:
+      sim_pcnt[unit].thres0 = value;
+      break;
+    case PCNT_EVT_THRES_1:
+      sim_pcnt[unit].thres1 = value;
+      break;
+    case PCNT_EVT_H_LIM:
+      sim_pcnt[unit].h_lim = value;
+      break;
+    case PCNT_EVT_L_LIM:
+      sim_pcnt[unit].l_lim = value;
+      break;
+    default:
+      return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+esp_err_t pcnt_get_event_status(pcnt_unit_t unit, uint32_t* status) {
+  if (!sim_pcnt_valid(unit) || status == NULL) return ESP_ERR_INVALID_ARG;
+  *status = sim_pcnt[unit].status;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t filter_val) {
+  if (!sim_pcnt_valid(unit) || filter_val > 1023) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[unit].filter = filter_val;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit) {
+  return sim_pcnt_valid(unit) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t pcnt_filter_disable(pcnt_unit_t unit) {
+  return sim_pcnt_valid(unit) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t pcnt_isr_service_install(int intr_alloc_flags) {
+  if (sim_pcnt_isr_service) return ESP_ERR_INVALID_STATE;
+  sim_pcnt_isr_service = true;
+  return ESP_OK;
+}
+
+void pcnt_isr_service_uninstall(void) {
+  sim_pcnt_isr_service = false;
+}
+
+esp_err_t pcnt_isr_handler_add(pcnt_unit_t unit, void (*isr_handler)(void*), void* args) {
+  if (!sim_pcnt_valid(unit)) return ESP_ERR_INVALID_ARG;
+  if (!sim_pcnt_isr_service) return ESP_ERR_INVALID_STATE;
+  sim_pcnt[unit].isr = isr_handler;
+  sim_pcnt[unit].isr_arg = args;
+  // The IDF driver enables the unit interrupt along with the handler
+  sim_pcnt[unit].intr_enabled = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_isr_handler_remove(pcnt_unit_t unit) {
+  if (!sim_pcnt_valid(unit)) return ESP_ERR_INVALID_ARG;
+  sim_pcnt[unit].isr = NULL;
+  sim_pcnt[unit].isr_arg = NULL;
+  return ESP_OK;
+}
@@ -0,0 +1,160 @@
+// esp_pm stand-in, tracks which power mode the held locks would leave the chip in and for how long
+//
+// Nothing is slowed down or put to sleep, the firmware only sees its locks accepted. The mode follows the
+// IDF rules: any ESP_PM_CPU_FREQ_MAX lock runs the CPU at max_freq_mhz, ESP_PM_APB_FREQ_MAX keeps the APB at
+// 80 MHz, and with neither the CPU drops to min_freq_mhz and light sleeps when idle unless ESP_PM_NO_LIGHT_SLEEP
+// is held. A deep sleep drops the configuration and the locks along with the firmware that held them.
+
+#include "esp_pm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp32/pm.h"
+#include "sim_internal.h"
+
+struct esp_pm_lock {
+  esp_pm_lock_type_t type;
+  const char* name;
+  int count;
+  int64_t held_us;  // Total time held, up to the last release
+  int64_t since;    // Virtual time of the first acquire while held
+  struct esp_pm_lock* next;
+};
+
+static const char* const sim_pm_mode_names[SIM_PM_MODE_MAX] = {
+    [SIM_PM_CPU_MAX] = "CPU_MAX",
+    [SIM_PM_APB_MAX] = "APB_MAX",
+    [SIM_PM_APB_MIN] = "APB_MIN",
+    [SIM_PM_LIGHT_SLEEP] = "SLEEP",
+    [SIM_PM_DEEP_SLEEP] = "DEEP",
+};
+
+static bool sim_pm_configured = false;
+static esp_pm_config_esp32_t sim_pm_config;
+static struct esp_pm_lock* sim_pm_locks = NULL;
+static int sim_pm_held[ESP_PM_NO_LIGHT_SLEEP + 1];
+static bool sim_pm_asleep = false;
+static SimPmMode sim_pm_current = SIM_PM_CPU_MAX;
+static int64_t sim_pm_since = 0;
+static int64_t sim_pm_time[SIM_PM_MODE_MAX];
+
+static void sim_pm_update(void) {
+  SimPmMode mode = SIM_PM_CPU_MAX;
+  if (sim_pm_asleep) {
+    mode = SIM_PM_DEEP_SLEEP;
+  } else if (sim_pm_configured && !sim_pm_held[ESP_PM_CPU_FREQ_MAX]) {
+    if (sim_pm_held[ESP_PM_APB_FREQ_MAX]) {
+      mode = SIM_PM_APB_MAX;
+    } else if (sim_pm_held[ESP_PM_NO_LIGHT_SLEEP] || !sim_pm_config.light_sleep_enable) {
+      mode = SIM_PM_APB_MIN;
+    } else {
+      mode = SIM_PM_LIGHT_SLEEP;
+    }
+  }
+  int64_t now = sim_now();
+  sim_pm_time[sim_pm_current] += now - sim_pm_since;
+  sim_pm_since = now;
+  sim_pm_current = mode;
+}
+
+SimPmMode sim_pm_mode(void) {
+  return sim_pm_current;
+}
+
+const char* sim_pm_mode_name(SimPmMode mode) {
+  return mode < SIM_PM_MODE_MAX ? sim_pm_mode_names[mode] : "?";
+}
+
+int64_t sim_pm_mode_time(SimPmMode mode) {
+  if (mode >= SIM_PM_MODE_MAX) return 0;
+  return sim_pm_time[mode] + (mode == sim_pm_current ? sim_now() - sim_pm_since : 0);
+}
+
+void sim_pm_chip_sleep(bool asleep) {
+  if (asleep) {
+    sim_pm_configured = false;
+    sim_pm_locks = NULL;
+    memset(sim_pm_held, 0, sizeof(sim_pm_held));
+  }
+  sim_pm_asleep = asleep;
+  sim_pm_update();
+}
+
+esp_err_t esp_pm_configure(const void* config) {
+  const esp_pm_config_esp32_t* esp32_config = config;
+  if (esp32_config == NULL || esp32_config->min_freq_mhz > esp32_config->max_freq_mhz) return ESP_ERR_INVALID_ARG;
+  sim_pm_config = *esp32_config;
+  sim_pm_configured = true;
+  sim_pm_update();
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char* name,
+                             esp_pm_lock_handle_t* out_handle) {
+  (void)arg;
+  if (lock_type > ESP_PM_NO_LIGHT_SLEEP || out_handle == NULL) return ESP_ERR_INVALID_ARG;
+  esp_pm_lock_handle_t lock = calloc(1, sizeof(struct esp_pm_lock));
+  lock->type = lock_type;
+  lock->name = name ? name : "lock";
+  lock->next = sim_pm_locks;
+  sim_pm_locks = lock;
+  *out_handle = lock;
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_delete(esp_pm_lock_handle_t handle) {
+  if (handle == NULL) return ESP_ERR_INVALID_ARG;
+  if (handle->count) return ESP_ERR_INVALID_STATE;
+  for (struct esp_pm_lock** link = &sim_pm_locks; *link != NULL; link = &(*link)->next) {
+    if (*link == handle) {
+      *link = handle->next;
+      break;
+    }
+  }
+  free(handle);
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+  if (handle == NULL) return ESP_ERR_INVALID_ARG;
+  if (handle->count++ == 0) {
+    handle->since = sim_now();
+    sim_pm_held[handle->type]++;
+    sim_pm_update();
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+  if (handle == NULL) return ESP_ERR_INVALID_ARG;
+  if (handle->count == 0) return ESP_ERR_INVALID_STATE;
+  if (--handle->count == 0) {
+    handle->held_us += sim_now() - handle->since;
+    sim_pm_held[handle->type]--;
+    sim_pm_update();
+  }
+  return ESP_OK;
+}
+
+// Same layout as the IDF dump with CONFIG_PM_PROFILING, times are virtual
+esp_err_t esp_pm_dump_locks(FILE* stream) {
+  int64_t now = sim_now();
+  fprintf(stream, "Time: %lld\n", (long long)now);
+  fprintf(stream, "Lock stats:\n");
+  fprintf(stream, "%-15s %-14s %-5s %-8s %-13s\n", "Name", "Type", "Arg", "Active", "Time(us)");
+  for (struct esp_pm_lock* lock = sim_pm_locks; lock != NULL; lock = lock->next) {
+    static const char* const types[] = {"CPU_FREQ_MAX", "APB_FREQ_MAX", "NO_LIGHT_SLEEP"};
+    int64_t held = lock->held_us + (lock->count ? now - lock->since : 0);
+    fprintf(stream, "%-15s %-14s %-5d %-8d %-13lld\n", lock->name, types[lock->type], 0, lock->count,
+            (long long)held);
+  }
+  fprintf(stream, "Mode stats:\n");
+  fprintf(stream, "%-8s %-13s %-4s\n", "Mode", "Time(us)", "%");
+  for (int mode = 0; mode < SIM_PM_MODE_MAX; mode++) {
+    int64_t time = sim_pm_mode_time(mode);
+    fprintf(stream, "%-8s %-13lld %-4.1f\n", sim_pm_mode_names[mode], (long long)time,
+            now ? 100.0 * time / now : 0.0);
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,313 @@
+// Virtual clock, event list and the baton passing task scheduler behind the FreeRTOS stand-ins
+
+#include "sim.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_internal.h"
+
+struct SimEvent {
+  int64_t at;
+  uint64_t seq;
+  SimEventFn fn;
+  void* arg;
+  bool chip;  // Dropped by a deep sleep
+  SimEvent* next;
+};
+
+// Bracket the firmware objects on the link line, see CMakeLists.txt. Their .data and .bss is the memory a deep
+// sleep loses, RTC_DATA_ATTR moves a variable out of it.
+extern char sim_chip_data_begin[];
+extern char sim_chip_data_end[];
+extern char sim_chip_bss_begin[];
+extern char sim_chip_bss_end[];
+
+static int64_t sim_clock = 0;
+static uint64_t sim_event_seq = 0;
+static uint64_t sim_ready_seq = 0;
+static SimEvent* sim_events = NULL;
+static SimTask* sim_tasks = NULL;
+static SimTask* sim_current = NULL;  // NULL while the scheduler holds the baton
+static uint64_t sim_wakeup_count = 0;
+static int64_t sim_wakeup_at = -1;
+static bool sim_idle_spell = false;  // Idle hooks ran, the tick hooks are due at the next wake-up
+static void (*sim_entry)(void) = NULL;
+static uint8_t* sim_chip_image = NULL;  // Firmware .data as it was before app_main first ran
+static size_t sim_chip_data_size = 0;
+static int64_t sim_chip_boot_at = 0;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_scheduler_cond = PTHREAD_COND_INITIALIZER;
+
+int64_t sim_now(void) {
+  return sim_clock;
+}
+
+void sim_advance(int64_t us) {
+  if (us > 0) sim_clock += us;
+}
+
+bool sim_in_scheduler(void) {
+  return sim_current == NULL;
+}
+
+uint64_t sim_wakeups(void) {
+  return sim_wakeup_count;
+}
+
+void sim_wakeup_note(void) {
+  if (sim_idle_spell) {
+    sim_idle_spell = false;
+    sim_freertos_tick();
+  }
+  if (sim_wakeup_at == sim_clock) return;
+  sim_wakeup_at = sim_clock;
+  sim_wakeup_count++;
+}
+
+SimTask* sim_task_current(void) {
+  return sim_current;
+}
+
+SimTask* sim_task_first(void) {
+  return sim_tasks;
+}
+
+SimEvent* sim_schedule(int64_t at_us, SimEventFn fn, void* arg) {
+  SimEvent* event = calloc(1, sizeof(SimEvent));
+  event->at = at_us < sim_clock ? sim_clock : at_us;
+  event->seq = sim_event_seq++;
+  event->fn = fn;
+  event->arg = arg;
+
+  SimEvent** link = &sim_events;
+  while (*link != NULL && (*link)->at <= event->at) link = &(*link)->next;
+  event->next = *link;
+  *link = event;
+  return event;
+}
+
+SimEvent* sim_schedule_chip(int64_t at_us, SimEventFn fn, void* arg) {
+  SimEvent* event = sim_schedule(at_us, fn, arg);
+  event->chip = true;
+  return event;
+}
+
+void sim_cancel(SimEvent* event) {
+  for (SimEvent** link = &sim_events; *link != NULL; link = &(*link)->next) {
+    if (*link == event) {
+      *link = event->next;
+      free(event);
+      return;
+    }
+  }
+}
+
+void sim_task_make_ready(SimTask* task) {
+  if (task->state != SIM_TASK_BLOCKED) return;
+  task->state = SIM_TASK_READY;
+  task->ready_seq = sim_ready_seq++;
+}
+
+static SimTask* sim_pick_ready(void) {
+  SimTask* best = NULL;
+  for (SimTask* task = sim_tasks; task != NULL; task = task->next) {
+    if (task->state != SIM_TASK_READY) continue;
+    if (best == NULL || task->priority > best->priority ||
+        (task->priority == best->priority && task->ready_seq < best->ready_seq)) {
+      best = task;
+    }
+  }
+  return best;
+}
+
+// Hand the baton back to the scheduler and sleep until it is handed to this task again
+static void sim_switch_out(SimTask* self) {
+  pthread_mutex_lock(&sim_lock);
+  sim_current = NULL;
+  pthread_cond_signal(&sim_scheduler_cond);
+  while (sim_current != self) pthread_cond_wait(&self->cond, &sim_lock);
+  pthread_mutex_unlock(&sim_lock);
+}
+
+static void sim_run_task(SimTask* task) {
+  sim_wakeup_note();
+  pthread_mutex_lock(&sim_lock);
+  task->state = SIM_TASK_RUNNING;
+  sim_current = task;
+  pthread_cond_signal(&task->cond);
+  while (sim_current != NULL) pthread_cond_wait(&sim_scheduler_cond, &sim_lock);
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void sim_task_block(int64_t wake_at) {
+  SimTask* self = sim_current;
+  if (self == NULL) {
+    fprintf(stderr, "sim: blocking call from scheduler context\n");
+    abort();
+  }
+  self->state = SIM_TASK_BLOCKED;
+  self->wake_at = wake_at;
+  self->timed_out = false;
+  sim_switch_out(self);
+}
+
+void sim_yield(void) {
+  SimTask* self = sim_current;
+  if (self == NULL) return;
+
+  SimTask* next = sim_pick_ready();
+  if (next == NULL || next->priority <= self->priority) return;
+  self->state = SIM_TASK_READY;
+  self->ready_seq = sim_ready_seq++;
+  sim_switch_out(self);
+}
+
+void sim_task_exit(void) {
+  SimTask* self = sim_current;
+  pthread_mutex_lock(&sim_lock);
+  self->state = SIM_TASK_DELETED;
+  sim_current = NULL;
+  pthread_cond_signal(&sim_scheduler_cond);
+  pthread_mutex_unlock(&sim_lock);
+  pthread_exit(NULL);
+}
+
+static void* sim_task_entry(void* arg) {
+  SimTask* self = arg;
+
+  pthread_mutex_lock(&sim_lock);
+  while (sim_current != self) pthread_cond_wait(&self->cond, &sim_lock);
+  pthread_mutex_unlock(&sim_lock);
+
+  self->fn(self->arg);
+  sim_task_exit();
+  return NULL;
+}
+
+SimTask* sim_task_create(void (*fn)(void*), const char* name, void* arg, unsigned priority) {
+  SimTask* task = calloc(1, sizeof(SimTask));
+  task->fn = fn;
+  task->arg = arg;
+  task->priority = priority;
+  task->state = SIM_TASK_READY;
+  task->ready_seq = sim_ready_seq++;
+  task->wake_at = SIM_FOREVER;
+  snprintf(task->name, sizeof(task->name), "%s", name ? name : "task");
+  pthread_cond_init(&task->cond, NULL);
+
+  SimTask** link = &sim_tasks;
+  while (*link != NULL) link = &(*link)->next;
+  *link = task;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&task->thread, &attr, sim_task_entry, task) != 0) {
+    fprintf(stderr, "sim: pthread_create failed for %s\n", task->name);
+    abort();
+  }
+  pthread_attr_destroy(&attr);
+
+  // A new task that outranks its creator runs straight away, as on target
+  sim_yield();
+  return task;
+}
+
+static void sim_main_task(void* arg) {
+  ((void (*)(void))arg)();
+}
+
+void sim_start(void (*entry)(void)) {
+  uintptr_t begin = (uintptr_t)sim_chip_data_begin;
+  uintptr_t end = (uintptr_t)sim_chip_data_end;
+  if (end <= begin || (uintptr_t)sim_chip_bss_end <= (uintptr_t)sim_chip_bss_begin) {
+    fprintf(stderr, "sim: firmware objects not linked between the chip markers\n");
+    abort();
+  }
+  sim_chip_data_size = end - begin;
+  sim_chip_image = malloc(sim_chip_data_size);
+  memcpy(sim_chip_image, sim_chip_data_begin, sim_chip_data_size);
+  sim_entry = entry;
+
+  sim_board_init();
+  sim_task_create(sim_main_task, "main", (void*)entry, 1);
+}
+
+// The tasks left behind stay blocked on their threads for good, nothing hands them the baton again
+void sim_chip_halt(void) {
+  for (SimTask* task = sim_tasks; task != NULL; task = task->next) {
+    if (task != sim_current) task->state = SIM_TASK_DELETED;
+  }
+  for (SimEvent** link = &sim_events; *link != NULL;) {
+    SimEvent* event = *link;
+    if (!event->chip) {
+      link = &event->next;
+      continue;
+    }
+    *link = event->next;
+    free(event);
+  }
+}
+
+void sim_chip_boot(void) {
+  memcpy(sim_chip_data_begin, sim_chip_image, sim_chip_data_size);
+  memset(sim_chip_bss_begin, 0, (uintptr_t)sim_chip_bss_end - (uintptr_t)sim_chip_bss_begin);
+  sim_chip_boot_at = sim_clock;
+  sim_task_create(sim_main_task, "main", (void*)sim_entry, 1);
+}
+
+int64_t sim_chip_boot_us(void) {
+  return sim_chip_boot_at;
+}
+
+bool sim_chip_idle(void) {
+  return sim_current == NULL && sim_pick_ready() == NULL;
+}
+
+static int64_t sim_next_wake(void) {
+  int64_t next = sim_events ? sim_events->at : SIM_FOREVER;
+  for (SimTask* task = sim_tasks; task != NULL; task = task->next) {
+    if (task->state == SIM_TASK_BLOCKED && task->wake_at < next) next = task->wake_at;
+  }
+  return next;
+}
+
+void sim_run_until(int64_t end_us) {
+  while (1) {
+    SimTask* task = sim_pick_ready();
+    if (task != NULL) {
+      // Whatever woke the chip lets the interrupts a light sleep held back in first, they may outrank the task
+      if (sim_gpio_chip_wake()) continue;
+      sim_run_task(task);
+      continue;
+    }
+
+    if (!sim_idle_spell) {
+      sim_idle_spell = true;
+      sim_freertos_idle();
+    }
+    int64_t next = sim_next_wake();
+    if (next > end_us) break;
+    if (next > sim_clock) sim_clock = next;
+
+    // Events first, they stand in for ISRs and system tasks that outrank every firmware task
+    while (sim_events != NULL && sim_events->at <= sim_clock) {
+      SimEvent* event = sim_events;
+      sim_events = event->next;
+      event->fn(event->arg);
+      if (event->chip) sim_gpio_chip_wake();
+      free(event);
+    }
+    for (SimTask* blocked = sim_tasks; blocked != NULL; blocked = blocked->next) {
+      if (blocked->state == SIM_TASK_BLOCKED && blocked->wake_at <= sim_clock) {
+        blocked->timed_out = true;
+        sim_task_make_ready(blocked);
+      }
+    }
+  }
+  if (end_us != SIM_FOREVER && sim_clock < end_us) sim_clock = end_us;
+}
@@ -0,0 +1,127 @@
+#ifndef SIM_H__
+#define SIM_H__
+
+// Discrete event core of the host build
+//
+// Every FreeRTOS task runs on its own pthread, but only one of them (or the scheduler itself) holds the baton
+// at any time, so firmware code never runs concurrently and needs no real locking. Time is virtual: it only
+// moves when every task is blocked, jumping straight to the next timer, timeout or scripted event. A run is
+// therefore fully deterministic and independent of how fast the host is.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SIM_FOREVER INT64_MAX
+
+typedef void (*SimEventFn)(void* arg);
+
+typedef struct SimEvent SimEvent;
+
+// Current virtual time in microseconds
+int64_t sim_now(void);
+
+// Burn virtual time from inside a task, e.g. a busy wait
+void sim_advance(int64_t us);
+
+// Run fn(arg) from the scheduler context at the given virtual time, the returned handle stays valid until the
+// event has fired or been cancelled
+SimEvent* sim_schedule(int64_t at_us, SimEventFn fn, void* arg);
+
+void sim_cancel(SimEvent* event);
+
+// Run tasks and events until virtual time reaches end_us or nothing is left to do
+void sim_run_until(int64_t end_us);
+
+// True while code runs in scheduler context: events, esp_timer callbacks, BLE stack callbacks and ISRs raised
+// by scripted input. These stand in for the high priority system tasks on target and never block.
+bool sim_in_scheduler(void);
+
+// Let a higher priority task that became ready run first, no-op in scheduler context
+void sim_yield(void);
+
+// Distinct virtual time instants at which a task ran or an esp_timer callback fired, i.e. how often the chip had
+// to leave idle. BLE stack callbacks alone do not count, on target the controller handles those.
+uint64_t sim_wakeups(void);
+
+// Board model, implemented in board.c
+void sim_key_set(int key, bool pressed);  // key 1..9 in matrix order, 10 is the rotary encoder switch
+bool sim_key_get(int key);
+void sim_pin_set(int gpio, int level);    // Drive a plain input pin, e.g. PIN_5VDET
+void sim_encoder_step(int delta);         // Turn the encoder by delta counts, positive is clockwise
+
+// Peripheral hooks used by the scenario runner
+typedef int (*SimGpioInputHook)(int gpio, int* level);  // Return non-zero if the hook drives the pin
+void sim_gpio_set_input_hook(SimGpioInputHook hook);
+void sim_gpio_set_input(int gpio, int level);
+int sim_gpio_output_level(int gpio);
+bool sim_gpio_is_output(int gpio);
+void sim_gpio_eval_interrupts(void);
+
+void sim_adc_set_raw(int channel, int raw);
+
+void sim_pcnt_step(int unit, int delta);
+
+void sim_uart_inject(int uart_num, const uint8_t* data, int length);
+// Bytes sent at a rate of the sender's own, they arrive as framing errors unless it matches the UART's rate
+void sim_uart_inject_baud(int uart_num, const uint8_t* data, int length, uint32_t baud_rate);
+typedef void (*SimUartTxHook)(int uart_num, const uint8_t* data, int length);
+void sim_uart_set_tx_hook(SimUartTxHook hook);
+
+// BLE link model
+#define SIM_BLE_HOSTS 4  // Hosts, numbered from 1
+#define SIM_BLE_LINKS 3  // Links at once, CONFIG_BTDM_CTRL_BLE_MAX_CONN
+
+typedef struct SimBleNotification {
+  uint8_t host;  // Host the link goes to
+  uint16_t handle;
+  uint16_t length;
+  uint8_t data[32];
+  int64_t accepted_us;   // esp_ble_gatts_send_indicate returned ESP_OK
+  int64_t delivered_us;  // Connection event that carried it to the host
+} SimBleNotification;
+
+typedef void (*SimBleNotifyHook)(const SimBleNotification* notification);
+void sim_ble_set_notify_hook(SimBleNotifyHook hook);
+// Functions taking a host number read host 0 as the first one connected, or every host for a disconnect
+void sim_ble_connect(int host);    // Straight away if the advertising lets the host in
+void sim_ble_reconnect(int host);  // The host scans in the background until it finds the pad
+void sim_ble_disconnect(int host);
+int64_t sim_ble_link_since(int host);  // When the link came up, -1 when disconnected
+const char* sim_ble_advertising_kind(void);  // "off", "directed", "whitelist" or "open"
+int sim_ble_bonds(void);
+bool sim_ble_connected(int host);
+uint16_t sim_ble_interval(int host);  // Connection interval in 1.25 ms units, 0 when disconnected
+uint16_t sim_ble_latency(int host);   // Slave latency in connection events
+// A host (0: the first one connected) writes a characteristic
+void sim_ble_write(int host, uint16_t handle, const uint8_t* data, uint16_t length);
+
+// NVS model, implemented in nvs.c
+uint32_t sim_nvs_writes(void);  // Entries written or erased, a set that stores the value already there is free
+uint32_t sim_nvs_commits(void);
+
+// Power management model, implemented in pm.c
+typedef enum SimPmMode {
+  SIM_PM_CPU_MAX = 0,  // CPU at max_freq_mhz, before esp_pm_configure() or while a CPU_FREQ_MAX lock is held
+  SIM_PM_APB_MAX,      // APB_FREQ_MAX lock held
+  SIM_PM_APB_MIN,      // CPU at min_freq_mhz, NO_LIGHT_SLEEP lock held
+  SIM_PM_LIGHT_SLEEP,  // CPU at min_freq_mhz and light sleep whenever idle
+  SIM_PM_DEEP_SLEEP,   // esp_deep_sleep_start() until a wake-up source boots the firmware again
+  SIM_PM_MODE_MAX,
+} SimPmMode;
+
+SimPmMode sim_pm_mode(void);
+const char* sim_pm_mode_name(SimPmMode mode);
+int64_t sim_pm_mode_time(SimPmMode mode);  // Virtual microseconds spent in the mode
+
+// Deep sleep model, implemented in sleep.c
+uint32_t sim_sleep_count(void);    // esp_deep_sleep_start() calls so far
+bool sim_sleeping(void);           // In deep sleep, up to the start of app_main after a wake-up
+int64_t sim_sleep_woke_at(void);   // Input edge behind the last wake-up, -1 if the chip never woke
+
+// Logging threshold for the ESP_LOGx stand-ins, ESP_LOG_* values
+void sim_log_set_level(int level);
+
+// Create the main task running entry, like the IDF startup code does for app_main
+void sim_start(void (*entry)(void));
+
+#endif /* SIM_H__ */
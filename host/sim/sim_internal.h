@@ -0,0 +1,90 @@
+#ifndef SIM_INTERNAL_H__
+#define SIM_INTERNAL_H__
+
+// Shared between the simulator core and the peripheral stand-ins, not for firmware code
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sim.h"
+
+typedef enum SimTaskState {
+  SIM_TASK_READY = 0,
+  SIM_TASK_RUNNING,
+  SIM_TASK_BLOCKED,
+  SIM_TASK_DELETED,
+} SimTaskState;
+
+typedef struct SimTask {
+  pthread_t thread;
+  pthread_cond_t cond;
+  void (*fn)(void*);
+  void* arg;
+  char name[16];
+  unsigned priority;
+  SimTaskState state;
+  uint64_t ready_seq;  // FIFO order among ready tasks of equal priority
+  int64_t wake_at;     // Timeout of the current block, SIM_FOREVER for none
+  bool timed_out;      // Last block ended by its timeout rather than by a wake-up
+  uint32_t notify_value;
+  bool notify_waiting;
+  void* queue_waiting;  // Queue the task is blocked on, NULL if none
+  struct SimTask* next;
+} SimTask;
+
+SimTask* sim_task_create(void (*fn)(void*), const char* name, void* arg, unsigned priority);
+
+SimTask* sim_task_current(void);
+
+// Block the calling task until sim_task_make_ready() or wake_at, whichever comes first
+void sim_task_block(int64_t wake_at);
+
+void sim_task_make_ready(SimTask* task);
+
+void sim_task_exit(void) __attribute__((noreturn));
+
+// Count a wake-up unless something already ran at the current virtual time
+void sim_wakeup_note(void);
+
+// Run the registered FreeRTOS idle hooks, and the tick hooks once something wakes the chip again
+void sim_freertos_idle(void);
+void sim_freertos_tick(void);
+
+// Walk every task, used by the queue stand-in to find its waiters
+SimTask* sim_task_first(void);
+
+// Schedule an event on behalf of the chip: an esp_timer alarm, a stack callback or a driver interrupt on its way
+// to the firmware. A deep sleep drops these along with the tasks, the other events belong to the world outside.
+SimEvent* sim_schedule_chip(int64_t at_us, SimEventFn fn, void* arg);
+
+// Deep sleep. sim_chip_halt() deletes every task but the calling one and drops the chip events, then each
+// stand-in goes back to its reset state through its sim_*_chip_reset(). sim_chip_boot() puts the firmware's
+// .data back as it was at the first start, clears its .bss and creates the main task again.
+void sim_chip_halt(void);
+void sim_chip_boot(void);
+int64_t sim_chip_boot_us(void);  // Virtual time of the last start, esp_timer_get_time() counts from there
+
+void sim_freertos_chip_reset(void);  // Hooks go, power_init() registers them again
+void sim_gpio_chip_reset(void);      // Held pads keep their level
+void sim_pcnt_chip_reset(void);
+void sim_uart_chip_reset(void);
+void sim_ble_chip_reset(void);  // Links drop without a word to either side, bonds stay
+void sim_nvs_chip_reset(void);  // Handles close, entries stay
+void sim_pm_chip_sleep(bool asleep);
+
+// Check the deep sleep wake-up sources, called whenever an input level may have changed
+void sim_sleep_eval(void);
+bool sim_sleep_gpio_wakeup_enabled(void);  // esp_sleep_enable_gpio_wakeup() since the last start
+
+// Nothing ready to run, the chip light sleeps here when the held locks allow it
+bool sim_chip_idle(void);
+
+// Deliver the GPIO interrupts a light sleep held back, called once something else has woken the chip. Returns
+// true if any were pending.
+bool sim_gpio_chip_wake(void);
+
+// Hook the board model into the GPIO stand-in, called by sim_start()
+void sim_board_init(void);
+
+#endif /* SIM_INTERNAL_H__ */
@@ -0,0 +1,163 @@
+// Deep sleep stand-in
+//
+// esp_deep_sleep_start() halts the chip: the firmware's tasks, timers and pending stack callbacks are dropped and
+// every peripheral goes back to its reset state, while NVS, the bonds and the variables marked RTC_DATA_ATTR
+// stay. Pads held with gpio_deep_sleep_hold_en() keep driving. The ext0 and ext1 sources are checked whenever an
+// input changes, and SIM_SLEEP_BOOT_US after the edge that wakes the chip the firmware starts over from its
+// initial memory image, with esp_reset_reason() ESP_RST_DEEPSLEEP. esp_sleep_enable_gpio_wakeup() only matters to
+// the light sleep model in gpio.c.
+
+#include "esp_sleep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "driver/rtc_io.h"
+#include "esp_system.h"
+#include "sim_internal.h"
+
+// ROM bootloader and the image load with CONFIG_BOOTLOADER_SKIP_VALIDATE_IN_DEEP_SLEEP, up to app_main
+#define SIM_SLEEP_BOOT_US 40000
+
+#define SIM_SLEEP_RTC_GPIOS                                                                                      \
+  ((1ULL << 0) | (1ULL << 2) | (1ULL << 4) | (1ULL << 12) | (1ULL << 13) | (1ULL << 14) | (1ULL << 15) |        \
+   (1ULL << 25) | (1ULL << 26) | (1ULL << 27) | (0xFFULL << 32))
+
+static int sim_sleep_ext0_gpio = -1;
+static int sim_sleep_ext0_level = 0;
+static uint64_t sim_sleep_ext1_mask = 0;
+static esp_sleep_ext1_wakeup_mode_t sim_sleep_ext1_mode = ESP_EXT1_WAKEUP_ALL_LOW;
+static bool sim_sleep_gpio_wakeup = false;
+static bool sim_sleep_asleep = false;
+static SimEvent* sim_sleep_boot = NULL;
+static esp_sleep_wakeup_cause_t sim_sleep_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+static uint64_t sim_sleep_ext1_status = 0;
+static esp_reset_reason_t sim_sleep_reset_reason = ESP_RST_POWERON;
+static uint32_t sim_sleep_entered = 0;
+static int64_t sim_sleep_woke = -1;
+
+uint32_t sim_sleep_count(void) {
+  return sim_sleep_entered;
+}
+
+bool sim_sleeping(void) {
+  return sim_sleep_asleep;
+}
+
+int64_t sim_sleep_woke_at(void) {
+  return sim_sleep_woke;
+}
+
+bool rtc_gpio_is_valid_gpio(gpio_num_t gpio_num) {
+  return gpio_num >= 0 && gpio_num < GPIO_NUM_MAX && (SIM_SLEEP_RTC_GPIOS & (1ULL << gpio_num));
+}
+
+esp_err_t rtc_gpio_deinit(gpio_num_t gpio_num) {
+  return rtc_gpio_is_valid_gpio(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t rtc_gpio_pullup_en(gpio_num_t gpio_num) {
+  return rtc_gpio_is_valid_gpio(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t rtc_gpio_pulldown_dis(gpio_num_t gpio_num) {
+  return rtc_gpio_is_valid_gpio(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_sleep_enable_ext0_wakeup(gpio_num_t gpio_num, int level) {
+  if (!rtc_gpio_is_valid_gpio(gpio_num) || level < 0 || level > 1) return ESP_ERR_INVALID_ARG;
+  sim_sleep_ext0_gpio = gpio_num;
+  sim_sleep_ext0_level = level;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode) {
+  if (mask & ~SIM_SLEEP_RTC_GPIOS) return ESP_ERR_INVALID_ARG;
+  sim_sleep_ext1_mask = mask;
+  sim_sleep_ext1_mode = mode;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup(void) {
+  sim_sleep_gpio_wakeup = true;
+  return ESP_OK;
+}
+
+bool sim_sleep_gpio_wakeup_enabled(void) {
+  return sim_sleep_gpio_wakeup;
+}
+
+esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t source) {
+  if (source == ESP_SLEEP_WAKEUP_EXT0 || source == ESP_SLEEP_WAKEUP_ALL) sim_sleep_ext0_gpio = -1;
+  if (source == ESP_SLEEP_WAKEUP_EXT1 || source == ESP_SLEEP_WAKEUP_ALL) sim_sleep_ext1_mask = 0;
+  if (source == ESP_SLEEP_WAKEUP_GPIO || source == ESP_SLEEP_WAKEUP_ALL) sim_sleep_gpio_wakeup = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option) {
+  return domain < ESP_PD_DOMAIN_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void) {
+  return sim_sleep_reset_reason == ESP_RST_DEEPSLEEP ? sim_sleep_cause : ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+uint64_t esp_sleep_get_ext1_wakeup_status(void) {
+  return sim_sleep_cause == ESP_SLEEP_WAKEUP_EXT1 ? sim_sleep_ext1_status : 0;
+}
+
+esp_reset_reason_t esp_reset_reason(void) {
+  return sim_sleep_reset_reason;
+}
+
+static void sim_sleep_wake(void* arg) {
+  sim_sleep_boot = NULL;
+  sim_sleep_asleep = false;
+  sim_sleep_reset_reason = ESP_RST_DEEPSLEEP;
+  sim_sleep_ext0_gpio = -1;
+  sim_sleep_ext1_mask = 0;
+  sim_sleep_gpio_wakeup = false;
+  sim_pm_chip_sleep(false);
+  sim_chip_boot();
+}
+
+void sim_sleep_eval(void) {
+  if (!sim_sleep_asleep || sim_sleep_boot != NULL) return;
+
+  uint64_t high = 0;
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    if ((sim_sleep_ext1_mask & (1ULL << gpio)) && gpio_get_level(gpio)) high |= 1ULL << gpio;
+  }
+  if (sim_sleep_ext0_gpio >= 0 && gpio_get_level(sim_sleep_ext0_gpio) == sim_sleep_ext0_level) {
+    sim_sleep_cause = ESP_SLEEP_WAKEUP_EXT0;
+  } else if (sim_sleep_ext1_mask && sim_sleep_ext1_mode == ESP_EXT1_WAKEUP_ANY_HIGH && high) {
+    sim_sleep_cause = ESP_SLEEP_WAKEUP_EXT1;
+  } else if (sim_sleep_ext1_mask && sim_sleep_ext1_mode == ESP_EXT1_WAKEUP_ALL_LOW && !high) {
+    sim_sleep_cause = ESP_SLEEP_WAKEUP_EXT1;
+  } else {
+    return;
+  }
+  sim_sleep_ext1_status = high;
+  sim_sleep_woke = sim_now();
+  sim_sleep_boot = sim_schedule(sim_now() + SIM_SLEEP_BOOT_US, sim_sleep_wake, NULL);
+}
+
+void esp_deep_sleep_start(void) {
+  if (sim_in_scheduler()) {
+    fprintf(stderr, "sim: esp_deep_sleep_start() from scheduler context\n");
+    abort();
+  }
+  sim_sleep_asleep = true;
+  sim_sleep_entered++;
+  sim_chip_halt();
+  sim_freertos_chip_reset();
+  sim_gpio_chip_reset();
+  sim_pcnt_chip_reset();
+  sim_uart_chip_reset();
+  sim_ble_chip_reset();
+  sim_nvs_chip_reset();
+  sim_pm_chip_sleep(true);
+  // A source already asserted wakes the chip straight away
+  sim_sleep_eval();
+  sim_task_exit();
+}
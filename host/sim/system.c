@@ -0,0 +1,77 @@
+// Logging, error names, busy waits and the other small system stand-ins
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp32/rom/ets_sys.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "sim.h"
+
+static int sim_log_level = ESP_LOG_ERROR;
+
+void sim_log_set_level(int level) {
+  sim_log_level = level;
+}
+
+void esp_log_level_set(const char* tag, esp_log_level_t level) {
+  // Per tag levels are not modelled, the wildcard sets the global threshold
+  if (tag != NULL && strcmp(tag, "*") == 0) sim_log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...) {
+  static const char letters[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+  if (level > sim_log_level || level == ESP_LOG_NONE) return;
+
+  int64_t now = sim_now();
+  fprintf(stderr, "%c (%lld.%03lld) %s: ", letters[level], (long long)(now / 1000), (long long)(now % 1000), tag);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+const char* esp_err_to_name(esp_err_t code) {
+  switch (code) {
+    case ESP_OK:
+      return "ESP_OK";
+    case ESP_FAIL:
+      return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+      return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+      return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+      return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+      return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+      return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+      return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+      return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_CRC:
+      return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_NVS_NOT_FOUND:
+      return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_NO_FREE_PAGES:
+      return "ESP_ERR_NVS_NO_FREE_PAGES";
+    case ESP_ERR_NVS_NEW_VERSION_FOUND:
+      return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+    default:
+      return "UNKNOWN ERROR";
+  }
+}
+
+void ets_delay_us(uint32_t us) {
+  sim_advance(us);
+}
+
+void esp_restart(void) {
+  fprintf(stderr, "esp_restart() at %lld us\n", (long long)sim_now());
+  exit(2);
+}
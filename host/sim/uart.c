@@ -0,0 +1,314 @@
+// UART driver stand-in with pattern detection
+//
+// Injected bytes land in the RX buffer one frame time apart at the configured baud rate. Pattern positions are
+// queued like the IDF driver does and reported relative to the read pointer. Bytes left after the last pattern
+// raise a UART_DATA event once the RX full threshold is reached or the line has been idle for the RX timeout.
+// Bytes sent at a rate more than SIM_UART_BAUD_TOLERANCE off the receiver's are dropped with a UART_FRAME_ERR.
+
+#include "driver/uart.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_internal.h"
+
+#define SIM_UART_BITS_PER_BYTE 10
+#define SIM_UART_RX_TOUT_SYMBOLS 10   // UART_TOUT_THRESH_DEFAULT
+#define SIM_UART_RX_FULL_THRESH 120  // UART_FULL_THRESH_DEFAULT
+#define SIM_UART_PATTERN_QUEUE_MAX 256
+#define SIM_UART_BAUD_TOLERANCE 0.03
+
+typedef struct SimUart {
+  bool installed;
+  uint32_t baud_rate;
+  uint8_t* rx;
+  int rx_size;
+  int rx_head;   // Absolute read index
+  int rx_count;  // Bytes buffered
+  QueueHandle_t event_queue;
+  char pattern_chr;
+  int pattern_num;
+  int pattern_run;  // Consecutive pattern characters seen so far
+  int pattern_queue[SIM_UART_PATTERN_QUEUE_MAX];  // Absolute positions
+  int pattern_length;
+  int pattern_count;
+  int rx_pending;          // Bytes not yet covered by a pattern or data event
+  int rx_full_thresh;      // rx_pending that raises UART_DATA without waiting for the timeout
+  int rx_tout_symbols;     // 0 disables the timeout
+  SimEvent* rx_tout;
+  int64_t rx_busy_until;  // End of the last injected byte on the wire
+  SimTask* reader;
+} SimUart;
+
+typedef struct SimUartByte {
+  int uart_num;
+  uint8_t data;
+  uint32_t baud_rate;
+} SimUartByte;
+
+static SimUart sim_uart[UART_NUM_MAX];
+static SimUartTxHook sim_uart_tx_hook = NULL;
+
+void sim_uart_set_tx_hook(SimUartTxHook hook) {
+  sim_uart_tx_hook = hook;
+}
+
+static bool sim_uart_valid(uart_port_t uart_num) {
+  return uart_num >= 0 && uart_num < UART_NUM_MAX;
+}
+
+static int64_t sim_uart_byte_us(SimUart* uart) {
+  uint32_t baud = uart->baud_rate ? uart->baud_rate : 115200;
+  return (SIM_UART_BITS_PER_BYTE * 1000000LL + baud - 1) / baud;
+}
+
+static void sim_uart_post(SimUart* uart, uart_event_type_t type, size_t size) {
+  if (uart->event_queue == NULL) return;
+  uart_event_t event = {.type = type, .size = size, .timeout_flag = false};
+  xQueueSendFromISR(uart->event_queue, &event, NULL);
+}
+
+// The line went idle with bytes that did not end in a pattern
+static void sim_uart_rx_timeout(void* arg) {
+  SimUart* uart = arg;
+  uart->rx_tout = NULL;
+  if (uart->rx_pending) sim_uart_post(uart, UART_DATA, uart->rx_pending);
+  uart->rx_pending = 0;
+}
+
+static void sim_uart_deliver(void* arg) {
+  SimUartByte* rx_byte = arg;
+  SimUart* uart = &sim_uart[rx_byte->uart_num];
+  uint8_t byte = rx_byte->data;
+  uint32_t baud_rate = rx_byte->baud_rate;
+  free(rx_byte);
+
+  // Bytes arriving at a UART without its driver are lost
+  if (!uart->installed) return;
+
+  uint32_t rx_baud = uart->baud_rate ? uart->baud_rate : 115200;
+  if (baud_rate < rx_baud * (1 - SIM_UART_BAUD_TOLERANCE) || baud_rate > rx_baud * (1 + SIM_UART_BAUD_TOLERANCE)) {
+    sim_uart_post(uart, UART_FRAME_ERR, 0);
+    return;
+  }
+
+  if (uart->rx_count >= uart->rx_size) {
+    sim_uart_post(uart, UART_BUFFER_FULL, 0);
+    return;
+  }
+  int abs_pos = uart->rx_head + uart->rx_count;
+  uart->rx[abs_pos % uart->rx_size] = byte;
+  uart->rx_count++;
+  uart->rx_pending++;
+
+  if (uart->pattern_num) {
+    uart->pattern_run = (byte == (uint8_t)uart->pattern_chr) ? uart->pattern_run + 1 : 0;
+    if (uart->pattern_run == uart->pattern_num) {
+      uart->pattern_run = 0;
+      if (uart->pattern_count < uart->pattern_length) {
+        uart->pattern_queue[uart->pattern_count++] = abs_pos - (uart->pattern_num - 1);
+      }
+      uart->rx_pending = 0;
+      sim_uart_post(uart, UART_PATTERN_DET, 0);
+    }
+  }
+  if (uart->rx_pending >= uart->rx_full_thresh) {
+    sim_uart_post(uart, UART_DATA, uart->rx_pending);
+    uart->rx_pending = 0;
+  }
+
+  if (uart->rx_tout != NULL) sim_cancel(uart->rx_tout);
+  uart->rx_tout = NULL;
+  if (uart->rx_pending && uart->rx_tout_symbols) {
+    uart->rx_tout = sim_schedule_chip(sim_now() + uart->rx_tout_symbols * sim_uart_byte_us(uart), sim_uart_rx_timeout, uart);
+  }
+  if (uart->reader != NULL) sim_task_make_ready(uart->reader);
+}
+
+void sim_uart_inject_baud(int uart_num, const uint8_t* data, int length, uint32_t baud_rate) {
+  if (!sim_uart_valid(uart_num) || length <= 0 || baud_rate == 0) return;
+  SimUart* uart = &sim_uart[uart_num];
+
+  // Bytes queue up behind whatever is still on the wire
+  int64_t start = uart->rx_busy_until > sim_now() ? uart->rx_busy_until : sim_now();
+  int64_t byte_us = (SIM_UART_BITS_PER_BYTE * 1000000LL + baud_rate - 1) / baud_rate;
+  for (int i = 0; i < length; i++) {
+    SimUartByte* rx_byte = malloc(sizeof(SimUartByte));
+    rx_byte->uart_num = uart_num;
+    rx_byte->data = data[i];
+    rx_byte->baud_rate = baud_rate;
+    sim_schedule(start + (i + 1) * byte_us, sim_uart_deliver, rx_byte);
+  }
+  uart->rx_busy_until = start + length * byte_us;
+}
+
+void sim_uart_inject(int uart_num, const uint8_t* data, int length) {
+  if (!sim_uart_valid(uart_num)) return;
+  SimUart* uart = &sim_uart[uart_num];
+  sim_uart_inject_baud(uart_num, data, length, uart->baud_rate ? uart->baud_rate : 115200);
+}
+
+// The driver and its buffers are gone, the line keeps whatever is still on the wire
+void sim_uart_chip_reset(void) {
+  for (int i = 0; i < UART_NUM_MAX; i++) {
+    SimUart* uart = &sim_uart[i];
+    int64_t busy_until = uart->rx_busy_until;
+    free(uart->rx);
+    memset(uart, 0, sizeof(SimUart));
+    uart->rx_busy_until = busy_until;
+  }
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t* uart_config) {
+  if (!sim_uart_valid(uart_num) || uart_config == NULL) return ESP_ERR_INVALID_ARG;
+  sim_uart[uart_num].baud_rate = uart_config->baud_rate;
+  return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num) {
+  return sim_uart_valid(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              QueueHandle_t* uart_queue, int intr_alloc_flags) {
+  if (!sim_uart_valid(uart_num) || rx_buffer_size <= 0) return ESP_ERR_INVALID_ARG;
+  SimUart* uart = &sim_uart[uart_num];
+  if (uart->installed) return ESP_FAIL;
+
+  uart->installed = true;
+  uart->rx = calloc(1, rx_buffer_size);
+  uart->rx_size = rx_buffer_size;
+  uart->rx_full_thresh = SIM_UART_RX_FULL_THRESH;
+  uart->rx_tout_symbols = SIM_UART_RX_TOUT_SYMBOLS;
+  if (queue_size > 0 && uart_queue != NULL) {
+    uart->event_queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+    *uart_queue = uart->event_queue;
+  }
+  return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate) {
+  if (!sim_uart_valid(uart_num) || baudrate == 0) return ESP_ERR_INVALID_ARG;
+  sim_uart[uart_num].baud_rate = baudrate;
+  return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t uart_num, uint32_t* baudrate) {
+  if (!sim_uart_valid(uart_num) || baudrate == NULL) return ESP_ERR_INVALID_ARG;
+  *baudrate = sim_uart[uart_num].baud_rate;
+  return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void* src, size_t size) {
+  if (!sim_uart_valid(uart_num) || !sim_uart[uart_num].installed) return -1;
+  if (sim_uart_tx_hook != NULL) sim_uart_tx_hook(uart_num, src, (int)size);
+  return (int)size;
+}
+
+static void sim_uart_consume(SimUart* uart, int length) {
+  uart->rx_head += length;
+  uart->rx_count -= length;
+  // Patterns that were read past are gone, like uart_pattern_queue_update() drops them on target
+  int kept = 0;
+  for (int i = 0; i < uart->pattern_count; i++) {
+    if (uart->pattern_queue[i] >= uart->rx_head) uart->pattern_queue[kept++] = uart->pattern_queue[i];
+  }
+  uart->pattern_count = kept;
+}
+
+int uart_read_bytes(uart_port_t uart_num, void* buf, uint32_t length, TickType_t ticks_to_wait) {
+  if (!sim_uart_valid(uart_num) || !sim_uart[uart_num].installed) return -1;
+  SimUart* uart = &sim_uart[uart_num];
+  uint8_t* out = buf;
+  int read = 0;
+  int64_t deadline = ticks_to_wait == portMAX_DELAY
+                         ? SIM_FOREVER
+                         : sim_now() + (int64_t)ticks_to_wait * (1000000 / configTICK_RATE_HZ);
+
+  while (read < (int)length) {
+    int chunk = uart->rx_count < (int)length - read ? uart->rx_count : (int)length - read;
+    for (int i = 0; i < chunk; i++) {
+      out[read + i] = uart->rx[(uart->rx_head + i) % uart->rx_size];
+    }
+    sim_uart_consume(uart, chunk);
+    read += chunk;
+    if (read == (int)length || sim_now() >= deadline || sim_in_scheduler()) break;
+
+    uart->reader = sim_task_current();
+    sim_task_block(deadline);
+    uart->reader = NULL;
+  }
+  return read;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num) {
+  if (!sim_uart_valid(uart_num)) return ESP_ERR_INVALID_ARG;
+  SimUart* uart = &sim_uart[uart_num];
+  sim_uart_consume(uart, uart->rx_count);
+  uart->pattern_count = 0;
+  uart->pattern_run = 0;
+  uart->rx_pending = 0;
+  return ESP_OK;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t uart_num, int threshold) {
+  if (!sim_uart_valid(uart_num) || !sim_uart[uart_num].installed || threshold <= 0) return ESP_ERR_INVALID_ARG;
+  sim_uart[uart_num].rx_full_thresh = threshold;
+  return ESP_OK;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t uart_num, const uint8_t tout_thresh) {
+  if (!sim_uart_valid(uart_num) || !sim_uart[uart_num].installed) return ESP_ERR_INVALID_ARG;
+  sim_uart[uart_num].rx_tout_symbols = tout_thresh;
+  return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t* size) {
+  if (!sim_uart_valid(uart_num) || size == NULL) return ESP_ERR_INVALID_ARG;
+  *size = sim_uart[uart_num].rx_count;
+  return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait) {
+  return sim_uart_valid(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_enable_pattern_det_baud_intr(uart_port_t uart_num, char pattern_chr, uint8_t chr_num, int chr_tout,
+                                            int post_idle, int pre_idle) {
+  if (!sim_uart_valid(uart_num) || chr_num == 0) return ESP_ERR_INVALID_ARG;
+  sim_uart[uart_num].pattern_chr = pattern_chr;
+  sim_uart[uart_num].pattern_num = chr_num;
+  sim_uart[uart_num].pattern_run = 0;
+  return ESP_OK;
+}
+
+esp_err_t uart_disable_pattern_det_intr(uart_port_t uart_num) {
+  if (!sim_uart_valid(uart_num)) return ESP_ERR_INVALID_ARG;
+  sim_uart[uart_num].pattern_num = 0;
+  return ESP_OK;
+}
+
+int uart_pattern_pop_pos(uart_port_t uart_num) {
+  if (!sim_uart_valid(uart_num)) return -1;
+  SimUart* uart = &sim_uart[uart_num];
+  if (uart->pattern_count == 0) return -1;
+
+  int pos = uart->pattern_queue[0] - uart->rx_head;
+  memmove(uart->pattern_queue, uart->pattern_queue + 1, (uart->pattern_count - 1) * sizeof(int));
+  uart->pattern_count--;
+  return pos;
+}
+
+int uart_pattern_get_pos(uart_port_t uart_num) {
+  if (!sim_uart_valid(uart_num)) return -1;
+  SimUart* uart = &sim_uart[uart_num];
+  return uart->pattern_count ? uart->pattern_queue[0] - uart->rx_head : -1;
+}
+
+esp_err_t uart_pattern_queue_reset(uart_port_t uart_num, int queue_length) {
+  if (!sim_uart_valid(uart_num) || queue_length <= 0) return ESP_ERR_INVALID_ARG;
+  SimUart* uart = &sim_uart[uart_num];
+  uart->pattern_length = queue_length < SIM_UART_PATTERN_QUEUE_MAX ? queue_length : SIM_UART_PATTERN_QUEUE_MAX;
+  uart->pattern_count = 0;
+  return ESP_OK;
+}
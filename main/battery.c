@@ -0,0 +1,97 @@
+// Battery voltage and state of charge
+//
+// A sample averages 2^BATTERY_OVERSAMPLE_SHIFT raw readings of the sense divider, converts the average to mV
+// with the ADC calibration burnt into the eFuse and scales it back up to the cell voltage. Samples then go
+// through a first order low-pass filter kept in fixed point, so a sample costs a burst of ADC reads and a few
+// integer operations. The level is only looked up again, on the discharge curve, once the filtered voltage has
+// moved by BATTERY_HYSTERESIS_MV, which keeps a voltage sitting on the edge between two percentages from
+// flickering between them.
+
+#include "battery.h"
+
+#include <string.h>
+
+#include "esp_adc_cal.h"
+#include "esp_log.h"
+
+#define BATTERY_TAG "BATTERY"
+
+const BatteryCurvePoint battery_curve[BATTERY_CURVE_POINTS] = {
+    {4200, 100}, {4100, 90}, {4000, 79}, {3920, 70}, {3870, 60}, {3820, 50},
+    {3790, 40},  {3770, 30}, {3740, 20}, {3680, 10}, {3300, 0},
+};
+
+static const char* const battery_calibration_names[] = {
+    [ESP_ADC_CAL_VAL_EFUSE_VREF] = "eFuse Vref",
+    [ESP_ADC_CAL_VAL_EFUSE_TP] = "eFuse two point",
+    [ESP_ADC_CAL_VAL_DEFAULT_VREF] = "default Vref",
+};
+
+static esp_adc_cal_characteristics_t battery_adc;
+
+esp_err_t battery_init(Battery* battery) {
+  esp_adc_cal_value_t calibration;
+  esp_err_t ret;
+
+  memset(battery, 0, sizeof(Battery));
+  battery->level = BATTERY_LEVEL_UNKNOWN;
+
+  ret = adc1_config_width(ADC_WIDTH_BIT_12);
+  if (ret == ESP_OK) ret = adc1_config_channel_atten(BATTERY_ADC_CHANNEL, ADC_ATTEN_DB_11);
+  if (ret != ESP_OK) {
+    ESP_LOGE(BATTERY_TAG, "%s ADC setup failed: %s", __func__, esp_err_to_name(ret));
+    return ret;
+  }
+  calibration = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, BATTERY_DEFAULT_VREF_MV,
+                                         &battery_adc);
+  ESP_LOGI(BATTERY_TAG, "ADC calibrated from %s, Vref %u mV", battery_calibration_names[calibration],
+           battery_adc.vref);
+  return ESP_OK;
+}
+
+uint8_t battery_percent(uint32_t mv) {
+  if (mv >= battery_curve[0].mv) return battery_curve[0].percent;
+  for (int i = 1; i < BATTERY_CURVE_POINTS; i++) {
+    const BatteryCurvePoint* high = &battery_curve[i - 1];
+    const BatteryCurvePoint* low = &battery_curve[i];
+    if (mv >= low->mv) return low->percent + (mv - low->mv) * (high->percent - low->percent) / (high->mv - low->mv);
+  }
+  return battery_curve[BATTERY_CURVE_POINTS - 1].percent;
+}
+
+bool battery_update(Battery* battery, uint32_t mv) {
+  uint8_t level;
+
+  // The filter holds the voltage scaled up by its shift, so the fraction the shift drops is not lost
+  if (battery->filtered == 0) {
+    battery->filtered = mv << BATTERY_FILTER_SHIFT;
+  } else {
+    battery->filtered += mv - (battery->filtered >> BATTERY_FILTER_SHIFT);
+  }
+  battery->mv = (battery->filtered + (1 << (BATTERY_FILTER_SHIFT - 1))) >> BATTERY_FILTER_SHIFT;
+
+  if (battery->level_mv != 0 && battery->mv < battery->level_mv + BATTERY_HYSTERESIS_MV &&
+      battery->mv + BATTERY_HYSTERESIS_MV > battery->level_mv) {
+    return false;
+  }
+  battery->level_mv = battery->mv;
+  level = battery_percent(battery->mv);
+  if (level == battery->level) return false;
+  battery->level = level;
+  return true;
+}
+
+bool battery_sample(Battery* battery) {
+  uint32_t sum = 0;
+  uint32_t pin_mv;
+
+  for (int i = 0; i < (1 << BATTERY_OVERSAMPLE_SHIFT); i++) sum += adc1_get_raw(BATTERY_ADC_CHANNEL);
+  pin_mv = esp_adc_cal_raw_to_voltage((sum + (1 << (BATTERY_OVERSAMPLE_SHIFT - 1))) >> BATTERY_OVERSAMPLE_SHIFT,
+                                      &battery_adc);
+  return battery_update(battery, pin_mv * 1000 / BATTERY_DIVIDER_PERMILLE);
+}
+
+void battery_restart(Battery* battery) {
+  battery->filtered = 0;
+  battery->level_mv = 0;
+}
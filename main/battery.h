@@ -0,0 +1,50 @@
+#ifndef BATTERY_H__
+#define BATTERY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/adc.h"
+#include "esp_err.h"
+
+#define BATTERY_ADC_CHANNEL ADC1_CHANNEL_4  // PIN_BATTSENSE
+#define BATTERY_DEFAULT_VREF_MV 1100        // Used when the eFuse holds no Vref or two point calibration
+#define BATTERY_DIVIDER_PERMILLE 685        // Sense pin mV per volt on the cell, fitted at 3.7 V and 4.2 V
+#define BATTERY_OVERSAMPLE_SHIFT 4          // 16 raw readings averaged per sample
+#define BATTERY_FILTER_SHIFT 2              // Each sample moves the filtered voltage a quarter of the way
+#define BATTERY_HYSTERESIS_MV 8             // Filtered voltage change needed before the level is looked up again
+#define BATTERY_CURVE_POINTS 11
+#define BATTERY_LEVEL_UNKNOWN 0xFF          // Level before the first sample
+
+typedef struct BatteryCurvePoint {
+  uint16_t mv;
+  uint8_t percent;
+} BatteryCurvePoint;
+
+typedef struct Battery {
+  uint32_t filtered;  // Cell voltage in mV << BATTERY_FILTER_SHIFT, 0 before the first sample
+  uint16_t mv;        // Filtered cell voltage
+  uint16_t level_mv;  // Filtered voltage the current level was looked up at
+  uint8_t level;      // State of charge in percent
+} Battery;
+
+// Single cell LiPo discharge curve at a light load, sorted by falling voltage
+extern const BatteryCurvePoint battery_curve[BATTERY_CURVE_POINTS];
+
+// Set up the sense channel and the ADC calibration, from the eFuse when it has one
+esp_err_t battery_init(Battery* battery);
+
+// Take an oversampled reading and run it through the filter, true if the level changed
+bool battery_sample(Battery* battery);
+
+// Feed a cell voltage straight into the filter, true if the level changed
+bool battery_update(Battery* battery, uint32_t mv);
+
+// Start the filter over at the next sample, for a jump in voltage such as the charger letting go. The level
+// stays until that sample replaces it.
+void battery_restart(Battery* battery);
+
+// State of charge for a cell voltage, interpolated between the points of battery_curve
+uint8_t battery_percent(uint32_t mv);
+
+#endif /* BATTERY_H__ */
@@ -2,6 +2,7 @@
 
 #include <string.h>
 
+#include "boot.h"
 #include "esp_log.h"
 #include "hid_keydefinition.h"
 
@@ -9,7 +10,7 @@
 #define GATTHANDLER_TAG "GATTS_HANDLER"
 #define GATTCB_TAG "GATTS_CALLBACK"
 
-uint8_t hidReportMapLen = sizeof(hidReportMap);
+uint16_t hidReportMapLen = sizeof(hidReportMap);
 uint8_t hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
 
 struct CharacteristicPresentationInfo {
@@ -44,6 +45,8 @@ static uint8_t hidReportRefKeyIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_KEY_IN, HID_R
 static uint8_t hidReportRefLedOut[HID_REPORT_REF_LEN] = {HID_RPT_ID_LED_OUT, HID_REPORT_TYPE_OUTPUT};
 static uint8_t hidReportRefFeature[HID_REPORT_REF_LEN] = {HID_RPT_ID_FEATURE, HID_REPORT_TYPE_FEATURE};
 static uint8_t hidReportRefCCIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT};
+static uint8_t hidReportRefVendorOut[HID_REPORT_REF_LEN] = {HID_RPT_ID_VENDOR_OUT, HID_REPORT_TYPE_OUTPUT};
+static uint8_t hidReportRefNkroIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT};
 
 static uint16_t hid_service_uuid = ATT_SVC_HID;
 uint16_t hid_count = 0;
@@ -207,6 +210,41 @@ static esp_gatts_attr_db_t hidd_attribute_table[HIDD_LE_IDX_NB] = {
                                           {ESP_UUID_LEN_16, (uint8_t*)&hid_report_ref_descr_uuid, ESP_GATT_PERM_READ,
                                            sizeof(hidReportRefCCIn), sizeof(hidReportRefCCIn), hidReportRefCCIn}},
 
+    // Vendor Output Report Characteristic Declaration, written by the host to edit the keymap store
+    [HIDD_LE_IDX_REPORT_VENDOR_OUT_CHAR] = {{ESP_GATT_AUTO_RSP},
+                                            {ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ,
+                                             CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+                                             (uint8_t*)&char_prop_read_write}},
+    // Vendor Output Report Characteristic Value, only over an encrypted link
+    [HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL] = {{ESP_GATT_AUTO_RSP},
+                                           {ESP_UUID_LEN_16, (uint8_t*)&hid_report_uuid,
+                                            ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE_ENCRYPTED, HIDD_LE_REPORT_MAX_LEN,
+                                            0, NULL}},
+    // Vendor Output Report Characteristic - Report Reference Descriptor
+    [HIDD_LE_IDX_REPORT_VENDOR_OUT_REP_REF] = {{ESP_GATT_AUTO_RSP},
+                                               {ESP_UUID_LEN_16, (uint8_t*)&hid_report_ref_descr_uuid,
+                                                ESP_GATT_PERM_READ, sizeof(hidReportRefVendorOut),
+                                                sizeof(hidReportRefVendorOut), hidReportRefVendorOut}},
+
+    // Keyboard Bitmap Input Report Characteristic Declaration
+    [HIDD_LE_IDX_REPORT_NKRO_IN_CHAR] = {{ESP_GATT_AUTO_RSP},
+                                         {ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ,
+                                          CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+                                          (uint8_t*)&char_prop_read_notify}},
+    // Keyboard Bitmap Input Report Characteristic Value
+    [HIDD_LE_IDX_REPORT_NKRO_IN_VAL] = {{ESP_GATT_AUTO_RSP},
+                                        {ESP_UUID_LEN_16, (uint8_t*)&hid_report_uuid, ESP_GATT_PERM_READ,
+                                         HIDD_LE_REPORT_MAX_LEN, 0, NULL}},
+    // Keyboard Bitmap Input Report Characteristic - Client Characteristic Configuration Descriptor
+    [HIDD_LE_IDX_REPORT_NKRO_IN_CCC] = {{ESP_GATT_AUTO_RSP},
+                                        {ESP_UUID_LEN_16, (uint8_t*)&character_client_config_uuid,
+                                         (ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE), sizeof(uint16_t), 0, NULL}},
+    // Keyboard Bitmap Input Report Characteristic - Report Reference Descriptor
+    [HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF] = {{ESP_GATT_AUTO_RSP},
+                                            {ESP_UUID_LEN_16, (uint8_t*)&hid_report_ref_descr_uuid, ESP_GATT_PERM_READ,
+                                             sizeof(hidReportRefNkroIn), sizeof(hidReportRefNkroIn),
+                                             hidReportRefNkroIn}},
+
     // Boot Keyboard Input Report Characteristic Declaration
     [HIDD_LE_IDX_BOOT_KB_IN_REPORT_CHAR] = {{ESP_GATT_AUTO_RSP},
                                             {ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ,
@@ -274,12 +312,18 @@ void hidd_clcb_alloc(uint16_t conn_id, esp_bd_addr_t bda) {
   uint8_t i_clcb = 0;
   HIDConnectionLink* p_clcb = NULL;
 
-  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_APPS; i_clcb++, p_clcb++) {
+  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_LINKS; i_clcb++, p_clcb++) {
+    if (p_clcb->in_use && p_clcb->conn_id == conn_id) return;
+  }
+  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_LINKS; i_clcb++, p_clcb++) {
     if (!p_clcb->in_use) {
       p_clcb->in_use = true;
       p_clcb->conn_id = conn_id;
       p_clcb->connected = true;
+      p_clcb->proto_mode = HID_PROTOCOL_MODE_REPORT;
       memcpy(p_clcb->remote_bda, bda, ESP_BD_ADDR_LEN);
+      // The slot may have carried another host's reports, none of them reached this one
+      hid_dev_reset_report_cache(conn_id);
       break;
     }
   }
@@ -290,14 +334,90 @@ bool hidd_clcb_dealloc(uint16_t conn_id) {
   uint8_t i_clcb = 0;
   HIDConnectionLink* p_clcb = NULL;
 
-  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_APPS; i_clcb++, p_clcb++) {
-    memset(p_clcb, 0, sizeof(HIDConnectionLink));
-    return true;
+  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_LINKS; i_clcb++, p_clcb++) {
+    if (p_clcb->in_use && p_clcb->conn_id == conn_id) {
+      memset(p_clcb, 0, sizeof(HIDConnectionLink));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static HIDConnectionLink* hidd_clcb_get(uint16_t conn_id) {
+  for (uint8_t i_clcb = 0; i_clcb < HID_MAX_LINKS; i_clcb++) {
+    HIDConnectionLink* p_clcb = &hid_engine.hidd_clcb[i_clcb];
+    if (p_clcb->in_use && p_clcb->conn_id == conn_id) return p_clcb;
+  }
+  return NULL;
+}
+
+static bool hidd_clcb_any(void) {
+  for (uint8_t i_clcb = 0; i_clcb < HID_MAX_LINKS; i_clcb++) {
+    if (hid_engine.hidd_clcb[i_clcb].in_use) return true;
+  }
+  return false;
+}
+
+bool hidd_clcb_find(const esp_bd_addr_t bda, uint16_t* conn_id) {
+  for (uint8_t i_clcb = 0; i_clcb < HID_MAX_LINKS; i_clcb++) {
+    HIDConnectionLink* p_clcb = &hid_engine.hidd_clcb[i_clcb];
+    if (p_clcb->in_use && memcmp(p_clcb->remote_bda, bda, ESP_BD_ADDR_LEN) == 0) {
+      *conn_id = p_clcb->conn_id;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool hidd_clcb_remote_bda(uint16_t conn_id, esp_bd_addr_t bda) {
+  HIDConnectionLink* p_clcb = hidd_clcb_get(conn_id);
+  if (p_clcb == NULL) return false;
+  memcpy(bda, p_clcb->remote_bda, ESP_BD_ADDR_LEN);
+  return true;
+}
+
+static void hidd_clcb_set_congested(uint16_t conn_id, bool congested) {
+  uint8_t i_clcb = 0;
+  HIDConnectionLink* p_clcb = NULL;
+
+  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_LINKS; i_clcb++, p_clcb++) {
+    if (p_clcb->in_use && p_clcb->conn_id == conn_id) {
+      p_clcb->congest = congested;
+      break;
+    }
+  }
+  return;
+}
+
+bool hidd_clcb_congested(uint16_t conn_id) {
+  uint8_t i_clcb = 0;
+  HIDConnectionLink* p_clcb = NULL;
+
+  for (i_clcb = 0, p_clcb = hid_engine.hidd_clcb; i_clcb < HID_MAX_LINKS; i_clcb++, p_clcb++) {
+    if (p_clcb->in_use && p_clcb->conn_id == conn_id) {
+      return p_clcb->congest;
+    }
   }
 
   return false;
 }
 
+uint8_t hidd_clcb_protocol_mode(uint16_t conn_id) {
+  HIDConnectionLink* p_clcb = hidd_clcb_get(conn_id);
+  return p_clcb != NULL ? p_clcb->proto_mode : HID_PROTOCOL_MODE_REPORT;
+}
+
+uint8_t hidd_clcb_index(uint16_t conn_id) {
+  HIDConnectionLink* p_clcb = hidd_clcb_get(conn_id);
+  return p_clcb != NULL ? p_clcb - hid_engine.hidd_clcb : HID_MAX_LINKS;
+}
+
+bool hidd_clcb_battery_notify(uint16_t conn_id) {
+  HIDConnectionLink* p_clcb = hidd_clcb_get(conn_id);
+  return p_clcb != NULL && p_clcb->connected && p_clcb->bas_notify;
+}
+
 static struct GATTSProfileInstance gatts_profile_instance[PROFILE_NUM] = {
     [PROFILE_APP_IDX] =
         {
@@ -348,9 +468,9 @@ void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, es
       if (param->reg.app_id == HIDD_APP_ID) {
         ESP_LOGI(GATTCB_TAG, "APP_ID is for HIDD_APP_ID, attaching GATT Interface to HID Engine");
         hid_engine.gatt_if = gatts_if;
+        boot_mark(BOOT_REGISTER);
         if (hid_engine.hidd_cb != NULL) {
-          ESP_LOGI(GATTCB_TAG, "Raising HIDD_EVENT_REG_FINISH event for HID Engine");
-          (hid_engine.hidd_cb)(ESP_HIDD_EVENT_REG_FINISH, &hidd_param);
+          // ESP_HIDD_EVENT_REG_FINISH follows once the HID Service has started
           ESP_LOGI(GATTCB_TAG, "Creating Battery Attribute Table");
           esp_ble_gatts_create_attr_tab(battery_attribute_table, hid_engine.gatt_if, BAS_IDX_NB, 0);
         }
@@ -380,6 +500,13 @@ void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, es
 
       memcpy(cb_param.connect.remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
       cb_param.connect.conn_id = param->connect.conn_id;
+      // Every link starts in report mode, a boot host switches over once it is connected. The stack keeps one
+      // attribute value for every link, so a host joining the others reads the mode they left.
+      if (!hidd_clcb_any()) {
+        hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
+        esp_ble_gatts_set_attr_value(hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL],
+                                     sizeof(hidProtocolMode), &hidProtocolMode);
+      }
       ESP_LOGI(GATTCB_TAG, "Allocating connection link");
       hidd_clcb_alloc(param->connect.conn_id, param->connect.remote_bda);
       ESP_LOGI(GATTCB_TAG, "Setting Encryption to ESP_BLE_SEC_ENCRPYT_NO_MITM");
@@ -395,7 +522,10 @@ void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, es
       ESP_LOGI(GATTCB_TAG, "GATTS Disconnect Event");
       if (hid_engine.hidd_cb != NULL) {
         ESP_LOGI(GATTCB_TAG, "Raising ESP_HIDD_EVENT_BLE_DISCONNECT event for HID Engine");
-        (hid_engine.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, NULL);
+        HIDEventParameters cb_param = {0};
+        cb_param.disconnect.conn_id = param->disconnect.conn_id;
+        memcpy(cb_param.disconnect.remote_bda, param->disconnect.remote_bda, sizeof(esp_bd_addr_t));
+        (hid_engine.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, &cb_param);
       }
       ESP_LOGI(GATTCB_TAG, "Deallocating connection link");
       hidd_clcb_dealloc(param->disconnect.conn_id);
@@ -404,8 +534,49 @@ void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, es
     case ESP_GATTS_CLOSE_EVT:
       ESP_LOGI(GATTCB_TAG, "GATTS Close Event");
       break;
+    case ESP_GATTS_CONGEST_EVT: {
+      ESP_LOGD(GATTCB_TAG, "GATTS Congest Event conn_id = %x congested = %d", param->congest.conn_id,
+               param->congest.congested);
+      hidd_clcb_set_congested(param->congest.conn_id, param->congest.congested);
+
+      if (hid_engine.hidd_cb != NULL) {
+        HIDEventParameters cb_param = {0};
+        cb_param.congest.conn_id = param->congest.conn_id;
+        cb_param.congest.congested = param->congest.congested;
+        (hid_engine.hidd_cb)(ESP_HIDD_EVENT_BLE_CONGEST, &cb_param);
+      }
+      break;
+    }
     case ESP_GATTS_WRITE_EVT: {
-      ESP_LOGI(GATTCB_TAG, "GATTS Write Event");
+      ESP_LOGD(GATTCB_TAG, "GATTS Write Event");
+      if (param->write.handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL] &&
+          hid_engine.hidd_cb != NULL) {
+        HIDEventParameters cb_param = {0};
+        cb_param.vendor_write.conn_id = param->write.conn_id;
+        cb_param.vendor_write.report_id = HID_RPT_ID_VENDOR_OUT;
+        cb_param.vendor_write.length = param->write.len;
+        cb_param.vendor_write.data = param->write.value;
+        (hid_engine.hidd_cb)(ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT, &cb_param);
+      }
+      if (param->write.handle == hid_engine.bas_tbl[BAS_IDX_BATT_LVL_NTF_CFG] && param->write.len == 2 &&
+          hidd_clcb_get(param->write.conn_id) != NULL) {
+        bool notify = param->write.value[0] & 0x01;
+        hidd_clcb_get(param->write.conn_id)->bas_notify = notify;
+        ESP_LOGI(GATTCB_TAG, "Battery Level notifications %s on conn_id %x", notify ? "on" : "off",
+                 param->write.conn_id);
+      }
+      // The stack keeps its own copy of the attribute, the reports to this host follow its link's copy
+      if (param->write.handle == hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL] && param->write.len == 1 &&
+          param->write.value[0] <= HID_PROTOCOL_MODE_REPORT && hidd_clcb_get(param->write.conn_id) != NULL) {
+        HIDConnectionLink* p_clcb = hidd_clcb_get(param->write.conn_id);
+        hidProtocolMode = param->write.value[0];
+        if (p_clcb->proto_mode != hidProtocolMode) {
+          p_clcb->proto_mode = hidProtocolMode;
+          ESP_LOGI(GATTCB_TAG, "Protocol mode %s on conn_id %x",
+                   hidProtocolMode == HID_PROTOCOL_MODE_BOOT ? "boot" : "report", param->write.conn_id);
+          hid_dev_reset_report_cache(param->write.conn_id);
+        }
+      }
       break;
     }
     case ESP_GATTS_CREAT_ATTR_TAB_EVT: {
@@ -416,16 +587,20 @@ void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, es
           param->add_attr_tab.svc_uuid.uuid.uuid16 == ESP_GATT_UUID_BATTERY_SERVICE_SVC &&
           param->add_attr_tab.status == ESP_GATT_OK) {
         ESP_LOGI(GATTCB_TAG, "UUID for BATTERY Service");
+        boot_mark(BOOT_BATTERY_TABLE);
+        memcpy(hid_engine.bas_tbl, param->add_attr_tab.handles, BAS_IDX_NB * sizeof(uint16_t));
         incl_svc.start_hdl = param->add_attr_tab.handles[BAS_IDX_SVC];
         incl_svc.end_hdl = incl_svc.start_hdl + BAS_IDX_NB - 1;
         ESP_LOGI(GATTCB_TAG, "BATTERY Service Handle Start: x%04X End: x%04X", incl_svc.start_hdl, incl_svc.end_hdl);
 
+        // The HID table includes the Battery Service by its handles, so it cannot be created any sooner
         ESP_LOGI(GATTCB_TAG, "Creating attribute table for HID Device");
         esp_ble_gatts_create_attr_tab(hidd_attribute_table, gatts_if, HIDD_LE_IDX_NB, 0);
       }
 
       if (param->add_attr_tab.num_handle == HIDD_LE_IDX_NB && param->add_attr_tab.status == ESP_GATT_OK) {
         ESP_LOGI(GATTCB_TAG, "UUID for HID Device Service with add_attr_tab.status of ESP_GATT_OK");
+        boot_mark(BOOT_HID_TABLE);
         memcpy(hid_engine.hidd_inst.att_tbl, param->add_attr_tab.handles, HIDD_LE_IDX_NB * sizeof(uint16_t));
         ESP_LOGI(GATTCB_TAG, "HID Device Service Handle Start: x%04X End: x%04X",
                  hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_SVC],
@@ -441,6 +616,20 @@ void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, es
       break;
     }
 
+    case ESP_GATTS_START_EVT: {
+      // The HID Service is the last one started, the profile is ready with it
+      if (param->start.service_handle != hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_SVC]) break;
+      ESP_LOGI(GATTCB_TAG, "HID Device Service started, status %d", param->start.status);
+      HIDEventParameters hidd_param;
+      hidd_param.init_finish.state = param->start.status == ESP_GATT_OK ? ESP_HIDD_INIT_OK : ESP_HIDD_INIT_FAILED;
+      hidd_param.init_finish.gatts_if = gatts_if;
+      if (hid_engine.hidd_cb != NULL) {
+        ESP_LOGI(GATTCB_TAG, "Raising HIDD_EVENT_REG_FINISH event for HID Engine");
+        (hid_engine.hidd_cb)(ESP_HIDD_EVENT_REG_FINISH, &hidd_param);
+      }
+      break;
+    }
+
     default:
       ESP_LOGI(GATTCB_TAG, "GATTS Event %d unmanaged", event);
       break;
@@ -472,6 +661,15 @@ void hidd_get_attr_value(uint16_t handle, uint16_t* length, uint8_t** value) {
   return;
 }
 
+void hidd_set_battery_level(uint8_t level) {
+  uint16_t handle = hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL];
+
+  // Before the service exists the table picks the value up when it is created
+  battery_level = level;
+  if (handle == 0) return;
+  esp_ble_gatts_set_attr_value(handle, sizeof(battery_level), &battery_level);
+}
+
 static void hid_add_id_tbl(void) {
   // Mouse input report
   hid_rpt_map[0].id = hidReportRefMouseIn[0];
@@ -532,6 +730,20 @@ static void hid_add_id_tbl(void) {
   hid_rpt_map[7].cccdHandle = 0;
   hid_rpt_map[7].mode = HID_PROTOCOL_MODE_REPORT;
 
+  // Vendor output report
+  hid_rpt_map[8].id = hidReportRefVendorOut[0];
+  hid_rpt_map[8].type = hidReportRefVendorOut[1];
+  hid_rpt_map[8].handle = hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL];
+  hid_rpt_map[8].cccdHandle = 0;
+  hid_rpt_map[8].mode = HID_PROTOCOL_MODE_REPORT;
+
+  // Keyboard bitmap input report
+  hid_rpt_map[9].id = hidReportRefNkroIn[0];
+  hid_rpt_map[9].type = hidReportRefNkroIn[1];
+  hid_rpt_map[9].handle = hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_VAL];
+  hid_rpt_map[9].cccdHandle = hid_engine.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_CCC];
+  hid_rpt_map[9].mode = HID_PROTOCOL_MODE_REPORT;
+
   // Setup report ID map
   hid_dev_register_reports(HID_NUM_REPORTS, hid_rpt_map);
 }
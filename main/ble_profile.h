@@ -36,12 +36,13 @@
 #define BATTRAY_APP_ID 0x180f
 #define ATT_SVC_HID 0x1812
 
-#define HID_MAX_APPS 1
-#define HID_NUM_REPORTS 9        // Number of HID reports defined in the service
+#define HID_MAX_LINKS 3          // Hosts connected at once, CONFIG_BTDM_CTRL_BLE_MAX_CONN
+#define HID_NUM_REPORTS 10       // Number of HID reports defined in the service
 #define HID_RPT_ID_MOUSE_IN 1    // Mouse input report ID
 #define HID_RPT_ID_KEY_IN 2      // Keyboard input report ID
 #define HID_RPT_ID_CC_IN 3       // Consumer Control input report ID
 #define HID_RPT_ID_VENDOR_OUT 4  // Vendor output report ID
+#define HID_RPT_ID_NKRO_IN 5     // Keyboard bitmap input report ID, replaces KEY_IN input in report mode
 #define HID_RPT_ID_LED_OUT 0     // LED output report ID
 #define HID_RPT_ID_FEATURE 0     // Feature report ID
 
@@ -78,6 +79,7 @@
 #define HID_REPORT_TYPE_INPUT 1
 #define HID_REPORT_TYPE_OUTPUT 2
 #define HID_REPORT_TYPE_FEATURE 3
+#define HID_REPORT_TYPE_BATTERY 0x80  // Report queue records carrying a Battery Level notification, not a HID type
 
 /* HID Report type */
 #define HID_TYPE_INPUT 1
@@ -88,6 +90,10 @@
 #define HID_LED_OUT_RPT_LEN 1      // HID LED output report length
 #define HID_MOUSE_IN_RPT_LEN 5     // HID mouse input report length
 #define HID_CC_IN_RPT_LEN 2        // HID consumer control input report length
+#define HID_VENDOR_OUT_RPT_LEN 32  // HID vendor output report length, one keymap store command
+#define HID_NKRO_USAGES 128        // Keyboard usages 0..127 covered by the bitmap report, one bit each
+#define HID_NKRO_USAGE_WORDS (HID_NKRO_USAGES / 32)
+#define HID_NKRO_IN_RPT_LEN (1 + HID_NKRO_USAGES / 8)  // HID keyboard bitmap report length, modifiers then bitmap
 
 #define LEFT_CONTROL_KEY_MASK (1 << 0)
 #define LEFT_SHIFT_KEY_MASK (1 << 1)
@@ -163,6 +169,13 @@ enum HIDServiceAttributeIndex {
   HIDD_LE_IDX_REPORT_CC_IN_VAL,              // Consumer device input
   HIDD_LE_IDX_REPORT_CC_IN_CCC,              // Consumer device input
   HIDD_LE_IDX_REPORT_CC_IN_REP_REF,          // Consumer device input
+  HIDD_LE_IDX_REPORT_VENDOR_OUT_CHAR,        // Vendor output
+  HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL,         // Vendor output
+  HIDD_LE_IDX_REPORT_VENDOR_OUT_REP_REF,     // Vendor output
+  HIDD_LE_IDX_REPORT_NKRO_IN_CHAR,           // Keyboard bitmap input
+  HIDD_LE_IDX_REPORT_NKRO_IN_VAL,            // Keyboard bitmap input
+  HIDD_LE_IDX_REPORT_NKRO_IN_CCC,            // Keyboard bitmap input
+  HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF,        // Keyboard bitmap input
   HIDD_LE_IDX_BOOT_KB_IN_REPORT_CHAR,        // Boot Keyboard Input Report
   HIDD_LE_IDX_BOOT_KB_IN_REPORT_VAL,         // Boot Keyboard Input Report
   HIDD_LE_IDX_BOOT_KB_IN_REPORT_NTF_CFG,     // Boot Keyboard Input Report
@@ -253,6 +266,7 @@ typedef enum HIDCallbackEvent {
   ESP_HIDD_EVENT_BLE_CONNECT,
   ESP_HIDD_EVENT_BLE_DISCONNECT,
   ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT,
+  ESP_HIDD_EVENT_BLE_CONGEST,
 } HIDCallbackEvent;
 
 typedef union HIDEventParameters {
@@ -275,6 +289,7 @@ typedef union HIDEventParameters {
 
   struct HIDDisconnectEvent {
     // ESP_HIDD_EVENT_DISCONNECT
+    uint16_t conn_id;
     esp_bd_addr_t remote_bda;
   } disconnect;
 
@@ -286,6 +301,12 @@ typedef union HIDEventParameters {
     uint8_t* data;
   } vendor_write;
 
+  struct HIDCongestEvent {
+    // ESP_HIDD_EVENT_BLE_CONGEST
+    uint16_t conn_id;
+    bool congested;
+  } congest;
+
 } HIDEventParameters;
 
 typedef void (*HIDCallback)(HIDCallbackEvent event, HIDEventParameters* param);
@@ -319,6 +340,8 @@ typedef struct HIDConnectionLink {
   uint16_t conn_id;
   bool connected;
   esp_bd_addr_t remote_bda;  // Bluetooth Device Address
+  bool bas_notify;           // Battery Level notifications enabled by this host
+  uint8_t proto_mode;        // Protocol mode this host last wrote, report mode until it does
   uint32_t trans_id;
   uint8_t cur_srvc_id;
 
@@ -348,31 +371,56 @@ typedef struct HIDInformation {
 } HIDInformation;
 
 typedef struct HIDServiceEngine {
-  HIDConnectionLink hidd_clcb[HID_MAX_APPS]; /* connection link*/
+  HIDConnectionLink hidd_clcb[HID_MAX_LINKS]; /* connection link*/
   esp_gatt_if_t gatt_if;
   bool enabled;
   bool is_take;
   bool is_primery;
   HIDInstance hidd_inst;
+  uint16_t bas_tbl[BAS_IDX_NB];  // Battery Service attribute handles
   HIDCallback hidd_cb;
   uint8_t inst_id;
 } HIDServiceEngine;
 
 extern HIDServiceEngine hid_engine;
+// Protocol Mode attribute value, the stack keeps one for every link. The reports follow the mode of their own
+// link, hidd_clcb_protocol_mode().
 extern uint8_t hidProtocolMode;
 
 void hidd_clcb_alloc(uint16_t conn_id, esp_bd_addr_t bda);
 
 bool hidd_clcb_dealloc(uint16_t conn_id);
 
+bool hidd_clcb_congested(uint16_t conn_id);
+
+// Protocol mode of the host on a link, report mode for a link that is gone
+uint8_t hidd_clcb_protocol_mode(uint16_t conn_id);
+
+// Position of a link in hid_engine.hidd_clcb, HID_MAX_LINKS if it is gone. It stays put while the link is up.
+uint8_t hidd_clcb_index(uint16_t conn_id);
+
+// True while the host on a link has Battery Level notifications enabled
+bool hidd_clcb_battery_notify(uint16_t conn_id);
+
+// Link of a host by its address, false if it has none
+bool hidd_clcb_find(const esp_bd_addr_t bda, uint16_t* conn_id);
+
+// Address of the host on a link, false if the link is gone
+bool hidd_clcb_remote_bda(uint16_t conn_id, esp_bd_addr_t bda);
+
 void hidd_set_attr_value(uint16_t handle, uint16_t val_len, const uint8_t* value);
 
 void hidd_get_attr_value(uint16_t handle, uint16_t* length, uint8_t** value);
 
+// Battery Level characteristic value a host read returns, hid_send_battery_level() notifies the hosts
+void hidd_set_battery_level(uint8_t level);
+
 void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
 
 void gatts_event_callback(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
 
 void hid_dev_register_reports(uint8_t num_reports, HIDReportMapping* p_report);
 
+void hid_dev_reset_report_cache(uint16_t conn_id);
+
 #endif
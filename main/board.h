@@ -0,0 +1,19 @@
+#ifndef BOARD_H__
+#define BOARD_H__
+
+// GPIO Defines
+#define PIN_COL0 5
+#define PIN_COL1 16
+#define PIN_COL2 4
+#define PIN_ROW0 19
+#define PIN_ROW1 21
+#define PIN_ROW2 22
+#define PIN_ROT_A 27
+#define PIN_ROT_B 14
+#define PIN_ROT_SW 23
+#define PIN_BATTSENSE 32  // A1_4
+#define PIN_5VDET 33      // A1_5
+#define PIN_COL_MASK ((1ULL << PIN_COL0) | (1ULL << PIN_COL1) | (1ULL << PIN_COL2))
+#define PIN_ROW_MASK ((1ULL << PIN_ROW0) | (1ULL << PIN_ROW1) | (1ULL << PIN_ROW2))
+
+#endif /* BOARD_H__ */
@@ -0,0 +1,92 @@
+// Startup trace
+//
+// Each stage of the bring-up is stamped with esp_timer_get_time() the first time it is reached, so the trace
+// covers the application from the start of the esp_timer clock, shortly before app_main. The BT stack comes up
+// on a task of its own while app_main sets up NVS, the drivers and the event loop, and advertising starts once
+// the three parts it needs are ready, whichever of them finishes last.
+
+#include "boot.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define BOOT_TAG "BOOT"
+#define BOOT_ADVERTISE_NEEDS ((1 << BOOT_APP) | (1 << BOOT_SERVICES) | (1 << BOOT_ADV_DATA))
+
+static const char* const boot_stage_names[BOOT_STAGE_MAX] = {
+    "nvs",      "controller", "keymap", "hardware", "uart",        "app",       "bluedroid", "register",
+    "adv_data", "battery",    "hid",    "services", "advertising", "connected", "secure",
+};
+
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t boot_reached = 0;  // Bit per stage
+static uint32_t boot_us[BOOT_STAGE_MAX];
+
+bool boot_mark(BootStage stage) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&boot_lock);
+  bool first = !(boot_reached & (1 << stage));
+  if (first) {
+    boot_reached |= 1 << stage;
+    boot_us[stage] = now;
+  }
+  portEXIT_CRITICAL(&boot_lock);
+  return first;
+}
+
+bool boot_ready(BootStage stage) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&boot_lock);
+  bool before = (boot_reached & BOOT_ADVERTISE_NEEDS) == BOOT_ADVERTISE_NEEDS;
+  if (!(boot_reached & (1 << stage))) {
+    boot_reached |= 1 << stage;
+    boot_us[stage] = now;
+  }
+  bool after = (boot_reached & BOOT_ADVERTISE_NEEDS) == BOOT_ADVERTISE_NEEDS;
+  portEXIT_CRITICAL(&boot_lock);
+  return after && !before;
+}
+
+int64_t boot_time(BootStage stage) {
+  if (stage >= BOOT_STAGE_MAX || !(boot_reached & (1 << stage))) return -1;
+  return boot_us[stage];
+}
+
+const char* boot_stage_name(BootStage stage) {
+  return stage < BOOT_STAGE_MAX ? boot_stage_names[stage] : "?";
+}
+
+size_t boot_serialize(uint8_t* buf, size_t len) {
+  if (len < BOOT_SERIALIZED_LEN) return 0;
+
+  for (int stage = 0; stage < BOOT_STAGE_MAX; stage++) {
+    int64_t us = boot_time(stage);
+    uint32_t value = us < 0 ? BOOT_NOT_REACHED : (uint32_t)us;
+    for (int byte = 0; byte < 4; byte++) {
+      *buf++ = value >> (8 * byte);
+    }
+  }
+  return BOOT_SERIALIZED_LEN;
+}
+
+// The two tasks reach their stages interleaved, so they are logged in the order of their times
+void boot_log(void) {
+  uint32_t logged = 0;
+  int64_t last = 0;
+  while (1) {
+    int next = -1;
+    for (int stage = 0; stage < BOOT_STAGE_MAX; stage++) {
+      int64_t us = boot_time(stage);
+      if (us < 0 || (logged & (1 << stage))) continue;
+      if (next < 0 || us < boot_time(next)) next = stage;
+    }
+    if (next < 0) break;
+    logged |= 1 << next;
+    int64_t us = boot_time(next);
+    ESP_LOGI(BOOT_TAG, "%-11s %8.3f ms %+8.3f ms", boot_stage_names[next], us / 1000.0, (us - last) / 1000.0);
+    last = us;
+  }
+}
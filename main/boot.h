@@ -0,0 +1,52 @@
+#ifndef BOOT_H__
+#define BOOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOOT_NOT_REACHED 0xFFFFFFFF  // Serialized time of a stage not reached yet
+
+// Stages of the bring-up, in the order they are usually reached. The BT controller, Bluedroid and GATT stages
+// run on the bt_start task while app_main sets up the rest.
+typedef enum BootStage {
+  BOOT_NVS = 0,        // NVS initialised, the controller needs it for its calibration data and the bonds
+  BOOT_CONTROLLER,     // BT controller enabled
+  BOOT_KEYMAP,         // Keymap and macros read into RAM
+  BOOT_HARDWARE,       // GPIO, ADC and PCNT set up
+  BOOT_UART,           // Inter-MCU UART driver installed
+  BOOT_APP,            // Event loop and report sender running
+  BOOT_BLUEDROID,      // Bluedroid enabled
+  BOOT_REGISTER,       // GATT application registered
+  BOOT_ADV_DATA,       // Advertising data set
+  BOOT_BATTERY_TABLE,  // Battery Service attribute table created
+  BOOT_HID_TABLE,      // HID Service attribute table created
+  BOOT_SERVICES,       // HID Service started, the profile is ready
+  BOOT_ADVERTISING,    // First advertising on air
+  BOOT_CONNECTED,      // First host link
+  BOOT_SECURE,         // First link encrypted
+  BOOT_STAGE_MAX,
+} BootStage;
+
+#define BOOT_SERIALIZED_LEN (BOOT_STAGE_MAX * sizeof(uint32_t))
+
+// Record the time a stage was first reached, from any task or BLE callback. True if this was the first time.
+bool boot_mark(BootStage stage);
+
+// Mark one of the stages advertising waits for: BOOT_APP, BOOT_SERVICES and BOOT_ADV_DATA. True for the one
+// call that completes the set, which then starts advertising.
+bool boot_ready(BootStage stage);
+
+// Microseconds from startup to the first time a stage was reached, -1 if it has not been
+int64_t boot_time(BootStage stage);
+
+const char* boot_stage_name(BootStage stage);
+
+// Time per stage as little endian uint32 microseconds, BOOT_NOT_REACHED for the ones not reached, returns the
+// bytes written
+size_t boot_serialize(uint8_t* buf, size_t len);
+
+// Log the stages reached in the order of their times, each with the time since the one before
+void boot_log(void);
+
+#endif /* BOOT_H__ */
@@ -1,4 +1,6 @@
 #include "driver/gpio.h"
+#include "boot.h"
+#include "conn_params.h"
 #include "esp_bt_defs.h"
 #include "esp_bt_device.h"
 #include "esp_bt_main.h"
@@ -6,17 +8,23 @@
 #include "esp_gatt_defs.h"
 #include "esp_gatts_api.h"
 #include "esp_log.h"
+#include "event_loop.h"
 #include "hid_dev.h"
+#include "keymap_store.h"
+#include "reconnect.h"
+#include "report_queue.h"
+#include "sleep.h"
 
 #define BTCONFIG_TAG "BT_CONFIG"
 #define GAP_TAG "GAP_HANDLER"
 #define CHAR_DECLARATION_SIZE (sizeof(uint8_t))
 #define HIDD_DEVICE_NAME "BT HID Macropad"
 
-static uint16_t hid_conn_id = 0;
+// Link and security of the active host slot. Only the event loop task writes these, the BLE callbacks post
+// APP_EVENT_BLE_* instead.
+#define HID_CONN_ID_NONE 0xFFFF  // The active slot has no link
+static uint16_t hid_conn_id = HID_CONN_ID_NONE;
 static bool sec_conn = false;
-static uint16_t buttonToggleMask = 0;
-static uint16_t last_counter = 0;
 static void hidd_event_callback(HIDCallbackEvent event, HIDEventParameters* param);
 
 static uint8_t hidd_service_uuid128[] = {
@@ -41,15 +49,10 @@ static esp_ble_adv_data_t hidd_adv_data = {
     .flag = 0x6,
 };
 
-static esp_ble_adv_params_t hidd_adv_params = {
-    .adv_int_min = 0x20,
-    .adv_int_max = 0x30,
-    .adv_type = ADV_TYPE_IND,
-    .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
-    //.peer_addr            =
-    //.peer_addr_type       =
-    .channel_map = ADV_CHNL_ALL,
-    .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
+// Input idle time on battery before the pad closes its links and goes to deep sleep
+static const HIDDeviceConfiguration hidd_config = {
+    .idleTimeout = SLEEP_IDLE_TIMEOUT_MS,
+    .hidFlags = HID_KBD_FLAGS,
 };
 
 static void hidd_event_callback(HIDCallbackEvent event, HIDEventParameters* param) {
@@ -57,11 +60,8 @@ static void hidd_event_callback(HIDCallbackEvent event, HIDEventParameters* para
   switch (event) {
     case ESP_HIDD_EVENT_REG_FINISH: {
       ESP_LOGI(BTCONFIG_TAG, "HID Device Event Register Finish");
-      if (param->init_finish.state == ESP_HIDD_INIT_OK) {
-        // esp_bd_addr_t rand_addr = {0x04,0x11,0x11,0x11,0x11,0x05};
-        esp_ble_gap_set_device_name(HIDD_DEVICE_NAME);
-        esp_ble_gap_config_adv_data(&hidd_adv_data);
-      }
+      // The HID Service is up, advertising starts if the advertising data and the event loop are ready too
+      if (param->init_finish.state == ESP_HIDD_INIT_OK && boot_ready(BOOT_SERVICES)) reconnect_start();
       break;
     }
     case ESP_BAT_EVENT_REG: {
@@ -73,17 +73,30 @@ static void hidd_event_callback(HIDCallbackEvent event, HIDEventParameters* para
       break;
     case ESP_HIDD_EVENT_BLE_CONNECT: {
       ESP_LOGI(BTCONFIG_TAG, "ESP_HIDD_EVENT_BLE_CONNECT");
-      hid_conn_id = param->connect.conn_id;
+      event_loop_post(APP_EVENT_BLE_CONNECT, param->connect.conn_id);
+      reconnect_connected(param->connect.remote_bda, param->connect.conn_id);
       break;
     }
     case ESP_HIDD_EVENT_BLE_DISCONNECT: {
-      sec_conn = false;
+      event_loop_post(APP_EVENT_BLE_DISCONNECT, param->disconnect.conn_id);
+      if (param->disconnect.conn_id == hid_conn_id) report_queue_set_congested(false);
       ESP_LOGI(BTCONFIG_TAG, "ESP_HIDD_EVENT_BLE_DISCONNECT");
-      esp_ble_gap_start_advertising(&hidd_adv_params);
+      reconnect_disconnected(param->disconnect.remote_bda);
+      break;
+    }
+    case ESP_HIDD_EVENT_BLE_CONGEST: {
+      ESP_LOGD(BTCONFIG_TAG, "ESP_HIDD_EVENT_BLE_CONGEST %d", param->congest.congested);
+      // Only the link the reports go to holds them back, a host switch picks up the state of the new one
+      if (param->congest.conn_id == hid_conn_id) report_queue_set_congested(param->congest.congested);
       break;
     }
     case ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT: {
       ESP_LOGI(BTCONFIG_TAG, "ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT");
+      // Keymap commands, applied on the event loop task that owns the keymap
+      if (!keymap_store_submit(param->vendor_write.data, param->vendor_write.length)) {
+        ESP_LOGW(BTCONFIG_TAG, "Keymap command dropped");
+      }
+      break;
     }
     default:
       // ESP_LOGI(BTCONFIG_TAG, "HID Device Event Unmanaged x%02X", event);
@@ -97,7 +110,10 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
   switch (event) {
     case ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT:
       ESP_LOGI(GAP_TAG, "ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT");
-      esp_ble_gap_start_advertising(&hidd_adv_params);
+      if (boot_ready(BOOT_ADV_DATA)) reconnect_start();
+      break;
+    case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+      if (param->adv_start_cmpl.status == ESP_BT_STATUS_SUCCESS) boot_mark(BOOT_ADVERTISING);
       break;
     case ESP_GAP_BLE_SEC_REQ_EVT:
       ESP_LOGI(GAP_TAG, "ESP_GAP_BLE_SEC_REQ_EVT");
@@ -108,9 +124,10 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
       break;
     case ESP_GAP_BLE_AUTH_CMPL_EVT:
       ESP_LOGI(GAP_TAG, "ESP_GAP_BLE_AUTH_CMPL_EVT");
-      sec_conn = true;
       esp_bd_addr_t bd_addr;
+      uint16_t conn_id;
       memcpy(bd_addr, param->ble_security.auth_cmpl.bd_addr, sizeof(esp_bd_addr_t));
+      if (hidd_clcb_find(bd_addr, &conn_id)) event_loop_post(APP_EVENT_BLE_SECURE, conn_id);
       ESP_LOGI(GAP_TAG, "remote BD_ADDR: %08x%04x",
                (bd_addr[0] << 24) + (bd_addr[1] << 16) + (bd_addr[2] << 8) + bd_addr[3],
                (bd_addr[4] << 8) + bd_addr[5]);
@@ -118,8 +135,15 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
       ESP_LOGI(GAP_TAG, "pair status = %s", param->ble_security.auth_cmpl.success ? "success" : "fail");
       if (!param->ble_security.auth_cmpl.success) {
         ESP_LOGE(GAP_TAG, "fail reason = 0x%x", param->ble_security.auth_cmpl.fail_reason);
+      } else {
+        reconnect_bonded(bd_addr, param->ble_security.auth_cmpl.addr_type);
       }
       break;
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+      ESP_LOGI(GAP_TAG, "ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT status = %d", param->update_conn_params.status);
+      conn_params_negotiated(param->update_conn_params.bda, param->update_conn_params.conn_int,
+                             param->update_conn_params.latency, param->update_conn_params.timeout);
+      break;
     default:
       ESP_LOGI(GAP_TAG, "GAP Event Unmanaged x%02X", event);
       break;
@@ -0,0 +1,140 @@
+// Connection parameter manager
+//
+// Keeps the link at a 7.5 ms interval while the pad is in use and asks the host for a long interval with
+// high slave latency once input has been quiet for CONN_PARAMS_IDLE_TIMEOUT_MS. The activity hook only
+// stores a timestamp unless a profile switch is due, so it is cheap enough for the scan path. Only the link the
+// reports go to is managed that way, the other hosts are parked on the inactive profile until they become the
+// active one.
+
+#include "conn_params.h"
+
+#include <string.h>
+
+#include "esp_gap_ble_api.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define CONN_PARAMS_TAG "CONN_PARAMS"
+
+typedef struct ConnProfileParams {
+  uint16_t min_int;  // Time = min_int * 1.25 msec
+  uint16_t max_int;  // Time = max_int * 1.25 msec
+  uint16_t latency;
+  uint16_t timeout;  // Time = timeout * 10 msec
+} ConnProfileParams;
+
+static const ConnProfileParams conn_profiles[CONN_PROFILE_MAX] = {
+    [CONN_PROFILE_LOW_LATENCY] = {.min_int = 0x0006, .max_int = 0x0006, .latency = 0, .timeout = 400},
+    [CONN_PROFILE_IDLE] = {.min_int = 0x0048, .max_int = 0x0050, .latency = 15, .timeout = 600},
+    // 1.9 s between the events the pad has to attend, the most hosts allow and under a third of the timeout
+    [CONN_PROFILE_INACTIVE] = {.min_int = 0x0050, .max_int = 0x0050, .latency = 18, .timeout = 600},
+};
+
+static const char* const conn_profile_names[CONN_PROFILE_MAX] = {"low latency", "idle", "inactive"};
+
+static portMUX_TYPE conn_params_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t conn_params_idle_timer = NULL;
+static esp_bd_addr_t conn_params_bda;
+static bool conn_params_connected_flag = false;
+static ConnProfile conn_params_current = CONN_PROFILE_LOW_LATENCY;
+static ConnParams conn_params_active;
+static volatile int64_t conn_params_last_activity = 0;
+
+static void conn_params_request(const esp_bd_addr_t bda, ConnProfile profile) {
+  esp_ble_conn_update_params_t update;
+  memcpy(update.bda, bda, sizeof(esp_bd_addr_t));
+  update.min_int = conn_profiles[profile].min_int;
+  update.max_int = conn_profiles[profile].max_int;
+  update.latency = conn_profiles[profile].latency;
+  update.timeout = conn_profiles[profile].timeout;
+
+  ESP_LOGI(CONN_PARAMS_TAG, "Requesting %s profile", conn_profile_names[profile]);
+  esp_err_t ret = esp_ble_gap_update_conn_params(&update);
+  if (ret != ESP_OK) {
+    ESP_LOGE(CONN_PARAMS_TAG, "%s update conn params failed: %d", __func__, ret);
+  }
+}
+
+static void conn_params_idle_timer_callback(void* arg) {
+  int64_t idle_us = esp_timer_get_time() - conn_params_last_activity;
+  int64_t timeout_us = (int64_t)CONN_PARAMS_IDLE_TIMEOUT_MS * 1000;
+
+  if (!conn_params_connected_flag) return;
+  if (idle_us < timeout_us) {
+    // Activity since the timer was armed, sleep for the remainder
+    esp_timer_start_once(conn_params_idle_timer, timeout_us - idle_us);
+    return;
+  }
+
+  portENTER_CRITICAL(&conn_params_lock);
+  bool switch_profile = conn_params_current != CONN_PROFILE_IDLE;
+  conn_params_current = CONN_PROFILE_IDLE;
+  portEXIT_CRITICAL(&conn_params_lock);
+
+  if (switch_profile) conn_params_request(conn_params_bda, CONN_PROFILE_IDLE);
+}
+
+esp_err_t conn_params_init(void) {
+  const esp_timer_create_args_t timer_args = {
+      .callback = conn_params_idle_timer_callback,
+      .name = "conn_params_idle",
+  };
+  return esp_timer_create(&timer_args, &conn_params_idle_timer);
+}
+
+void conn_params_connected(esp_bd_addr_t remote_bda) {
+  memcpy(conn_params_bda, remote_bda, sizeof(esp_bd_addr_t));
+  conn_params_connected_flag = true;
+  conn_params_current = CONN_PROFILE_LOW_LATENCY;
+  conn_params_last_activity = esp_timer_get_time();
+
+  conn_params_request(conn_params_bda, CONN_PROFILE_LOW_LATENCY);
+  if (conn_params_idle_timer != NULL) {
+    esp_timer_stop(conn_params_idle_timer);
+    esp_timer_start_once(conn_params_idle_timer, (uint64_t)CONN_PARAMS_IDLE_TIMEOUT_MS * 1000);
+  }
+}
+
+void conn_params_disconnected(void) {
+  conn_params_connected_flag = false;
+  if (conn_params_idle_timer != NULL) esp_timer_stop(conn_params_idle_timer);
+  memset(&conn_params_active, 0, sizeof(ConnParams));
+}
+
+void conn_params_inactive(esp_bd_addr_t remote_bda) {
+  conn_params_request(remote_bda, CONN_PROFILE_INACTIVE);
+}
+
+void conn_params_activity(void) {
+  conn_params_last_activity = esp_timer_get_time();
+  if (!conn_params_connected_flag || conn_params_current == CONN_PROFILE_LOW_LATENCY) return;
+
+  portENTER_CRITICAL(&conn_params_lock);
+  bool switch_profile = conn_params_current != CONN_PROFILE_LOW_LATENCY;
+  conn_params_current = CONN_PROFILE_LOW_LATENCY;
+  portEXIT_CRITICAL(&conn_params_lock);
+
+  if (switch_profile) {
+    conn_params_request(conn_params_bda, CONN_PROFILE_LOW_LATENCY);
+    esp_timer_stop(conn_params_idle_timer);
+    esp_timer_start_once(conn_params_idle_timer, (uint64_t)CONN_PARAMS_IDLE_TIMEOUT_MS * 1000);
+  }
+}
+
+void conn_params_negotiated(esp_bd_addr_t remote_bda, uint16_t interval, uint16_t latency, uint16_t timeout) {
+  ESP_LOGI(CONN_PARAMS_TAG, "Negotiated interval %d.%02d ms latency %d timeout %d ms", (interval * 125) / 100,
+           (interval * 125) % 100, latency, timeout * 10);
+  if (!conn_params_connected_flag || memcmp(remote_bda, conn_params_bda, sizeof(esp_bd_addr_t)) != 0) return;
+  conn_params_active.interval = interval;
+  conn_params_active.latency = latency;
+  conn_params_active.timeout = timeout;
+}
+
+void conn_params_get(ConnParams* params) {
+  *params = conn_params_active;
+}
+
+ConnProfile conn_params_profile(void) {
+  return conn_params_current;
+}
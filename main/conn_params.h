@@ -0,0 +1,47 @@
+#ifndef CONN_PARAMS_H__
+#define CONN_PARAMS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_bt_defs.h"
+#include "esp_err.h"
+
+#define CONN_PARAMS_IDLE_TIMEOUT_MS (30 * 1000)  // Input inactivity before dropping to the idle profile
+
+typedef enum ConnProfile {
+  CONN_PROFILE_LOW_LATENCY = 0,  // 7.5 ms interval, no slave latency, for typing/gaming
+  CONN_PROFILE_IDLE,             // Long interval with high slave latency, for battery life
+  CONN_PROFILE_INACTIVE,         // Host the reports do not go to, as much slave latency as hosts accept
+  CONN_PROFILE_MAX,
+} ConnProfile;
+
+typedef struct ConnParams {
+  uint16_t interval;  // Connection interval, Time = interval * 1.25 msec
+  uint16_t latency;   // Slave latency in connection events
+  uint16_t timeout;   // Supervision timeout, Time = timeout * 10 msec
+} ConnParams;
+
+esp_err_t conn_params_init(void);
+
+// The reports go to this host from now on, request the low latency profile from it
+void conn_params_connected(esp_bd_addr_t remote_bda);
+
+// The reports no longer go to the host from conn_params_connected(), or its link went down
+void conn_params_disconnected(void);
+
+// Park a link the reports do not go to on the inactive profile
+void conn_params_inactive(esp_bd_addr_t remote_bda);
+
+// Note input activity, switches straight back to the low latency profile when idling
+void conn_params_activity(void);
+
+// Record the parameters reported by ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, only those of the active link are kept
+void conn_params_negotiated(esp_bd_addr_t remote_bda, uint16_t interval, uint16_t latency, uint16_t timeout);
+
+// Parameters currently in effect on the active link, all zero when there is none
+void conn_params_get(ConnParams* params);
+
+ConnProfile conn_params_profile(void);
+
+#endif /* CONN_PARAMS_H__ */
@@ -0,0 +1,103 @@
+// Per key debounce between the matrix scan and the report builder
+//
+// All state is held in a fixed Debouncer instance, keys are visited by iterating the set bits of the
+// relevant masks so an idle matrix costs nothing beyond a couple of XORs per sample.
+
+#include "debounce.h"
+
+#include <string.h>
+
+#define FOR_EACH_BIT(i, mask) \
+  for (uint16_t _m = (mask), i = 0; _m && ((i = __builtin_ctz(_m)), 1); _m &= _m - 1)
+
+void debounce_init(Debouncer* debouncer, DebounceAlgorithm algorithm, uint32_t window_us) {
+  memset(debouncer, 0, sizeof(Debouncer));
+  debouncer->algorithm = algorithm;
+  debouncer->window_us = window_us;
+}
+
+static void debounce_eager_press(Debouncer* debouncer, uint32_t now) {
+  // Presses go straight through, the release side carries the whole window
+  uint16_t pressed = debouncer->raw & ~debouncer->state;
+  debouncer->state |= pressed;
+  debouncer->accepted_edges += __builtin_popcount(pressed);
+
+  uint16_t releasing = debouncer->state & ~debouncer->raw;
+  FOR_EACH_BIT(i, releasing) {
+    if (now - debouncer->key_time[i] >= debouncer->window_us) {
+      debouncer->state &= ~(1 << i);
+      debouncer->accepted_edges++;
+    }
+  }
+}
+
+static void debounce_symmetric(Debouncer* debouncer, uint32_t now) {
+  uint16_t differing = debouncer->raw ^ debouncer->state;
+  FOR_EACH_BIT(i, differing) {
+    if (now - debouncer->key_time[i] >= debouncer->window_us) {
+      debouncer->state ^= (1 << i);
+      debouncer->accepted_edges++;
+    }
+  }
+}
+
+static void debounce_integrator(Debouncer* debouncer, uint32_t now) {
+  uint32_t elapsed = now - debouncer->last_us;
+  // Only keys that are down or still draining need to be visited
+  uint16_t active = debouncer->raw | debouncer->state | debouncer->pending;
+  debouncer->pending = 0;
+  FOR_EACH_BIT(i, active) {
+    // Never credit time from before the key's own edge, the matrix may have been parked for ages
+    uint32_t dt = now - debouncer->key_time[i];
+    if (dt > elapsed) dt = elapsed;
+
+    uint32_t level = debouncer->integrator[i];
+    if (debouncer->raw & (1 << i)) {
+      level = (debouncer->window_us - level > dt) ? level + dt : debouncer->window_us;
+    } else {
+      level = (level > dt) ? level - dt : 0;
+    }
+    debouncer->integrator[i] = level;
+
+    if (level == debouncer->window_us && !(debouncer->state & (1 << i))) {
+      debouncer->state |= (1 << i);
+      debouncer->accepted_edges++;
+    } else if (level == 0 && (debouncer->state & (1 << i))) {
+      debouncer->state &= ~(1 << i);
+      debouncer->accepted_edges++;
+    }
+
+    // Settled once the level sits at the rail of the raw level, a release seen on this very sample has not
+    // drained anything yet and needs the scans to go on
+    if (level != ((debouncer->raw & (1 << i)) ? debouncer->window_us : 0)) {
+      debouncer->pending |= (1 << i);
+    }
+  }
+}
+
+uint16_t debounce_update(Debouncer* debouncer, uint16_t raw, int64_t now_us) {
+  uint32_t now = (uint32_t)now_us;  // Wrapping arithmetic, windows are far below 2^32 us
+
+  uint16_t edges = raw ^ debouncer->raw;
+  FOR_EACH_BIT(i, edges) { debouncer->key_time[i] = now; }
+  debouncer->raw_edges += __builtin_popcount(edges);
+  debouncer->raw = raw;
+
+  switch (debouncer->algorithm) {
+    case DEBOUNCE_SYMMETRIC:
+      debounce_symmetric(debouncer, now);
+      debouncer->pending = debouncer->raw ^ debouncer->state;
+      break;
+    case DEBOUNCE_INTEGRATOR:
+      debounce_integrator(debouncer, now);
+      break;
+    case DEBOUNCE_EAGER_PRESS:
+    default:
+      debounce_eager_press(debouncer, now);
+      debouncer->pending = debouncer->state & ~debouncer->raw;
+      break;
+  }
+
+  debouncer->last_us = now;
+  return debouncer->state;
+}
@@ -0,0 +1,37 @@
+#ifndef DEBOUNCE_H__
+#define DEBOUNCE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEBOUNCE_MAX_KEYS 16            // One slot per bit of the scanned button status
+#define DEBOUNCE_DEFAULT_WINDOW_US 5000  // Default debounce window
+
+typedef enum DebounceAlgorithm {
+  DEBOUNCE_EAGER_PRESS = 0,  // Press reported on the first edge, release once stable for the window
+  DEBOUNCE_SYMMETRIC,        // Both edges reported once the raw level is stable for the window
+  DEBOUNCE_INTEGRATOR,       // Per key integrator that has to fill/drain the window before toggling
+} DebounceAlgorithm;
+
+typedef struct Debouncer {
+  DebounceAlgorithm algorithm;
+  uint32_t window_us;
+  uint32_t last_us;                        // Timestamp of the previous sample
+  uint16_t raw;                            // Raw button status of the previous sample
+  uint16_t state;                          // Debounced button status
+  uint16_t pending;                        // Keys whose raw level disagrees with the debounced state
+  uint32_t key_time[DEBOUNCE_MAX_KEYS];    // Time of the last raw edge per key
+  uint32_t integrator[DEBOUNCE_MAX_KEYS];  // Integrator level per key, DEBOUNCE_INTEGRATOR only
+  uint32_t raw_edges;                      // Raw edges seen
+  uint32_t accepted_edges;                 // Edges that made it into the debounced state
+} Debouncer;
+
+void debounce_init(Debouncer* debouncer, DebounceAlgorithm algorithm, uint32_t window_us);
+
+// Feed one raw scan taken at now_us, returns the debounced button status
+uint16_t debounce_update(Debouncer* debouncer, uint16_t raw, int64_t now_us);
+
+// True while a key is still settling and needs further samples to resolve
+static inline bool debounce_pending(const Debouncer* debouncer) { return debouncer->pending != 0; }
+
+#endif /* DEBOUNCE_H__ */
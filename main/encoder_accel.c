@@ -0,0 +1,86 @@
+// Encoder acceleration and volume step batching
+//
+// Detents are weighted by a gain looked up from a smoothed velocity estimate, the fractional part of a step is
+// carried so slow turns keep an exact one step per detent. Steps are then played out as volume key presses,
+// each step costs a press and a release report, except that a reversal presses the other key in the same report
+// that releases the held one.
+
+#include "encoder_accel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void encoder_accel_init(EncoderAccel* accel, const EncoderAccelCurve* curve) {
+  memset(accel, 0, sizeof(EncoderAccel));
+  accel->curve = *curve;
+}
+
+static uint32_t encoder_accel_gain(const EncoderAccel* accel) {
+  const EncoderAccelCurve* curve = &accel->curve;
+  if (curve->num_points == 0) return ENCODER_ACCEL_GAIN_ONE;
+
+  const EncoderAccelPoint* low = &curve->points[0];
+  if (accel->velocity <= low->velocity * 1000u) return low->gain;
+  for (int i = 1; i < curve->num_points; i++) {
+    const EncoderAccelPoint* high = &curve->points[i];
+    uint32_t span = (high->velocity - low->velocity) * 1000u;
+    if (accel->velocity < high->velocity * 1000u && span > 0) {
+      uint32_t offset = accel->velocity - low->velocity * 1000u;
+      return low->gain + (int32_t)(high->gain - low->gain) * (int64_t)offset / span;
+    }
+    low = high;
+  }
+  return low->gain;
+}
+
+int32_t encoder_accel_update(EncoderAccel* accel, int32_t detents, int64_t now_us) {
+  if (detents == 0) return 0;
+  int8_t direction = detents > 0 ? 1 : -1;
+  int64_t elapsed = now_us - accel->last_us;
+
+  if (direction != accel->direction || elapsed >= ENCODER_ACCEL_IDLE_US) {
+    // First detent, a pause or a reversal, the hand is starting over from rest
+    accel->velocity = 0;
+    accel->fraction = 0;
+  } else {
+    uint64_t velocity = (uint64_t)abs(detents) * 1000000000ull / (elapsed > 0 ? elapsed : 1);
+    if (velocity > UINT32_MAX) velocity = UINT32_MAX;
+    // Halve towards each new sample, responsive within a few detents yet not thrown by one short gap
+    accel->velocity = ((uint64_t)accel->velocity + velocity) / 2;
+  }
+  accel->direction = direction;
+  accel->last_us = now_us;
+
+  int32_t scaled = accel->fraction + detents * (int32_t)encoder_accel_gain(accel);
+  int32_t steps = scaled / ENCODER_ACCEL_GAIN_ONE;  // Truncates towards zero so the remainder keeps the sign
+  accel->fraction = scaled - steps * ENCODER_ACCEL_GAIN_ONE;
+
+  accel->pending += steps;
+  accel->detents += abs(detents);
+  accel->steps += abs(steps);
+  return steps;
+}
+
+bool encoder_accel_next_report(const EncoderAccel* accel, int8_t* held) {
+  int8_t want = accel->pending > 0 ? 1 : (accel->pending < 0 ? -1 : 0);
+  if (accel->held != 0) {
+    // Another step the same way needs a release first, the other way can swap keys in one report
+    *held = want == -accel->held ? want : 0;
+    return true;
+  }
+  if (want == 0) return false;
+  *held = want;
+  return true;
+}
+
+void encoder_accel_report_sent(EncoderAccel* accel, int8_t held) {
+  accel->pending -= held;
+  accel->held = held;
+  accel->reports++;
+}
+
+void encoder_accel_cancel(EncoderAccel* accel) {
+  accel->pending = 0;
+  accel->held = 0;
+  accel->fraction = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef ENCODER_ACCEL_H__
+#define ENCODER_ACCEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ENCODER_ACCEL_GAIN_ONE 256          // Gain of one volume step per detent
+#define ENCODER_ACCEL_MAX_POINTS 4          // Points per acceleration curve
+#define ENCODER_ACCEL_IDLE_US (250 * 1000)  // A pause this long between detents restarts the velocity estimate
+
+// One step per detent at any speed
+#define ENCODER_ACCEL_CURVE_LINEAR {1, {{0, ENCODER_ACCEL_GAIN_ONE}}}
+
+// One step per detent up to 8 detents/s, two at 16 and three from 32 detents/s
+#define ENCODER_ACCEL_CURVE_DEFAULT                                                                      \
+  {                                                                                                      \
+    3, {{8, ENCODER_ACCEL_GAIN_ONE}, {16, 2 * ENCODER_ACCEL_GAIN_ONE}, {32, 3 * ENCODER_ACCEL_GAIN_ONE}} \
+  }
+
+typedef struct EncoderAccelPoint {
+  uint16_t velocity;  // Detents per second
+  uint16_t gain;      // Volume steps per detent, in 1/ENCODER_ACCEL_GAIN_ONE
+} EncoderAccelPoint;
+
+// Gain is interpolated linearly between points sorted by velocity and held flat beyond both ends
+typedef struct EncoderAccelCurve {
+  uint8_t num_points;
+  EncoderAccelPoint points[ENCODER_ACCEL_MAX_POINTS];
+} EncoderAccelCurve;
+
+typedef struct EncoderAccel {
+  EncoderAccelCurve curve;
+  uint32_t velocity;  // Smoothed velocity in milli-detents per second
+  int64_t last_us;    // Time of the previous detent
+  int8_t direction;   // Direction of the previous detent, 0 before the first one
+  int32_t fraction;   // Sub-step remainder carried to the next detent, in 1/ENCODER_ACCEL_GAIN_ONE
+  int32_t pending;    // Net volume steps not pressed yet, positive for volume up
+  int8_t held;        // Volume key held by the last report sent, +1 up, -1 down, 0 none
+  uint32_t detents;   // Detents fed in
+  uint32_t steps;     // Volume steps produced by the curve
+  uint32_t reports;   // Consumer reports that carried the steps
+} EncoderAccel;
+
+void encoder_accel_init(EncoderAccel* accel, const EncoderAccelCurve* curve);
+
+// Feed the detents counted since the last call, signed by direction, returns the steps they were worth
+int32_t encoder_accel_update(EncoderAccel* accel, int32_t detents, int64_t now_us);
+
+// Volume key state the next consumer report should carry, false when there is nothing left to send
+bool encoder_accel_next_report(const EncoderAccel* accel, int8_t* held);
+
+// Account for a report from encoder_accel_next_report() that made it into the report queue
+void encoder_accel_report_sent(EncoderAccel* accel, int8_t held);
+
+// Forget steps that can no longer be delivered, e.g. while no host is connected
+void encoder_accel_cancel(EncoderAccel* accel);
+
+// True while steps are waiting or a volume key is still held
+static inline bool encoder_accel_busy(const EncoderAccel* accel) { return accel->pending != 0 || accel->held != 0; }
+
+#endif /* ENCODER_ACCEL_H__ */
@@ -0,0 +1,150 @@
+// Single task event dispatcher
+//
+// Interrupts, esp_timer callbacks and the BLE stack post typed events to one queue, and the dispatcher task
+// waits on that queue together with the driver queues added to it (a FreeRTOS queue set). Each handler runs to
+// completion before the next event is taken, so the input, mode and link state they share is owned by one task.
+// Events that only say "go and look" are signalled rather than posted: a signal that is already waiting is not
+// queued again, so a burst of interrupts costs one slot and one handler run.
+
+#include "event_loop.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+
+#define EVENT_LOOP_TAG "EVENT_LOOP"
+
+typedef struct AppEvent {
+  uint8_t type;
+  bool signal;
+  uint32_t arg;
+} AppEvent;
+
+typedef struct EventLoopQueue {
+  QueueHandle_t queue;
+  UBaseType_t length;
+  EventLoopQueueHandler handler;
+} EventLoopQueue;
+
+static EventLoopHandler event_loop_handlers[APP_EVENT_MAX];
+static EventLoopQueue event_loop_queues[EVENT_LOOP_MAX_QUEUES];
+static int event_loop_queue_count = 0;
+static QueueHandle_t event_loop_queue = NULL;
+static QueueSetHandle_t event_loop_set = NULL;
+
+static portMUX_TYPE event_loop_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t event_loop_pending = 0;  // Signals waiting in the queue, one bit per AppEventType
+
+esp_err_t event_loop_register(AppEventType type, EventLoopHandler handler) {
+  if (type >= APP_EVENT_MAX) return ESP_ERR_INVALID_ARG;
+  event_loop_handlers[type] = handler;
+  return ESP_OK;
+}
+
+esp_err_t event_loop_add_queue(QueueHandle_t queue, UBaseType_t length, EventLoopQueueHandler handler) {
+  if (queue == NULL || handler == NULL) return ESP_ERR_INVALID_ARG;
+  if (event_loop_set != NULL || event_loop_queue_count >= EVENT_LOOP_MAX_QUEUES) return ESP_ERR_INVALID_STATE;
+  event_loop_queues[event_loop_queue_count++] = (EventLoopQueue){queue, length, handler};
+  return ESP_OK;
+}
+
+static void event_loop_dispatch(const AppEvent* event) {
+  if (event->signal) {
+    // Cleared before the handler runs, so a signal raised while it runs is seen by another run
+    portENTER_CRITICAL(&event_loop_lock);
+    event_loop_pending &= ~(1u << event->type);
+    portEXIT_CRITICAL(&event_loop_lock);
+  }
+  if (event->type < APP_EVENT_MAX && event_loop_handlers[event->type] != NULL) {
+    event_loop_handlers[event->type](event->arg);
+  }
+}
+
+static void event_loop_task(void* arg) {
+  void (*init)(void) = arg;
+  AppEvent event;
+
+  if (init != NULL) init();
+  while (1) {
+    QueueSetMemberHandle_t member = xQueueSelectFromSet(event_loop_set, portMAX_DELAY);
+    if (member == event_loop_queue) {
+      if (xQueueReceive(event_loop_queue, &event, 0)) event_loop_dispatch(&event);
+      continue;
+    }
+    for (int i = 0; i < event_loop_queue_count; i++) {
+      if (member == event_loop_queues[i].queue) event_loop_queues[i].handler(member);
+    }
+  }
+}
+
+esp_err_t event_loop_start(void (*init)(void)) {
+  if (event_loop_set != NULL) return ESP_ERR_INVALID_STATE;
+
+  UBaseType_t set_length = EVENT_LOOP_QUEUE_LEN;
+  for (int i = 0; i < event_loop_queue_count; i++) set_length += event_loop_queues[i].length;
+  event_loop_queue = xQueueCreate(EVENT_LOOP_QUEUE_LEN, sizeof(AppEvent));
+  event_loop_set = xQueueCreateSet(set_length);
+  if (event_loop_queue == NULL || event_loop_set == NULL) {
+    ESP_LOGE(EVENT_LOOP_TAG, "%s create queues failed", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+  xQueueAddToSet(event_loop_queue, event_loop_set);
+  for (int i = 0; i < event_loop_queue_count; i++) {
+    // Only an empty queue can join a set, anything a driver queued during boot is dropped
+    xQueueReset(event_loop_queues[i].queue);
+    xQueueAddToSet(event_loop_queues[i].queue, event_loop_set);
+  }
+
+  if (xTaskCreate(event_loop_task, "event_loop", EVENT_LOOP_TASK_STACK, (void*)init, EVENT_LOOP_TASK_PRIORITY,
+                  NULL) != pdPASS) {
+    ESP_LOGE(EVENT_LOOP_TAG, "%s create task failed", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+  ESP_LOGI(EVENT_LOOP_TAG, "Event loop started");
+  return ESP_OK;
+}
+
+bool event_loop_post(AppEventType type, uint32_t arg) {
+  AppEvent event = {.type = type, .signal = false, .arg = arg};
+  if (event_loop_queue == NULL) return false;
+  return xQueueSend(event_loop_queue, &event, 0) == pdTRUE;
+}
+
+void event_loop_signal(AppEventType type) {
+  AppEvent event = {.type = type, .signal = true, .arg = 0};
+  uint32_t bit = 1u << type;
+  bool queue;
+
+  if (event_loop_queue == NULL) return;
+  portENTER_CRITICAL(&event_loop_lock);
+  queue = !(event_loop_pending & bit);
+  event_loop_pending |= bit;
+  portEXIT_CRITICAL(&event_loop_lock);
+  if (!queue) return;
+
+  if (xQueueSend(event_loop_queue, &event, 0) != pdTRUE) {
+    portENTER_CRITICAL(&event_loop_lock);
+    event_loop_pending &= ~bit;
+    portEXIT_CRITICAL(&event_loop_lock);
+  }
+}
+
+void IRAM_ATTR event_loop_signal_from_isr(AppEventType type, BaseType_t* higher_priority_woken) {
+  AppEvent event = {.type = type, .signal = true, .arg = 0};
+  uint32_t bit = 1u << type;
+  bool queue;
+
+  if (event_loop_queue == NULL) return;
+  portENTER_CRITICAL_ISR(&event_loop_lock);
+  queue = !(event_loop_pending & bit);
+  event_loop_pending |= bit;
+  portEXIT_CRITICAL_ISR(&event_loop_lock);
+  if (!queue) return;
+
+  if (xQueueSendFromISR(event_loop_queue, &event, higher_priority_woken) != pdTRUE) {
+    portENTER_CRITICAL_ISR(&event_loop_lock);
+    event_loop_pending &= ~bit;
+    portEXIT_CRITICAL_ISR(&event_loop_lock);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef EVENT_LOOP_H__
+#define EVENT_LOOP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define EVENT_LOOP_QUEUE_LEN 16  // Posted events waiting for the dispatcher, signals take one slot per type at most
+#define EVENT_LOOP_MAX_QUEUES 2  // Driver queues the dispatcher also waits on, e.g. the UART event queue
+#define EVENT_LOOP_TASK_PRIORITY 12
+#define EVENT_LOOP_TASK_STACK 4096
+
+typedef enum AppEventType {
+  APP_EVENT_MATRIX = 0,      // Row interrupt or held-key scan tick
+  APP_EVENT_ENCODER,         // Detent reached, or held back volume steps are due for another try
+  APP_EVENT_BATTERY,         // Battery sample period elapsed
+  APP_EVENT_POWER,           // PIN_5VDET settled on the other power source
+  APP_EVENT_BLE_CONNECT,     // Arg is the connection id
+  APP_EVENT_BLE_SECURE,      // Pairing or encryption with a host completed, arg is the connection id
+  APP_EVENT_BLE_DISCONNECT,  // Arg is the connection id
+  APP_EVENT_KEYMAP_STORE,    // Keymap commands submitted, or the pending edits are due to be written
+  APP_EVENT_MACRO,           // Macro started, or its next burst of reports is due
+  APP_EVENT_SLEEP,           // Idle timeout on battery, or the links had their time to close before deep sleep
+  APP_EVENT_HEARTBEAT,       // Inter-MCU state records are due to be repeated
+  APP_EVENT_MAX,
+} AppEventType;
+
+typedef void (*EventLoopHandler)(uint32_t arg);
+
+// Called once the queue has an item, the handler takes it with a zero timeout
+typedef void (*EventLoopQueueHandler)(QueueHandle_t queue);
+
+esp_err_t event_loop_register(AppEventType type, EventLoopHandler handler);
+
+// Wait on a driver queue as well, length is the one it was created with. Call before event_loop_start() and
+// while the queue is still empty.
+esp_err_t event_loop_add_queue(QueueHandle_t queue, UBaseType_t length, EventLoopQueueHandler handler);
+
+// Create the dispatcher task, init runs first on it, before any handler. Every handler runs to completion on
+// that task, so state only they touch needs no locking.
+esp_err_t event_loop_start(void (*init)(void));
+
+// Post an event carrying an argument, never blocks. False if the queue is full.
+bool event_loop_post(AppEventType type, uint32_t arg);
+
+// Post an argument-less event unless one of that type is already waiting, the handler runs once for any
+// number of signals raised before it starts. Safe from any task and from esp_timer callbacks.
+void event_loop_signal(AppEventType type);
+void event_loop_signal_from_isr(AppEventType type, BaseType_t* higher_priority_woken);
+
+#endif /* EVENT_LOOP_H__ */
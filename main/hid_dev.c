@@ -22,41 +22,101 @@
 #include <string.h>
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "report_queue.h"
 
 #define HIDD_TAG "HID_DEVICE"
 
-static HIDReportMapping* hid_dev_rpt_tbl;
-static uint8_t hid_dev_rpt_tbl_Len;
-
-static HIDReportMapping* hid_get_report_by_id(uint8_t id, uint8_t type) {
-  HIDReportMapping* rpt = hid_dev_rpt_tbl;
+typedef struct HIDReportCache {
+  bool valid;
+  uint8_t length;
+  uint8_t data[HID_REPORT_CACHE_LEN];
+  int64_t sent_at;
+} HIDReportCache;
+
+// Value handle per protocol mode, report type and report ID, 0 where the service has no such report. The
+// protocol mode picks the plane, so a mode change needs nothing rebuilt.
+static uint16_t hid_report_handles[HID_PROTOCOL_MODE_REPORT + 1][HID_REPORT_TYPE_FEATURE][HID_REPORT_LOOKUP_IDS];
+
+// Last input report sent per link and report ID, only touched by the report queue task. Other tasks ask for a
+// link's entries to be cleared through hid_report_cache_reset, a bit per link, and the sender clears them before
+// its next send.
+static HIDReportCache hid_report_cache[HID_MAX_LINKS][HID_REPORT_CACHE_IDS];
+static uint32_t hid_report_cache_reset = 0;
+static HIDReportStats hid_report_stats;
+
+static uint16_t hid_get_report_handle(uint16_t conn_id, uint8_t id, uint8_t type) {
+  if (id >= HID_REPORT_LOOKUP_IDS || type < HID_REPORT_TYPE_INPUT || type > HID_REPORT_TYPE_FEATURE) return 0;
+  return hid_report_handles[hidd_clcb_protocol_mode(conn_id)][type - HID_REPORT_TYPE_INPUT][id];
+}
 
-  for (uint8_t i = hid_dev_rpt_tbl_Len; i > 0; i--, rpt++) {
-    if (rpt->id == id && rpt->type == type && rpt->mode == hidProtocolMode) {
-      return rpt;
+void hid_dev_register_reports(uint8_t num_reports, HIDReportMapping* p_report) {
+  ESP_LOGI(HIDD_TAG, "Registering report");
+  memset(hid_report_handles, 0, sizeof(hid_report_handles));
+  for (HIDReportMapping* rpt = p_report; rpt < p_report + num_reports; rpt++) {
+    if (rpt->id >= HID_REPORT_LOOKUP_IDS || rpt->type < HID_REPORT_TYPE_INPUT || rpt->type > HID_REPORT_TYPE_FEATURE ||
+        rpt->mode > HID_PROTOCOL_MODE_REPORT || rpt->handle == 0) {
+      ESP_LOGW(HIDD_TAG, "Report id %d type %d mode %d left out of the lookup", rpt->id, rpt->type, rpt->mode);
+      continue;
     }
+    hid_report_handles[rpt->mode][rpt->type - HID_REPORT_TYPE_INPUT][rpt->id] = rpt->handle;
   }
+}
 
-  return NULL;
+void hid_dev_reset_report_cache(uint16_t conn_id) {
+  uint8_t link = hidd_clcb_index(conn_id);
+  if (link < HID_MAX_LINKS) __atomic_fetch_or(&hid_report_cache_reset, 1u << link, __ATOMIC_RELEASE);
 }
 
-void hid_dev_register_reports(uint8_t num_reports, HIDReportMapping* p_report) {
-  ESP_LOGI(HIDD_TAG, "Registering report");
-  hid_dev_rpt_tbl = p_report;
-  hid_dev_rpt_tbl_Len = num_reports;
-  return;
+void hid_dev_get_report_stats(HIDReportStats* stats) {
+  *stats = hid_report_stats;
 }
 
-void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id, uint8_t id, uint8_t type, uint8_t length,
-                         uint8_t* data) {
-  HIDReportMapping* report;
-  report = hid_get_report_by_id(id, type);
-  if (report != NULL) {
-    // ESP_LOGI(HIDD_TAG, "Sending report %d", report->handle);
-    esp_ble_gatts_send_indicate(gatts_if, conn_id, report->handle, length, data, false);
+// Returns true if the input report repeats the last one sent on the link and the keep-alive has not run out yet
+static bool hid_report_is_duplicate(uint8_t link, uint8_t id, uint8_t length, uint8_t* data, int64_t now) {
+  uint32_t reset = __atomic_exchange_n(&hid_report_cache_reset, 0, __ATOMIC_ACQUIRE);
+  for (; reset; reset &= reset - 1) memset(hid_report_cache[__builtin_ctz(reset)], 0, sizeof(hid_report_cache[0]));
+  if (link >= HID_MAX_LINKS || id >= HID_REPORT_CACHE_IDS || length > HID_REPORT_CACHE_LEN) return false;
+
+  HIDReportCache* cache = &hid_report_cache[link][id];
+  if (cache->valid && cache->length == length && memcmp(cache->data, data, length) == 0 &&
+      (now - cache->sent_at) < HID_REPORT_KEEPALIVE_US) {
+    return true;
   }
 
-  return;
+  cache->valid = true;
+  cache->length = length;
+  memcpy(cache->data, data, length);
+  cache->sent_at = now;
+  return false;
+}
+
+esp_err_t hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id, uint8_t id, uint8_t type, uint8_t length,
+                              uint8_t* data) {
+  uint16_t handle = hid_get_report_handle(conn_id, id, type);
+  uint8_t link = hidd_clcb_index(conn_id);
+  esp_err_t ret;
+  if (type == HID_REPORT_TYPE_BATTERY) {
+    // The host may have turned notifications off while the record waited
+    handle = hidd_clcb_battery_notify(conn_id) ? hid_engine.bas_tbl[BAS_IDX_BATT_LVL_VAL] : 0;
+  }
+  if (handle == 0) return ESP_ERR_NOT_FOUND;
+
+  if (type == HID_REPORT_TYPE_INPUT && hid_report_is_duplicate(link, id, length, data, esp_timer_get_time())) {
+    hid_report_stats.suppressed++;
+    return ESP_OK;
+  }
+
+  // ESP_LOGI(HIDD_TAG, "Sending report %d", handle);
+  ret = esp_ble_gatts_send_indicate(gatts_if, conn_id, handle, length, data, false);
+  if (ret != ESP_OK) {
+    // Not on air, so the next attempt must not be mistaken for a duplicate
+    if (link < HID_MAX_LINKS && id < HID_REPORT_CACHE_IDS) hid_report_cache[link][id].valid = false;
+    return ret;
+  }
+
+  if (type == HID_REPORT_TYPE_INPUT) hid_report_stats.sent++;
+  return ESP_OK;
 }
 
 void hid_consumer_build_report(uint8_t* buffer, consumer_cmd cmd) {
@@ -133,21 +193,29 @@ void hid_consumer_build_report(uint8_t* buffer, consumer_cmd cmd) {
   }
 }
 
-void hid_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed) {
+bool hid_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed) {
   ESP_LOGI(HIDD_TAG, "Sending consumer value CMD: x%02X Value: x%02X", key_cmd, key_pressed);
   uint8_t buffer[HID_CC_IN_RPT_LEN] = {0, 0};
   if (key_pressed) {
     hid_consumer_build_report(buffer, key_cmd);
   }
-  hid_dev_send_report(hid_engine.gatt_if, conn_id, HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, buffer);
-  return;
+  return report_queue_push(conn_id, HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, buffer);
 }
 
-void hid_send_keyboard_value(uint16_t conn_id, key_mask special_key_mask, keyboard_cmd* keyboard_cmd, uint8_t num_key) {
+bool hid_send_keyboard_value(uint16_t conn_id, key_mask special_key_mask, keyboard_cmd* keyboard_cmd, uint8_t num_key) {
   ESP_LOGV(HIDD_TAG, "Sending keyboard value");
   if (num_key > HID_KEYBOARD_IN_RPT_LEN - 2) {
     ESP_LOGE(HIDD_TAG, "%s(), the number key should not be more than %d", __func__, HID_KEYBOARD_IN_RPT_LEN);
-    return;
+    return false;
+  }
+
+  // A report mode host only listens to the bitmap report
+  if (hidd_clcb_protocol_mode(conn_id) == HID_PROTOCOL_MODE_REPORT) {
+    uint32_t bits[HID_NKRO_USAGE_WORDS] = {0};
+    for (int i = 0; i < num_key; i++) {
+      if (keyboard_cmd[i] < HID_NKRO_USAGES) bits[keyboard_cmd[i] >> 5] |= 1u << (keyboard_cmd[i] & 31);
+    }
+    return hid_send_keyboard_bits(conn_id, special_key_mask, bits);
   }
 
   uint8_t buffer[HID_KEYBOARD_IN_RPT_LEN] = {0};
@@ -160,9 +228,36 @@ void hid_send_keyboard_value(uint16_t conn_id, key_mask special_key_mask, keyboa
 
   ESP_LOGD(HIDD_TAG, "the key vaule = %d,%d,%d, %d, %d, %d,%d, %d", buffer[0], buffer[1], buffer[2], buffer[3],
            buffer[4], buffer[5], buffer[6], buffer[7]);
-  hid_dev_send_report(hid_engine.gatt_if, conn_id, HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN,
-                      buffer);
-  return;
+  report_queue_trace_stamp(LATENCY_STAGE_BUILD);
+  return report_queue_push(conn_id, HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, buffer);
+}
+
+bool hid_send_keyboard_bits(uint16_t conn_id, key_mask special_key_mask, const uint32_t* bits) {
+  uint8_t buffer[HID_NKRO_IN_RPT_LEN] = {0};
+  uint8_t count = 0;
+
+  buffer[0] = special_key_mask;
+  if (hidd_clcb_protocol_mode(conn_id) == HID_PROTOCOL_MODE_REPORT) {
+    // The bitmap goes out as it is held, four report bytes per word
+    for (int word = 0; word < HID_NKRO_USAGE_WORDS; word++) {
+      buffer[1 + word * 4] = bits[word];
+      buffer[2 + word * 4] = bits[word] >> 8;
+      buffer[3 + word * 4] = bits[word] >> 16;
+      buffer[4 + word * 4] = bits[word] >> 24;
+    }
+    report_queue_trace_stamp(LATENCY_STAGE_BUILD);
+    return report_queue_push(conn_id, HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT, HID_NKRO_IN_RPT_LEN, buffer);
+  }
+
+  // Boot mode carries six usages, the lowest ones held, found a set bit at a time
+  for (int word = 0; word < HID_NKRO_USAGE_WORDS; word++) {
+    for (uint32_t set = bits[word]; set && count < HID_KEYBOARD_IN_RPT_LEN - 2; set &= set - 1) {
+      buffer[2 + count++] = word * 32 + __builtin_ctz(set);
+    }
+  }
+  ESP_LOGD(HIDD_TAG, "%d keys in the boot report, modifiers 0x%02x", count, special_key_mask);
+  report_queue_trace_stamp(LATENCY_STAGE_BUILD);
+  return report_queue_push(conn_id, HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, buffer);
 }
 
 void hid_device_profile_init(void) {
@@ -192,6 +287,15 @@ void hid_device_profile_deinit(void) {
   esp_ble_gatts_app_unregister(hid_engine.gatt_if);
 }
 
+void hid_send_battery_level(uint8_t level) {
+  HIDConnectionLink* p_clcb = hid_engine.hidd_clcb;
+  for (uint8_t i_clcb = 0; i_clcb < HID_MAX_LINKS; i_clcb++, p_clcb++) {
+    if (p_clcb->in_use && hidd_clcb_battery_notify(p_clcb->conn_id)) {
+      report_queue_push(p_clcb->conn_id, 0, HID_REPORT_TYPE_BATTERY, sizeof(level), &level);
+    }
+  }
+}
+
 // TODO: possible deprecate
 void hid_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y) {
   uint8_t buffer[HID_MOUSE_IN_RPT_LEN];
@@ -202,7 +306,6 @@ void hid_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys
   buffer[3] = 0;             // Wheel
   buffer[4] = 0;             // AC Pan
 
-  hid_dev_send_report(hid_engine.gatt_if, conn_id, HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT, HID_MOUSE_IN_RPT_LEN,
-                      buffer);
+  report_queue_push(conn_id, HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT, HID_MOUSE_IN_RPT_LEN, buffer);
   return;
 }
\ No newline at end of file
@@ -7,18 +7,42 @@
 #include "esp_gatt_defs.h"
 #include "hid_keydefinition.h"
 
+#define HID_REPORT_KEEPALIVE_US (1000 * 1000)    // Resend an unchanged input report after this long
+#define HID_REPORT_CACHE_IDS 8                    // Report IDs tracked by the duplicate filter
+#define HID_REPORT_CACHE_LEN HID_NKRO_IN_RPT_LEN  // Largest input report tracked by the duplicate filter
+#define HID_REPORT_LOOKUP_IDS 8                   // Report IDs resolved by the handle lookup, 0..7
+
+typedef struct HIDReportStats {
+  uint32_t sent;        // Input reports handed to the BLE stack
+  uint32_t suppressed;  // Input reports dropped as duplicates of the last one sent
+} HIDReportStats;
+
+// Resolve the report table into the handle lookup used by every send, once the attribute table exists
 void hid_dev_register_reports(uint8_t num_reports, HIDReportMapping* p_report);
 
-void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id, uint8_t id, uint8_t type, uint8_t length,
-                         uint8_t* data);
+// Forget the input reports last sent on a link, so the next ones go out even if they repeat them. Safe from any
+// task, the report queue task applies it before its next send.
+void hid_dev_reset_report_cache(uint16_t conn_id);
+
+void hid_dev_get_report_stats(HIDReportStats* stats);
+
+esp_err_t hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id, uint8_t id, uint8_t type, uint8_t length,
+                              uint8_t* data);
 
 void hid_consumer_build_report(uint8_t* buffer, consumer_cmd cmd);
 
 void hid_keyboard_build_report(uint8_t* buffer, keyboard_cmd cmd);
 
-void hid_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed);
+// Returns false if the report queue had no room for the report
+bool hid_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed);
+
+// Returns false if the report queue had no room for the report
+bool hid_send_keyboard_value(uint16_t conn_id, key_mask special_key_mask, keyboard_cmd* keyboard_cmd, uint8_t num_key);
 
-void hid_send_keyboard_value(uint16_t conn_id, key_mask special_key_mask, keyboard_cmd* keyboard_cmd, uint8_t num_key);
+// Keyboard report for every usage set in bits, HID_NKRO_USAGE_WORDS words with usage u at bit u % 32 of word
+// u / 32. Goes out as the bitmap report in report mode and as the lowest six usages in boot mode. Returns false
+// if the report queue had no room for the report
+bool hid_send_keyboard_bits(uint16_t conn_id, key_mask special_key_mask, const uint32_t* bits);
 
 void hid_device_register_callbacks(HIDCallback callbacks);
 
@@ -26,6 +50,9 @@ void hid_device_profile_init(void);
 
 void hid_device_profile_deinit(void);
 
+// Queue a Battery Level notification for every host that has them enabled, behind the reports already queued
+void hid_send_battery_level(uint8_t level);
+
 // TODO: possible deprecate
 void hid_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y);
 
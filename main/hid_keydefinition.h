@@ -303,4 +303,36 @@ static const uint8_t hidReportMap[] = {
     0xC0,        //   End Collection
     0x81, 0x03,  //   Input (Const, Var, Abs)
     0xC0,        // End Collection
+
+    0x06, 0x00, 0xFF,  // Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,        // Usage (Vendor Usage 1)
+    0xA1, 0x01,        // Collection (Application)
+    0x85, 0x04,        //   Report Id (4)
+    0x09, 0x02,        //   Usage (Vendor Usage 2)
+    0x15, 0x00,        //   Logical Min (0)
+    0x26, 0xFF, 0x00,  //   Logical Max (255)
+    0x75, 0x08,        //   Report Size (8)
+    0x95, 0x20,        //   Report Count (32), HID_VENDOR_OUT_RPT_LEN
+    0x91, 0x02,        //   Output (Data, Var, Abs)
+    0xC0,              // End Collection
+
+    0x05, 0x01,  // Usage Pg (Generic Desktop)
+    0x09, 0x06,  // Usage (Keyboard)
+    0xA1, 0x01,  // Collection: (Application)
+    0x85, 0x05,  //   Report Id (5)
+    0x05, 0x07,  //     Usage Pg (Key Codes)
+    0x19, 0xE0,  //     Usage Min (224)
+    0x29, 0xE7,  //     Usage Max (231)
+    0x15, 0x00,  //     Log Min (0)
+    0x25, 0x01,  //     Log Max (1)
+                 //   Modifier byte
+    0x75, 0x01,  //   Report Size (1)
+    0x95, 0x08,  //   Report Count (8)
+    0x81, 0x02,  //   Input: (Data, Variable, Absolute)
+                 //   Key bitmap (16 bytes), one bit per usage
+    0x19, 0x00,  //   Usage Min (0)
+    0x29, 0x7F,  //   Usage Max (127)
+    0x95, 0x80,  //   Report Count (128), HID_NKRO_USAGES
+    0x81, 0x02,  //   Input: (Data, Variable, Absolute)
+    0xC0,        // End Collection
 };
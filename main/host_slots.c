@@ -0,0 +1,106 @@
+// Host slots
+//
+// Up to HOST_SLOTS hosts stay connected, each on a slot of its own, and one slot is the active one the reports go
+// to. Moving to another slot only changes where the next report goes, so switching hosts takes one connection
+// event rather than a reconnect. Slots follow hosts by address for as long as the pad runs, deep sleeps
+// included, a host that comes back gets its slot back. Only the event loop task touches the table.
+
+#include "host_slots.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+
+#define HOST_SLOTS_TAG "HOST_SLOTS"
+
+void host_slots_init(HostSlots* slots) {
+  memset(slots, 0, sizeof(HostSlots));
+}
+
+void host_slots_resume(HostSlots* slots, const HostSlots* saved, int64_t saved_us, int64_t now_us) {
+  *slots = *saved;
+  for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+    slots->slot[i].connected = false;
+    slots->slot[i].secure = false;
+    // The order of the times is what counts, they move over to the new clock together
+    slots->slot[i].last_us += now_us - saved_us;
+  }
+  if (slots->active >= HOST_SLOTS) slots->active = 0;
+}
+
+static uint8_t host_slots_pick(const HostSlots* slots, const esp_bd_addr_t bda) {
+  uint8_t stalest = HOST_SLOT_NONE;
+
+  for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+    if (slots->slot[i].known && memcmp(slots->slot[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) return i;
+  }
+  if (!slots->slot[slots->active].known) return slots->active;
+  for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+    if (!slots->slot[i].known) return i;
+  }
+  for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+    if (slots->slot[i].connected || i == slots->active) continue;
+    if (stalest == HOST_SLOT_NONE || slots->slot[i].last_us < slots->slot[stalest].last_us) stalest = i;
+  }
+  return stalest;
+}
+
+uint8_t host_slots_connected(HostSlots* slots, uint16_t conn_id, const esp_bd_addr_t bda, int64_t now_us) {
+  uint8_t i = host_slots_pick(slots, bda);
+  if (i == HOST_SLOT_NONE) {
+    ESP_LOGW(HOST_SLOTS_TAG, "No slot left for conn_id %x", conn_id);
+    return HOST_SLOT_NONE;
+  }
+
+  HostSlot* slot = &slots->slot[i];
+  slot->known = true;
+  slot->connected = true;
+  slot->secure = false;
+  slot->conn_id = conn_id;
+  memcpy(slot->bda, bda, sizeof(esp_bd_addr_t));
+  slot->last_us = now_us;
+  ESP_LOGI(HOST_SLOTS_TAG, "Slot %u connected, conn_id %x%s", i, conn_id, i == slots->active ? ", active" : "");
+  return i;
+}
+
+uint8_t host_slots_secured(HostSlots* slots, uint16_t conn_id) {
+  uint8_t i = host_slots_find(slots, conn_id);
+  if (i != HOST_SLOT_NONE) slots->slot[i].secure = true;
+  return i;
+}
+
+uint8_t host_slots_disconnected(HostSlots* slots, uint16_t conn_id, int64_t now_us) {
+  uint8_t i = host_slots_find(slots, conn_id);
+  if (i == HOST_SLOT_NONE) return HOST_SLOT_NONE;
+
+  slots->slot[i].connected = false;
+  slots->slot[i].secure = false;
+  slots->slot[i].last_us = now_us;
+  ESP_LOGI(HOST_SLOTS_TAG, "Slot %u disconnected", i);
+  return i;
+}
+
+uint8_t host_slots_find(const HostSlots* slots, uint16_t conn_id) {
+  for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+    if (slots->slot[i].connected && slots->slot[i].conn_id == conn_id) return i;
+  }
+  return HOST_SLOT_NONE;
+}
+
+bool host_slots_select(HostSlots* slots, uint8_t slot) {
+  if (slot >= HOST_SLOTS || slot == slots->active) return false;
+  slots->active = slot;
+  ESP_LOGI(HOST_SLOTS_TAG, "Slot %u active, %s", slot,
+           slots->slot[slot].connected ? "connected" : slots->slot[slot].known ? "away" : "unused");
+  return true;
+}
+
+const HostSlot* host_slots_active(const HostSlots* slots) {
+  return &slots->slot[slots->active];
+}
+
+uint8_t host_slots_links(const HostSlots* slots) {
+  uint8_t links = 0;
+  for (uint8_t i = 0; i < HOST_SLOTS; i++) links += slots->slot[i].connected;
+  return links;
+}
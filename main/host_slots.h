@@ -0,0 +1,53 @@
+#ifndef HOST_SLOTS_H__
+#define HOST_SLOTS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_bt_defs.h"
+
+#define HOST_SLOTS 3          // Hosts kept connected at once, CONFIG_BTDM_CTRL_BLE_MAX_CONN
+#define HOST_SLOT_NONE 0xFF
+
+typedef struct HostSlot {
+  bool known;         // A host has connected on this slot since power-on
+  bool connected;
+  bool secure;        // Encrypted, reports may go out
+  uint16_t conn_id;   // Valid while connected
+  esp_bd_addr_t bda;  // Valid while known
+  int64_t last_us;    // Last connect or disconnect, the slot idle the longest is the one given up for a new host
+} HostSlot;
+
+typedef struct HostSlots {
+  HostSlot slot[HOST_SLOTS];
+  uint8_t active;  // Slot the reports go to, it stays put while its host is away
+} HostSlots;
+
+void host_slots_init(HostSlots* slots);
+
+// Take over the slots saved before a deep sleep, saved_us on the clock of that boot and now_us on this one. The
+// hosts keep their slots, every link is down.
+void host_slots_resume(HostSlots* slots, const HostSlots* saved, int64_t saved_us, int64_t now_us);
+
+// A host connected: the slot it had before, else the active slot if no host has used it yet, else the first
+// unused slot, else the slot idle the longest. Returns the slot, HOST_SLOT_NONE if every slot is connected.
+uint8_t host_slots_connected(HostSlots* slots, uint16_t conn_id, const esp_bd_addr_t bda, int64_t now_us);
+
+// Encryption completed on a link, returns its slot or HOST_SLOT_NONE
+uint8_t host_slots_secured(HostSlots* slots, uint16_t conn_id);
+
+// Link down, the slot keeps its host. Returns the slot or HOST_SLOT_NONE.
+uint8_t host_slots_disconnected(HostSlots* slots, uint16_t conn_id, int64_t now_us);
+
+// Slot of a connected link, HOST_SLOT_NONE if there is none
+uint8_t host_slots_find(const HostSlots* slots, uint16_t conn_id);
+
+// Make slot the report target, false if it already is or does not exist
+bool host_slots_select(HostSlots* slots, uint8_t slot);
+
+const HostSlot* host_slots_active(const HostSlots* slots);
+
+// Slots with a link up
+uint8_t host_slots_links(const HostSlots* slots);
+
+#endif /* HOST_SLOTS_H__ */
@@ -0,0 +1,514 @@
+// Inter-MCU link to the ATmega
+//
+// Frames are COBS encoded and end in a 0x00 delimiter, so a receiver picks up again at the next zero whatever it
+// was in the middle of and payload bytes never need escaping. Decoded, a frame is
+//
+//   seq | record ... | crc16
+//
+// seq counts frames per direction, crc16 is CRC-16/CCITT-FALSE over seq and the records, big endian. A record
+// is a header byte with the type in the low 5 bits and the value length in the top 3, IMCU_EXT_LEN meaning a
+// length byte follows, then the value. A frame carries as many records as fit in IMCU_MAX_RECORDS_LEN.
+//
+// Records are sent as soon as the line is idle. Records queued while a frame is still on the wire share the
+// next frame, so bursts cost one frame overhead rather than one per record. Periodically sampled state, like the
+// encoder switch or the battery level, goes through imcu_send_state() and only takes up the line when it changes
+// or at the heartbeat interval, which lets a peer that restarted catch up. The caller offers the state again on a
+// timer for that, nothing here runs on its own.
+//
+// Both ends start at the first entry of IMCU_BAUD_RATES. Once the peer has been heard, the ESP32 proposes the
+// next rate with a BAUD_REQ. A peer that can run it answers with a BAUD_ACK for the same code, at the old rate,
+// and switches as soon as that ACK is out. The ESP32 switches when its own queue has drained and repeats the
+// BAUD_REQ at the new rate, and the step is final when the peer ACKs that too. Both ends fall back to the old
+// rate if the exchange at the new rate does not complete within IMCU_BAUD_TIMEOUT_US. An ACK for any other
+// code, or no ACK at all, ends the negotiation at the current rate.
+
+#include "imcu.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define IMCU_TAG "IMCU"
+#define IMCU_BITS_PER_BYTE 10
+
+typedef enum ImcuBaudState {
+  IMCU_BAUD_IDLE = 0,    // Waiting to hear from the peer
+  IMCU_BAUD_STARTING,    // Peer heard, first step not proposed yet
+  IMCU_BAUD_PROPOSED,    // BAUD_REQ sent at the current rate
+  IMCU_BAUD_SWITCHING,   // Peer agreed, waiting for the TX queue to drain before switching
+  IMCU_BAUD_CONFIRMING,  // BAUD_REQ repeated at the new rate
+  IMCU_BAUD_DONE,
+} ImcuBaudState;
+
+static const uint32_t imcu_baud_rates[IMCU_BAUD_RATE_COUNT] = IMCU_BAUD_RATES;
+
+static uart_port_t imcu_uart = UART_NUM_0;
+static int64_t imcu_byte_us = 0;
+static ImcuParser imcu_parser;
+static ImcuRecordHandler imcu_handler = NULL;
+static ImcuStats imcu_stats;
+static esp_timer_handle_t imcu_flush_timer = NULL;
+
+// Records waiting for the flush timer, shared with every task that sends
+static portMUX_TYPE imcu_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t imcu_tx_pending[IMCU_TX_BUFFER];
+static size_t imcu_tx_fill = 0;
+static bool imcu_flush_armed = false;
+static int64_t imcu_tx_busy_until = 0;  // End of the last frame on the wire
+
+// Last state record sent per type, under imcu_lock
+typedef struct ImcuState {
+  bool sent;
+  uint8_t value;
+  int64_t sent_us;
+} ImcuState;
+
+static ImcuState imcu_state[IMCU_MAX_TYPE + 1];
+static int64_t imcu_heartbeat_us = 0;
+
+// Only touched by the flush timer
+static uint8_t imcu_tx_seq = 0;
+
+// Baud negotiation, only the negotiation timer moves the state on once it has started
+static esp_timer_handle_t imcu_baud_timer = NULL;
+static ImcuBaudState imcu_baud_state = IMCU_BAUD_IDLE;
+static int imcu_baud_acked = -1;  // Code of the last BAUD_ACK, under imcu_lock
+static int imcu_baud_code = -1;  // Rate code in effect, -1 when the configured rate is not in the table
+static int imcu_baud_next = -1;  // Rate code on trial
+static int imcu_baud_max = -1;   // Highest rate code to try
+
+uint16_t imcu_crc16(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+size_t imcu_cobs_encode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t code_at = 0;
+  size_t written = 1;
+  uint8_t code = 1;
+  for (size_t i = 0; i < length; i++) {
+    if (in[i] == 0) {
+      out[code_at] = code;
+      code_at = written++;
+      code = 1;
+      continue;
+    }
+    out[written++] = in[i];
+    if (++code == 0xFF) {
+      out[code_at] = code;
+      code_at = written++;
+      code = 1;
+    }
+  }
+  out[code_at] = code;
+  return written;
+}
+
+size_t imcu_record_put(uint8_t* buf, size_t capacity, uint8_t type, const uint8_t* value, uint8_t length) {
+  size_t header = length < IMCU_EXT_LEN ? 1 : 2;
+  if (type > IMCU_MAX_TYPE || header + length > capacity) return 0;
+
+  if (length < IMCU_EXT_LEN) {
+    buf[0] = type | (length << 5);
+  } else {
+    buf[0] = type | (IMCU_EXT_LEN << 5);
+    buf[1] = length;
+  }
+  if (length) memcpy(buf + header, value, length);
+  return header + length;
+}
+
+size_t imcu_record_size(const uint8_t* buf, size_t avail) {
+  if (avail == 0) return 0;
+  size_t header = 1;
+  size_t length = buf[0] >> 5;
+  if (length == IMCU_EXT_LEN) {
+    if (avail < 2) return 0;
+    header = 2;
+    length = buf[1];
+  }
+  return header + length <= avail ? header + length : 0;
+}
+
+size_t imcu_frame_encode(uint8_t seq, const uint8_t* records, size_t length, uint8_t* out) {
+  uint8_t raw[IMCU_MAX_RAW_LEN];
+  if (length > IMCU_MAX_RECORDS_LEN) return 0;
+
+  raw[0] = seq;
+  memcpy(raw + 1, records, length);
+  uint16_t crc = imcu_crc16(raw, length + 1);
+  raw[length + 1] = crc >> 8;
+  raw[length + 2] = crc & 0xFF;
+
+  size_t encoded = imcu_cobs_encode(raw, length + 3, out);
+  out[encoded++] = 0;
+  return encoded;
+}
+
+void imcu_parser_init(ImcuParser* parser, ImcuRecordHandler handler, void* ctx, ImcuStats* stats) {
+  memset(parser, 0, sizeof(ImcuParser));
+  parser->handler = handler;
+  parser->ctx = ctx;
+  parser->stats = stats;
+}
+
+void imcu_parser_reset(ImcuParser* parser) {
+  parser->fill = 0;
+  parser->block_left = 0;
+  parser->block_zero = false;
+  parser->started = false;
+  parser->overrun = false;
+}
+
+static void imcu_parser_frame(ImcuParser* parser) {
+  const uint8_t* raw = parser->buf;
+  size_t length = parser->fill;
+  if (length < 3 || imcu_crc16(raw, length - 2) != ((raw[length - 2] << 8) | raw[length - 1])) {
+    parser->stats->crc_errors++;
+    return;
+  }
+
+  uint8_t seq = raw[0];
+  if (parser->synced && seq != (uint8_t)(parser->last_seq + 1)) parser->stats->seq_gaps++;
+  parser->synced = true;
+  parser->last_seq = seq;
+  parser->stats->rx_frames++;
+
+  const uint8_t* records = raw + 1;
+  size_t avail = length - 3;
+  while (avail) {
+    size_t size = imcu_record_size(records, avail);
+    if (size == 0) {
+      parser->stats->malformed++;
+      return;
+    }
+    size_t header = (records[0] >> 5) == IMCU_EXT_LEN ? 2 : 1;
+    parser->stats->rx_records++;
+    if (parser->handler != NULL) {
+      parser->handler(records[0] & IMCU_MAX_TYPE, records + header, size - header, parser->ctx);
+    }
+    records += size;
+    avail -= size;
+  }
+}
+
+static void imcu_parser_put(ImcuParser* parser, uint8_t byte) {
+  if (parser->fill < sizeof(parser->buf)) {
+    parser->buf[parser->fill++] = byte;
+  } else {
+    parser->overrun = true;
+  }
+}
+
+// Single pass over the input, bytes are decoded straight into the frame buffer as they arrive
+void imcu_parser_feed(ImcuParser* parser, const uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    uint8_t byte = data[i];
+    if (byte == 0) {
+      if (parser->overrun) {
+        parser->stats->overruns++;
+      } else if (parser->block_left) {
+        parser->stats->crc_errors++;  // Delimiter inside a block, the frame was cut short
+      } else if (parser->started) {
+        imcu_parser_frame(parser);
+      }
+      imcu_parser_reset(parser);
+      continue;
+    }
+
+    parser->started = true;
+    if (parser->overrun) continue;
+    if (parser->block_left) {
+      imcu_parser_put(parser, byte);
+      parser->block_left--;
+      continue;
+    }
+    // A code byte, the zero the previous block stood for only exists because another block follows
+    if (parser->block_zero) imcu_parser_put(parser, 0);
+    parser->block_left = byte - 1;
+    parser->block_zero = byte != 0xFF;
+  }
+}
+
+// Move the whole records that fit in one frame out of the pending buffer
+static size_t imcu_take_records(uint8_t* records) {
+  size_t length = 0;
+  size_t size;
+  while ((size = imcu_record_size(imcu_tx_pending + length, imcu_tx_fill - length)) != 0 &&
+         length + size <= IMCU_MAX_RECORDS_LEN) {
+    length += size;
+  }
+  memcpy(records, imcu_tx_pending, length);
+  memmove(imcu_tx_pending, imcu_tx_pending + length, imcu_tx_fill - length);
+  imcu_tx_fill -= length;
+  return length;
+}
+
+static void imcu_flush(void* arg) {
+  uint8_t records[IMCU_MAX_RECORDS_LEN];
+  uint8_t frame[IMCU_MAX_FRAME];
+
+  while (1) {
+    portENTER_CRITICAL(&imcu_lock);
+    size_t length = imcu_take_records(records);
+    if (length == 0) {
+      imcu_flush_armed = false;
+      portEXIT_CRITICAL(&imcu_lock);
+      return;
+    }
+    portEXIT_CRITICAL(&imcu_lock);
+
+    size_t encoded = imcu_frame_encode(imcu_tx_seq++, records, length, frame);
+    uart_write_bytes(imcu_uart, frame, encoded);
+
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&imcu_lock);
+    if (imcu_tx_busy_until < now) imcu_tx_busy_until = now;
+    imcu_tx_busy_until += encoded * imcu_byte_us;
+    portEXIT_CRITICAL(&imcu_lock);
+
+    imcu_stats.tx_frames++;
+    imcu_stats.tx_bytes += encoded;
+    for (size_t offset = 0; offset < length; offset += imcu_record_size(records + offset, length - offset)) {
+      imcu_stats.tx_records++;
+    }
+  }
+}
+
+bool imcu_send(uint8_t type, const uint8_t* value, uint8_t length) {
+  int64_t delay_us = -1;
+  if (imcu_flush_timer == NULL) return false;
+  if (length > IMCU_MAX_VALUE_LEN) {
+    // It would never leave the head of the TX buffer and everything queued behind it would wait forever
+    imcu_stats.tx_dropped++;
+    ESP_LOGE(IMCU_TAG, "Record 0x%02X of %u bytes does not fit in a frame", type, length);
+    return false;
+  }
+
+  portENTER_CRITICAL(&imcu_lock);
+  size_t size = imcu_record_put(imcu_tx_pending + imcu_tx_fill, sizeof(imcu_tx_pending) - imcu_tx_fill, type, value,
+                                length);
+  imcu_tx_fill += size;
+  if (size && !imcu_flush_armed) {
+    imcu_flush_armed = true;
+    // Wait for the line, the records queued meanwhile ride along in the same frame
+    delay_us = imcu_tx_busy_until - esp_timer_get_time();
+    if (delay_us < 0) delay_us = 0;
+  }
+  portEXIT_CRITICAL(&imcu_lock);
+
+  if (size == 0) {
+    imcu_stats.tx_dropped++;
+    ESP_LOGW(IMCU_TAG, "TX buffer full, dropped record 0x%02X", type);
+    return false;
+  }
+  if (delay_us >= 0) esp_timer_start_once(imcu_flush_timer, delay_us);
+  return true;
+}
+
+bool imcu_send_state(uint8_t type, uint8_t value) {
+  if (type > IMCU_MAX_TYPE) return false;
+  int64_t now = esp_timer_get_time();
+  ImcuState* state = &imcu_state[type];
+
+  portENTER_CRITICAL(&imcu_lock);
+  bool changed = !state->sent || state->value != value ||
+                 (imcu_heartbeat_us && now - state->sent_us >= imcu_heartbeat_us);
+  if (changed) {
+    state->sent = true;
+    state->value = value;
+    state->sent_us = now;
+  } else {
+    imcu_stats.tx_suppressed++;
+  }
+  portEXIT_CRITICAL(&imcu_lock);
+
+  if (!changed) return false;
+  if (imcu_send(type, &value, 1)) return true;
+  state->sent = false;  // Not on its way, the next sample goes out whatever its value
+  return false;
+}
+
+void imcu_set_heartbeat(uint32_t interval_ms) {
+  portENTER_CRITICAL(&imcu_lock);
+  imcu_heartbeat_us = (int64_t)interval_ms * 1000;
+  portEXIT_CRITICAL(&imcu_lock);
+}
+
+static void imcu_set_baud(int code) {
+  uart_set_baudrate(imcu_uart, imcu_baud_rates[code]);
+  portENTER_CRITICAL(&imcu_lock);
+  imcu_baud_code = code;
+  imcu_byte_us = (IMCU_BITS_PER_BYTE * 1000000LL + imcu_baud_rates[code] - 1) / imcu_baud_rates[code];
+  portEXIT_CRITICAL(&imcu_lock);
+}
+
+static void imcu_baud_request(ImcuBaudState state) {
+  uint8_t code = imcu_baud_next;
+  imcu_baud_state = state;
+  imcu_send(IMCU_BAUD_REQ, &code, 1);
+  esp_timer_stop(imcu_baud_timer);
+  esp_timer_start_once(imcu_baud_timer, IMCU_BAUD_TIMEOUT_US);
+}
+
+// Propose the next rate up, or stop at the top of the table
+static void imcu_baud_step(void) {
+  if (imcu_baud_code >= imcu_baud_max) {
+    imcu_baud_state = IMCU_BAUD_DONE;
+    ESP_LOGI(IMCU_TAG, "Link at %u baud", imcu_baud_rates[imcu_baud_code]);
+    return;
+  }
+  imcu_baud_next = imcu_baud_code + 1;
+  imcu_baud_request(IMCU_BAUD_PROPOSED);
+}
+
+// Drain the TX queue at the old rate, then switch and repeat the request at the new one
+static void imcu_baud_switch(void) {
+  int64_t wait_us = 0;
+  portENTER_CRITICAL(&imcu_lock);
+  if (imcu_flush_armed || imcu_tx_fill) {
+    wait_us = imcu_byte_us;
+  } else if (imcu_tx_busy_until > esp_timer_get_time()) {
+    wait_us = imcu_tx_busy_until - esp_timer_get_time();
+  }
+  portEXIT_CRITICAL(&imcu_lock);
+  if (wait_us) {
+    esp_timer_start_once(imcu_baud_timer, wait_us);
+    return;
+  }
+  uart_wait_tx_done(imcu_uart, pdMS_TO_TICKS(10));
+  imcu_set_baud(imcu_baud_next);
+  imcu_baud_request(IMCU_BAUD_CONFIRMING);
+}
+
+// Runs every state change, on a BAUD_ACK, a timeout or while waiting for the TX queue to drain
+static void imcu_baud_event(void* arg) {
+  portENTER_CRITICAL(&imcu_lock);
+  int acked = imcu_baud_acked;
+  imcu_baud_acked = -1;
+  portEXIT_CRITICAL(&imcu_lock);
+
+  switch (imcu_baud_state) {
+    case IMCU_BAUD_STARTING:
+      imcu_baud_step();
+      break;
+    case IMCU_BAUD_PROPOSED:
+      if (acked == imcu_baud_next) {
+        imcu_baud_state = IMCU_BAUD_SWITCHING;
+        imcu_baud_switch();
+      } else {
+        imcu_baud_state = IMCU_BAUD_DONE;
+        ESP_LOGI(IMCU_TAG, "Peer did not take %u baud, link at %u baud", imcu_baud_rates[imcu_baud_next],
+                 imcu_baud_rates[imcu_baud_code]);
+      }
+      break;
+    case IMCU_BAUD_SWITCHING:
+      imcu_baud_switch();
+      break;
+    case IMCU_BAUD_CONFIRMING:
+      if (acked == imcu_baud_next) {
+        imcu_baud_step();
+      } else if (acked < 0) {
+        imcu_set_baud(imcu_baud_next - 1);
+        imcu_baud_state = IMCU_BAUD_DONE;
+        ESP_LOGW(IMCU_TAG, "No confirmation at %u baud, link back at %u baud", imcu_baud_rates[imcu_baud_next],
+                 imcu_baud_rates[imcu_baud_code]);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Hand a BAUD_ACK over to the negotiation timer, which owns the state
+static void imcu_baud_ack(uint8_t code) {
+  portENTER_CRITICAL(&imcu_lock);
+  imcu_baud_acked = code;
+  portEXIT_CRITICAL(&imcu_lock);
+  esp_timer_stop(imcu_baud_timer);
+  esp_timer_start_once(imcu_baud_timer, 0);
+}
+
+// Link records are handled here, everything else goes to the application
+static void imcu_link_record(uint8_t type, const uint8_t* value, uint8_t length, void* ctx) {
+  if (type == IMCU_BAUD_ACK) {
+    if (length == 1) imcu_baud_ack(value[0]);
+    return;
+  }
+  if (type == IMCU_BAUD_REQ) return;  // The ESP32 leads the negotiation
+  if (imcu_handler != NULL) imcu_handler(type, value, length, ctx);
+}
+
+esp_err_t imcu_init(uart_port_t uart_num, ImcuRecordHandler handler, uint32_t max_baud) {
+  uint32_t baud_rate;
+  esp_err_t ret = uart_get_baudrate(uart_num, &baud_rate);
+  if (ret != ESP_OK) return ret;
+
+  imcu_uart = uart_num;
+  imcu_handler = handler;
+  imcu_byte_us = (IMCU_BITS_PER_BYTE * 1000000LL + baud_rate - 1) / baud_rate;
+  memset(&imcu_stats, 0, sizeof(imcu_stats));
+  memset(imcu_state, 0, sizeof(imcu_state));
+  imcu_parser_init(&imcu_parser, imcu_link_record, NULL, &imcu_stats);
+
+  imcu_baud_code = -1;
+  imcu_baud_max = -1;
+  for (int code = 0; code < IMCU_BAUD_RATE_COUNT; code++) {
+    if (imcu_baud_rates[code] == baud_rate) imcu_baud_code = code;
+    if (imcu_baud_rates[code] <= max_baud) imcu_baud_max = code;
+  }
+  imcu_baud_state = imcu_baud_code >= 0 && imcu_baud_max > imcu_baud_code ? IMCU_BAUD_IDLE : IMCU_BAUD_DONE;
+
+  const esp_timer_create_args_t timer_args = {
+      .callback = imcu_flush,
+      .name = "imcu_flush",
+  };
+  ret = esp_timer_create(&timer_args, &imcu_flush_timer);
+  if (ret != ESP_OK) return ret;
+
+  const esp_timer_create_args_t baud_timer_args = {
+      .callback = imcu_baud_event,
+      .name = "imcu_baud",
+  };
+  ret = esp_timer_create(&baud_timer_args, &imcu_baud_timer);
+  if (ret != ESP_OK) return ret;
+
+  ESP_LOGI(IMCU_TAG, "Inter-MCU link on UART%d at %u baud", uart_num, baud_rate);
+  return ESP_OK;
+}
+
+void imcu_receive(const uint8_t* data, size_t length) {
+  imcu_parser_feed(&imcu_parser, data, length);
+  // The first frame from the peer shows it is up, start stepping the rate
+  if (imcu_baud_state == IMCU_BAUD_IDLE && imcu_parser.synced) {
+    imcu_baud_state = IMCU_BAUD_STARTING;
+    esp_timer_start_once(imcu_baud_timer, 0);
+  }
+}
+
+void imcu_rx_reset(void) {
+  imcu_parser_reset(&imcu_parser);
+}
+
+uint8_t imcu_rx_seq(void) {
+  return imcu_parser.last_seq;
+}
+
+void imcu_get_stats(ImcuStats* stats) {
+  *stats = imcu_stats;
+}
+
+uint32_t imcu_baud(void) {
+  uint32_t baud_rate = 0;
+  uart_get_baudrate(imcu_uart, &baud_rate);
+  return baud_rate;
+}
@@ -0,0 +1,108 @@
+#ifndef IMCU_H__
+#define IMCU_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/uart.h"
+#include "esp_err.h"
+
+#define IMCU_MAX_RECORDS_LEN 64                          // Record bytes per frame
+#define IMCU_MAX_RAW_LEN (1 + IMCU_MAX_RECORDS_LEN + 2)  // Sequence number, records and CRC before COBS
+#define IMCU_MAX_FRAME (IMCU_MAX_RAW_LEN + 2)            // One COBS code byte per 254 bytes plus the 0x00 delimiter
+#define IMCU_MAX_TYPE 0x1F                               // Record types are 5 bits
+#define IMCU_BAUD_REQ 0x1D                               // Link record, value is a rate code to switch to or confirm
+#define IMCU_BAUD_ACK 0x1E                               // Link record, value is the rate code the peer agrees to
+#define IMCU_EXT_LEN 7                                   // Length field value for a separate length byte
+#define IMCU_TX_BUFFER 256                               // Records waiting for the line to go idle
+#define IMCU_MAX_VALUE_LEN (IMCU_MAX_RECORDS_LEN - 2)    // Longest record value, with its header it fills a frame
+#define IMCU_BAUD_TIMEOUT_US (20 * 1000)                 // Wait for a BAUD_ACK before giving up on a rate
+
+// Rates the link steps through, a rate code is an index into this table
+#define IMCU_BAUD_RATES {38400, 115200, 250000, 500000, 1000000}
+#define IMCU_BAUD_RATE_COUNT 5
+
+typedef struct ImcuStats {
+  uint32_t tx_frames;
+  uint32_t tx_records;
+  uint32_t tx_bytes;       // Encoded bytes on the wire, delimiters included
+  uint32_t tx_dropped;     // Records turned away, longer than a frame or with the TX buffer full
+  uint32_t tx_suppressed;  // State records not sent because the value had not changed
+  uint32_t rx_frames;      // Frames that passed the CRC
+  uint32_t rx_records;
+  uint32_t crc_errors;  // Frames dropped for a bad CRC or COBS encoding
+  uint32_t malformed;   // Frames whose records ran past the end, records before the bad one were delivered
+  uint32_t overruns;    // Frames longer than IMCU_MAX_FRAME, dropped up to the next delimiter
+  uint32_t seq_gaps;    // Frames that did not follow the previous sequence number
+} ImcuStats;
+
+typedef void (*ImcuRecordHandler)(uint8_t type, const uint8_t* value, uint8_t length, void* ctx);
+
+// Streaming receiver, bytes are COBS decoded as they arrive and records come out once their frame checks out
+typedef struct ImcuParser {
+  ImcuRecordHandler handler;
+  void* ctx;
+  uint8_t buf[IMCU_MAX_RAW_LEN];  // Decoded part of the current frame
+  size_t fill;
+  uint8_t block_left;  // Bytes left in the current COBS block, 0 when the next byte is a code
+  bool block_zero;     // The current block is followed by a zero unless it is the last one
+  bool started;        // Bytes seen since the last delimiter
+  bool overrun;        // Dropping bytes until the next delimiter
+  bool synced;         // A frame has been received, last_seq is valid
+  uint8_t last_seq;
+  ImcuStats* stats;
+} ImcuParser;
+
+// CRC-16/CCITT-FALSE
+uint16_t imcu_crc16(const uint8_t* data, size_t length);
+
+// out needs room for length + length / 254 + 1 bytes, returns the encoded length
+size_t imcu_cobs_encode(const uint8_t* in, size_t length, uint8_t* out);
+
+// Append a record to buf, returns the bytes written or 0 if it does not fit
+size_t imcu_record_put(uint8_t* buf, size_t capacity, uint8_t type, const uint8_t* value, uint8_t length);
+
+// Size of the record at the start of buf, 0 if it runs past avail
+size_t imcu_record_size(const uint8_t* buf, size_t avail);
+
+// Frame records with a sequence number and CRC, out needs IMCU_MAX_FRAME bytes, returns the bytes to send
+size_t imcu_frame_encode(uint8_t seq, const uint8_t* records, size_t length, uint8_t* out);
+
+void imcu_parser_init(ImcuParser* parser, ImcuRecordHandler handler, void* ctx, ImcuStats* stats);
+
+void imcu_parser_feed(ImcuParser* parser, const uint8_t* data, size_t length);
+
+// Drop a partly received frame, e.g. after the driver flushed its RX buffer
+void imcu_parser_reset(ImcuParser* parser);
+
+// Start the link on an installed UART, records received are handed to handler from imcu_receive()'s caller. When
+// max_baud is above the configured rate, the rate is stepped up through IMCU_BAUD_RATES once the peer is heard.
+esp_err_t imcu_init(uart_port_t uart_num, ImcuRecordHandler handler, uint32_t max_baud);
+
+// Queue a record, it goes out straight away when the line is idle or batched with the records queued behind it
+// while the previous frame is still on the wire. A record has to fit in one frame, false for a value longer than
+// IMCU_MAX_VALUE_LEN or when the TX buffer is full.
+bool imcu_send(uint8_t type, const uint8_t* value, uint8_t length);
+
+// Queue a one byte state record, skipped while the value matches the last one sent for this type and the
+// heartbeat interval has not passed since. Returns true if the record was queued.
+bool imcu_send_state(uint8_t type, uint8_t value);
+
+// Period at which unchanged state records are repeated anyway, 0 sends them only on a change
+void imcu_set_heartbeat(uint32_t interval_ms);
+
+// Feed bytes read from the UART
+void imcu_receive(const uint8_t* data, size_t length);
+
+void imcu_rx_reset(void);
+
+// Sequence number of the last frame received
+uint8_t imcu_rx_seq(void);
+
+void imcu_get_stats(ImcuStats* stats);
+
+// Rate the link runs at, which may still be on trial while a step up waits for its confirmation
+uint32_t imcu_baud(void);
+
+#endif /* IMCU_H__ */
@@ -0,0 +1,209 @@
+// Layered keymap between the debouncer and the HID reports
+//
+// Each key has one KeyAction per layer in a constant table, so the default map is laid out by the compiler and
+// stays in flash. An update only visits the keys whose debounced state changed, by iterating the set bits of the
+// changed mask, and looks each one up from the highest active layer down to the first entry that is not
+// transparent.
+
+#include "keymap.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "hid_keydefinition.h"
+#include "matrix.h"
+
+#define KEYMAP_TAG "KEYMAP"
+
+#define KEYMAP_IS_MODIFIER(usage) ((usage) >= HID_KEY_LEFT_CTRL && (usage) <= HID_KEY_RIGHT_GUI)
+
+#define FOR_EACH_BIT(i, mask) \
+  for (uint16_t _m = (mask), i = 0; _m && ((i = __builtin_ctz(_m)), 1); _m &= _m - 1)
+
+// Matrix keys are bits 1..9 in reading order, the encoder switch is MATRIX_ROT_SW_BIT. Layer 2 leaves key 9
+// to the layers below, so holding the switch still reaches the toggle that turns it off.
+const KeyAction keymap_default[KEYMAP_DEFAULT_LAYERS][KEYMAP_KEYS] = {
+    [0] =
+        {
+            [1] = KEYMAP_KEY(HID_KEY_1),
+            [2] = KEYMAP_KEY(HID_KEY_2),
+            [3] = KEYMAP_KEY(HID_KEY_3),
+            [4] = KEYMAP_KEY(HID_KEY_4),
+            [5] = KEYMAP_KEY(HID_KEY_5),
+            [6] = KEYMAP_KEY(HID_KEY_6),
+            [7] = KEYMAP_KEY(HID_KEY_7),
+            [8] = KEYMAP_KEY(HID_KEY_8),
+            [9] = KEYMAP_KEY(HID_KEY_9),
+            [MATRIX_ROT_SW_BIT] = KEYMAP_LT_CC(1, HID_CONSUMER_MUTE),
+            [KEYMAP_ENCODER_CW] = KEYMAP_CC(HID_CONSUMER_VOLUME_UP),
+            [KEYMAP_ENCODER_CCW] = KEYMAP_CC(HID_CONSUMER_VOLUME_DOWN),
+        },
+    [1] =
+        {
+            [1] = KEYMAP_CC(HID_CONSUMER_SCAN_PREV_TRK),
+            [2] = KEYMAP_CC(HID_CONSUMER_PLAY),
+            [3] = KEYMAP_CC(HID_CONSUMER_SCAN_NEXT_TRK),
+            [4] = KEYMAP_CC(HID_CONSUMER_REWIND),
+            [5] = KEYMAP_CC(HID_CONSUMER_PAUSE),
+            [6] = KEYMAP_CC(HID_CONSUMER_FAST_FORWARD),
+            [7] = KEYMAP_HOST(KEYMAP_HOST_NEXT),
+            [8] = KEYMAP_CC(HID_CONSUMER_STOP),
+            [9] = KEYMAP_TG(2),
+        },
+    [2] =
+        {
+            [1] = KEYMAP_KEY(HID_KEY_F1),
+            [2] = KEYMAP_KEY(HID_KEY_F2),
+            [3] = KEYMAP_KEY(HID_KEY_F3),
+            [4] = KEYMAP_KEY(HID_KEY_F4),
+            [5] = KEYMAP_KEY(HID_KEY_F5),
+            [6] = KEYMAP_KEY(HID_KEY_F6),
+            [7] = KEYMAP_KEY(HID_KEY_F7),
+            [8] = KEYMAP_KEY(HID_KEY_F8),
+        },
+};
+
+void keymap_init(Keymap* keymap, const KeyAction (*map)[KEYMAP_KEYS], uint8_t layer_count,
+                 const KeymapOutput* output) {
+  memset(keymap, 0, sizeof(Keymap));
+  keymap->map = map;
+  keymap->layer_count = layer_count < KEYMAP_MAX_LAYERS ? layer_count : KEYMAP_MAX_LAYERS;
+  keymap->output = *output;
+}
+
+uint8_t keymap_layers(const Keymap* keymap) {
+  uint8_t layers = keymap->toggled | 1;
+  for (int layer = 1; layer < keymap->layer_count; layer++) {
+    if (keymap->momentary[layer]) layers |= 1 << layer;
+  }
+  return layers;
+}
+
+KeyAction keymap_action(const Keymap* keymap, int key) {
+  uint8_t layers = keymap_layers(keymap);
+  while (layers) {
+    int layer = 31 - __builtin_clz(layers);
+    KeyAction action = keymap->map[layer][key];
+    if (KEYMAP_ACTION_KIND(action) != KEYMAP_KIND_TRANSPARENT) return action;
+    layers &= ~(1 << layer);
+  }
+  return KEYMAP_NO;
+}
+
+// The report is rebuilt from the held keys, every usage gets its bit so a chord of any size goes out whole
+static void keymap_flush(Keymap* keymap) {
+  uint8_t modifiers = 0;
+  uint32_t bits[KEYMAP_USAGE_WORDS] = {0};
+
+  FOR_EACH_BIT(key, keymap->state) {
+    KeyAction action = keymap->active[key];
+    if (KEYMAP_ACTION_KIND(action) != KEYMAP_KIND_KEY) continue;
+    uint8_t usage = KEYMAP_ACTION_USAGE(action);
+    if (KEYMAP_IS_MODIFIER(usage)) {
+      modifiers |= 1 << (usage - HID_KEY_LEFT_CTRL);
+    } else if (usage < KEYMAP_USAGE_WORDS * 32) {
+      bits[usage >> 5] |= 1u << (usage & 31);
+    }
+  }
+  if (keymap->tap_usage != 0 && keymap->tap_usage < KEYMAP_USAGE_WORDS * 32) {
+    bits[keymap->tap_usage >> 5] |= 1u << (keymap->tap_usage & 31);
+  }
+
+  if (modifiers == keymap->modifiers && memcmp(bits, keymap->bits, sizeof(bits)) == 0) return;
+  keymap->modifiers = modifiers;
+  memcpy(keymap->bits, bits, sizeof(bits));
+  if (keymap->output.keyboard != NULL) keymap->output.keyboard(modifiers, keymap->bits, keymap->output.ctx);
+}
+
+static void keymap_consumer(Keymap* keymap, uint8_t usage, bool pressed) {
+  if (keymap->output.consumer != NULL) keymap->output.consumer(usage, pressed, keymap->output.ctx);
+}
+
+static void keymap_press(Keymap* keymap, int key, uint32_t now) {
+  KeyAction action = keymap_action(keymap, key);
+  uint8_t layer = KEYMAP_ACTION_LAYER(action);
+
+  keymap->active[key] = action;
+  keymap->press_us[key] = now;
+  switch (KEYMAP_ACTION_KIND(action)) {
+    case KEYMAP_KIND_CONSUMER:
+      keymap_consumer(keymap, KEYMAP_ACTION_USAGE(action), true);
+      break;
+    case KEYMAP_KIND_LAYER_TAP:
+    case KEYMAP_KIND_LAYER_TAP_CONSUMER:
+      keymap->tap_pending |= 1 << key;
+      // fall through
+    case KEYMAP_KIND_MOMENTARY:
+      if (layer < keymap->layer_count) keymap->momentary[layer]++;
+      break;
+    case KEYMAP_KIND_TOGGLE:
+      if (layer < keymap->layer_count) keymap->toggled ^= 1 << layer;
+      ESP_LOGD(KEYMAP_TAG, "Layers 0x%02x", keymap_layers(keymap));
+      break;
+    case KEYMAP_KIND_MACRO:
+      if (keymap->output.macro != NULL) keymap->output.macro(KEYMAP_ACTION_USAGE(action), keymap->output.ctx);
+      break;
+    case KEYMAP_KIND_HOST:
+      if (keymap->output.host != NULL) keymap->output.host(KEYMAP_ACTION_USAGE(action), keymap->output.ctx);
+      break;
+    default:
+      break;
+  }
+}
+
+static void keymap_release(Keymap* keymap, int key, uint32_t now) {
+  KeyAction action = keymap->active[key];
+  uint8_t layer = KEYMAP_ACTION_LAYER(action);
+  bool tap = (keymap->tap_pending & (1 << key)) && now - keymap->press_us[key] < KEYMAP_TAP_TERM_MS * 1000;
+
+  keymap->tap_pending &= ~(1 << key);
+  keymap->active[key] = KEYMAP_NO;
+  switch (KEYMAP_ACTION_KIND(action)) {
+    case KEYMAP_KIND_CONSUMER:
+      keymap_consumer(keymap, KEYMAP_ACTION_USAGE(action), false);
+      break;
+    case KEYMAP_KIND_LAYER_TAP:
+    case KEYMAP_KIND_LAYER_TAP_CONSUMER:
+    case KEYMAP_KIND_MOMENTARY:
+      if (layer < keymap->layer_count && keymap->momentary[layer] > 0) keymap->momentary[layer]--;
+      break;
+    default:
+      break;
+  }
+  if (!tap) return;
+
+  // A tap is the whole press and release at once, anything already changed goes out before it
+  if (KEYMAP_ACTION_KIND(action) == KEYMAP_KIND_LAYER_TAP) {
+    keymap_flush(keymap);
+    keymap->tap_usage = KEYMAP_ACTION_USAGE(action);
+    keymap_flush(keymap);
+    keymap->tap_usage = 0;
+  } else {
+    keymap_consumer(keymap, KEYMAP_ACTION_USAGE(action), true);
+    keymap_consumer(keymap, KEYMAP_ACTION_USAGE(action), false);
+  }
+}
+
+void keymap_update(Keymap* keymap, uint16_t status, int64_t now_us) {
+  uint32_t now = (uint32_t)now_us;
+  uint16_t released = keymap->state & ~status;
+  uint16_t pressed = status & ~keymap->state;
+
+  keymap->state = status;
+  // Releases first, so a layer key let go in the same scan as another goes down no longer applies to it
+  FOR_EACH_BIT(key, released) keymap_release(keymap, key, now);
+  // Any other press makes the layer-tap keys held at the time holds rather than taps
+  if (pressed) keymap->tap_pending = 0;
+  FOR_EACH_BIT(key, pressed) keymap_press(keymap, key, now);
+  keymap_flush(keymap);
+}
+
+void keymap_resync(Keymap* keymap) {
+  FOR_EACH_BIT(key, keymap->state) {
+    KeyAction action = keymap->active[key];
+    if (KEYMAP_ACTION_KIND(action) == KEYMAP_KIND_CONSUMER) keymap_consumer(keymap, KEYMAP_ACTION_USAGE(action), true);
+  }
+  keymap->modifiers = 0;
+  memset(keymap->bits, 0, sizeof(keymap->bits));
+  keymap_flush(keymap);
+}
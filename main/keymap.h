@@ -0,0 +1,96 @@
+#ifndef KEYMAP_H__
+#define KEYMAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEYMAP_KEYS 16          // One action per bit of the debounced button status
+#define KEYMAP_MAX_LAYERS 8     // Layers are tracked in a byte wide mask
+#define KEYMAP_USAGE_WORDS 4    // Keyboard usages 0..127 held as a bitmap of 32 bit words, as the NKRO report does
+#define KEYMAP_TAP_TERM_MS 200  // A layer-tap key released sooner, with no other press in between, is a tap
+#define KEYMAP_ENCODER_CW 14    // Virtual keys the matrix never reports, hold the encoder binding of each layer
+#define KEYMAP_ENCODER_CCW 15
+#define KEYMAP_HOST_NEXT 0x80   // Usages of a host action besides a slot number
+#define KEYMAP_HOST_PREV 0x81
+
+// An action is 16 bits: the kind in the top four, a layer in the next four and a HID usage in the low byte.
+// Kind 0 is transparent, so the entries a layer leaves out fall through to the layers below it.
+typedef uint16_t KeyAction;
+
+typedef enum KeyActionKind {
+  KEYMAP_KIND_TRANSPARENT = 0,     // Use the action of the next active layer down
+  KEYMAP_KIND_NONE,                // Does nothing and hides the layers below
+  KEYMAP_KIND_KEY,                 // Keyboard usage, the modifier usages set their bit in the modifier byte
+  KEYMAP_KIND_CONSUMER,            // HID_CONSUMER_* usage, held while the key is
+  KEYMAP_KIND_MOMENTARY,           // Layer on while held
+  KEYMAP_KIND_TOGGLE,              // Layer on or off with each press
+  KEYMAP_KIND_LAYER_TAP,           // Layer on while held, keyboard usage on a tap
+  KEYMAP_KIND_LAYER_TAP_CONSUMER,  // Layer on while held, consumer usage on a tap
+  KEYMAP_KIND_MACRO,               // Plays the macro in slot usage on a press
+  KEYMAP_KIND_HOST,                // Sends the reports to host slot usage, or KEYMAP_HOST_NEXT/PREV, on a press
+} KeyActionKind;
+
+#define KEYMAP_ACTION(kind, layer, usage) ((KeyAction)(((kind) << 12) | (((layer)&0x0F) << 8) | ((usage)&0xFF)))
+#define KEYMAP_ACTION_KIND(action) ((action) >> 12)
+#define KEYMAP_ACTION_LAYER(action) (((action) >> 8) & 0x0F)
+#define KEYMAP_ACTION_USAGE(action) ((action)&0xFF)
+
+#define KEYMAP_TRNS KEYMAP_ACTION(KEYMAP_KIND_TRANSPARENT, 0, 0)
+#define KEYMAP_NO KEYMAP_ACTION(KEYMAP_KIND_NONE, 0, 0)
+#define KEYMAP_KEY(usage) KEYMAP_ACTION(KEYMAP_KIND_KEY, 0, usage)
+#define KEYMAP_CC(usage) KEYMAP_ACTION(KEYMAP_KIND_CONSUMER, 0, usage)
+#define KEYMAP_MO(layer) KEYMAP_ACTION(KEYMAP_KIND_MOMENTARY, layer, 0)
+#define KEYMAP_TG(layer) KEYMAP_ACTION(KEYMAP_KIND_TOGGLE, layer, 0)
+#define KEYMAP_LT(layer, usage) KEYMAP_ACTION(KEYMAP_KIND_LAYER_TAP, layer, usage)
+#define KEYMAP_LT_CC(layer, usage) KEYMAP_ACTION(KEYMAP_KIND_LAYER_TAP_CONSUMER, layer, usage)
+#define KEYMAP_MACRO(slot) KEYMAP_ACTION(KEYMAP_KIND_MACRO, 0, slot)
+#define KEYMAP_HOST(slot) KEYMAP_ACTION(KEYMAP_KIND_HOST, 0, slot)
+
+// Where the resolved actions go, called from keymap_update() on the caller's task
+typedef struct KeymapOutput {
+  void (*keyboard)(uint8_t modifiers, const uint32_t* bits, void* ctx);  // KEYMAP_USAGE_WORDS words
+  void (*consumer)(uint8_t usage, bool pressed, void* ctx);
+  void (*macro)(uint8_t slot, void* ctx);
+  void (*host)(uint8_t slot, void* ctx);  // Slot number, KEYMAP_HOST_NEXT or KEYMAP_HOST_PREV
+  void* ctx;
+} KeymapOutput;
+
+typedef struct Keymap {
+  const KeyAction (*map)[KEYMAP_KEYS];  // [layer][key], keymap_default or the RAM copy of keymap_store
+  uint8_t layer_count;
+  KeymapOutput output;
+  uint16_t state;                        // Button status of the previous update
+  uint16_t tap_pending;                  // Layer-tap keys held with no other press since they went down
+  uint8_t toggled;                       // Layers switched on by a toggle key
+  uint8_t momentary[KEYMAP_MAX_LAYERS];  // Held keys keeping each layer on
+  KeyAction active[KEYMAP_KEYS];         // Action each held key was pressed with, its release undoes that one
+  uint32_t press_us[KEYMAP_KEYS];        // Press time per key
+  uint8_t tap_usage;                     // Keyboard usage of a layer-tap while its tap is reported
+  uint8_t modifiers;                     // Keyboard report last handed out
+  uint32_t bits[KEYMAP_USAGE_WORDS];     // Usage u at bit u % 32 of word u / 32
+} Keymap;
+
+#define KEYMAP_DEFAULT_LAYERS 3
+
+// Layer 0 is the number pad with the encoder switch tapping mute, holding the switch selects layer 1 (media
+// keys and key 7 moving on to the next host) and, from there, key 9 toggles layer 2 (F1..F8)
+extern const KeyAction keymap_default[KEYMAP_DEFAULT_LAYERS][KEYMAP_KEYS];
+
+void keymap_init(Keymap* keymap, const KeyAction (*map)[KEYMAP_KEYS], uint8_t layer_count,
+                 const KeymapOutput* output);
+
+// Apply the debounced button status taken at now_us. Only keys that changed are looked up, the action a key
+// was pressed with is the one its release undoes, whatever the layers did in between.
+void keymap_update(Keymap* keymap, uint16_t status, int64_t now_us);
+
+// Hand the held keys to the output again as if it had seen none of them: a keyboard report if anything is held
+// and a press of each held consumer usage. For an output that dropped the updates while it could not send.
+void keymap_resync(Keymap* keymap);
+
+// Action a key maps to on the active layers right now, e.g. for KEYMAP_ENCODER_CW
+KeyAction keymap_action(const Keymap* keymap, int key);
+
+// Mask of the active layers, bit 0 is always set
+uint8_t keymap_layers(const Keymap* keymap);
+
+#endif /* KEYMAP_H__ */
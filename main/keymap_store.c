@@ -0,0 +1,264 @@
+// Keymap and macro storage in NVS with a RAM cache
+//
+// The keymap, encoder bindings included, and the macros are read from NVS once at boot into RAM, and the scan
+// path only ever reads that copy. Edits change the copy at once and mark the entries they touched, which are
+// written out together KEYMAP_STORE_COMMIT_MS after the first edit of a batch. A host rewriting the whole map
+// key by key therefore costs one NVS write per entry, not one per key. Through a deep sleep the cache is kept in
+// RTC memory, so a wake does not read NVS at all.
+//
+// NVS layout, in namespace KEYMAP_STORE_NAMESPACE:
+//   "version"  u16   KEYMAP_STORE_VERSION, with any other value the rest is ignored
+//   "map"      blob  KeyAction[KEYMAP_STORE_LAYERS][KEYMAP_KEYS] in CPU byte order
+//   "macro<n>" blob  bytes of macro slot n, absent while the slot is empty
+
+#include "keymap_store.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "event_loop.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "nvs.h"
+#include "sleep.h"
+
+#define KEYMAP_STORE_TAG "KEYMAP_STORE"
+
+#define KEYMAP_STORE_DIRTY_MAP (1u << KEYMAP_STORE_MACROS)  // Bits below are the macro slots
+#define KEYMAP_STORE_DIRTY_ALL ((KEYMAP_STORE_DIRTY_MAP << 1) - 1)
+#define KEYMAP_STORE_SET_KEY_LEN 5
+#define KEYMAP_STORE_SET_MACRO_HEADER 4  // Op, slot, offset, count
+
+typedef struct KeymapStoreCommand {
+  uint8_t length;
+  uint8_t data[KEYMAP_STORE_COMMAND_LEN];
+} KeymapStoreCommand;
+
+typedef struct KeymapStoreRetained {
+  uint32_t magic;  // KEYMAP_STORE_RETAIN_MAGIC while the rest is valid
+  uint32_t dirty;
+  KeyAction map[KEYMAP_STORE_LAYERS][KEYMAP_KEYS];
+  uint8_t macros[KEYMAP_STORE_MACROS][KEYMAP_STORE_MACRO_LEN];
+  uint8_t macro_len[KEYMAP_STORE_MACROS];
+} KeymapStoreRetained;
+
+// Owned by the event loop task
+static KeyAction keymap_store_cache[KEYMAP_STORE_LAYERS][KEYMAP_KEYS];
+static uint8_t keymap_store_macros[KEYMAP_STORE_MACROS][KEYMAP_STORE_MACRO_LEN];
+static uint8_t keymap_store_macro_len[KEYMAP_STORE_MACROS];
+static uint32_t keymap_store_dirty = 0;  // Entries changed since the last write, KEYMAP_STORE_DIRTY_*
+
+static esp_timer_handle_t keymap_store_timer = NULL;
+static QueueHandle_t keymap_store_queue = NULL;
+static RTC_DATA_ATTR KeymapStoreRetained keymap_store_retained;
+
+static void keymap_store_defaults(void) {
+  int layers = KEYMAP_DEFAULT_LAYERS < KEYMAP_STORE_LAYERS ? KEYMAP_DEFAULT_LAYERS : KEYMAP_STORE_LAYERS;
+  memset(keymap_store_cache, 0, sizeof(keymap_store_cache));
+  memcpy(keymap_store_cache, keymap_default, layers * sizeof(keymap_default[0]));
+  memset(keymap_store_macro_len, 0, sizeof(keymap_store_macro_len));
+}
+
+static void keymap_store_macro_key(uint8_t slot, char* key, size_t size) {
+  snprintf(key, size, "macro%u", slot);
+}
+
+static void keymap_store_timer_callback(void* arg) {
+  event_loop_signal(APP_EVENT_KEYMAP_STORE);
+}
+
+// The first edit of a batch starts the clock, later ones ride along with it
+static void keymap_store_touch(uint32_t dirty) {
+  keymap_store_dirty |= dirty;
+  if (!esp_timer_is_active(keymap_store_timer)) {
+    esp_timer_start_once(keymap_store_timer, KEYMAP_STORE_COMMIT_MS * 1000);
+  }
+}
+
+esp_err_t keymap_store_init(void) {
+  const esp_timer_create_args_t timer_args = {
+      .callback = keymap_store_timer_callback,
+      .name = "keymap_store",
+  };
+  nvs_handle_t nvs;
+  uint16_t version = 0;
+  size_t length;
+  char key[16];
+  esp_err_t ret;
+
+  keymap_store_defaults();
+  ret = esp_timer_create(&timer_args, &keymap_store_timer);
+  if (ret != ESP_OK) return ret;
+  keymap_store_queue = xQueueCreate(KEYMAP_STORE_QUEUE_LEN, sizeof(KeymapStoreCommand));
+  if (keymap_store_queue == NULL) return ESP_ERR_NO_MEM;
+
+  if (sleep_woke() && keymap_store_retained.magic == KEYMAP_STORE_RETAIN_MAGIC) {
+    memcpy(keymap_store_cache, keymap_store_retained.map, sizeof(keymap_store_cache));
+    memcpy(keymap_store_macros, keymap_store_retained.macros, sizeof(keymap_store_macros));
+    memcpy(keymap_store_macro_len, keymap_store_retained.macro_len, sizeof(keymap_store_macro_len));
+    keymap_store_retained.magic = 0;
+    // Edits that did not reach NVS before the sleep go out with a new batch
+    if (keymap_store_retained.dirty) keymap_store_touch(keymap_store_retained.dirty);
+    ESP_LOGI(KEYMAP_STORE_TAG, "Keymap kept through deep sleep");
+    return ESP_OK;
+  }
+
+  ret = nvs_open(KEYMAP_STORE_NAMESPACE, NVS_READONLY, &nvs);
+  if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    ESP_LOGI(KEYMAP_STORE_TAG, "Nothing stored, using the default keymap");
+    return ESP_OK;
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(KEYMAP_STORE_TAG, "%s open failed: %s", __func__, esp_err_to_name(ret));
+    return ret;
+  }
+
+  if (nvs_get_u16(nvs, "version", &version) != ESP_OK || version != KEYMAP_STORE_VERSION) {
+    ESP_LOGW(KEYMAP_STORE_TAG, "Stored schema %u is not %u, using the default keymap", version,
+             KEYMAP_STORE_VERSION);
+    nvs_close(nvs);
+    return ESP_OK;
+  }
+  length = sizeof(keymap_store_cache);
+  if (nvs_get_blob(nvs, "map", keymap_store_cache, &length) != ESP_OK || length != sizeof(keymap_store_cache)) {
+    ESP_LOGW(KEYMAP_STORE_TAG, "Stored map unreadable, using the default keymap");
+    keymap_store_defaults();
+  }
+  for (uint8_t slot = 0; slot < KEYMAP_STORE_MACROS; slot++) {
+    keymap_store_macro_key(slot, key, sizeof(key));
+    length = KEYMAP_STORE_MACRO_LEN;
+    if (nvs_get_blob(nvs, key, keymap_store_macros[slot], &length) == ESP_OK) keymap_store_macro_len[slot] = length;
+  }
+  nvs_close(nvs);
+  ESP_LOGI(KEYMAP_STORE_TAG, "Keymap loaded");
+  return ESP_OK;
+}
+
+const KeyAction (*keymap_store_map(void))[KEYMAP_KEYS] {
+  return (const KeyAction(*)[KEYMAP_KEYS])keymap_store_cache;
+}
+
+const uint8_t* keymap_store_macro(uint8_t slot, size_t* length) {
+  if (slot >= KEYMAP_STORE_MACROS || keymap_store_macro_len[slot] == 0) return NULL;
+  *length = keymap_store_macro_len[slot];
+  return keymap_store_macros[slot];
+}
+
+static esp_err_t keymap_store_commit(void) {
+  nvs_handle_t nvs;
+  char key[16];
+  esp_err_t ret;
+
+  if (esp_timer_is_active(keymap_store_timer)) esp_timer_stop(keymap_store_timer);
+  if (keymap_store_dirty == 0) return ESP_OK;
+
+  ret = nvs_open(KEYMAP_STORE_NAMESPACE, NVS_READWRITE, &nvs);
+  if (ret != ESP_OK) {
+    ESP_LOGE(KEYMAP_STORE_TAG, "%s open failed: %s", __func__, esp_err_to_name(ret));
+    return ret;
+  }
+  ret = nvs_set_u16(nvs, "version", KEYMAP_STORE_VERSION);
+  if (ret == ESP_OK && (keymap_store_dirty & KEYMAP_STORE_DIRTY_MAP)) {
+    ret = nvs_set_blob(nvs, "map", keymap_store_cache, sizeof(keymap_store_cache));
+  }
+  for (uint8_t slot = 0; slot < KEYMAP_STORE_MACROS && ret == ESP_OK; slot++) {
+    if (!(keymap_store_dirty & (1u << slot))) continue;
+    keymap_store_macro_key(slot, key, sizeof(key));
+    if (keymap_store_macro_len[slot] != 0) {
+      ret = nvs_set_blob(nvs, key, keymap_store_macros[slot], keymap_store_macro_len[slot]);
+    } else {
+      ret = nvs_erase_key(nvs, key);
+      if (ret == ESP_ERR_NVS_NOT_FOUND) ret = ESP_OK;
+    }
+  }
+  if (ret == ESP_OK) ret = nvs_commit(nvs);
+  nvs_close(nvs);
+
+  // Whatever did not make it stays marked and goes out with the next batch
+  if (ret != ESP_OK) {
+    ESP_LOGE(KEYMAP_STORE_TAG, "%s write failed: %s", __func__, esp_err_to_name(ret));
+    return ret;
+  }
+  ESP_LOGI(KEYMAP_STORE_TAG, "Keymap written, dirty 0x%03x", keymap_store_dirty);
+  keymap_store_dirty = 0;
+  return ESP_OK;
+}
+
+esp_err_t keymap_store_apply(const uint8_t* command, size_t length) {
+  if (length == 0) return ESP_ERR_INVALID_SIZE;
+
+  switch (command[0]) {
+    case KEYMAP_STORE_SET_KEY: {
+      if (length < KEYMAP_STORE_SET_KEY_LEN) return ESP_ERR_INVALID_SIZE;
+      uint8_t layer = command[1];
+      uint8_t key = command[2];
+      KeyAction action = command[3] | (command[4] << 8);
+      if (layer >= KEYMAP_STORE_LAYERS || key >= KEYMAP_KEYS) return ESP_ERR_INVALID_ARG;
+      if (keymap_store_cache[layer][key] == action) return ESP_OK;
+      keymap_store_cache[layer][key] = action;
+      keymap_store_touch(KEYMAP_STORE_DIRTY_MAP);
+      return ESP_OK;
+    }
+    case KEYMAP_STORE_SET_MACRO: {
+      if (length < KEYMAP_STORE_SET_MACRO_HEADER) return ESP_ERR_INVALID_SIZE;
+      uint8_t slot = command[1];
+      uint8_t offset = command[2];
+      uint8_t count = command[3];
+      // Chunks go in order, a gap would leave stale bytes inside the macro
+      if (slot >= KEYMAP_STORE_MACROS || offset > keymap_store_macro_len[slot] ||
+          offset + count > KEYMAP_STORE_MACRO_LEN) {
+        return ESP_ERR_INVALID_ARG;
+      }
+      if (length < KEYMAP_STORE_SET_MACRO_HEADER + count) return ESP_ERR_INVALID_SIZE;
+      memcpy(keymap_store_macros[slot] + offset, command + KEYMAP_STORE_SET_MACRO_HEADER, count);
+      keymap_store_macro_len[slot] = offset + count;
+      keymap_store_touch(1u << slot);
+      return ESP_OK;
+    }
+    case KEYMAP_STORE_RESET:
+      keymap_store_defaults();
+      keymap_store_touch(KEYMAP_STORE_DIRTY_ALL);
+      return ESP_OK;
+    case KEYMAP_STORE_COMMIT:
+      return keymap_store_commit();
+    default:
+      return ESP_ERR_NOT_SUPPORTED;
+  }
+}
+
+bool keymap_store_submit(const uint8_t* command, size_t length) {
+  KeymapStoreCommand item;
+  if (keymap_store_queue == NULL || length == 0 || length > KEYMAP_STORE_COMMAND_LEN) return false;
+
+  item.length = length;
+  memcpy(item.data, command, length);
+  if (xQueueSend(keymap_store_queue, &item, 0) != pdTRUE) return false;
+  event_loop_signal(APP_EVENT_KEYMAP_STORE);
+  return true;
+}
+
+void keymap_store_process(void) {
+  KeymapStoreCommand item;
+  esp_err_t ret;
+
+  while (xQueueReceive(keymap_store_queue, &item, 0) == pdTRUE) {
+    ret = keymap_store_apply(item.data, item.length);
+    if (ret != ESP_OK) {
+      ESP_LOGW(KEYMAP_STORE_TAG, "Command 0x%02x rejected: %s", item.data[0], esp_err_to_name(ret));
+    }
+  }
+  // The batch timer has run out
+  if (keymap_store_dirty != 0 && !esp_timer_is_active(keymap_store_timer)) keymap_store_commit();
+}
+
+void keymap_store_retain(void) {
+  keymap_store_commit();
+  memcpy(keymap_store_retained.map, keymap_store_cache, sizeof(keymap_store_cache));
+  memcpy(keymap_store_retained.macros, keymap_store_macros, sizeof(keymap_store_macros));
+  memcpy(keymap_store_retained.macro_len, keymap_store_macro_len, sizeof(keymap_store_macro_len));
+  keymap_store_retained.dirty = keymap_store_dirty;
+  keymap_store_retained.magic = KEYMAP_STORE_RETAIN_MAGIC;
+}
@@ -0,0 +1,55 @@
+#ifndef KEYMAP_STORE_H__
+#define KEYMAP_STORE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "keymap.h"
+
+#define KEYMAP_STORE_NAMESPACE "keymap"
+#define KEYMAP_STORE_VERSION 1       // Bump when the layout of a stored entry changes, older entries are ignored
+#define KEYMAP_STORE_LAYERS 4        // Layers held in the RAM cache
+#define KEYMAP_STORE_MACROS 8        // Macro slots
+#define KEYMAP_STORE_MACRO_LEN 64    // Bytes per macro
+#define KEYMAP_STORE_COMMIT_MS 5000  // Edits are written out this long after the first edit of a batch
+#define KEYMAP_STORE_COMMAND_LEN 32  // Largest command, one vendor output report
+#define KEYMAP_STORE_QUEUE_LEN 8     // Commands from the BLE stack waiting for the event loop
+#define KEYMAP_STORE_RETAIN_MAGIC 0x4B4D5254  // "KMRT", the RTC copy holds a cache
+
+// Commands, the same bytes arrive in a vendor output report or a KEYMAP_CMD inter-MCU record
+typedef enum KeymapStoreOp {
+  KEYMAP_STORE_SET_KEY = 0x01,    // layer, key, action (uint16 LE). Keys KEYMAP_ENCODER_CW/CCW bind the encoder
+  KEYMAP_STORE_SET_MACRO = 0x02,  // slot, offset, count, bytes of MacroOp code. The macro ends after the last
+                                  // byte written, offset 0 starts it over. Padding past count is ignored
+  KEYMAP_STORE_RESET = 0x03,      // Back to keymap_default with no macros
+  KEYMAP_STORE_COMMIT = 0x04,     // Write pending edits now
+} KeymapStoreOp;
+
+// Load the keymap and macros from NVS into the RAM cache, or the defaults if nothing valid is stored. A wake from
+// deep sleep takes the copy keymap_store_retain() left in RTC memory instead and reads nothing. Call once NVS is
+// initialised and before anything reads the cache.
+esp_err_t keymap_store_init(void);
+
+// Write the pending edits and copy the cache to RTC memory, right before a deep sleep. Edits that could not be
+// written stay pending in the copy.
+void keymap_store_retain(void);
+
+// Keymap table in RAM, for keymap_init() with KEYMAP_STORE_LAYERS layers. Edits change it in place.
+const KeyAction (*keymap_store_map(void))[KEYMAP_KEYS];
+
+// Macro bytes in RAM, NULL for an empty slot
+const uint8_t* keymap_store_macro(uint8_t slot, size_t* length);
+
+// Apply a command on the task that owns the cache, see KeymapStoreOp
+esp_err_t keymap_store_apply(const uint8_t* command, size_t length);
+
+// Copy a command for the owning task, from any other task. It is applied by keymap_store_process() after an
+// APP_EVENT_KEYMAP_STORE. False if the queue is full or the command too long.
+bool keymap_store_submit(const uint8_t* command, size_t length);
+
+// Apply the submitted commands and write out the pending edits once their batch is due, on the owning task
+void keymap_store_process(void);
+
+#endif /* KEYMAP_STORE_H__ */
@@ -0,0 +1,140 @@
+// Scan-to-notify latency histograms
+//
+// A LatencyTrace travels with each keyboard report from the row interrupt to the GATT send and is folded
+// into one fixed size log-linear histogram per stage once the report is on air. Recording is a handful of
+// integer operations under a spinlock, percentiles are only worked out when somebody asks for them.
+
+#include "latency.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#define LATENCY_TAG "LATENCY"
+#define LATENCY_LINEAR_BUCKETS 8  // Values below this get a bucket each
+
+typedef struct LatencyHistogram {
+  uint32_t count;
+  uint32_t max_us;
+  uint32_t buckets[LATENCY_HIST_BUCKETS];
+} LatencyHistogram;
+
+static const char* const latency_stage_names[LATENCY_STAGE_MAX] = {
+    [LATENCY_STAGE_EDGE] = "edge",       [LATENCY_STAGE_SCAN] = "scan",       [LATENCY_STAGE_DEBOUNCE] = "debounce",
+    [LATENCY_STAGE_BUILD] = "build",     [LATENCY_STAGE_ENQUEUE] = "enqueue", [LATENCY_STAGE_SEND] = "send",
+    [LATENCY_STAGE_TOTAL] = "total",
+};
+
+static LatencyHistogram latency_hist[LATENCY_STAGE_MAX];
+static portMUX_TYPE latency_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Below LATENCY_LINEAR_BUCKETS one bucket per us, above that four buckets per power of two
+static uint32_t latency_bucket(uint32_t us) {
+  if (us < LATENCY_LINEAR_BUCKETS) return us;
+
+  uint32_t msb = 31 - __builtin_clz(us);
+  uint32_t bucket = LATENCY_LINEAR_BUCKETS + (msb - 3) * 4 + ((us >> (msb - 2)) & 3);
+  return bucket < LATENCY_HIST_BUCKETS ? bucket : LATENCY_HIST_BUCKETS - 1;
+}
+
+// Largest value that lands in the bucket
+static uint32_t latency_bucket_upper(uint32_t bucket) {
+  if (bucket < LATENCY_LINEAR_BUCKETS) return bucket;
+
+  uint32_t msb = 3 + (bucket - LATENCY_LINEAR_BUCKETS) / 4;
+  uint32_t sub = (bucket - LATENCY_LINEAR_BUCKETS) % 4;
+  return (1u << msb) + ((sub + 1) << (msb - 2)) - 1;
+}
+
+static void latency_hist_add(LatencyHistogram* hist, uint32_t us) {
+  hist->count++;
+  hist->buckets[latency_bucket(us)]++;
+  if (us > hist->max_us) hist->max_us = us;
+}
+
+void latency_record(const LatencyTrace* trace) {
+  if (trace->mask == 0) return;
+
+  uint32_t first = trace->stamp[__builtin_ctz(trace->mask)];
+  uint32_t prev = first;
+
+  portENTER_CRITICAL(&latency_lock);
+  for (uint8_t mask = trace->mask & (trace->mask - 1); mask; mask &= mask - 1) {
+    int stage = __builtin_ctz(mask);
+    latency_hist_add(&latency_hist[stage], trace->stamp[stage] - prev);
+    prev = trace->stamp[stage];
+  }
+  if (trace->mask & (1 << LATENCY_STAGE_SEND)) {
+    latency_hist_add(&latency_hist[LATENCY_STAGE_TOTAL], trace->stamp[LATENCY_STAGE_SEND] - first);
+  }
+  portEXIT_CRITICAL(&latency_lock);
+}
+
+static uint32_t latency_percentile(const LatencyHistogram* hist, uint32_t permille) {
+  // Rank of the sample that sits at the percentile, rounded up so p99 of a few samples is the largest one
+  uint32_t rank = (uint32_t)(((uint64_t)hist->count * permille + 999) / 1000);
+  uint32_t seen = 0;
+
+  for (uint32_t bucket = 0; bucket < LATENCY_HIST_BUCKETS; bucket++) {
+    seen += hist->buckets[bucket];
+    if (seen >= rank) {
+      uint32_t upper = latency_bucket_upper(bucket);
+      return upper < hist->max_us ? upper : hist->max_us;
+    }
+  }
+  return hist->max_us;
+}
+
+void latency_get_stats(LatencyStage stage, LatencyStats* stats) {
+  memset(stats, 0, sizeof(LatencyStats));
+  if (stage >= LATENCY_STAGE_MAX) return;
+
+  portENTER_CRITICAL(&latency_lock);
+  const LatencyHistogram* hist = &latency_hist[stage];
+  stats->count = hist->count;
+  stats->max_us = hist->max_us;
+  if (hist->count) {
+    stats->p50_us = latency_percentile(hist, 500);
+    stats->p99_us = latency_percentile(hist, 990);
+  }
+  portEXIT_CRITICAL(&latency_lock);
+}
+
+void latency_reset(void) {
+  portENTER_CRITICAL(&latency_lock);
+  memset(latency_hist, 0, sizeof(latency_hist));
+  portEXIT_CRITICAL(&latency_lock);
+}
+
+static uint8_t* latency_put_u32(uint8_t* buffer, uint32_t value) {
+  buffer[0] = value & 0xFF;
+  buffer[1] = (value >> 8) & 0xFF;
+  buffer[2] = (value >> 16) & 0xFF;
+  buffer[3] = (value >> 24) & 0xFF;
+  return buffer + 4;
+}
+
+size_t latency_serialize(uint8_t* buffer, size_t length) {
+  if (length < LATENCY_SERIALIZED_LEN) return 0;
+
+  uint8_t* out = buffer;
+  for (int stage = 0; stage < LATENCY_STAGE_MAX; stage++) {
+    LatencyStats stats;
+    latency_get_stats(stage, &stats);
+    out = latency_put_u32(out, stats.count);
+    out = latency_put_u32(out, stats.p50_us);
+    out = latency_put_u32(out, stats.p99_us);
+    out = latency_put_u32(out, stats.max_us);
+  }
+  return out - buffer;
+}
+
+void latency_log(void) {
+  for (int stage = LATENCY_STAGE_SCAN; stage < LATENCY_STAGE_MAX; stage++) {
+    LatencyStats stats;
+    latency_get_stats(stage, &stats);
+    ESP_LOGI(LATENCY_TAG, "%-8s n=%u p50=%uus p99=%uus max=%uus", latency_stage_names[stage], stats.count,
+             stats.p50_us, stats.p99_us, stats.max_us);
+  }
+}
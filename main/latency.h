@@ -0,0 +1,67 @@
+#ifndef LATENCY_H__
+#define LATENCY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_timer.h"
+
+#define LATENCY_TRACE_ENABLED 1  // Set to 0 to compile every stamp out of the report path
+#define LATENCY_HIST_BUCKETS 64  // Log-linear buckets per histogram, 4 per power of two, ~131 ms before clamping
+
+typedef enum LatencyStage {
+  LATENCY_STAGE_EDGE = 0,   // Row interrupt that woke the scanner, absent when the press was found by a timer scan
+  LATENCY_STAGE_SCAN,       // Matrix scan that saw the new button status
+  LATENCY_STAGE_DEBOUNCE,   // Debouncer accepted the change
+  LATENCY_STAGE_BUILD,      // Input report built in hid_send_keyboard_value
+  LATENCY_STAGE_ENQUEUE,    // Report copied into the producer ring
+  LATENCY_STAGE_SEND,       // esp_ble_gatts_send_indicate accepted the report
+  LATENCY_STAGE_TOTAL,      // Histogram only, first stamp to LATENCY_STAGE_SEND
+  LATENCY_STAGE_MAX,
+} LatencyStage;
+
+typedef struct LatencyTrace {
+  uint32_t stamp[LATENCY_STAGE_TOTAL];  // esp_timer_get_time() truncated to 32 bits, wrapping arithmetic
+  uint8_t mask;                         // Stages stamped so far
+} LatencyTrace;
+
+typedef struct LatencyStats {
+  uint32_t count;
+  uint32_t p50_us;  // Upper edge of the bucket holding the median
+  uint32_t p99_us;  // Upper edge of the bucket holding the 99th percentile
+  uint32_t max_us;  // Exact
+} LatencyStats;
+
+#define LATENCY_SERIALIZED_LEN (LATENCY_STAGE_MAX * sizeof(LatencyStats))
+
+static inline void latency_trace_reset(LatencyTrace* trace) { trace->mask = 0; }
+
+static inline void latency_stamp_at(LatencyTrace* trace, LatencyStage stage, uint32_t now_us) {
+#if LATENCY_TRACE_ENABLED
+  trace->stamp[stage] = now_us;
+  trace->mask |= (1 << stage);
+#endif
+}
+
+static inline void latency_stamp(LatencyTrace* trace, LatencyStage stage) {
+#if LATENCY_TRACE_ENABLED
+  latency_stamp_at(trace, stage, (uint32_t)esp_timer_get_time());
+#endif
+}
+
+// Fold a finished trace into the histograms. Every stamped stage is charged the time since the previous
+// stamped stage, LATENCY_STAGE_TOTAL the time since the first one.
+void latency_record(const LatencyTrace* trace);
+
+void latency_get_stats(LatencyStage stage, LatencyStats* stats);
+
+void latency_reset(void);
+
+// Write LatencyStats for every stage in stage order, little endian, returns the bytes written
+size_t latency_serialize(uint8_t* buffer, size_t length);
+
+// Print p50/p99/max per stage to the console
+void latency_log(void);
+
+#endif /* LATENCY_H__ */
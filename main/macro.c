@@ -0,0 +1,245 @@
+// Macro playback
+//
+// A macro is a short bytecode program (see MacroOp) played one report at a time: the caller asks for the next
+// report whenever the link can take one, so a macro never blocks anything and goes exactly as fast as reports
+// are drained. Text is typed with rollover, each character goes down in the report that lets go of the one
+// before it, which halves the reports per character. Only a repeated key needs a release in between.
+
+#include "macro.h"
+
+#include <string.h>
+
+#include "hid_keydefinition.h"
+
+#define MACRO_SHIFTED(usage) ((usage) | MACRO_CHAR_SHIFT)
+#define MACRO_IS_MODIFIER(usage) ((usage) >= HID_KEY_LEFT_CTRL && (usage) <= HID_KEY_RIGHT_GUI)
+
+// Everything printable that is not a letter or a digit 1..9, US layout
+static const uint8_t macro_ascii[128] = {
+    ['\b'] = HID_KEY_DELETE,
+    ['\t'] = HID_KEY_TAB,
+    ['\n'] = HID_KEY_RETURN,
+    [' '] = HID_KEY_SPACEBAR,
+    ['!'] = MACRO_SHIFTED(HID_KEY_1),
+    ['"'] = MACRO_SHIFTED(HID_KEY_SGL_QUOTE),
+    ['#'] = MACRO_SHIFTED(HID_KEY_3),
+    ['$'] = MACRO_SHIFTED(HID_KEY_4),
+    ['%'] = MACRO_SHIFTED(HID_KEY_5),
+    ['&'] = MACRO_SHIFTED(HID_KEY_7),
+    ['\''] = HID_KEY_SGL_QUOTE,
+    ['('] = MACRO_SHIFTED(HID_KEY_9),
+    [')'] = MACRO_SHIFTED(HID_KEY_0),
+    ['*'] = MACRO_SHIFTED(HID_KEY_8),
+    ['+'] = MACRO_SHIFTED(HID_KEY_EQUAL),
+    [','] = HID_KEY_COMMA,
+    ['-'] = HID_KEY_MINUS,
+    ['.'] = HID_KEY_DOT,
+    ['/'] = HID_KEY_FWD_SLASH,
+    ['0'] = HID_KEY_0,
+    [':'] = MACRO_SHIFTED(HID_KEY_SEMI_COLON),
+    [';'] = HID_KEY_SEMI_COLON,
+    ['<'] = MACRO_SHIFTED(HID_KEY_COMMA),
+    ['='] = HID_KEY_EQUAL,
+    ['>'] = MACRO_SHIFTED(HID_KEY_DOT),
+    ['?'] = MACRO_SHIFTED(HID_KEY_FWD_SLASH),
+    ['@'] = MACRO_SHIFTED(HID_KEY_2),
+    ['['] = HID_KEY_LEFT_BRKT,
+    ['\\'] = HID_KEY_BACK_SLASH,
+    [']'] = HID_KEY_RIGHT_BRKT,
+    ['^'] = MACRO_SHIFTED(HID_KEY_6),
+    ['_'] = MACRO_SHIFTED(HID_KEY_MINUS),
+    ['`'] = HID_KEY_GRV_ACCENT,
+    ['{'] = MACRO_SHIFTED(HID_KEY_LEFT_BRKT),
+    ['|'] = MACRO_SHIFTED(HID_KEY_BACK_SLASH),
+    ['}'] = MACRO_SHIFTED(HID_KEY_RIGHT_BRKT),
+    ['~'] = MACRO_SHIFTED(HID_KEY_GRV_ACCENT),
+};
+
+uint8_t macro_char(char c) {
+  if (c >= 'a' && c <= 'z') return HID_KEY_A + (c - 'a');
+  if (c >= 'A' && c <= 'Z') return MACRO_SHIFTED(HID_KEY_A + (c - 'A'));
+  if (c >= '1' && c <= '9') return HID_KEY_1 + (c - '1');
+  if ((unsigned char)c >= sizeof(macro_ascii)) return 0;
+  return macro_ascii[(unsigned char)c];
+}
+
+void macro_init(Macro* macro) {
+  memset(macro, 0, sizeof(Macro));
+}
+
+static uint8_t macro_modifier_bit(uint8_t usage) {
+  return MACRO_IS_MODIFIER(usage) ? 1 << (usage - HID_KEY_LEFT_CTRL) : 0;
+}
+
+static void macro_keyboard(Macro* macro) {
+  MacroReport* report = &macro->report;
+  memset(report, 0, sizeof(MacroReport));
+  report->modifiers = macro->modifiers | (macro->tap_down ? macro->tap_modifiers : 0);
+  memcpy(report->keys, macro->keys, macro->key_count);
+  report->key_count = macro->key_count;
+  if (macro->tap_down && macro->tap != 0 && report->key_count < MACRO_REPORT_KEYS) {
+    report->keys[report->key_count++] = macro->tap;
+  }
+  macro->ready = true;
+}
+
+static void macro_consumer(Macro* macro, uint8_t usage) {
+  memset(&macro->report, 0, sizeof(MacroReport));
+  macro->report.consumer = true;
+  macro->report.usage = usage;
+  macro->consumer = usage;
+  macro->ready = true;
+}
+
+static void macro_tap(Macro* macro, uint8_t usage, uint8_t modifiers) {
+  macro->tap_down = true;
+  macro->tap = MACRO_IS_MODIFIER(usage) ? 0 : usage;
+  macro->tap_modifiers = modifiers | macro_modifier_bit(usage);
+}
+
+static void macro_press(Macro* macro, uint8_t usage) {
+  if (MACRO_IS_MODIFIER(usage)) {
+    macro->modifiers |= macro_modifier_bit(usage);
+  } else if (memchr(macro->keys, usage, macro->key_count) == NULL && macro->key_count < MACRO_REPORT_KEYS) {
+    macro->keys[macro->key_count++] = usage;
+  }
+}
+
+static void macro_release(Macro* macro, uint8_t usage) {
+  uint8_t* key = memchr(macro->keys, usage, macro->key_count);
+  macro->modifiers &= ~macro_modifier_bit(usage);
+  if (key == NULL) return;
+  memmove(key, key + 1, macro->keys + macro->key_count - key - 1);
+  macro->key_count--;
+}
+
+void macro_start(Macro* macro, const uint8_t* code, size_t length) {
+  bool keyboard_down =
+      macro->tap_down || macro->key_count || macro->modifiers || (macro->ready && !macro->report.consumer);
+  uint8_t consumer = macro->consumer;
+
+  macro_init(macro);
+  macro->code = code;
+  macro->length = length;
+  // Whatever the previous macro held goes up before this one starts
+  macro->consumer = consumer;
+  if (keyboard_down) macro_keyboard(macro);
+}
+
+// Operand bytes following each opcode, a macro cut short in the middle of one ends there
+static size_t macro_operands(uint8_t op) {
+  switch (op) {
+    case MACRO_OP_PRESS:
+    case MACRO_OP_RELEASE:
+    case MACRO_OP_TAP:
+    case MACRO_OP_TEXT:
+    case MACRO_OP_CONSUMER:
+      return 1;
+    case MACRO_OP_DELAY:
+      return 2;
+    default:
+      return SIZE_MAX;
+  }
+}
+
+bool macro_next(Macro* macro, int64_t now_us, MacroReport* report) {
+  if (!macro->ready && now_us < macro->resume_us) return false;
+
+  while (!macro->ready) {
+    if (macro->text_left > 0) {
+      uint8_t typed = macro_char(macro->code[macro->pc]);
+      uint8_t usage = typed & ~MACRO_CHAR_SHIFT;
+      if (typed == 0) {
+        macro->pc++;
+        macro->text_left--;
+        continue;
+      }
+      // The same key again needs a release in between, any other goes down as the previous one goes up
+      if (macro->tap_down && macro->tap == usage) {
+        macro->tap_down = false;
+        macro_keyboard(macro);
+        break;
+      }
+      macro->pc++;
+      macro->text_left--;
+      macro_tap(macro, usage, (typed & MACRO_CHAR_SHIFT) ? macro_modifier_bit(HID_KEY_LEFT_SHIFT) : 0);
+      macro_keyboard(macro);
+      break;
+    }
+    if (macro->tap_down) {
+      macro->tap_down = false;
+      macro_keyboard(macro);
+      break;
+    }
+    if (macro->consumer != 0) {
+      macro_consumer(macro, 0);
+      break;
+    }
+    if (macro->pc >= macro->length) {
+      if (macro->key_count == 0 && macro->modifiers == 0) return false;
+      macro->key_count = 0;
+      macro->modifiers = 0;
+      macro_keyboard(macro);
+      break;
+    }
+
+    uint8_t op = macro->code[macro->pc++];
+    if (macro_operands(op) > macro->length - macro->pc) {
+      macro->pc = macro->length;
+      continue;
+    }
+    const uint8_t* operand = &macro->code[macro->pc];
+    macro->pc += macro_operands(op);
+    switch (op) {
+      case MACRO_OP_PRESS:
+        macro_press(macro, operand[0]);
+        macro_keyboard(macro);
+        break;
+      case MACRO_OP_RELEASE:
+        macro_release(macro, operand[0]);
+        macro_keyboard(macro);
+        break;
+      case MACRO_OP_TAP:
+        macro_tap(macro, operand[0], 0);
+        macro_keyboard(macro);
+        break;
+      case MACRO_OP_DELAY:
+        macro->resume_us = now_us + (int64_t)(operand[0] | (operand[1] << 8)) * 1000;
+        if (macro->resume_us > now_us) return false;
+        break;
+      case MACRO_OP_TEXT:
+        macro->text_left = operand[0] < macro->length - macro->pc ? operand[0] : macro->length - macro->pc;
+        break;
+      case MACRO_OP_CONSUMER:
+        macro_consumer(macro, operand[0]);
+        break;
+    }
+  }
+  *report = macro->report;
+  return true;
+}
+
+void macro_report_sent(Macro* macro) {
+  macro->ready = false;
+}
+
+void macro_cancel(Macro* macro) {
+  macro->pc = macro->length;
+  macro->text_left = 0;
+  macro->resume_us = 0;
+}
+
+bool macro_running(const Macro* macro) {
+  return macro->ready || macro->pc < macro->length || macro->text_left > 0 || macro->tap_down ||
+         macro->consumer != 0 || macro->key_count != 0 || macro->modifiers != 0;
+}
+
+bool macro_report_supersedes(const MacroReport* older, const MacroReport* newer) {
+  if (older->consumer != newer->consumer) return false;
+  if (older->consumer) return older->usage == newer->usage;
+  if (older->modifiers & ~newer->modifiers) return false;
+  for (int i = 0; i < older->key_count; i++) {
+    if (memchr(newer->keys, older->keys[i], newer->key_count) == NULL) return false;
+  }
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef MACRO_H__
+#define MACRO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MACRO_REPORT_KEYS 6    // Keys one keyboard report carries
+#define MACRO_CHAR_SHIFT 0x80  // Set by macro_char() for characters typed with shift held
+
+// Bytecode, an opcode byte followed by its operands. A macro ends after its last byte and lets go of whatever
+// it still holds.
+typedef enum MacroOp {
+  MACRO_OP_PRESS = 0x01,     // usage. Keyboard usage held until released, the modifier usages included
+  MACRO_OP_RELEASE = 0x02,   // usage
+  MACRO_OP_TAP = 0x03,       // usage. Press and release
+  MACRO_OP_DELAY = 0x04,     // ms (uint16 LE). Pause before the next op
+  MACRO_OP_TEXT = 0x05,      // length, then that many ASCII characters typed on a US layout
+  MACRO_OP_CONSUMER = 0x06,  // usage. Tap of a HID_CONSUMER_* usage
+} MacroOp;
+
+typedef struct MacroReport {
+  bool consumer;  // Consumer report carrying usage, a keyboard report otherwise
+  uint8_t usage;  // 0 releases the consumer control
+  uint8_t modifiers;
+  uint8_t keys[MACRO_REPORT_KEYS];
+  uint8_t key_count;
+} MacroReport;
+
+typedef struct Macro {
+  const uint8_t* code;
+  size_t length;
+  size_t pc;                        // Next opcode, or next character while text_left is non-zero
+  size_t text_left;                 // Characters of the current MACRO_OP_TEXT still to type
+  int64_t resume_us;                // End of the current delay
+  uint8_t modifiers;                // Held by MACRO_OP_PRESS
+  uint8_t keys[MACRO_REPORT_KEYS];  // Held by MACRO_OP_PRESS
+  uint8_t key_count;
+  bool tap_down;                    // A tap or character is down, released by the next report
+  uint8_t tap;                      // Its usage, 0 for a modifier
+  uint8_t tap_modifiers;
+  uint8_t consumer;                 // Consumer usage down
+  MacroReport report;               // From macro_next(), until macro_report_sent()
+  bool ready;
+} Macro;
+
+void macro_init(Macro* macro);
+
+// Play code instead of whatever was playing, anything the previous macro held is released first. The code is
+// read as it plays and has to stay in place until the macro ends.
+void macro_start(Macro* macro, const uint8_t* code, size_t length);
+
+// Next report of the macro, false while it waits out a delay (until resume_us) or once it has ended. The same
+// report comes back until macro_report_sent() accounts for it.
+bool macro_next(Macro* macro, int64_t now_us, MacroReport* report);
+
+// Account for a report from macro_next() that made it into the report queue
+void macro_report_sent(Macro* macro);
+
+// Skip the rest of the macro, what it holds is still released by the reports that follow
+void macro_cancel(Macro* macro);
+
+// True until the last report of the macro has been sent
+bool macro_running(const Macro* macro);
+
+// True if the report queue would fold older into newer when both wait in it at once, so newer has to go out in
+// a later connection event for older to reach the host, e.g. a release followed by the same key again
+bool macro_report_supersedes(const MacroReport* older, const MacroReport* newer);
+
+// Keyboard usage that types an ASCII character, with MACRO_CHAR_SHIFT set when it takes shift, 0 for none
+uint8_t macro_char(char c);
+
+#endif /* MACRO_H__ */
@@ -10,283 +10,521 @@ void app_main(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
+  boot_mark(BOOT_NVS);
 
+  ESP_ERROR_CHECK(conn_params_init());  // Activity driven connection interval switching
+  ESP_ERROR_CHECK(reconnect_init());    // Directed, then white list, then open advertising after a disconnect
+  // A wake from deep sleep goes after the host the reports went to before it, ahead of any other bonded host
+  resuming = sleep_woke() && resume.magic == RESUME_MAGIC;
+  if (resuming && resume.host_slots.slot[resume.host_slots.active].known) {
+    reconnect_prefer(resume.host_slots.slot[resume.host_slots.active].bda);
+  }
+  // The controller, Bluedroid and the GATT tables come up on a task of their own, mostly waiting on the stack's
+  // tasks, while this one sets up everything else
+  xTaskCreate(bt_start_task, "bt_start", BT_START_STACK, NULL, BT_START_PRIORITY, NULL);
+
+  ESP_ERROR_CHECK(keymap_store_init());  // Keymap and macros into RAM, nothing reads NVS after this
+  boot_mark(BOOT_KEYMAP);
   hardwareInit();  // Sets hardware GPIO
-  initUart();      // Configure UART task
-
-  initBT();   // Sets BT controller
-  initHID();  // Register HID + GAP protocol callbacks
-  xTaskCreate(&uart_event_task, "uart_event_task", 2048, NULL, 12, NULL);
-  xTaskCreate(&keyboard_task, "keyboard_task", 2048, NULL, 5, NULL);
-  xTaskCreate(&encoder_task, "encoder_task", 2048, NULL, 5, NULL);
-  xTaskCreate(&battery_task, "battery_task", 2048, NULL, 5, NULL);
-  xTaskCreate(&kbmode_task, "kbmode_task", 2048, NULL, 6, NULL);
-}
-
-void encoder_task(void* pvParamaters) {
-  int8_t vol_mode = VOL_NONE;
-  uint8_t counter_difference = 0;
-  uint16_t current_counter;
-  while (1) {
-    if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
-      txInterMcu(ROT_SW_UPDATE, gpio_get_level(PIN_ROT_SW));
-    }
-    current_counter = encoder->get_counter_value(encoder);
-    // ESP_LOGI(TAG, "Encoder value: %d", current_counter);
-    if (current_counter == last_counter) {
-      last_counter = current_counter;
-      counter_difference = 0;
-      if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
-        txInterMcu(ROT_POS_POSITIVE, counter_difference);
-      }
-      if (vol_mode != VOL_NONE) {
-        if (vol_mode == VOL_UP) {
-          // release volup
-          if (sec_conn && (current_kb_mode == KB_BT))
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_UP, false);
-        } else {
-          // release voldown
-          if (sec_conn && (current_kb_mode == KB_BT))
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_DOWN, false);
-        }
-        vol_mode = VOL_NONE;
-      }
-    } else if (current_counter > last_counter) {
-      counter_difference = current_counter - last_counter;
-      last_counter = current_counter;
-      if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
-        txInterMcu(ROT_POS_POSITIVE, counter_difference);
-      }
-      // increase volume
-      if (vol_mode != VOL_UP) {
-        if (vol_mode == VOL_NONE) {
-          // press volup
-          if (sec_conn && (current_kb_mode == KB_BT))
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_UP, true);
-        } else {
-          if (sec_conn && (current_kb_mode == KB_BT)) {
-            // release voldown
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_DOWN, false);
-            // press volup
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_UP, true);
-          }
-        }
-        vol_mode = VOL_UP;
-      }
-    } else {
-      counter_difference = last_counter - current_counter;
-      last_counter = current_counter;
-      if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
-        txInterMcu(ROT_POS_NEGATIVE, counter_difference);
-      }
-      // decrease volume
-      if (vol_mode != VOL_DOWN) {
-        if (vol_mode == VOL_NONE) {
-          if (sec_conn && (current_kb_mode == KB_BT))
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_DOWN, true);
-        } else {
-          if (sec_conn && (current_kb_mode == KB_BT)) {
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_UP, false);
-            hid_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_DOWN, true);
-          }
-        }
-        vol_mode = VOL_DOWN;
-      }
-    }
-    if (counter_difference < 10) {
-      counter_difference = 10;
-    }
+  boot_mark(BOOT_HARDWARE);
+  initUart();  // Configure UART driver, its events go to the event loop
+  boot_mark(BOOT_UART);
+
+  // Everything below the drivers runs on the event loop task. Advertising waits for it, so no connection event
+  // is lost.
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_MATRIX, keyboard_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_ENCODER, encoder_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_BATTERY, battery_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_POWER, power_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_BLE_CONNECT, ble_connect_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_BLE_SECURE, ble_secure_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_BLE_DISCONNECT, ble_disconnect_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_KEYMAP_STORE, keymap_store_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_MACRO, macro_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_SLEEP, sleep_handler));
+  ESP_ERROR_CHECK(event_loop_register(APP_EVENT_HEARTBEAT, heartbeat_handler));
+  ESP_ERROR_CHECK(event_loop_start(event_loop_init));
+  ESP_ERROR_CHECK(report_queue_init());  // BLE sender task, sole caller of esp_ble_gatts_send_indicate
+  if (boot_ready(BOOT_APP)) reconnect_start();
+}
+
+// First thing on the event loop task, before any handler
+void event_loop_init(void) {
+  const EncoderAccelCurve curve = ENCODER_ACCEL_CURVE;
+  const esp_timer_create_args_t encoder_timer_args = {
+      .callback = encoder_retry_callback,
+      .name = "encoder_retry",
+  };
+  const esp_timer_create_args_t battery_timer_args = {
+      .callback = battery_timer_callback,
+      .name = "battery_sample",
+  };
+  const esp_timer_create_args_t macro_timer_args = {
+      .callback = macro_timer_callback,
+      .name = "macro",
+  };
+  const esp_timer_create_args_t heartbeat_timer_args = {
+      .callback = heartbeat_timer_callback,
+      .name = "imcu_heartbeat",
+  };
+  const KeymapOutput keymap_output = {
+      .keyboard = keymap_keyboard_output,
+      .consumer = keymap_consumer_output,
+      .macro = keymap_macro_output,
+      .host = keymap_host_output,
+  };
+
+  ESP_ERROR_CHECK(report_queue_register_producer());
 
-    vTaskDelay(pdMS_TO_TICKS(counter_difference));
+  debounce_init(&debouncer, KEY_DEBOUNCE_ALGORITHM, KEY_DEBOUNCE_US);
+  keymap_init(&keymap, keymap_store_map(), KEYMAP_STORE_LAYERS, &keymap_output);
+  host_slots_init(&host_slots);
+  if (resuming) host_slots_resume(&host_slots, &resume.host_slots, resume.sleep_us, esp_timer_get_time());
+  macro_init(&macro);
+  ESP_ERROR_CHECK(esp_timer_create(&macro_timer_args, &macro_timer));
+  latency_trace_reset(&trace);
+  // The ATmega starts out with the encoder switch released, later changes follow the debounced state
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
+    imcu_send_state(ROT_SW_UPDATE, 0);
+    ESP_ERROR_CHECK(esp_timer_create(&heartbeat_timer_args, &heartbeat_timer));
   }
+  matrix_start();
+
+  encoder_accel_init(&encoder_accel, &curve);
+  ESP_ERROR_CHECK(esp_timer_create(&encoder_timer_args, &encoder_retry_timer));
+  ESP_ERROR_CHECK(encoder->set_event_callback(encoder, ENCODER_COUNTS_PER_DETENT, encoder_event_callback, NULL));
+  last_counter = encoder->get_counter_value(encoder);
+  // A detent half turned before a deep sleep completes where it would have
+  detent_counter = last_counter - (resuming ? resume.encoder_counts : 0);
+  resume.magic = 0;
+
+  ESP_ERROR_CHECK(esp_timer_create(&battery_timer_args, &battery_timer));
+  power_handler(0);
+}
+
+// Runs in the PCNT ISR once per detent
+void IRAM_ATTR encoder_event_callback(rotary_encoder_t* encoder, int direction, void* user_ctx) {
+  BaseType_t task_woken = pdFALSE;
+  event_loop_signal_from_isr(APP_EVENT_ENCODER, &task_woken);
+  if (task_woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+void encoder_retry_callback(void* arg) {
+  event_loop_signal(APP_EVENT_ENCODER);
 }
 
-void battery_task(void* pvParameters) {
-  uint8_t scaledBatteryVoltage = 0;
-  while (1) {
-    if (gpio_get_level(PIN_5VDET)) {
-      ESP_LOGV(TAG, "5V Present");
-    } else {
-      ESP_LOGV(TAG, "5V Not Present");
+void encoder_handler(uint32_t arg) {
+  int counter, counter_difference;
+  int32_t detents;
+  int8_t held;
+
+  counter = encoder->get_counter_value(encoder);
+  counter_difference = counter - last_counter;
+  last_counter = counter;
+  // Movement is sent as it happens, the congestion retries run this without any
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0 && counter_difference != 0) {
+    txInterMcu(counter_difference < 0 ? ROT_POS_NEGATIVE : ROT_POS_POSITIVE, abs(counter_difference));
+  }
+
+  // Partial detents stay in the counter until they complete or unwind
+  detents = (counter - detent_counter) / ENCODER_COUNTS_PER_DETENT;
+  if (detents != 0) {
+    detent_counter += detents * ENCODER_COUNTS_PER_DETENT;
+    input_activity();
+    // A host binding moves one slot per detent, whatever state the link of the active slot is in
+    KeyAction action = keymap_action(&keymap, detents > 0 ? KEYMAP_ENCODER_CW : KEYMAP_ENCODER_CCW);
+    if (KEYMAP_ACTION_KIND(action) == KEYMAP_KIND_HOST) {
+      for (int32_t i = 0; i < abs(detents); i++) host_switch(KEYMAP_ACTION_USAGE(action));
+      return;
     }
+    encoder_accel_update(&encoder_accel, detents, esp_timer_get_time());
+  }
 
-    ESP_LOGV(TAG, "Battery value: %f", getBatteryVoltage());
-    scaledBatteryVoltage = ((int)(getBatteryVoltage() * 100)) / 2;
-    if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
-      txInterMcu(BATT_UPDATE, scaledBatteryVoltage);
+  if (!(sec_conn && (current_kb_mode == KB_BT))) {
+    encoder_accel_cancel(&encoder_accel);
+    return;
+  }
+  // One report per key edge, paused while the link is congested so the queue cannot merge a press away
+  while (!report_queue_busy() && encoder_accel_next_report(&encoder_accel, &held)) {
+    int8_t key = held != 0 ? held : encoder_accel.held;
+    // Each direction sends what the active layers bind it to, steps of an unbound direction are dropped
+    KeyAction action = keymap_action(&keymap, key > 0 ? KEYMAP_ENCODER_CW : KEYMAP_ENCODER_CCW);
+    if (KEYMAP_ACTION_KIND(action) == KEYMAP_KIND_CONSUMER &&
+        !hid_send_consumer_value(hid_conn_id, KEYMAP_ACTION_USAGE(action), held != 0)) {
+      break;
     }
+    encoder_accel_report_sent(&encoder_accel, held);
+  }
+  // Steps held back by a congested link are tried again shortly
+  if (encoder_accel_busy(&encoder_accel) && !esp_timer_is_active(encoder_retry_timer)) {
+    esp_timer_start_once(encoder_retry_timer, ENCODER_RETRY_MS * 1000);
+  }
+}
 
-    vTaskDelay(pdMS_TO_TICKS(1000));
+void heartbeat_timer_callback(void* arg) {
+  event_loop_signal(APP_EVENT_HEARTBEAT);
+}
+
+// Nothing samples the switch or the battery on this period, the last state is offered again and imcu_send_state()
+// lets it through once UART_HEARTBEAT_MS have passed since it last went out, so an ATmega that restarted catches up
+void heartbeat_handler(uint32_t arg) {
+  imcu_send_state(ROT_SW_UPDATE, (lastButtonStatus >> MATRIX_ROT_SW_BIT) & 1);
+  imcu_send_state(BATT_UPDATE, battery.mv / 20);
+}
+
+void battery_timer_callback(void* arg) {
+  event_loop_signal(APP_EVENT_BATTERY);
+}
+
+void battery_handler(uint32_t arg) {
+  bool changed = battery_sample(&battery);
+
+  ESP_LOGV(TAG, "Battery %u mV, %u%%, 5V %s", battery.mv, battery.level,
+           power_source() == POWER_SOURCE_USB ? "present" : "not present");
+  // The host only hears about a new percentage, the voltage moves far more often than that
+  if (changed) {
+    hidd_set_battery_level(battery.level);
+    hid_send_battery_level(battery.level);
+  }
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
+    imcu_send_state(BATT_UPDATE, battery.mv / 20);  // 20 mV steps
   }
 }
 
-void keyboard_task(void* pvParameters) {
-  uint16_t buttonStatus;
-  uint8_t numKeysPressed;
-  while (1) {
-    ESP_LOGV(BTCONFIG_TAG, "Secure Connection is: x%02X", sec_conn);
-    if (sec_conn && (current_kb_mode == KB_BT)) {
-      keyboard_cmd key_values[10];
-      numKeysPressed = 0;
+// A change of power source samples the battery straight away and switches to the other period. The charger
+// lifts the cell voltage, so the filter starts over rather than creep between the two.
+void power_handler(uint32_t arg) {
+  uint32_t period_ms = power_source() == POWER_SOURCE_USB ? BATTERY_SAMPLE_USB_MS : BATTERY_SAMPLE_MS;
+  if (esp_timer_is_active(battery_timer)) {
+    esp_timer_stop(battery_timer);
+  }
+  esp_timer_start_periodic(battery_timer, period_ms * 1000);
+  battery_restart(&battery);
+  battery_handler(0);
+  // Deep sleep is for battery power only
+  if (power_source() == POWER_SOURCE_USB) deep_sleep_cancel();
+  sleep_arm(power_source() == POWER_SOURCE_BATTERY);
+  // The ATmega only runs on USB power, on battery the heartbeat would wake the chip for nobody
+  if (heartbeat_timer != NULL) {
+    if (esp_timer_is_active(heartbeat_timer)) esp_timer_stop(heartbeat_timer);
+    if (power_source() == POWER_SOURCE_USB) esp_timer_start_periodic(heartbeat_timer, UART_HEARTBEAT_MS * 1000);
+  }
+}
 
-      buttonStatus = scanButtons();
-      if (buttonStatus & (1 << 1)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 1 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_1;
-      }
-      if (buttonStatus & (1 << 2)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 2 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_2;
-      }
-      if (buttonStatus & (1 << 3)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 3 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_3;
-      }
-      if (buttonStatus & (1 << 4)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 4 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_4;
-      }
-      if (buttonStatus & (1 << 5)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 5 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_5;
-      }
-      if (buttonStatus & (1 << 6)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 6 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_6;
-      }
-      if (buttonStatus & (1 << 7)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 7 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_7;
-      }
-      if (buttonStatus & (1 << 8)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 8 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_8;
-      }
-      if (buttonStatus & (1 << 9)) {
-        ESP_LOGI(BTCONFIG_TAG, "Button 9 Pressed");
-        key_values[numKeysPressed++] = HID_KEY_9;
-      }
-      if (buttonStatus & (1 << 10)) {
-        if (!(buttonToggleMask & (1 << 10))) {
-          ESP_LOGI(BTCONFIG_TAG, "Button 10 Pressed");
-          hid_send_consumer_value(hid_conn_id, HID_CONSUMER_MUTE, true);
-          buttonToggleMask |= (1 << 10);
-        }
-      } else {
-        if ((buttonToggleMask & (1 << 10))) {
-          ESP_LOGI(BTCONFIG_TAG, "Button 10 Unpressed");
-          hid_send_consumer_value(hid_conn_id, HID_CONSUMER_MUTE, false);
-          buttonToggleMask &= ~(1 << 10);
-        }
-      }
+// Point the reports at the link of the active slot
+static void host_sync(void) {
+  const HostSlot* active = host_slots_active(&host_slots);
+  hid_conn_id = active->connected ? active->conn_id : HID_CONN_ID_NONE;
+  sec_conn = active->secure;
+}
 
-      if (numKeysPressed > 6) {
-        numKeysPressed = 6;
-      }
-      hid_send_keyboard_value(hid_conn_id, 0, key_values, numKeysPressed);
+static bool host_keys_held(void) {
+  bool held = keymap.modifiers != 0;
+  for (int word = 0; word < KEYMAP_USAGE_WORDS; word++) held |= keymap.bits[word] != 0;
+  return held && sec_conn && (current_kb_mode == KB_BT);
+}
 
-      // esp_hidd_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_DOWN, true);
-      // vTaskDelay(3000 / portTICK_PERIOD_MS);
-      // esp_hidd_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_DOWN, false);
-    }
-    vTaskDelay(pdMS_TO_TICKS(10));
+// Keys held while the active host could not hear them reach it now rather than at the next change. The keymap
+// kept its state while the output was gated, so it sends the whole of it again, consumer usages included.
+static void host_resend_held(void) {
+  if (sec_conn && (current_kb_mode == KB_BT)) keymap_resync(&keymap);
+}
+
+// Every host keeps its link, only the active one gets the low latency profile
+void ble_connect_handler(uint32_t arg) {
+  esp_bd_addr_t bda;
+  // Gone again already, its disconnect is on the way
+  if (!hidd_clcb_remote_bda(arg, bda)) return;
+  boot_mark(BOOT_CONNECTED);
+
+  uint8_t slot = host_slots_connected(&host_slots, arg, bda, esp_timer_get_time());
+  if (slot == HOST_SLOT_NONE) {
+    // Every other slot has its host connected and the active one waits for its own. The link would hold one of
+    // the controller's few for nothing and keep that host out, so it goes and advertising seeks the active host.
+    reconnect_prefer(host_slots_active(&host_slots)->bda);
+    reconnect_refuse(bda);
+    esp_ble_gap_disconnect(bda);
+    return;
+  }
+  if (slot == host_slots.active) {
+    host_sync();
+    conn_params_connected(bda);
+  } else {
+    conn_params_inactive(bda);
   }
 }
 
-void kbmode_task(void* pvParamaters) {
-  // Handle changes to Keyboard Mode
-  // In BT mode, ESP does the key scanning
-  // In USB mode, release resources and set COL pins to high impedence so ATMEGA can scan
-  while (1) {
-    if (current_kb_mode != keyboard_mode) {
-      if (keyboard_mode == KB_BT) {
-        ESP_LOGI(TAG, "Changing KB MODE to Bluetooth");
-        gpio_config_t col_config;
-        col_config.intr_type = GPIO_INTR_DISABLE;
-        col_config.mode = GPIO_MODE_OUTPUT;
-        col_config.pin_bit_mask = PIN_COL_MASK;
-        col_config.pull_down_en = 0;
-        col_config.pull_up_en = 0;
-        gpio_config(&col_config);
-        current_kb_mode = KB_BT;
-      }
+void ble_secure_handler(uint32_t arg) {
+  // The bring-up ends with the first host able to take reports
+  if (boot_mark(BOOT_SECURE)) boot_log();
+  if (host_slots_secured(&host_slots, arg) != host_slots.active) return;
+  host_sync();
+  host_resend_held();
+}
 
-      if (keyboard_mode == KB_USB) {
-        ESP_LOGI(TAG, "Changing KB MODE to USB");
-        gpio_config_t col_config;
-        col_config.intr_type = GPIO_INTR_DISABLE;
-        col_config.mode = GPIO_MODE_INPUT;
-        col_config.pin_bit_mask = PIN_COL_MASK;
-        col_config.pull_down_en = 0;
-        col_config.pull_up_en = 0;
-        gpio_config(&col_config);
-        current_kb_mode = KB_USB;
-      }
+void ble_disconnect_handler(uint32_t arg) {
+  uint8_t slot = host_slots_disconnected(&host_slots, arg, esp_timer_get_time());
+  if (slot == host_slots.active) {
+    host_sync();
+    conn_params_disconnected();
+  }
+  if (sleep_pending && host_slots_links(&host_slots) == 0) deep_sleep_enter();
+}
+
+// Move the reports to another host slot. A connected host takes the next report at its next connection event,
+// one that is away is sought with directed advertising and an unused slot opens pairing.
+void host_switch(uint8_t slot) {
+  const uint32_t none[KEYMAP_USAGE_WORDS] = {0};
+  uint8_t from = host_slots.active;
+
+  if (slot == KEYMAP_HOST_NEXT) slot = (from + 1) % HOST_SLOTS;
+  if (slot == KEYMAP_HOST_PREV) slot = (from + HOST_SLOTS - 1) % HOST_SLOTS;
+  if (slot >= HOST_SLOTS || slot == from) return;
+
+  // Whatever is held is let go on the host left behind, it would repeat there until the host timed it out
+  if (host_keys_held()) hid_send_keyboard_bits(hid_conn_id, 0, none);
+  macro_init(&macro);
+  encoder_accel_cancel(&encoder_accel);
+  conn_params_disconnected();
+  if (host_slots.slot[from].connected) conn_params_inactive(host_slots.slot[from].bda);
+
+  host_slots_select(&host_slots, slot);
+  host_sync();
+  HostSlot* active = &host_slots.slot[slot];
+  report_queue_set_congested(active->connected && hidd_clcb_congested(active->conn_id));
+  if (active->connected) {
+    conn_params_connected(active->bda);
+  } else if (active->known) {
+    reconnect_seek(active->bda);
+  } else {
+    reconnect_pair();
+  }
+  host_resend_held();
+}
+
+void keymap_store_handler(uint32_t arg) {
+  keymap_store_process();
+}
+
+// Keep what the next boot needs in RTC memory and go. The hosts keep their slots, the partial detent its counts.
+void deep_sleep_enter(void) {
+  keymap_store_retain();
+  resume.host_slots = host_slots;
+  resume.sleep_us = esp_timer_get_time();
+  resume.encoder_counts = encoder->get_counter_value(encoder) - detent_counter;
+  resume.magic = RESUME_MAGIC;
+  sleep_start();
+}
+
+// A deep sleep still waiting for its links to close is called off, the hosts may come back
+void deep_sleep_cancel(void) {
+  if (!sleep_pending) return;
+  sleep_pending = false;
+  ESP_LOGI(TAG, "Deep sleep called off");
+  reconnect_start();
+}
+
+// Input counts against the idle clocks of the connection and of deep sleep
+void input_activity(void) {
+  conn_params_activity();
+  sleep_activity();
+  deep_sleep_cancel();
+}
+
+// Idle on battery for hidd_config.idleTimeout, on a board whose keys can wake it or with SLEEP_WITHOUT_KEY_WAKE.
+// The links are closed first, so the hosts see the pad leave rather than wait out the supervision timeout, and it
+// sleeps once they are down or after SLEEP_DISCONNECT_MS.
+void sleep_handler(uint32_t arg) {
+  bool busy = lastButtonStatus != 0 || macro_running(&macro) || encoder_accel_busy(&encoder_accel);
+  if (busy || current_kb_mode != KB_BT || power_source() != POWER_SOURCE_BATTERY) {
+    sleep_arm(power_source() == POWER_SOURCE_BATTERY);
+    return;
+  }
+  // The second call comes SLEEP_DISCONNECT_MS later, with links that did not close left to time out
+  if (!sleep_pending) {
+    sleep_pending = true;
+    reconnect_stop();
+    for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+      if (host_slots.slot[i].connected) esp_ble_gap_disconnect(host_slots.slot[i].bda);
+    }
+    if (host_slots_links(&host_slots) > 0) {
+      ESP_LOGI(TAG, "Idle, closing %u links for deep sleep", host_slots_links(&host_slots));
+      sleep_defer(SLEEP_DISCONNECT_MS);
+      return;
     }
-    vTaskDelay(pdMS_TO_TICKS(10));
   }
+  deep_sleep_enter();
 }
 
-void uart_event_task(void* pvParamaters) {
+// Runs on a row interrupt, then follows the held keys at MATRIX_SCAN_INTERVAL_US until the matrix is parked again
+void keyboard_handler(uint32_t arg) {
+  keyboard_update(matrix_read());
+  matrix_rearm(debounce_pending(&debouncer));
+}
+
+void keyboard_update(uint16_t buttonStatus) {
+  uint32_t edge_us;
+
+  if (matrix_take_edge(&edge_us)) {
+    latency_trace_reset(&trace);
+    latency_stamp_at(&trace, LATENCY_STAGE_EDGE, edge_us);
+  }
+  // The first scan that sees a raw change starts the debounce stage, later bounces do not move it
+  if (buttonStatus != lastRawStatus) {
+    lastRawStatus = buttonStatus;
+    if (!(trace.mask & (1 << LATENCY_STAGE_SCAN))) latency_stamp(&trace, LATENCY_STAGE_SCAN);
+  }
+  buttonStatus = debounce_update(&debouncer, buttonStatus, esp_timer_get_time());
+  if (buttonStatus == lastButtonStatus) {
+    // Bounced back without an accepted change, nothing left for this trace to measure
+    if (!debounce_pending(&debouncer)) latency_trace_reset(&trace);
+    return;
+  }
+  lastButtonStatus = buttonStatus;
+  latency_stamp(&trace, LATENCY_STAGE_DEBOUNCE);
+  input_activity();
+  // The switch stays with the ESP in USB mode too, the matrix keeps reporting it while the ATmega scans
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
+    imcu_send_state(ROT_SW_UPDATE, (buttonStatus >> MATRIX_ROT_SW_BIT) & 1);
+  }
+
+  // Any press stops a playing macro, its releases go out ahead of the press, which may start another one
+  if ((buttonStatus & ~keymap.state) && macro_running(&macro)) {
+    macro_cancel(&macro);
+    macro_handler(0);
+  }
+  keymap_update(&keymap, buttonStatus, esp_timer_get_time());
+  latency_trace_reset(&trace);
+}
+
+// Keymap output, reports only go out over a secured link while the ESP has the matrix
+void keymap_keyboard_output(uint8_t modifiers, const uint32_t* bits, void* ctx) {
+  if (!(sec_conn && (current_kb_mode == KB_BT))) return;
+
+  ESP_LOGD(BTCONFIG_TAG, "Keys 0x%08x%08x%08x%08x held, modifiers 0x%02x", bits[3], bits[2], bits[1], bits[0],
+           modifiers);
+  report_queue_trace(&trace);
+  hid_send_keyboard_bits(hid_conn_id, modifiers, bits);
+}
+
+void keymap_consumer_output(uint8_t usage, bool pressed, void* ctx) {
+  if (!(sec_conn && (current_kb_mode == KB_BT))) return;
+
+  ESP_LOGD(BTCONFIG_TAG, "Consumer 0x%02x %s", usage, pressed ? "pressed" : "released");
+  hid_send_consumer_value(hid_conn_id, usage, pressed);
+}
+
+void keymap_host_output(uint8_t slot, void* ctx) {
+  ESP_LOGD(BTCONFIG_TAG, "Host slot 0x%02x", slot);
+  host_switch(slot);
+}
+
+void keymap_macro_output(uint8_t slot, void* ctx) {
+  const uint8_t* code;
+  size_t length;
+  if (!(sec_conn && (current_kb_mode == KB_BT))) return;
+
+  code = keymap_store_macro(slot, &length);
+  if (code == NULL) return;
+  ESP_LOGD(BTCONFIG_TAG, "Macro %u, %u bytes", slot, length);
+  macro_start(&macro, code, length);
+  event_loop_signal(APP_EVENT_MACRO);
+}
+
+void macro_timer_callback(void* arg) {
+  event_loop_signal(APP_EVENT_MACRO);
+}
+
+// A burst of reports per connection interval keeps up with what the link carries without backing up the report
+// queue, so keys pressed meanwhile are not stuck behind a long macro
+void macro_handler(uint32_t arg) {
+  int64_t now = esp_timer_get_time();
+  MacroReport report, last;
+  ConnParams params;
+  int64_t wait;
+  int sent = 0;
+
+  if (!(sec_conn && (current_kb_mode == KB_BT))) {
+    macro_init(&macro);
+    return;
+  }
+  while (sent < MACRO_REPORTS_PER_INTERVAL && !report_queue_busy() && macro_next(&macro, now, &report)) {
+    // The queue would fold the earlier one into this report before either went out
+    if (sent > 0 && macro_report_supersedes(&last, &report)) break;
+    bool queued = report.consumer
+                      ? hid_send_consumer_value(hid_conn_id, report.usage, report.usage != 0)
+                      : hid_send_keyboard_value(hid_conn_id, report.modifiers, report.keys, report.key_count);
+    if (!queued) break;
+    macro_report_sent(&macro);
+    last = report;
+    sent++;
+  }
+  if (sent > 0) input_activity();
+  if (!macro_running(&macro)) return;
+
+  // Delays run to the next burst at or after their end
+  conn_params_get(&params);
+  wait = params.interval ? params.interval * 1250 : MACRO_IDLE_PERIOD_US;
+  if (macro.resume_us - now > wait) wait = macro.resume_us - now;
+  if (esp_timer_is_active(macro_timer)) esp_timer_stop(macro_timer);
+  esp_timer_start_once(macro_timer, wait);
+}
+
+// Hand the matrix over when the ATmega asks for another mode
+// In BT mode, ESP does the key scanning
+// In USB mode, release resources and set COL pins to high impedence so ATMEGA can scan
+void setKeyboardMode(int mode) {
+  if (current_kb_mode == mode) return;
+  if (mode == KB_BT) {
+    ESP_LOGI(TAG, "Changing KB MODE to Bluetooth");
+    matrix_enable(true);
+    current_kb_mode = KB_BT;
+  }
+
+  if (mode == KB_USB) {
+    ESP_LOGI(TAG, "Changing KB MODE to USB");
+    matrix_enable(false);
+    current_kb_mode = KB_USB;
+  }
+}
+
+void uart_event_handler(QueueHandle_t queue) {
   uart_event_t event;
-  size_t buffered_size;
-  uint8_t* dtmp = (uint8_t*)malloc(RD_BUF_SIZE);
-  while (1) {
-    if (xQueueReceive(uart_queue, (void*)&event, (portTickType)portMAX_DELAY)) {
-      bzero(dtmp, RD_BUF_SIZE);
-      ESP_LOGI(UARTTAG, "UART[%d] event:", EX_UART_NUM);
-      switch (event.type) {
-        case UART_DATA:
-          uart_read_bytes(EX_UART_NUM, dtmp, event.size, portMAX_DELAY);
-          ESP_LOGI(UARTTAG, "std data: %s", dtmp);
-          break;
-        case UART_FIFO_OVF:
-          ESP_LOGE(UARTTAG, "hw fifo overflow");
-          uart_flush_input(EX_UART_NUM);
-          xQueueReset(uart_queue);
-          break;
-        case UART_BUFFER_FULL:
-          ESP_LOGE(UARTTAG, "ring buffer full");
-          uart_flush_input(EX_UART_NUM);
-          xQueueReset(uart_queue);
-          break;
-        case UART_PARITY_ERR:
-          ESP_LOGE(UARTTAG, "uart parity error");
-          break;
-        case UART_FRAME_ERR:
-          ESP_LOGE(UARTTAG, "uart frame error");
-          break;
-        case UART_PATTERN_DET:
-          uart_get_buffered_data_len(EX_UART_NUM, &buffered_size);
-          int pos = uart_pattern_pop_pos(EX_UART_NUM);
-
-          ESP_LOGI(UARTTAG, "[UART PATTERN] pos: %d, bufsize: %d", pos, buffered_size);
-          if (pos == -1) {
-            ESP_LOGE(UARTTAG, "UART Pattern Detect Buffer Full");
-            uart_flush_input(EX_UART_NUM);
-          } else {
-            uint8_t payloadBuffer[PAYLOAD_LENGTH];
-            memset(payloadBuffer, 0, sizeof(payloadBuffer));
-            int len = pos + PATTERN_CHR_NUM;
-            if (len > (PAYLOAD_LENGTH)) {
-              uart_read_bytes(EX_UART_NUM, dtmp, (len - PAYLOAD_LENGTH), pdMS_TO_TICKS(100));
-              uart_read_bytes(EX_UART_NUM, payloadBuffer, len, pdMS_TO_TICKS(100));
-            } else if (len == (PAYLOAD_LENGTH)) {
-              uart_read_bytes(EX_UART_NUM, payloadBuffer, len, pdMS_TO_TICKS(100));
-            } else {
-              uart_read_bytes(EX_UART_NUM, dtmp, len, pdMS_TO_TICKS(100));
-            }
-            ESP_LOGI(UARTTAG, "C:0x%02X D:0x%02X", payloadBuffer[0], payloadBuffer[1]);
-            handleComms(payloadBuffer);
-          }
-          break;
-        default:
-          ESP_LOGI(UARTTAG, "uart event type: %d", event.type);
-          break;
+  int len;
+  uint8_t rx[UART_RX_CHUNK];
+  if (!xQueueReceive(queue, (void*)&event, 0)) return;
+  switch (event.type) {
+    case UART_DATA:
+      // Bytes go from the driver's ring buffer to the parser in small chunks, frame boundaries are left to
+      // the parser so nothing is staged or cleared in between
+      for (size_t left = event.size; left > 0; left -= len) {
+        len = uart_read_bytes(EX_UART_NUM, rx, left < sizeof(rx) ? left : sizeof(rx), 0);
+        if (len <= 0) break;
+        imcu_receive(rx, len);
       }
-    }
+      break;
+    case UART_FIFO_OVF:
+      ESP_LOGE(UARTTAG, "hw fifo overflow");
+      uart_flush_input(EX_UART_NUM);
+      xQueueReset(uart_queue);
+      imcu_rx_reset();
+      break;
+    case UART_BUFFER_FULL:
+      ESP_LOGE(UARTTAG, "ring buffer full");
+      uart_flush_input(EX_UART_NUM);
+      xQueueReset(uart_queue);
+      imcu_rx_reset();
+      break;
+    case UART_PARITY_ERR:
+      ESP_LOGE(UARTTAG, "uart parity error");
+      break;
+    case UART_FRAME_ERR:
+      ESP_LOGE(UARTTAG, "uart frame error");
+      break;
+    default:
+      ESP_LOGI(UARTTAG, "uart event type: %d", event.type);
+      break;
   }
-  free(dtmp);
-  dtmp = NULL;
-  vTaskDelete(NULL);
-}
\ No newline at end of file
+}
@@ -9,44 +9,69 @@
 // #include "esp_wifi.h"
 #include <esp32/rom/ets_sys.h>
 
+#include "battery.h"
+#include "board.h"
+#include "boot.h"
 #include "btconfig.h"
-#include "driver/adc.h"
+#include "debounce.h"
 #include "driver/gpio.h"
 #include "driver/uart.h"
+#include "encoder_accel.h"
+#include "esp_attr.h"
 #include "esp_bt.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "event_loop.h"
+#include "host_slots.h"
+#include "imcu.h"
+#include "keymap.h"
+#include "keymap_store.h"
+#include "latency.h"
+#include "macro.h"
+#include "matrix.h"
 #include "nvs_flash.h"
+#include "power.h"
+#include "report_queue.h"
 #include "rotary_encoder.h"
+#include "sleep.h"
 
-// GPIO Defines
-#define PIN_COL0 5
-#define PIN_COL1 16
-#define PIN_COL2 4
-#define PIN_ROW0 19
-#define PIN_ROW1 21
-#define PIN_ROW2 22
-#define PIN_ROT_A 27
-#define PIN_ROT_B 14
-#define PIN_ROT_SW 23
-#define PIN_BATTSENSE 32  // A1_4
-#define PIN_5VDET 33      // A1_5
-#define PIN_COL_MASK ((1ULL << PIN_COL0) | (1ULL << PIN_COL1) | (1ULL << PIN_COL2))
-#define PIN_ROW_MASK ((1ULL << PIN_ROW0) | (1ULL << PIN_ROW1) | (1ULL << PIN_ROW2))
-
-// ADC Vref calibration = 1121mV
-#define ADC_CONST 0.0025f  // 1/(3308 - 2914) 3308 is ADC value at 4.2V, 2914 is ADC value at 3.7V
-#define ADC_37V 2914
+#if KEYMAP_USAGE_WORDS != HID_NKRO_USAGE_WORDS
+#error "The keymap hands its usage bitmap straight to the NKRO report"
+#endif
+
+// Key Debounce Defines, the host build overrides the algorithm to replay the same bounce traces against each
+#ifndef KEY_DEBOUNCE_ALGORITHM
+#define KEY_DEBOUNCE_ALGORITHM DEBOUNCE_EAGER_PRESS
+#endif
+#define KEY_DEBOUNCE_US DEBOUNCE_DEFAULT_WINDOW_US
+
+// Macro Defines
+#define MACRO_REPORTS_PER_INTERVAL 4  // Reports queued per connection interval, what a host takes per event
+#define MACRO_IDLE_PERIOD_US 7500     // Burst period before the first connection parameters are known
+
+// Encoder Defines
+#define ENCODER_COUNTS_PER_DETENT 4                      // EC11 runs a full quadrature cycle per detent
+#define ENCODER_ACCEL_CURVE ENCODER_ACCEL_CURVE_DEFAULT  // Volume steps per detent against turning speed
+#define ENCODER_RETRY_MS 10                              // Retry period for volume steps held back by a congested link
+
+// Battery Defines
+#define BATTERY_SAMPLE_MS 30000     // Sample period on battery, each sample wakes the chip from light sleep
+#define BATTERY_SAMPLE_USB_MS 1000  // Sample period while charging
 
 // UART Defines
 #define EX_UART_NUM UART_NUM_0
-#define PATTERN_CHR_NUM (2)  // UART pattern;
-#define DATA_LENGTH (3)
-#define PAYLOAD_LENGTH (PATTERN_CHR_NUM + DATA_LENGTH)
-#define BUF_SIZE (1024)
-#define RD_BUF_SIZE (BUF_SIZE)
-
-// Intermcu Comm Defines
+#define UART_BAUD 38400            // Rate at boot, the console rate when logging is on
+#define UART_RX_FULL_THRESHOLD 64  // RX FIFO bytes that raise UART_DATA while a burst is still arriving
+#define UART_RX_TOUT_SYMBOLS 3     // Idle symbols after a burst before UART_DATA, frames end well before this
+#define UART_RX_CHUNK 128          // Bytes handed to the parser per uart_read_bytes() call
+#define UART_QUEUE_LEN 20          // Driver events waiting for the event loop
+#define UART_HEARTBEAT_MS 1000     // Unchanged switch and battery state is repeated this often on USB power
+#define BUF_SIZE (1024)            // Driver ring buffers are twice this, 20 ms of RX at 1 Mbaud
+// Highest rate negotiated with the ATmega, the UART is the console when logging is on and stays put
+#define UART_BAUD_MAX (CONFIG_LOG_DEFAULT_LEVEL == 0 ? 1000000 : UART_BAUD)
+
+// Intermcu Comm Defines, record types of the imcu.c framing
 #define HOST_USB_CONN 0x01
 #define HOST_USB_DISCONN 0x02
 #define TEST_MESSAGE 0x03
@@ -56,82 +81,146 @@
 #define ROT_SW_UPDATE 0x07
 #define ROT_POS_POSITIVE 0x08
 #define ROT_POS_NEGATIVE 0x09
-#define IMCU_ACK 0xFF
+#define LATENCY_REQ 0x0A    // Data non-zero resets the histograms after the dump
+#define LATENCY_START 0x0B  // Data is the number of bytes the LATENCY_DATA records carry
+#define LATENCY_DATA 0x0C   // Up to LATENCY_CHUNK_LEN bytes of latency_serialize() output
+#define POWER_REQ 0x0D      // Log the power source and mode residency and answer with a POWER_DATA record
+#define POWER_DATA 0x0E     // power_serialize() output
+#define KEYMAP_CMD 0x10     // Data is a keymap_store command, see KeymapStoreOp
+#define BOOT_REQ 0x11       // Log the startup trace and answer with a BOOT_DATA record
+#define BOOT_DATA 0x12      // boot_serialize() output
+#define IMCU_ACK 0x1F       // Data is the sequence number of the frame that carried the ACK_REQ
+#define LATENCY_CHUNK_LEN 32
+
+// Boot Defines
+#define BT_START_STACK 4096   // Bluedroid init and the first GAP and GATT calls
+#define BT_START_PRIORITY 5   // Above app_main, each stack call goes out as soon as the one before returns
+
+// Deep Sleep Defines
+#define RESUME_MAGIC 0x52534D45  // "RSME", the ResumeState in RTC memory was saved by the last deep sleep
 
 // Internal State Defines
-#define VOL_UP 1
-#define VOL_DOWN -1
-#define VOL_NONE 0
 #define KB_USB 1
 #define KB_BT 0
 
 static const char* TAG = "HWIN";
 static const char* UARTTAG = "UART";
-static const char* PATT = "+";
 
-int keyboard_mode = 0;
 int current_kb_mode = 0;
 rotary_encoder_t* encoder = NULL;
 static uint32_t pcnt_unit = 0;
 QueueHandle_t uart_queue;
 
+// Owned by the event loop task
+EncoderAccel encoder_accel;  // Global so the host runner can read the step counters
+static esp_timer_handle_t encoder_retry_timer = NULL;
+static int last_counter = 0;
+static int detent_counter = 0;  // Counter value at the last whole detent
+static esp_timer_handle_t battery_timer = NULL;
+static Battery battery;
+static esp_timer_handle_t macro_timer = NULL;
+static esp_timer_handle_t heartbeat_timer = NULL;
+static Macro macro;
+Debouncer debouncer;  // Global so the host runner can read the edge counters
+static Keymap keymap;
+static HostSlots host_slots;
+static LatencyTrace trace;
+static uint16_t lastButtonStatus = 0;
+static uint16_t lastRawStatus = 0;
+static bool sleep_pending = false;  // Links closing on the way to deep sleep
+static bool resuming = false;       // Woke from deep sleep with the state below saved
+
+// Event loop state kept through a deep sleep, the keymap cache is kept by keymap_store
+typedef struct ResumeState {
+  uint32_t magic;  // RESUME_MAGIC
+  int64_t sleep_us;
+  HostSlots host_slots;
+  int8_t encoder_counts;  // Past the last whole detent
+} ResumeState;
+static RTC_DATA_ATTR ResumeState resume;
+
 void hidd_event_callback(HIDCallbackEvent event, HIDEventParameters* param);
 void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
-void encoder_task(void* pvParamaters);
-void battery_task(void* pvParamaters);
-void keyboard_task(void* pvParamaters);
-void kbmode_task(void* pvParamaters);
-void uart_event_task(void* pvParamaters);
+void encoder_event_callback(rotary_encoder_t* encoder, int direction, void* user_ctx);
+void encoder_retry_callback(void* arg);
+void battery_timer_callback(void* arg);
+void event_loop_init(void);
+void keyboard_handler(uint32_t arg);
+void keyboard_update(uint16_t buttonStatus);
+void keymap_keyboard_output(uint8_t modifiers, const uint32_t* bits, void* ctx);
+void keymap_consumer_output(uint8_t usage, bool pressed, void* ctx);
+void keymap_macro_output(uint8_t slot, void* ctx);
+void keymap_host_output(uint8_t slot, void* ctx);
+void host_switch(uint8_t slot);
+void macro_timer_callback(void* arg);
+void macro_handler(uint32_t arg);
+void encoder_handler(uint32_t arg);
+void battery_handler(uint32_t arg);
+void power_handler(uint32_t arg);
+void ble_connect_handler(uint32_t arg);
+void ble_secure_handler(uint32_t arg);
+void ble_disconnect_handler(uint32_t arg);
+void keymap_store_handler(uint32_t arg);
+void sleep_handler(uint32_t arg);
+void heartbeat_timer_callback(void* arg);
+void heartbeat_handler(uint32_t arg);
+void deep_sleep_enter(void);
+void deep_sleep_cancel(void);
+void input_activity(void);
+void uart_event_handler(QueueHandle_t queue);
+void setKeyboardMode(int mode);
+void handleComms(uint8_t command, const uint8_t* data, uint8_t length, void* ctx);
 
 void txInterMcu(uint8_t command, uint8_t data) {
-  uint8_t commandBuffer[PAYLOAD_LENGTH] = {0x2b, 0x2b, 0x00, 0x00};
-  commandBuffer[PATTERN_CHR_NUM] = command;
-  commandBuffer[PATTERN_CHR_NUM + 1] = data;
-  uart_write_bytes(EX_UART_NUM, commandBuffer, PAYLOAD_LENGTH);
+  imcu_send(command, &data, 1);
+}
+
+// Dump the latency histograms, over the inter-MCU link when the UART is not the console
+void txLatencyStats(void) {
+  uint8_t stats[LATENCY_SERIALIZED_LEN];
+  size_t len = latency_serialize(stats, sizeof(stats));
+
+  latency_log();
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
+    txInterMcu(LATENCY_START, len);
+    for (size_t i = 0; i < len; i += LATENCY_CHUNK_LEN) {
+      imcu_send(LATENCY_DATA, &stats[i], len - i < LATENCY_CHUNK_LEN ? len - i : LATENCY_CHUNK_LEN);
+    }
+  }
+}
+
+// Log the time spent on each power source, and send it over the inter-MCU link when the UART is not the console
+void txPowerStats(void) {
+  uint8_t stats[POWER_SERIALIZED_LEN];
+  size_t len = power_serialize(stats, sizeof(stats));
+
+  power_log();
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
+    imcu_send(POWER_DATA, stats, len);
+  }
+}
+
+// Log the startup trace, and send it over the inter-MCU link when the UART is not the console
+void txBootTrace(void) {
+  uint8_t trace[BOOT_SERIALIZED_LEN];
+  size_t len = boot_serialize(trace, sizeof(trace));
+
+  boot_log();
+  if (CONFIG_LOG_DEFAULT_LEVEL == 0) {
+    imcu_send(BOOT_DATA, trace, len);
+  }
 }
 
 void hardwareInit(void) {
   ESP_LOGI(TAG, "Hardware initializing");
-  keyboard_mode = KB_BT;
-
-  gpio_config_t col_config;
-  col_config.intr_type = GPIO_INTR_DISABLE;
-  col_config.mode = GPIO_MODE_OUTPUT;
-  col_config.pin_bit_mask = PIN_COL_MASK;
-  col_config.pull_down_en = 0;
-  col_config.pull_up_en = 0;
-  gpio_config(&col_config);
-  current_kb_mode = KB_BT;
 
-  gpio_config_t row_config;
-  row_config.intr_type = GPIO_INTR_DISABLE;
-  row_config.mode = GPIO_MODE_INPUT;
-  row_config.pin_bit_mask = PIN_ROW_MASK;
-  row_config.pull_down_en = 0;
-  row_config.pull_up_en = 0;
-  gpio_config(&row_config);
-
-  gpio_config_t det5v_config;
-  det5v_config.mode = GPIO_MODE_INPUT;
-  det5v_config.pin_bit_mask = (1ULL << PIN_5VDET);
-  det5v_config.intr_type = GPIO_INTR_DISABLE;
-  det5v_config.pull_down_en = 0;
-  det5v_config.pull_up_en = 0;
-  gpio_config(&det5v_config);
-
-  gpio_config_t rot_sw_config;
-  rot_sw_config.mode = GPIO_MODE_INPUT;
-  rot_sw_config.pin_bit_mask = (1ULL << PIN_ROT_SW);
-  rot_sw_config.intr_type = GPIO_INTR_DISABLE;
-  rot_sw_config.pull_down_en = 0;
-  rot_sw_config.pull_up_en = 0;
-  gpio_config(&rot_sw_config);
+  ESP_ERROR_CHECK(sleep_init(hidd_config.idleTimeout));  // Before the drivers, a wake leaves pads held
+  ESP_ERROR_CHECK(power_init());                         // PIN_5VDET and the DFS / light sleep policy
+  ESP_ERROR_CHECK(matrix_init());
+  current_kb_mode = KB_BT;
   ESP_LOGI(TAG, "GPIO Initialized");
 
-  adc1_config_width(ADC_WIDTH_BIT_12);
-  adc1_config_channel_atten(
-      ADC1_CHANNEL_4,
-      ADC_ATTEN_DB_11);  // Full scale 2.6V (Input scaling=0.718) need to change to input scaling 0.5 (11K + 11K)
+  ESP_ERROR_CHECK(battery_init(&battery));
   ESP_LOGI(TAG, "ADC1_4 Initialized");
 
   // Create rotary encoder instance
@@ -142,66 +231,9 @@ void hardwareInit(void) {
   ESP_LOGI(TAG, "Rot. Enc. Initialized");
 }
 
-float getBatteryVoltage(void) {
-  uint16_t batteryRaw = adc1_get_raw(ADC1_CHANNEL_4);
-  float batteryVoltage = ((batteryRaw - ADC_37V) * ADC_CONST) * (0.282) + 3.7;
-
-  return batteryVoltage;
-}
-
-int scanButtons(void) {
-  uint16_t ButtonStatus = 0;
-  gpio_set_level(PIN_COL0, 1);
-  // ets_delay_us(100);
-  if (gpio_get_level(PIN_ROW0)) {
-    ButtonStatus |= (1 << 1);
-  }
-  if (gpio_get_level(PIN_ROW1)) {
-    ButtonStatus |= (1 << 2);
-  }
-  if (gpio_get_level(PIN_ROW2)) {
-    ButtonStatus |= (1 << 2);
-  }
-  gpio_set_level(PIN_COL0, 0);
-
-  gpio_set_level(PIN_COL1, 1);
-  // ets_delay_us(100);
-  if (gpio_get_level(PIN_ROW0)) {
-    ButtonStatus |= (1 << 4);
-  }
-  if (gpio_get_level(PIN_ROW1)) {
-    ButtonStatus |= (1 << 5);
-  }
-  if (gpio_get_level(PIN_ROW2)) {
-    ButtonStatus |= (1 << 6);
-  }
-  gpio_set_level(PIN_COL1, 0);
-
-  gpio_set_level(PIN_COL2, 1);
-  // ets_delay_us(100);
-  if (gpio_get_level(PIN_ROW0)) {
-    ButtonStatus |= (1 << 7);
-  }
-  if (gpio_get_level(PIN_ROW1)) {
-    ButtonStatus |= (1 << 8);
-  }
-  if (gpio_get_level(PIN_ROW2)) {
-    ButtonStatus |= (1 << 9);
-  }
-  gpio_set_level(PIN_COL2, 0);
-
-  if (gpio_get_level(PIN_ROT_SW)) {
-    ButtonStatus |= (1 << 10);
-  }
-
-  return ButtonStatus;
-}
-
 void initUart(void) {
-  // See UART ISR timeout issues with pattern detect
-  // https://github.com/espressif/esp-idf/issues/4707
   uart_config_t uart_config = {
-      .baud_rate = 38400,
+      .baud_rate = UART_BAUD,
       .data_bits = UART_DATA_8_BITS,
       .parity = UART_PARITY_DISABLE,
       .stop_bits = UART_STOP_BITS_1,
@@ -212,9 +244,13 @@ void initUart(void) {
   ESP_ERROR_CHECK(
       uart_set_pin(UART_NUM_1, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
 
-  ESP_ERROR_CHECK(uart_driver_install(EX_UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, 20, &uart_queue, 0));
-  ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(EX_UART_NUM, *PATT, PATTERN_CHR_NUM, 9, 0, 0));
-  ESP_ERROR_CHECK(uart_pattern_queue_reset(EX_UART_NUM, BUF_SIZE / 8));
+  ESP_ERROR_CHECK(uart_driver_install(EX_UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, UART_QUEUE_LEN, &uart_queue, 0));
+  ESP_ERROR_CHECK(event_loop_add_queue(uart_queue, UART_QUEUE_LEN, uart_event_handler));
+  // Frames are found by the imcu.c parser, so the driver only has to hand over bursts
+  ESP_ERROR_CHECK(uart_set_rx_full_threshold(EX_UART_NUM, UART_RX_FULL_THRESHOLD));
+  ESP_ERROR_CHECK(uart_set_rx_timeout(EX_UART_NUM, UART_RX_TOUT_SYMBOLS));
+  ESP_ERROR_CHECK(imcu_init(EX_UART_NUM, handleComms, UART_BAUD_MAX));
+  imcu_set_heartbeat(UART_HEARTBEAT_MS);
   ESP_LOGI(TAG, "UART Initialized");
 }
 
@@ -235,6 +271,7 @@ void initBT(void) {
     ESP_LOGE(BTCONFIG_TAG, "%s enable controller failed\n", __func__);
     return;
   }
+  boot_mark(BOOT_CONTROLLER);
 
   ret = esp_bluedroid_init();
   if (ret) {
@@ -247,6 +284,7 @@ void initBT(void) {
     ESP_LOGE(BTCONFIG_TAG, "%s enable bluedroid failed\n", __func__);
     return;
   }
+  boot_mark(BOOT_BLUEDROID);
 }
 
 void initHID(void) {
@@ -254,6 +292,9 @@ void initHID(void) {
 
   /// register the callback function to the gap module
   esp_ble_gap_register_callback(gap_event_handler);
+  // The advertising data needs no GATT service, it is set while the attribute tables are created
+  esp_ble_gap_set_device_name(HIDD_DEVICE_NAME);
+  esp_ble_gap_config_adv_data(&hidd_adv_data);
   hid_device_register_callbacks(hidd_event_callback);
 
   /* set the security iocap & auth_req & key size & init key response key parameters to the stack*/
@@ -273,20 +314,44 @@ you can distribute to the slave. */
   esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rsp_key, sizeof(uint8_t));
 }
 
-void handleComms(uint8_t* cmdBuffer) {
-  switch (cmdBuffer[0]) {
+// Bring up the BT stack and the HID profile, then leave
+static void bt_start_task(void* arg) {
+  initBT();
+  initHID();
+  vTaskDelete(NULL);
+}
+
+void handleComms(uint8_t command, const uint8_t* data, uint8_t length, void* ctx) {
+  uint8_t value = length ? data[0] : 0;
+  ESP_LOGI(UARTTAG, "C:0x%02X D:0x%02X", command, value);
+  switch (command) {
     case ACK_REQ:
-      txInterMcu(IMCU_ACK, 0);
+      txInterMcu(IMCU_ACK, imcu_rx_seq());
       break;
     case HOST_USB_CONN:
       break;
     case HOST_USB_DISCONN:
       break;
     case KB_MODE:
-      if (cmdBuffer[1] <= 1) keyboard_mode = cmdBuffer[1];
+      if (value <= 1) setKeyboardMode(value);
       break;
     case TEST_MESSAGE:
       break;
+    case LATENCY_REQ:
+      txLatencyStats();
+      if (value) latency_reset();
+      break;
+    case POWER_REQ:
+      txPowerStats();
+      break;
+    case BOOT_REQ:
+      txBootTrace();
+      break;
+    case KEYMAP_CMD: {
+      esp_err_t ret = keymap_store_apply(data, length);
+      if (ret != ESP_OK) ESP_LOGW(UARTTAG, "Keymap command rejected: %s", esp_err_to_name(ret));
+      break;
+    }
     default:
       break;
   }
@@ -0,0 +1,210 @@
+// Interrupt driven key matrix scanner
+//
+// At idle every column is parked high and the rows (plus PIN_ROT_SW) are armed with a high level
+// interrupt. The first press signals APP_EVENT_MATRIX straight from the ISR, after which the matrix is
+// scanned on a short esp_timer period until every key is released and the columns are parked again.
+// While the ATmega owns the matrix (USB mode) only PIN_ROT_SW is armed and reported, the same way.
+
+#include "matrix.h"
+
+#include <esp32/rom/ets_sys.h>
+
+#include "board.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "event_loop.h"
+#include "freertos/FreeRTOS.h"
+
+#define MATRIX_TAG "MATRIX"
+#define MATRIX_NUM_COLS 3
+#define MATRIX_NUM_ROWS 3
+
+static const gpio_num_t matrix_cols[MATRIX_NUM_COLS] = {PIN_COL0, PIN_COL1, PIN_COL2};
+static const gpio_num_t matrix_rows[MATRIX_NUM_ROWS] = {PIN_ROW0, PIN_ROW1, PIN_ROW2};
+
+static esp_timer_handle_t matrix_timer = NULL;
+static bool matrix_started = false;
+static uint16_t matrix_last_status = 0;
+static volatile bool matrix_enabled = true;
+static volatile bool matrix_edge_pending = false;
+static volatile uint32_t matrix_edge_us = 0;
+
+static void matrix_wake_intr_enable(bool enable) {
+  for (int row = 0; row < MATRIX_NUM_ROWS; row++) {
+    if (enable && matrix_enabled)
+      gpio_intr_enable(matrix_rows[row]);
+    else
+      gpio_intr_disable(matrix_rows[row]);
+  }
+  if (enable)
+    gpio_intr_enable(PIN_ROT_SW);
+  else
+    gpio_intr_disable(PIN_ROT_SW);
+}
+
+static void IRAM_ATTR matrix_isr_handler(void* arg) {
+  BaseType_t higher_priority_woken = pdFALSE;
+
+  matrix_edge_us = (uint32_t)esp_timer_get_time();
+  matrix_edge_pending = true;
+
+  // Level triggered, so keep the rows quiet until the scanner parks the columns again
+  for (int row = 0; row < MATRIX_NUM_ROWS; row++) {
+    gpio_intr_disable(matrix_rows[row]);
+  }
+  gpio_intr_disable(PIN_ROT_SW);
+
+  event_loop_signal_from_isr(APP_EVENT_MATRIX, &higher_priority_woken);
+  if (higher_priority_woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+static void matrix_timer_callback(void* arg) {
+  event_loop_signal(APP_EVENT_MATRIX);
+}
+
+// Drive every column high so that any press pulls its row up, then arm the row interrupts
+static void matrix_park(void) {
+  if (matrix_enabled) {
+    for (int col = 0; col < MATRIX_NUM_COLS; col++) {
+      gpio_set_level(matrix_cols[col], 1);
+    }
+  }
+  matrix_wake_intr_enable(true);
+}
+
+esp_err_t matrix_init(void) {
+  gpio_config_t col_config;
+  col_config.intr_type = GPIO_INTR_DISABLE;
+  col_config.mode = GPIO_MODE_OUTPUT;
+  col_config.pin_bit_mask = PIN_COL_MASK;
+  col_config.pull_down_en = 0;
+  col_config.pull_up_en = 0;
+  gpio_config(&col_config);
+
+  gpio_config_t row_config;
+  row_config.intr_type = GPIO_INTR_HIGH_LEVEL;
+  row_config.mode = GPIO_MODE_INPUT;
+  row_config.pin_bit_mask = PIN_ROW_MASK | (1ULL << PIN_ROT_SW);
+  row_config.pull_down_en = 0;
+  row_config.pull_up_en = 0;
+  gpio_config(&row_config);
+
+  // Interrupts stay off until matrix_start() parks the matrix for the first time
+  matrix_wake_intr_enable(false);
+
+  esp_err_t ret = gpio_install_isr_service(0);
+  if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(MATRIX_TAG, "%s install gpio isr service failed", __func__);
+    return ret;
+  }
+  for (int row = 0; row < MATRIX_NUM_ROWS; row++) {
+    gpio_isr_handler_add(matrix_rows[row], matrix_isr_handler, NULL);
+  }
+  gpio_isr_handler_add(PIN_ROT_SW, matrix_isr_handler, NULL);
+
+  const esp_timer_create_args_t timer_args = {
+      .callback = matrix_timer_callback,
+      .name = "matrix_scan",
+  };
+  ret = esp_timer_create(&timer_args, &matrix_timer);
+  if (ret != ESP_OK) {
+    ESP_LOGE(MATRIX_TAG, "%s create scan timer failed", __func__);
+    return ret;
+  }
+
+  ESP_LOGI(MATRIX_TAG, "Matrix Initialized");
+  return ESP_OK;
+}
+
+uint16_t matrix_scan(void) {
+  uint16_t buttonStatus = 0;
+
+  for (int col = 0; col < MATRIX_NUM_COLS; col++) {
+    gpio_set_level(matrix_cols[col], 0);
+  }
+
+  for (int col = 0; col < MATRIX_NUM_COLS; col++) {
+    gpio_set_level(matrix_cols[col], 1);
+    ets_delay_us(MATRIX_SETTLE_US);
+    for (int row = 0; row < MATRIX_NUM_ROWS; row++) {
+      if (gpio_get_level(matrix_rows[row])) {
+        buttonStatus |= (1 << (1 + col * MATRIX_NUM_ROWS + row));
+      }
+    }
+    gpio_set_level(matrix_cols[col], 0);
+  }
+
+  if (gpio_get_level(PIN_ROT_SW)) {
+    buttonStatus |= (1 << MATRIX_ROT_SW_BIT);
+  }
+
+  return buttonStatus;
+}
+
+static void matrix_timer_run(void) {
+  if (!esp_timer_is_active(matrix_timer)) {
+    esp_timer_start_periodic(matrix_timer, MATRIX_SCAN_INTERVAL_US);
+  }
+}
+
+void matrix_start(void) {
+  matrix_started = true;
+  matrix_park();
+}
+
+uint16_t matrix_read(void) {
+  matrix_last_status = matrix_enabled ? matrix_scan() : gpio_get_level(PIN_ROT_SW) << MATRIX_ROT_SW_BIT;
+  return matrix_last_status;
+}
+
+void matrix_rearm(bool busy) {
+  if (matrix_last_status || busy) {
+    matrix_timer_run();
+  } else {
+    if (esp_timer_is_active(matrix_timer)) {
+      esp_timer_stop(matrix_timer);
+    }
+    matrix_park();
+  }
+}
+
+bool matrix_take_edge(uint32_t* edge_us) {
+  if (!matrix_edge_pending) return false;
+  matrix_edge_pending = false;
+  *edge_us = matrix_edge_us;
+  return true;
+}
+
+void matrix_enable(bool enable) {
+  gpio_config_t col_config;
+  col_config.intr_type = GPIO_INTR_DISABLE;
+  col_config.pin_bit_mask = PIN_COL_MASK;
+  col_config.pull_down_en = 0;
+  col_config.pull_up_en = 0;
+
+  if (enable) {
+    col_config.mode = GPIO_MODE_OUTPUT;
+    gpio_config(&col_config);
+    matrix_enabled = true;
+    if (matrix_started) {
+      matrix_park();
+    }
+  } else {
+    matrix_wake_intr_enable(false);
+    matrix_enabled = false;
+    if (esp_timer_is_active(matrix_timer)) {
+      esp_timer_stop(matrix_timer);
+    }
+    // High impedance so the ATmega can scan
+    col_config.mode = GPIO_MODE_INPUT;
+    gpio_config(&col_config);
+    // Flush out a release, the next scan then parks on PIN_ROT_SW alone
+    if (matrix_started) {
+      event_loop_signal(APP_EVENT_MATRIX);
+    }
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef MATRIX_H__
+#define MATRIX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define MATRIX_SCAN_INTERVAL_US 1000  // Scan period while any key is held
+#define MATRIX_SETTLE_US 5            // Row settle time after a column is driven
+
+#define MATRIX_ROT_SW_BIT 10  // Button status bit of PIN_ROT_SW, matrix keys occupy bits 1..9
+
+// Configure the matrix GPIOs, the row edge interrupts and the held-key scan timer
+esp_err_t matrix_init(void);
+
+// Scan all columns and PIN_ROT_SW once, returns the raw button status
+uint16_t matrix_scan(void);
+
+// Arm the row interrupts for the first time, call from the task that handles APP_EVENT_MATRIX
+void matrix_start(void);
+
+// Scan after an APP_EVENT_MATRIX and return the button status. With the matrix released to the ATmega only the
+// PIN_ROT_SW bit is reported.
+uint16_t matrix_read(void);
+
+// Call once the status from matrix_read() has been handled. While any key is held, or the caller is busy (e.g.
+// still debouncing), another scan is signalled after MATRIX_SCAN_INTERVAL_US; otherwise the columns are parked
+// high until the next row interrupt.
+void matrix_rearm(bool busy);
+
+// Time of the row interrupt behind the last wake-up, true only once per interrupt
+bool matrix_take_edge(uint32_t* edge_us);
+
+// Hand the matrix to the ESP (true) or release the columns so the ATmega can scan (false)
+void matrix_enable(bool enable);
+
+#endif /* MATRIX_H__ */
@@ -0,0 +1,266 @@
+// Power source tracking and power management policy
+//
+// PIN_5VDET tells USB power from battery. On USB the CPU stays at full speed with light sleep locked out, the
+// ATmega is up and talks over the UART. On battery the locks are released, so with CONFIG_PM_ENABLE the CPU
+// drops to POWER_MIN_FREQ_MHZ whenever nothing holds it up and the tickless idle task enters light sleep
+// between events. Nothing polls, so the chip only wakes for input, timers and the BLE controller.
+//
+// Light sleep gates the GPIO interrupts, only a pin armed with gpio_wakeup_enable() brings the chip back and
+// the wake-up level is the interrupt type of the pin. The rows and PIN_ROT_SW already interrupt on a high level,
+// PIN_5VDET interrupts on the level opposite to the one it settled at and is armed again after each change.
+//
+// The time spent in each PowerMode is kept without CONFIG_PM_PROFILING and its bookkeeping on every lock. The
+// idle hook of each core marks it idle, its next tick interrupt marks it busy again, and the chip is idle while
+// every core is. A wake-up is only noticed at the next tick, so up to a tick of work per wake counts as idle.
+
+#include "power.h"
+
+#include <stdio.h>
+
+#include "board.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_freertos_hooks.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "event_loop.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#if CONFIG_PM_ENABLE
+#include "esp32/pm.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#endif
+
+#define POWER_TAG "POWER"
+
+static const char* const power_source_names[POWER_SOURCE_MAX] = {
+    [POWER_SOURCE_BATTERY] = "battery",
+    [POWER_SOURCE_USB] = "usb",
+};
+
+static const char* const power_mode_names[POWER_MODE_MAX] = {
+    [POWER_MODE_CPU_MAX] = "cpu_max",
+    [POWER_MODE_ACTIVE] = "active",
+    [POWER_MODE_IDLE] = "idle",
+};
+
+static esp_timer_handle_t power_settle_timer = NULL;
+
+// Only the settle timer changes the source once power_init() has returned
+static portMUX_TYPE power_lock = portMUX_INITIALIZER_UNLOCKED;
+static PowerSource power_current = POWER_SOURCE_MAX;
+static int64_t power_since_us = 0;
+static uint64_t power_residency_us[POWER_SOURCE_MAX];
+// Also written from the idle and tick hooks of both cores
+static PowerMode power_mode = POWER_MODE_CPU_MAX;
+static int64_t power_mode_since_us = 0;
+static uint64_t power_mode_us[POWER_MODE_MAX];
+static uint32_t power_idle_cores = 0;
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t power_cpu_lock = NULL;
+static esp_pm_lock_handle_t power_sleep_lock = NULL;
+#endif
+
+// Call with power_lock held
+static void IRAM_ATTR power_mode_set(PowerMode mode, int64_t now) {
+  if (mode == power_mode) return;
+  power_mode_us[power_mode] += now - power_mode_since_us;
+  power_mode = mode;
+  power_mode_since_us = now;
+}
+
+#if CONFIG_PM_ENABLE
+static bool power_idle_hook(void) {
+  portENTER_CRITICAL(&power_lock);
+  power_idle_cores |= 1 << xPortGetCoreID();
+  if (power_current == POWER_SOURCE_BATTERY && power_idle_cores == (1 << portNUM_PROCESSORS) - 1) {
+    power_mode_set(POWER_MODE_IDLE, esp_timer_get_time());
+  }
+  portEXIT_CRITICAL(&power_lock);
+  return true;
+}
+
+static void IRAM_ATTR power_tick_hook(void) {
+  portENTER_CRITICAL_ISR(&power_lock);
+  power_idle_cores &= ~(1 << xPortGetCoreID());
+  if (power_mode == POWER_MODE_IDLE) power_mode_set(POWER_MODE_ACTIVE, esp_timer_get_time());
+  portEXIT_CRITICAL_ISR(&power_lock);
+}
+#endif
+
+static void power_apply(PowerSource source) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&power_lock);
+  PowerSource previous = power_current;
+  if (previous != POWER_SOURCE_MAX) power_residency_us[previous] += now - power_since_us;
+  power_current = source;
+  power_since_us = now;
+#if CONFIG_PM_ENABLE
+  power_mode_set(source == POWER_SOURCE_USB ? POWER_MODE_CPU_MAX : POWER_MODE_ACTIVE, now);
+#endif
+  portEXIT_CRITICAL(&power_lock);
+  if (source == previous) return;
+
+#if CONFIG_PM_ENABLE
+  if (source == POWER_SOURCE_USB) {
+    esp_pm_lock_acquire(power_cpu_lock);
+    esp_pm_lock_acquire(power_sleep_lock);
+  } else if (previous == POWER_SOURCE_USB) {
+    esp_pm_lock_release(power_cpu_lock);
+    esp_pm_lock_release(power_sleep_lock);
+  }
+#endif
+  ESP_LOGI(POWER_TAG, "Running on %s", power_source_names[source]);
+  event_loop_signal(APP_EVENT_POWER);
+}
+
+static void power_detect_arm(int level) {
+  gpio_int_type_t intr_type = level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+#if CONFIG_PM_ENABLE
+  gpio_wakeup_enable(PIN_5VDET, intr_type);
+#else
+  gpio_set_intr_type(PIN_5VDET, intr_type);
+#endif
+  gpio_intr_enable(PIN_5VDET);
+}
+
+static void power_settle_callback(void* arg) {
+  int level = gpio_get_level(PIN_5VDET);
+
+  power_apply(level ? POWER_SOURCE_USB : POWER_SOURCE_BATTERY);
+  power_detect_arm(level);
+}
+
+// Plugging in bounces, the level is only trusted POWER_DETECT_SETTLE_MS after the first change
+static void IRAM_ATTR power_detect_isr(void* arg) {
+  gpio_intr_disable(PIN_5VDET);
+  esp_timer_stop(power_settle_timer);
+  esp_timer_start_once(power_settle_timer, POWER_DETECT_SETTLE_MS * 1000);
+}
+
+esp_err_t power_init(void) {
+  esp_err_t ret;
+
+#if CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t pm_config = {
+      .max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+      .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+      .light_sleep_enable = true,
+  };
+  ret = esp_pm_configure(&pm_config);
+  if (ret != ESP_OK) {
+    ESP_LOGE(POWER_TAG, "%s configure power management failed", __func__);
+    return ret;
+  }
+  ret = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "usb_cpu", &power_cpu_lock);
+  if (ret != ESP_OK) return ret;
+  ret = esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "usb_sleep", &power_sleep_lock);
+  if (ret != ESP_OK) return ret;
+
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    if ((PIN_ROW_MASK | (1ULL << PIN_ROT_SW)) & (1ULL << gpio)) gpio_wakeup_enable(gpio, GPIO_INTR_HIGH_LEVEL);
+  }
+  ret = esp_sleep_enable_gpio_wakeup();
+  if (ret != ESP_OK) {
+    ESP_LOGE(POWER_TAG, "%s enable gpio wakeup failed", __func__);
+    return ret;
+  }
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    ret = esp_register_freertos_idle_hook_for_cpu(power_idle_hook, core);
+    if (ret == ESP_OK) ret = esp_register_freertos_tick_hook_for_cpu(power_tick_hook, core);
+    if (ret != ESP_OK) {
+      ESP_LOGE(POWER_TAG, "%s register freertos hooks failed", __func__);
+      return ret;
+    }
+  }
+#endif
+
+  const esp_timer_create_args_t timer_args = {
+      .callback = power_settle_callback,
+      .name = "power_settle",
+  };
+  ret = esp_timer_create(&timer_args, &power_settle_timer);
+  if (ret != ESP_OK) return ret;
+
+  gpio_config_t det5v_config;
+  det5v_config.mode = GPIO_MODE_INPUT;
+  det5v_config.pin_bit_mask = (1ULL << PIN_5VDET);
+  det5v_config.intr_type = GPIO_INTR_DISABLE;
+  det5v_config.pull_down_en = 0;
+  det5v_config.pull_up_en = 0;
+  gpio_config(&det5v_config);
+
+  ret = gpio_install_isr_service(0);
+  if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(POWER_TAG, "%s install gpio isr service failed", __func__);
+    return ret;
+  }
+  ret = gpio_isr_handler_add(PIN_5VDET, power_detect_isr, NULL);
+  if (ret != ESP_OK) return ret;
+
+  power_settle_callback(NULL);
+  return ESP_OK;
+}
+
+PowerSource power_source(void) {
+  return power_current;
+}
+
+void power_get_residency(uint32_t residency_ms[POWER_SOURCE_MAX]) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&power_lock);
+  for (int source = 0; source < POWER_SOURCE_MAX; source++) {
+    uint64_t us = power_residency_us[source];
+    if (source == power_current) us += now - power_since_us;
+    residency_ms[source] = us / 1000;
+  }
+  portEXIT_CRITICAL(&power_lock);
+}
+
+void power_get_mode_residency(uint32_t residency_ms[POWER_MODE_MAX]) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&power_lock);
+  for (int mode = 0; mode < POWER_MODE_MAX; mode++) {
+    uint64_t us = power_mode_us[mode];
+    if (mode == power_mode) us += now - power_mode_since_us;
+    residency_ms[mode] = us / 1000;
+  }
+  portEXIT_CRITICAL(&power_lock);
+}
+
+size_t power_serialize(uint8_t* buf, size_t len) {
+  uint32_t residency_ms[POWER_SOURCE_MAX + POWER_MODE_MAX];
+  if (len < POWER_SERIALIZED_LEN) return 0;
+
+  power_get_residency(residency_ms);
+  power_get_mode_residency(residency_ms + POWER_SOURCE_MAX);
+  for (int i = 0; i < POWER_SOURCE_MAX + POWER_MODE_MAX; i++) {
+    for (int byte = 0; byte < 4; byte++) {
+      *buf++ = residency_ms[i] >> (8 * byte);
+    }
+  }
+  return POWER_SERIALIZED_LEN;
+}
+
+void power_log(void) {
+  uint32_t residency_ms[POWER_SOURCE_MAX];
+  uint32_t mode_ms[POWER_MODE_MAX];
+  power_get_residency(residency_ms);
+  power_get_mode_residency(mode_ms);
+  for (int source = 0; source < POWER_SOURCE_MAX; source++) {
+    ESP_LOGI(POWER_TAG, "%-8s %u ms%s", power_source_names[source], residency_ms[source],
+             source == power_current ? " (now)" : "");
+  }
+  for (int mode = 0; mode < POWER_MODE_MAX; mode++) {
+    ESP_LOGI(POWER_TAG, "%-8s %u ms%s", power_mode_names[mode], mode_ms[mode], mode == power_mode ? " (now)" : "");
+  }
+#if CONFIG_PM_ENABLE && CONFIG_PM_PROFILING
+  esp_pm_dump_locks(stdout);
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef POWER_H__
+#define POWER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define POWER_MIN_FREQ_MHZ 80      // BLE and the UART baud generator need the 80 MHz APB
+#define POWER_DETECT_SETTLE_MS 50  // PIN_5VDET has to hold its level this long before the source changes
+
+typedef enum PowerSource {
+  POWER_SOURCE_BATTERY = 0,  // DFS down to POWER_MIN_FREQ_MHZ and automatic light sleep
+  POWER_SOURCE_USB,          // Full speed, no light sleep, the ATmega link is up
+  POWER_SOURCE_MAX,
+} PowerSource;
+
+// What the chip does with its time, told apart from the locks power.c drives and the FreeRTOS idle and tick hooks.
+// Idle on battery is light sleep when nothing else holds it off; while something does, the BT controller on its
+// XTAL low power clock for one, the CPU waits for an interrupt at POWER_MIN_FREQ_MHZ instead.
+typedef enum PowerMode {
+  POWER_MODE_CPU_MAX = 0,  // On USB power with the locks held, or power management off
+  POWER_MODE_ACTIVE,       // On battery with something to run, DFS picks the frequency
+  POWER_MODE_IDLE,         // On battery with every core idle, from the idle hook to the next tick
+  POWER_MODE_MAX,
+} PowerMode;
+
+#define POWER_SERIALIZED_LEN ((POWER_SOURCE_MAX + POWER_MODE_MAX) * sizeof(uint32_t))
+
+// Configure power management, watch PIN_5VDET and apply the policy for the source present at boot. Every later
+// change of source is signalled as APP_EVENT_POWER.
+esp_err_t power_init(void);
+
+PowerSource power_source(void);
+
+// Milliseconds spent on each source since boot
+void power_get_residency(uint32_t residency_ms[POWER_SOURCE_MAX]);
+
+// Milliseconds spent in each mode since boot
+void power_get_mode_residency(uint32_t residency_ms[POWER_MODE_MAX]);
+
+// Residency per source then per mode as little endian uint32 milliseconds, returns the bytes written
+size_t power_serialize(uint8_t* buf, size_t len);
+
+// Log the residency per source and per mode and, with CONFIG_PM_PROFILING, the esp_pm lock and mode statistics
+void power_log(void);
+
+#endif /* POWER_H__ */
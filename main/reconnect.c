@@ -0,0 +1,290 @@
+// Reconnect advertising
+//
+// After a disconnect the pad goes after the host that dropped, using high duty cycle directed advertising. A host
+// scanning for its bonded devices answers that in its first scan window. If it does not, the pad falls back to
+// undirected advertising that only the bonded hosts on the white list may connect to. With no host connected
+// after that comes open advertising, so a new host can pair. The bonds are the ones the stack keeps in NVS, the
+// white list holds the ones that are not connected, so up to RECONNECT_MAX_LINKS hosts come back side by side.
+// The time from the disconnect to the first report the stack takes again is kept to track reconnect latency.
+
+#include "reconnect.h"
+
+#include <string.h>
+
+#include "esp_gap_ble_api.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define RECONNECT_TAG "RECONNECT"
+
+static const char* const reconnect_phase_names[RECONNECT_PHASE_MAX] = {"idle", "directed", "white list", "open"};
+
+static portMUX_TYPE reconnect_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t reconnect_timer = NULL;
+static ReconnectPhase reconnect_current = RECONNECT_IDLE;
+static esp_bd_addr_t reconnect_links[RECONNECT_MAX_LINKS];  // Hosts connected
+static int reconnect_link_count = 0;
+static bool reconnect_host_valid = false;  // reconnect_host holds the host directed advertising goes after
+static esp_bd_addr_t reconnect_host;
+static esp_ble_addr_type_t reconnect_host_type;
+static bool reconnect_held = false;           // reconnect_stop() called, advertising stays off
+static int64_t reconnect_down_us = 0;         // Disconnect the clock runs from
+static esp_bd_addr_t reconnect_down_bda;      // Host that dropped, only its own link back stops the clock
+static volatile bool reconnect_waiting = false;  // Clock running, no report to that host since the disconnect
+static volatile bool reconnect_back = false;     // The host is linked again on reconnect_back_conn_id
+static uint16_t reconnect_back_conn_id = 0;
+static bool reconnect_refused_valid = false;  // reconnect_refused holds a link the pad is closing itself
+static esp_bd_addr_t reconnect_refused;
+static ReconnectStats reconnect_stats;
+
+static bool reconnect_linked(const esp_bd_addr_t* links, int count, const esp_bd_addr_t bda) {
+  for (int i = 0; i < count; i++) {
+    if (memcmp(links[i], bda, sizeof(esp_bd_addr_t)) == 0) return true;
+  }
+  return false;
+}
+
+// Put the bonded hosts that are not connected on the white list. If the host directed advertising goes after is
+// connected or lost its bond, the last of them listed takes its place. Returns the number put on the list.
+static int reconnect_load_bonds(void) {
+  esp_ble_bond_dev_t bonds[RECONNECT_MAX_BONDS];
+  esp_bd_addr_t links[RECONNECT_MAX_LINKS];
+  int count = esp_ble_get_bond_device_num();
+  int absent = 0;
+  int last = -1;
+  bool host_absent = false;
+
+  esp_ble_gap_clear_whitelist();
+  if (count <= 0) return 0;
+  if (count > RECONNECT_MAX_BONDS) count = RECONNECT_MAX_BONDS;
+  if (esp_ble_get_bond_device_list(&count, bonds) != ESP_OK) return 0;
+
+  portENTER_CRITICAL(&reconnect_lock);
+  int link_count = reconnect_link_count;
+  memcpy(links, reconnect_links, sizeof(links));
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  for (int i = 0; i < count; i++) {
+    if (reconnect_linked(links, link_count, bonds[i].bd_addr)) continue;
+    esp_ble_wl_addr_type_t type =
+        bonds[i].bond_key.pid_key.addr_type == BLE_ADDR_TYPE_PUBLIC ? BLE_WL_ADDR_TYPE_PUBLIC : BLE_WL_ADDR_TYPE_RANDOM;
+    esp_ble_gap_update_whitelist(true, bonds[i].bd_addr, type);
+    if (reconnect_host_valid && memcmp(bonds[i].bd_addr, reconnect_host, sizeof(esp_bd_addr_t)) == 0) {
+      reconnect_host_type = bonds[i].bond_key.pid_key.addr_type;
+      host_absent = true;
+    }
+    last = i;
+    absent++;
+  }
+  if (last >= 0 && !host_absent) {
+    memcpy(reconnect_host, bonds[last].bd_addr, sizeof(esp_bd_addr_t));
+    reconnect_host_type = bonds[last].bond_key.pid_key.addr_type;
+    reconnect_host_valid = true;
+  }
+  return absent;
+}
+
+static void reconnect_advertise(ReconnectPhase phase, int links) {
+  esp_ble_adv_params_t params = {
+      .adv_int_min = RECONNECT_ADV_INT_MIN,
+      .adv_int_max = RECONNECT_ADV_INT_MAX,
+      .adv_type = ADV_TYPE_IND,
+      .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
+      .channel_map = ADV_CHNL_ALL,
+      .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
+  };
+  uint32_t duration_ms = 0;
+
+  if (phase == RECONNECT_IDLE) {
+    ESP_LOGI(RECONNECT_TAG, "Advertising off, %d hosts connected", links);
+    return;
+  }
+  if (phase == RECONNECT_DIRECTED) {
+    params.adv_type = ADV_TYPE_DIRECT_IND_HIGH;
+    memcpy(params.peer_addr, reconnect_host, sizeof(esp_bd_addr_t));
+    params.peer_addr_type = reconnect_host_type;
+    duration_ms = RECONNECT_DIRECTED_MS;
+  } else if (phase == RECONNECT_WHITELIST) {
+    // Anyone may still scan, so the pad shows up by name, but only bonded hosts connect
+    params.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST;
+    duration_ms = RECONNECT_WHITELIST_MS;
+  } else if (links > 0) {
+    // The hosts still connected keep the pad busy enough, pairing another one is a short window
+    duration_ms = RECONNECT_PAIR_MS;
+  }
+
+  ESP_LOGI(RECONNECT_TAG, "Advertising, %s", reconnect_phase_names[phase]);
+  esp_err_t ret = esp_ble_gap_start_advertising(&params);
+  if (ret != ESP_OK) {
+    ESP_LOGE(RECONNECT_TAG, "%s start advertising failed: %d", __func__, ret);
+  }
+  if (duration_ms != 0) esp_timer_start_once(reconnect_timer, (uint64_t)duration_ms * 1000);
+}
+
+// Move on to the next phase unless a link came up in the meantime. With other hosts connected the white list
+// and pairing windows end with advertising off.
+static void reconnect_timer_callback(void* arg) {
+  portENTER_CRITICAL(&reconnect_lock);
+  ReconnectPhase phase = reconnect_current;
+  int links = reconnect_link_count;
+  bool advance = phase != RECONNECT_IDLE;
+  ReconnectPhase next = RECONNECT_IDLE;
+  if (phase == RECONNECT_DIRECTED) next = RECONNECT_WHITELIST;
+  if (phase == RECONNECT_WHITELIST && links == 0) next = RECONNECT_OPEN;
+  if (advance) reconnect_current = next;
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  if (!advance) return;
+  esp_ble_gap_stop_advertising();
+  reconnect_advertise(next, links);
+}
+
+esp_err_t reconnect_init(void) {
+  const esp_timer_create_args_t timer_args = {
+      .callback = reconnect_timer_callback,
+      .name = "reconnect",
+  };
+  return esp_timer_create(&timer_args, &reconnect_timer);
+}
+
+// Stop whatever is on air and advertise from phase, or the first phase after it that has a host to let in
+static void reconnect_restart(ReconnectPhase phase) {
+  esp_timer_stop(reconnect_timer);
+  // The white list cannot change while advertising uses it
+  esp_ble_gap_stop_advertising();
+  if (reconnect_held) phase = RECONNECT_IDLE;
+  int absent = reconnect_load_bonds();
+
+  portENTER_CRITICAL(&reconnect_lock);
+  int links = reconnect_link_count;
+  if (phase == RECONNECT_DIRECTED && absent == 0) phase = RECONNECT_WHITELIST;
+  if (phase == RECONNECT_WHITELIST && absent == 0) phase = links == 0 ? RECONNECT_OPEN : RECONNECT_IDLE;
+  if (links >= RECONNECT_MAX_LINKS) phase = RECONNECT_IDLE;
+  reconnect_current = phase;
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  reconnect_advertise(phase, links);
+}
+
+void reconnect_start(void) {
+  reconnect_held = false;
+  reconnect_restart(RECONNECT_DIRECTED);
+}
+
+void reconnect_stop(void) {
+  reconnect_held = true;
+  reconnect_restart(RECONNECT_IDLE);
+}
+
+void reconnect_connected(const esp_bd_addr_t bda, uint16_t conn_id) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&reconnect_lock);
+  if (!reconnect_linked(reconnect_links, reconnect_link_count, bda) && reconnect_link_count < RECONNECT_MAX_LINKS) {
+    memcpy(reconnect_links[reconnect_link_count++], bda, sizeof(esp_bd_addr_t));
+  }
+  reconnect_stats.connects[reconnect_current]++;
+  if (reconnect_waiting && memcmp(reconnect_down_bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+    reconnect_stats.link_us = now - reconnect_down_us;
+    reconnect_back_conn_id = conn_id;
+    reconnect_back = true;
+  }
+  ReconnectPhase phase = reconnect_current;
+  reconnect_current = RECONNECT_IDLE;
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  esp_timer_stop(reconnect_timer);
+  ESP_LOGI(RECONNECT_TAG, "Connected while advertising %s", reconnect_phase_names[phase]);
+  // The other bonded hosts may still come back alongside this one
+  reconnect_restart(RECONNECT_WHITELIST);
+}
+
+void reconnect_disconnected(const esp_bd_addr_t bda) {
+  portENTER_CRITICAL(&reconnect_lock);
+  for (int i = 0; i < reconnect_link_count; i++) {
+    if (memcmp(reconnect_links[i], bda, sizeof(esp_bd_addr_t)) != 0) continue;
+    memmove(&reconnect_links[i], &reconnect_links[i + 1], (reconnect_link_count - i - 1) * sizeof(esp_bd_addr_t));
+    reconnect_link_count--;
+    break;
+  }
+  if (reconnect_refused_valid && memcmp(reconnect_refused, bda, sizeof(esp_bd_addr_t)) == 0) {
+    reconnect_refused_valid = false;
+    portEXIT_CRITICAL(&reconnect_lock);
+    reconnect_restart(RECONNECT_DIRECTED);
+    return;
+  }
+  reconnect_down_us = esp_timer_get_time();
+  memcpy(reconnect_down_bda, bda, sizeof(esp_bd_addr_t));
+  reconnect_waiting = true;
+  reconnect_back = false;
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  reconnect_seek(bda);
+}
+
+void reconnect_refuse(const esp_bd_addr_t bda) {
+  portENTER_CRITICAL(&reconnect_lock);
+  memcpy(reconnect_refused, bda, sizeof(esp_bd_addr_t));
+  reconnect_refused_valid = true;
+  portEXIT_CRITICAL(&reconnect_lock);
+}
+
+void reconnect_seek(const esp_bd_addr_t bda) {
+  portENTER_CRITICAL(&reconnect_lock);
+  memcpy(reconnect_host, bda, sizeof(esp_bd_addr_t));
+  reconnect_host_valid = true;
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  reconnect_restart(RECONNECT_DIRECTED);
+}
+
+void reconnect_pair(void) {
+  reconnect_restart(RECONNECT_OPEN);
+}
+
+void reconnect_prefer(const esp_bd_addr_t bda) {
+  portENTER_CRITICAL(&reconnect_lock);
+  memcpy(reconnect_host, bda, sizeof(esp_bd_addr_t));
+  reconnect_host_valid = true;
+  portEXIT_CRITICAL(&reconnect_lock);
+}
+
+void reconnect_bonded(const esp_bd_addr_t bda, esp_ble_addr_type_t addr_type) {
+  portENTER_CRITICAL(&reconnect_lock);
+  memcpy(reconnect_host, bda, sizeof(esp_bd_addr_t));
+  reconnect_host_type = addr_type;
+  reconnect_host_valid = true;
+  portEXIT_CRITICAL(&reconnect_lock);
+}
+
+void reconnect_report_sent(uint16_t conn_id) {
+  if (!reconnect_back) return;
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&reconnect_lock);
+  bool first = reconnect_back && reconnect_back_conn_id == conn_id;
+  if (first) reconnect_waiting = reconnect_back = false;
+  uint32_t report_us = now - reconnect_down_us;
+  if (first) {
+    reconnect_stats.count++;
+    reconnect_stats.report_us = report_us;
+    if (report_us > reconnect_stats.max_report_us) reconnect_stats.max_report_us = report_us;
+  }
+  uint32_t link_us = reconnect_stats.link_us;
+  portEXIT_CRITICAL(&reconnect_lock);
+
+  if (first) {
+    ESP_LOGI(RECONNECT_TAG, "Link back after %u ms, first report after %u ms", link_us / 1000, report_us / 1000);
+  }
+}
+
+ReconnectPhase reconnect_phase(void) {
+  return reconnect_current;
+}
+
+void reconnect_get_stats(ReconnectStats* stats) {
+  portENTER_CRITICAL(&reconnect_lock);
+  *stats = reconnect_stats;
+  portEXIT_CRITICAL(&reconnect_lock);
+}
@@ -0,0 +1,76 @@
+#ifndef RECONNECT_H__
+#define RECONNECT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_bt_defs.h"
+#include "esp_err.h"
+
+#define RECONNECT_MAX_BONDS 8          // Bonds read from the stack, and white list entries
+#define RECONNECT_DIRECTED_MS 1280     // High duty cycle directed advertising, the controller stops it after 1.28 s
+#define RECONNECT_WHITELIST_MS 30000   // Bonded hosts only, then anyone may connect and pair
+#define RECONNECT_PAIR_MS 60000        // Open advertising for a new host while others stay connected
+#define RECONNECT_MAX_LINKS 3          // Hosts connected at once, CONFIG_BTDM_CTRL_BLE_MAX_CONN
+#define RECONNECT_ADV_INT_MIN 0x20     // Undirected advertising, Time = N * 0.625 msec
+#define RECONNECT_ADV_INT_MAX 0x30
+
+typedef enum ReconnectPhase {
+  RECONNECT_IDLE = 0,     // Not advertising: every host is back, the stack is not up yet or the time ran out
+  RECONNECT_DIRECTED,     // Directed at one host, no one else can connect
+  RECONNECT_WHITELIST,    // Undirected, only the bonded hosts that are not connected can connect
+  RECONNECT_OPEN,         // Undirected, anyone can connect
+  RECONNECT_PHASE_MAX,
+} ReconnectPhase;
+
+typedef struct ReconnectStats {
+  uint32_t connects[RECONNECT_PHASE_MAX];  // Links that came up in each phase
+  uint32_t count;                          // Disconnects followed by a report to the same host reaching the stack
+  uint32_t link_us;                        // Disconnect to the link coming back, last reconnect
+  uint32_t report_us;                      // Disconnect to the first report the stack took, last reconnect
+  uint32_t max_report_us;
+} ReconnectStats;
+
+esp_err_t reconnect_init(void);
+
+// Advertise from the first phase that applies to the bonded hosts that are not connected: directed at the last
+// host when it is one of them, the white list when there are any, open advertising when no host is connected.
+// Call once the advertising data is set.
+void reconnect_start(void);
+
+// Advertising off until the next reconnect_start(), whatever connects or drops meanwhile, e.g. while the links
+// close for a deep sleep
+void reconnect_stop(void);
+
+// Link up, advertising has stopped. The white list phase starts over while bonded hosts are still missing.
+void reconnect_connected(const esp_bd_addr_t bda, uint16_t conn_id);
+
+// Link down, starts the reconnect clock and then advertising directed at that host
+void reconnect_disconnected(const esp_bd_addr_t bda);
+
+// The pad is about to close a link itself, e.g. for want of a host slot. Its disconnect neither starts the
+// reconnect clock nor goes after that host, advertising starts over for the others.
+void reconnect_refuse(const esp_bd_addr_t bda);
+
+// Go after a bonded host that is not connected, directed and then white list advertising
+void reconnect_seek(const esp_bd_addr_t bda);
+
+// Open advertising so a new host can pair, for RECONNECT_PAIR_MS when other hosts are connected
+void reconnect_pair(void);
+
+// Make a bonded host the one directed advertising goes after first, without advertising yet, e.g. the active
+// host kept through a deep sleep
+void reconnect_prefer(const esp_bd_addr_t bda);
+
+// Pairing with a host completed, it is the one directed advertising goes after from now on
+void reconnect_bonded(const esp_bd_addr_t bda, esp_ble_addr_type_t addr_type);
+
+// A report was handed to the stack, stops the reconnect clock on the first one that goes to the host that
+// dropped over its new link. Reports to the hosts that stayed connected leave the clock running.
+void reconnect_report_sent(uint16_t conn_id);
+
+ReconnectPhase reconnect_phase(void);
+
+void reconnect_get_stats(ReconnectStats* stats);
+
+#endif /* RECONNECT_H__ */
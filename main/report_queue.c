@@ -0,0 +1,312 @@
+// Lock-free HID report pipeline
+//
+// Every input task owns one single-producer/single-consumer ring. Producers copy fixed size report
+// records in and notify the sender task, which is the only caller of esp_ble_gatts_send_indicate.
+// Records are drained in global push order so the interleaving between rings never depends on timing. A
+// producer takes its sequence number before it publishes the record, so the sender stops at a gap in the
+// numbers: the missing record is still being published on another ring, and its kick brings the sender back.
+
+#include "report_queue.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hid_dev.h"
+#include "reconnect.h"
+
+#define REPORT_QUEUE_TAG "REPORT_QUEUE"
+#define REPORT_QUEUE_MASK (REPORT_QUEUE_DEPTH - 1)
+
+#if (REPORT_QUEUE_DEPTH & REPORT_QUEUE_MASK) != 0
+#error "REPORT_QUEUE_DEPTH must be a power of two"
+#endif
+
+typedef struct ReportRing {
+  TaskHandle_t owner;
+  LatencyTrace* trace;  // Attached to the next push, producer only
+  uint32_t head;  // Written by the producer only
+  uint32_t tail;  // Written by the sender only
+  HIDReportRecord records[REPORT_QUEUE_DEPTH];
+} ReportRing;
+
+static ReportRing report_rings[REPORT_QUEUE_MAX_PRODUCERS];
+static portMUX_TYPE report_rings_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t report_queue_task_handle = NULL;
+static uint32_t report_queue_seq = 0;
+static uint32_t report_queue_next_seq = 0;  // Sequence number the sender takes next, sender only
+static ReportQueueStats report_queue_stats;
+
+// Reports held back while the link is congested, in send order, only touched by the sender task
+static HIDReportRecord report_queue_held[REPORT_QUEUE_HELD_DEPTH];
+static uint8_t report_queue_held_count = 0;
+static bool report_queue_retry = false;
+static int64_t report_queue_congest_start = 0;
+static volatile bool report_queue_congested = false;
+
+static ReportRing* report_queue_own_ring(void) {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (int i = 0; i < REPORT_QUEUE_MAX_PRODUCERS; i++) {
+    if (report_rings[i].owner == self) return &report_rings[i];
+  }
+  return NULL;
+}
+
+esp_err_t report_queue_register_producer(void) {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  esp_err_t ret = ESP_ERR_NO_MEM;
+
+  portENTER_CRITICAL(&report_rings_lock);
+  for (int i = 0; i < REPORT_QUEUE_MAX_PRODUCERS; i++) {
+    if (report_rings[i].owner == self) {
+      ret = ESP_OK;
+      break;
+    }
+    if (report_rings[i].owner == NULL) {
+      report_rings[i].owner = self;
+      ret = ESP_OK;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&report_rings_lock);
+
+  if (ret != ESP_OK) ESP_LOGE(REPORT_QUEUE_TAG, "%s no free producer ring", __func__);
+  return ret;
+}
+
+bool report_queue_push(uint16_t conn_id, uint8_t id, uint8_t type, uint8_t length, const uint8_t* data) {
+  ReportRing* ring = report_queue_own_ring();
+  if (ring == NULL || length > REPORT_QUEUE_RECORD_LEN) {
+    __atomic_fetch_add(&report_queue_stats.dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= REPORT_QUEUE_DEPTH) {
+    ring->trace = NULL;
+    __atomic_fetch_add(&report_queue_stats.dropped, 1, __ATOMIC_RELAXED);
+    ESP_LOGW(REPORT_QUEUE_TAG, "Ring full, dropping report id %d", id);
+    return false;
+  }
+
+  HIDReportRecord* record = &ring->records[head & REPORT_QUEUE_MASK];
+  if (ring->trace != NULL) {
+    latency_stamp(ring->trace, LATENCY_STAGE_ENQUEUE);
+    record->trace = *ring->trace;
+    ring->trace = NULL;
+  } else {
+    latency_trace_reset(&record->trace);
+  }
+  record->seq = __atomic_fetch_add(&report_queue_seq, 1, __ATOMIC_RELAXED);
+  record->conn_id = conn_id;
+  record->id = id;
+  record->type = type;
+  record->length = length;
+  memcpy(record->data, data, length);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&report_queue_stats.pushed, 1, __ATOMIC_RELAXED);
+
+  report_queue_kick();
+  return true;
+}
+
+void report_queue_trace(LatencyTrace* trace) {
+  ReportRing* ring = report_queue_own_ring();
+  if (ring != NULL) ring->trace = trace;
+}
+
+void report_queue_trace_stamp(LatencyStage stage) {
+  ReportRing* ring = report_queue_own_ring();
+  if (ring != NULL && ring->trace != NULL) latency_stamp(ring->trace, stage);
+}
+
+void report_queue_kick(void) {
+  if (report_queue_task_handle != NULL) {
+    xTaskNotifyGive(report_queue_task_handle);
+  }
+}
+
+bool report_queue_busy(void) {
+  return report_queue_congested || __atomic_load_n(&report_queue_held_count, __ATOMIC_RELAXED);
+}
+
+void report_queue_set_congested(bool congested) {
+  if (congested == report_queue_congested) return;
+
+  int64_t now = esp_timer_get_time();
+  if (congested) {
+    report_queue_congest_start = now;
+    report_queue_stats.congestion_events++;
+  } else {
+    report_queue_stats.congested_us += now - report_queue_congest_start;
+  }
+  report_queue_congested = congested;
+  report_queue_kick();
+}
+
+// Ring holding the oldest unsent record across all producers, NULL if everything is drained or the next record
+// in push order is not published yet
+static ReportRing* report_queue_next_ring(void) {
+  ReportRing* next = NULL;
+  uint32_t next_seq = 0;
+
+  for (int i = 0; i < REPORT_QUEUE_MAX_PRODUCERS; i++) {
+    ReportRing* ring = &report_rings[i];
+    uint32_t tail = ring->tail;
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) continue;
+
+    uint32_t seq = ring->records[tail & REPORT_QUEUE_MASK].seq;
+    if (next == NULL || (int32_t)(seq - next_seq) < 0) {
+      next = ring;
+      next_seq = seq;
+    }
+  }
+  return next != NULL && next_seq == report_queue_next_seq ? next : NULL;
+}
+
+static void report_queue_pop(ReportRing* ring, HIDReportRecord* record) {
+  uint32_t tail = ring->tail;
+  *record = ring->records[tail & REPORT_QUEUE_MASK];
+  report_queue_next_seq = record->seq + 1;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// A queued keyboard report makes an older one redundant if it still holds every key the older one held,
+// the older one was just an intermediate step of a chord. Anything else must go out to keep taps intact.
+static bool report_queue_supersedes(const HIDReportRecord* older, const HIDReportRecord* newer) {
+  if (older->id != newer->id || older->type != newer->type || older->conn_id != newer->conn_id ||
+      older->length != newer->length) {
+    return false;
+  }
+  // Only the latest Battery Level is worth notifying
+  if (older->type == HID_REPORT_TYPE_BATTERY) return true;
+  if (memcmp(older->data, newer->data, older->length) == 0) return true;
+  if (older->id == HID_RPT_ID_NKRO_IN && older->length == HID_NKRO_IN_RPT_LEN) {
+    // Modifiers and bitmap alike, nothing set in the older report may be clear in the newer one
+    uint32_t old_bits[HID_NKRO_USAGE_WORDS], new_bits[HID_NKRO_USAGE_WORDS];
+    if (older->data[0] & ~newer->data[0]) return false;
+    memcpy(old_bits, &older->data[1], sizeof(old_bits));
+    memcpy(new_bits, &newer->data[1], sizeof(new_bits));
+    for (int word = 0; word < HID_NKRO_USAGE_WORDS; word++) {
+      if (old_bits[word] & ~new_bits[word]) return false;
+    }
+    return true;
+  }
+  if (older->id != HID_RPT_ID_KEY_IN || older->length != HID_KEYBOARD_IN_RPT_LEN) return false;
+
+  if (older->data[0] & ~newer->data[0]) return false;
+  for (int i = 2; i < HID_KEYBOARD_IN_RPT_LEN; i++) {
+    if (older->data[i] == 0) continue;
+    if (memchr(&newer->data[2], older->data[i], HID_KEYBOARD_IN_RPT_LEN - 2) == NULL) return false;
+  }
+  return true;
+}
+
+// Park a report until the link clears. It replaces the last one held for the same ID only if it supersedes it,
+// so a tap made while the link is congested still goes out as a press and a release.
+static void report_queue_hold(const HIDReportRecord* record) {
+  for (int i = report_queue_held_count - 1; i >= 0; i--) {
+    HIDReportRecord* held = &report_queue_held[i];
+    if (held->id != record->id || held->conn_id != record->conn_id) continue;
+    if (!report_queue_supersedes(held, record)) break;
+    // Keep the original position in the send order, only the contents move forward
+    uint32_t seq = held->seq;
+    *held = *record;
+    held->seq = seq;
+    report_queue_stats.merged++;
+    return;
+  }
+  report_queue_held[report_queue_held_count++] = *record;
+}
+
+static bool report_queue_send(HIDReportRecord* record) {
+  esp_err_t ret =
+      hid_dev_send_report(hid_engine.gatt_if, record->conn_id, record->id, record->type, record->length, record->data);
+  if (ret == ESP_ERR_NOT_FOUND) {
+    // Built for the protocol mode the host just left, or a notification the host turned off, no retry will ever
+    // deliver it
+    report_queue_stats.dropped++;
+    return true;
+  }
+  if (ret != ESP_OK) {
+    report_queue_stats.send_failures++;
+    return false;
+  }
+  report_queue_stats.sent++;
+  if (record->type == HID_REPORT_TYPE_INPUT) reconnect_report_sent(record->conn_id);
+  if (record->trace.mask) {
+    latency_stamp(&record->trace, LATENCY_STAGE_SEND);
+    latency_record(&record->trace);
+  }
+  return true;
+}
+
+// Send the held reports in their original order, returns false if the link refused one again
+static bool report_queue_flush_held(void) {
+  int sent = 0;
+  while (sent < report_queue_held_count) {
+    HIDReportRecord* oldest = &report_queue_held[sent];
+    if (hidd_clcb_congested(oldest->conn_id) || !report_queue_send(oldest)) break;
+    sent++;
+  }
+  report_queue_held_count -= sent;
+  memmove(report_queue_held, &report_queue_held[sent], report_queue_held_count * sizeof(HIDReportRecord));
+  return report_queue_held_count == 0;
+}
+
+static void report_queue_drain(void) {
+  HIDReportRecord record, next;
+  ReportRing* ring;
+
+  report_queue_retry = false;
+  bool blocked = !report_queue_flush_held();
+
+  // With the held list full the rest waits in the rings, the producers see them fill up
+  while (!(blocked && report_queue_held_count == REPORT_QUEUE_HELD_DEPTH) &&
+         (ring = report_queue_next_ring()) != NULL) {
+    report_queue_pop(ring, &record);
+
+    // Fold in newer reports that were queued on top of this one before it went out
+    while ((ring = report_queue_next_ring()) != NULL &&
+           report_queue_supersedes(&record, &ring->records[ring->tail & REPORT_QUEUE_MASK])) {
+      report_queue_pop(ring, &next);
+      record = next;
+      report_queue_stats.merged++;
+    }
+
+    // Once anything is held everything behind it is held too, so the send order never changes
+    if (blocked || report_queue_held_count || hidd_clcb_congested(record.conn_id) || !report_queue_send(&record)) {
+      report_queue_hold(&record);
+      blocked = true;
+    }
+  }
+
+  // Without a congestion event to wake us up, poll until the stack takes the held reports
+  report_queue_retry = report_queue_held_count && !report_queue_congested;
+}
+
+static void report_queue_task(void* pvParameters) {
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, report_queue_retry ? pdMS_TO_TICKS(REPORT_QUEUE_RETRY_MS) : portMAX_DELAY);
+    report_queue_drain();
+  }
+}
+
+esp_err_t report_queue_init(void) {
+  if (report_queue_task_handle != NULL) return ESP_OK;
+
+  if (xTaskCreate(&report_queue_task, "report_queue_task", 2048, NULL, REPORT_QUEUE_TASK_PRIORITY,
+                  &report_queue_task_handle) != pdPASS) {
+    ESP_LOGE(REPORT_QUEUE_TAG, "%s create sender task failed", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+  ESP_LOGI(REPORT_QUEUE_TAG, "Report queue initialized");
+  return ESP_OK;
+}
+
+void report_queue_get_stats(ReportQueueStats* stats) {
+  *stats = report_queue_stats;
+}
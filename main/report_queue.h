@@ -0,0 +1,66 @@
+#ifndef REPORT_QUEUE_H__
+#define REPORT_QUEUE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "latency.h"
+
+#define REPORT_QUEUE_DEPTH 16         // Records per producer ring, must be a power of two
+#define REPORT_QUEUE_MAX_PRODUCERS 4  // Tasks that may push reports
+#define REPORT_QUEUE_RECORD_LEN 17    // Largest report payload carried by a record, the keyboard bitmap
+#define REPORT_QUEUE_HELD_DEPTH 16    // Reports that can be held back while the link is congested
+#define REPORT_QUEUE_RETRY_MS 20      // Retry period after the stack refused a report
+#define REPORT_QUEUE_TASK_PRIORITY 10
+
+typedef struct HIDReportRecord {
+  uint32_t seq;  // Global push order without gaps, the sender drains the producer rings in this order
+  uint16_t conn_id;
+  uint8_t id;
+  uint8_t type;
+  uint8_t length;
+  uint8_t data[REPORT_QUEUE_RECORD_LEN];
+  LatencyTrace trace;  // Empty unless the producer attached one with report_queue_trace()
+} HIDReportRecord;
+
+typedef struct ReportQueueStats {
+  uint32_t pushed;             // Records accepted from producers
+  uint32_t sent;               // Records handed to hid_dev_send_report
+  uint32_t merged;             // Records superseded by a newer report for the same ID before they went out
+  uint32_t dropped;            // Records rejected because the producer ring was full or unregistered
+  uint32_t send_failures;      // Reports refused by esp_ble_gatts_send_indicate and held for a retry
+  uint32_t congestion_events;  // Times the link entered congestion
+  uint64_t congested_us;       // Total time spent congested
+} ReportQueueStats;
+
+// Create the BLE sender task that drains every producer ring
+esp_err_t report_queue_init(void);
+
+// Claim a single-producer ring for the calling task, call once before it pushes any report
+esp_err_t report_queue_register_producer(void);
+
+// Copy a report into the calling task's ring and wake the sender, never blocks
+bool report_queue_push(uint16_t conn_id, uint8_t id, uint8_t type, uint8_t length, const uint8_t* data);
+
+// Attach a trace to the next report pushed by the calling task, it is stamped at enqueue and at send and then
+// folded into the latency histograms. The trace is copied on push, the caller may reuse it straight away.
+void report_queue_trace(LatencyTrace* trace);
+
+// Stamp the trace attached by the calling task, no-op if there is none
+void report_queue_trace_stamp(LatencyStage stage);
+
+// Wake the sender
+void report_queue_kick(void);
+
+// True while reports are held for a congested link, a producer that cannot afford to have its reports merged
+// should wait until this clears before pushing the next one
+bool report_queue_busy(void);
+
+// Track ESP_GATTS_CONGEST_EVT, reports are held until the link clears, a newer report for the same ID replacing
+// the last one held only if it supersedes it
+void report_queue_set_congested(bool congested);
+
+void report_queue_get_stats(ReportQueueStats* stats);
+
+#endif /* REPORT_QUEUE_H__ */
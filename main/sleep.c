@@ -0,0 +1,139 @@
+// Deep sleep on idle
+//
+// On battery, SLEEP_IDLE_TIMEOUT_MS without input puts the chip in deep sleep, a few uA instead of light sleep
+// plus the connection events of every link. A turn of the encoder wakes it through ext0: the A contact is armed
+// for the level opposite to the one the last detent left it at. The RTC also watches, as ext1 any-high, those of
+// the rows, the encoder switch and PIN_5VDET that are RTC GPIOs, with the columns held high through the sleep so
+// a key pulls its row up. On this board only PIN_5VDET is, so USB power would wake the pad and the keys would not.
+// Keys that go dead on an idle pad are not worth the current saved, so unless SLEEP_WITHOUT_KEY_WAKE says
+// otherwise the idle timer is only armed when all the key pins are RTC GPIOs; rows moved to RTC pins are picked
+// up without a change here. A wake is a reset, app_main runs again and only the variables marked RTC_DATA_ATTR
+// keep their values.
+
+#include "sleep.h"
+
+#include "board.h"
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+#include "esp_attr.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "event_loop.h"
+
+#define SLEEP_TAG "SLEEP"
+// Inputs that read high while something wants the pad awake: a key against a held column, the encoder switch
+// and USB power
+#define SLEEP_KEY_PINS (PIN_ROW_MASK | (1ULL << PIN_ROT_SW))
+#define SLEEP_WAKE_HIGH_PINS (SLEEP_KEY_PINS | (1ULL << PIN_5VDET))
+
+static esp_timer_handle_t sleep_timer = NULL;
+static bool sleep_armed = false;
+static uint64_t sleep_idle_us = 0;
+static volatile int64_t sleep_last_activity = 0;
+static RTC_DATA_ATTR uint32_t sleep_entered = 0;
+static RTC_DATA_ATTR uint64_t sleep_rtc_pins = 0;  // Pads routed to the RTC for the last sleep
+
+static void sleep_timer_callback(void* arg) {
+  int64_t idle_us = esp_timer_get_time() - sleep_last_activity;
+
+  if (!sleep_armed) return;
+  if (idle_us < (int64_t)sleep_idle_us) {
+    // Activity since the timer was armed, sleep for the remainder
+    esp_timer_start_once(sleep_timer, sleep_idle_us - idle_us);
+    return;
+  }
+  event_loop_signal(APP_EVENT_SLEEP);
+}
+
+esp_err_t sleep_init(uint32_t idle_ms) {
+  const esp_timer_create_args_t timer_args = {
+      .callback = sleep_timer_callback,
+      .name = "sleep_idle",
+  };
+
+  sleep_idle_us = (uint64_t)idle_ms * 1000;
+  if (sleep_woke()) {
+    // The pads go back to the GPIO matrix, the drivers set them up as on any other boot
+    for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+      if (sleep_rtc_pins & (1ULL << gpio)) rtc_gpio_deinit(gpio);
+      if (PIN_COL_MASK & (1ULL << gpio)) gpio_hold_dis(gpio);
+    }
+    gpio_deep_sleep_hold_dis();
+    ESP_LOGI(SLEEP_TAG, "Woke from deep sleep %u, cause %d, ext1 0x%llx", sleep_entered,
+             esp_sleep_get_wakeup_cause(), esp_sleep_get_ext1_wakeup_status());
+  }
+  sleep_rtc_pins = 0;
+
+  uint64_t key_wake = 0;
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    if ((SLEEP_KEY_PINS & (1ULL << gpio)) && rtc_gpio_is_valid_gpio(gpio)) key_wake |= 1ULL << gpio;
+  }
+  if (key_wake != SLEEP_KEY_PINS && !SLEEP_WITHOUT_KEY_WAKE) {
+    ESP_LOGI(SLEEP_TAG, "Keys 0x%llx cannot wake a deep sleep, staying in light sleep", SLEEP_KEY_PINS & ~key_wake);
+    sleep_idle_us = 0;
+  }
+  return esp_timer_create(&timer_args, &sleep_timer);
+}
+
+bool sleep_woke(void) {
+  return esp_reset_reason() == ESP_RST_DEEPSLEEP;
+}
+
+uint32_t sleep_count(void) {
+  return sleep_entered;
+}
+
+void sleep_arm(bool armed) {
+  sleep_armed = armed && sleep_idle_us != 0;
+  if (esp_timer_is_active(sleep_timer)) esp_timer_stop(sleep_timer);
+  if (!sleep_armed) return;
+  sleep_last_activity = esp_timer_get_time();
+  esp_timer_start_once(sleep_timer, sleep_idle_us);
+}
+
+void sleep_activity(void) {
+  sleep_last_activity = esp_timer_get_time();
+}
+
+void sleep_defer(uint32_t ms) {
+  if (!sleep_armed) return;
+  if (esp_timer_is_active(sleep_timer)) esp_timer_stop(sleep_timer);
+  esp_timer_start_once(sleep_timer, (uint64_t)ms * 1000);
+}
+
+void sleep_start(void) {
+  int rot_a = gpio_get_level(PIN_ROT_A);
+  uint64_t wake_high = 0;
+
+  for (gpio_num_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+    uint64_t bit = 1ULL << gpio;
+    if (PIN_COL_MASK & bit) {
+      gpio_set_level(gpio, 1);
+      gpio_hold_en(gpio);
+    }
+    if ((SLEEP_WAKE_HIGH_PINS & bit) && rtc_gpio_is_valid_gpio(gpio)) wake_high |= bit;
+  }
+  gpio_deep_sleep_hold_en();
+
+  // The PCNT pull-ups are off in deep sleep, the RTC ones keep the open contact high
+  ESP_ERROR_CHECK(esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON));
+  rtc_gpio_pullup_en(PIN_ROT_A);
+  rtc_gpio_pulldown_dis(PIN_ROT_A);
+  // The light sleep GPIO wake-up of power.c has no say here, the RTC sources below are the ones that count
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  ESP_ERROR_CHECK(esp_sleep_enable_ext0_wakeup(PIN_ROT_A, !rot_a));
+  if (wake_high) ESP_ERROR_CHECK(esp_sleep_enable_ext1_wakeup(wake_high, ESP_EXT1_WAKEUP_ANY_HIGH));
+  sleep_rtc_pins = wake_high | (1ULL << PIN_ROT_A);
+  sleep_entered++;
+
+  ESP_LOGI(SLEEP_TAG, "Deep sleep %u, wake on GPIO %d %s or 0x%llx high", sleep_entered, PIN_ROT_A,
+           rot_a ? "low" : "high", wake_high);
+  // The controller has to be off before the chip powers down
+  esp_bluedroid_disable();
+  esp_bt_controller_disable();
+  esp_deep_sleep_start();
+}
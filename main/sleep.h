@@ -0,0 +1,43 @@
+#ifndef SLEEP_H__
+#define SLEEP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define SLEEP_IDLE_TIMEOUT_MS (10 * 60 * 1000)  // No input for this long on battery ends in deep sleep
+#define SLEEP_DISCONNECT_MS 500                 // Longest wait for the hosts to see their links close
+
+// A deep sleep is only entered when every key can wake the pad from it, that is the rows and PIN_ROT_SW are RTC
+// GPIOs. Set to 1 to deep sleep anyway on a board where they are not, with only the encoder and USB power to wake
+// it. Otherwise such a board stays in light sleep, where the keys wake it through power.c.
+#ifndef SLEEP_WITHOUT_KEY_WAKE
+#define SLEEP_WITHOUT_KEY_WAKE 0
+#endif
+
+// Release the pads a deep sleep left held or routed to the RTC, call before the drivers configure them. Creates
+// the idle timer, its expiry is signalled as APP_EVENT_SLEEP. The timer never runs when the keys cannot wake the
+// pad, see SLEEP_WITHOUT_KEY_WAKE.
+esp_err_t sleep_init(uint32_t idle_ms);
+
+// True when this boot is a wake from deep sleep, the RTC_DATA_ATTR variables still hold what they did
+bool sleep_woke(void);
+
+// Deep sleeps since power-on
+uint32_t sleep_count(void);
+
+// Run the idle clock from now, or stop it while the pad has to stay up, e.g. on USB power
+void sleep_arm(bool armed);
+
+// Input activity, the idle clock starts over. Only stores a timestamp, so it is cheap on every report.
+void sleep_activity(void);
+
+// Signal APP_EVENT_SLEEP again in ms unless there is activity meanwhile, e.g. while links are closing
+void sleep_defer(uint32_t ms);
+
+// Hold the columns high, arm the encoder and the RTC capable input pins as wake-up sources and enter deep sleep.
+// Never returns, the next thing to run is app_main.
+void sleep_start(void) __attribute__((noreturn));
+
+#endif /* SLEEP_H__ */